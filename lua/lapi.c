@@ -105,7 +105,7 @@ LUA_API int lua_checkstack (lua_State *L, int n) {
     res = 1;  /* yes; check is OK */
   else {  /* no; need to grow stack */
     int inuse = cast_int(L->top - L->stack) + EXTRA_STACK;
-    if (inuse > LUAI_MAXSTACK - n)  /* can grow without overflow? */
+    if (inuse > G(L)->stacklimit - n)  /* can grow without overflow? */
       res = 0;  /* no */
     else  /* try to grow stack */
       res = (luaD_rawrunprotected(L, &growstack, &n) == LUA_OK);
@@ -125,7 +125,9 @@ LUA_API void lua_xmove (lua_State *from, lua_State *to, int n) {
   api_check(from, G(from) == G(to), "moving among independent states");
   api_check(from, to->ci->top - to->top >= n, "stack overflow");
   from->top -= n;
+  luaC_touchthread(to);
   for (i = 0; i < n; i++) {
+    luaC_escapevalue(from->top + i);  /* 'to' may not be scanned by regions */
     setobj2s(to, to->top, from->top + i);
     to->top++;  /* stack already checked by previous 'api_check' */
   }
@@ -232,6 +234,8 @@ LUA_API void lua_copy (lua_State *L, int fromidx, int toidx) {
     luaC_barrier(L, clCvalue(L->ci->func), fr);
   /* LUA_REGISTRYINDEX does not need gc barrier
      (collector revisits it before finishing collection) */
+  else if (toidx == LUA_REGISTRYINDEX)
+    luaC_escapevalue(fr);
   lua_unlock(L);
 }
 
@@ -312,6 +316,7 @@ LUA_API void lua_arith (lua_State *L, int op) {
   }
   /* first operand at top - 2, second at top - 1; result go to top - 2 */
   luaO_arith(L, op, L->top - 2, L->top - 1, L->top - 2);
+  luaC_touchthread(L);
   L->top--;  /* remove second operand */
   lua_unlock(L);
 }
@@ -344,6 +349,11 @@ LUA_API size_t lua_stringtonumber (lua_State *L, const char *s) {
 }
 
 
+LUA_API int lua_integer2buff (char *buff, lua_Integer n) {
+  return luaO_int2str(buff, n);
+}
+
+
 #ifndef _KERNEL
 LUA_API lua_Number lua_tonumberx (lua_State *L, int idx, int *pisnum) {
   lua_Number n;
@@ -383,6 +393,7 @@ LUA_API const char *lua_tolstring (lua_State *L, int idx, size_t *len) {
     }
     lua_lock(L);  /* 'luaO_tostring' may create a new string */
     luaO_tostring(L, o);
+    luaC_touchthread(L);
     luaC_checkGC(L);
     o = index2addr(L, idx);  /* previous call may reallocate the stack */
     lua_unlock(L);
@@ -424,6 +435,20 @@ LUA_API void *lua_touserdata (lua_State *L, int idx) {
 }
 
 
+/*
+** Returns the block of the full userdata at index 'idx' if its
+** metatable is 'tag' (as given by 'lua_topointer'), or NULL otherwise.
+*/
+LUA_API void *lua_touserdatatag (lua_State *L, int idx, const void *tag) {
+  StkId o = index2addr(L, idx);
+  api_check(L, tag != NULL, "invalid tag");
+  if (ttisfulluserdata(o) && uvalue(o)->metatable == tag)
+    return getudatamem(uvalue(o));
+  else
+    return NULL;
+}
+
+
 LUA_API lua_State *lua_tothread (lua_State *L, int idx) {
   StkId o = index2addr(L, idx);
   return (!ttisthread(o)) ? NULL : thvalue(o);
@@ -440,6 +465,7 @@ LUA_API const void *lua_topointer (lua_State *L, int idx) {
     case LUA_TTHREAD: return thvalue(o);
     case LUA_TUSERDATA: return getudatamem(uvalue(o));
     case LUA_TLIGHTUSERDATA: return pvalue(o);
+    case LUA_TSHRSTR: case LUA_TLNGSTR: return tsvalue(o);
     default: return NULL;
   }
 }
@@ -494,6 +520,55 @@ LUA_API const char *lua_pushlstring (lua_State *L, const char *s, size_t len) {
 }
 
 
+/*
+** Push a string over memory owned by the caller, without copying it;
+** 's[len]' must be '\0' and the memory must stay unchanged until
+** 'release' is called (from the collector; it must not call Lua). Short
+** strings are copied, as they are always internalized, and 'release'
+** is called right away.
+*/
+LUA_API const char *lua_pushexternalstring (lua_State *L, const char *s,
+                                   size_t len, lua_Release release, void *ud) {
+  TString *ts;
+  lua_lock(L);
+  if (len <= LUAI_MAXSHORTLEN) {
+    ts = luaS_newlstr(L, s, len);
+    if (release != NULL)
+      (*release)(ud, s, len);
+  }
+  else
+    ts = luaS_newextstr(L, s, len, release, ud);
+  setsvalue2s(L, L->top, ts);
+  api_incr_top(L);
+  luaC_checkGC(L);
+  lua_unlock(L);
+  return getstr(ts);
+}
+
+
+/*
+** Pushes a long string of length 'len' with contents to be filled by
+** the caller, who must do so before the string is used in any way
+** (its hash, for instance, is computed lazily from the contents).
+** Short strings cannot be built like this, as they are internalized
+** by their contents: for them, nothing is pushed and the result is NULL.
+*/
+LUA_API char *lua_pushlongstring (lua_State *L, size_t len) {
+  TString *ts;
+  if (len <= LUAI_MAXSHORTLEN)
+    return NULL;
+  lua_lock(L);
+  if (len >= (MAX_SIZE - sizeof(TString))/sizeof(char))
+    luaM_toobig(L);
+  ts = luaS_createlngstrobj(L, len);
+  setsvalue2s(L, L->top, ts);
+  api_incr_top(L);
+  luaC_checkGC(L);
+  lua_unlock(L);
+  return getstr(ts);
+}
+
+
 LUA_API const char *lua_pushstring (lua_State *L, const char *s) {
   lua_lock(L);
   if (s == NULL)
@@ -515,6 +590,7 @@ LUA_API const char *lua_pushvfstring (lua_State *L, const char *fmt,
                                       va_list argp) {
   const char *ret;
   lua_lock(L);
+  luaC_touchthread(L);
   ret = luaO_pushvfstring(L, fmt, argp);
   luaC_checkGC(L);
   lua_unlock(L);
@@ -526,6 +602,7 @@ LUA_API const char *lua_pushfstring (lua_State *L, const char *fmt, ...) {
   const char *ret;
   va_list argp;
   lua_lock(L);
+  luaC_touchthread(L);
   va_start(argp, fmt);
   ret = luaO_pushvfstring(L, fmt, argp);
   va_end(argp);
@@ -550,6 +627,7 @@ LUA_API void lua_pushcclosure (lua_State *L, lua_CFunction fn, int n) {
     while (n--) {
       setobj2n(L, &cl->upvalue[n], L->top + n);
       /* does not need barrier because closure is white */
+      luaC_escapevalue(&cl->upvalue[n]);  /* but closures are not local */
     }
     setclCvalue(L, L->top, cl);
   }
@@ -590,9 +668,12 @@ LUA_API int lua_pushthread (lua_State *L) {
 */
 
 
-static int auxgetstr (lua_State *L, const TValue *t, const char *k) {
+/* 'luaH_getint' as a raw get function of 'luaV_fastget'/'luaV_fastset' */
+#define rawgetint(L,t,k)	((void)(L), luaH_getint(t, k))
+
+
+static int auxgetstr (lua_State *L, const TValue *t, TString *str) {
   const TValue *slot;
-  TString *str = luaS_new(L, k);
   if (luaV_fastget(L, t, str, slot, luaH_getstr)) {
     setobj2s(L, L->top, slot);
     api_incr_top(L);
@@ -610,7 +691,7 @@ static int auxgetstr (lua_State *L, const TValue *t, const char *k) {
 LUA_API int lua_getglobal (lua_State *L, const char *name) {
   Table *reg = hvalue(&G(L)->l_registry);
   lua_lock(L);
-  return auxgetstr(L, luaH_getint(reg, LUA_RIDX_GLOBALS), name);
+  return auxgetstr(L, luaH_getint(reg, LUA_RIDX_GLOBALS), luaS_new(L, name));
 }
 
 
@@ -618,6 +699,7 @@ LUA_API int lua_gettable (lua_State *L, int idx) {
   StkId t;
   lua_lock(L);
   t = index2addr(L, idx);
+  luaC_touchthread(L);
   luaV_gettable(L, t, L->top - 1, L->top - 1);
   lua_unlock(L);
   return ttnov(L->top - 1);
@@ -626,7 +708,16 @@ LUA_API int lua_gettable (lua_State *L, int idx) {
 
 LUA_API int lua_getfield (lua_State *L, int idx, const char *k) {
   lua_lock(L);
-  return auxgetstr(L, index2addr(L, idx), k);
+  return auxgetstr(L, index2addr(L, idx), luaS_new(L, k));
+}
+
+
+/*
+** 'lua_getfield' with a key from 'lua_internkey'
+*/
+LUA_API int lua_getfieldk (lua_State *L, int idx, lua_Key k) {
+  lua_lock(L);
+  return auxgetstr(L, index2addr(L, idx), cast(TString *, k));
 }
 
 
@@ -635,7 +726,7 @@ LUA_API int lua_geti (lua_State *L, int idx, lua_Integer n) {
   const TValue *slot;
   lua_lock(L);
   t = index2addr(L, idx);
-  if (luaV_fastget(L, t, n, slot, luaH_getint)) {
+  if (luaV_fastget(L, t, n, slot, rawgetint)) {
     setobj2s(L, L->top, slot);
     api_incr_top(L);
   }
@@ -654,7 +745,8 @@ LUA_API int lua_rawget (lua_State *L, int idx) {
   lua_lock(L);
   t = index2addr(L, idx);
   api_check(L, ttistable(t), "table expected");
-  setobj2s(L, L->top - 1, luaH_get(hvalue(t), L->top - 1));
+  setobj2s(L, L->top - 1, luaH_get(L, hvalue(t), L->top - 1));
+  luaC_touchthread(L);
   lua_unlock(L);
   return ttnov(L->top - 1);
 }
@@ -672,6 +764,34 @@ LUA_API int lua_rawgeti (lua_State *L, int idx, lua_Integer n) {
 }
 
 
+/*
+** Copies to 'v' the integers at t[i], ..., t[i + n - 1], where 't' is
+** the table at index 'idx' (raw access, converting like
+** 'lua_tointeger'), stopping at the first value that is not an
+** integer; returns the number of values copied.
+*/
+LUA_API int lua_getiarray (lua_State *L, int idx, lua_Integer i,
+                           lua_Integer *v, int n) {
+  StkId o;
+  Table *t;
+  int k;
+  lua_lock(L);
+  o = index2addr(L, idx);
+  api_check(L, ttistable(o), "table expected");
+  api_check(L, n >= 0 && i <= LUA_MAXINTEGER - n, "invalid interval");
+  t = hvalue(o);
+  for (k = 0; k < n; k++, i++) {
+    const TValue *e = (l_castS2U(i) - 1u < t->sizearray)
+                      ? &t->array[i - 1]
+                      : luaH_getint(t, i);
+    if (!tointeger(e, &v[k]))
+      break;
+  }
+  lua_unlock(L);
+  return k;
+}
+
+
 LUA_API int lua_rawgetp (lua_State *L, int idx, const void *p) {
   StkId t;
   TValue k;
@@ -679,7 +799,7 @@ LUA_API int lua_rawgetp (lua_State *L, int idx, const void *p) {
   t = index2addr(L, idx);
   api_check(L, ttistable(t), "table expected");
   setpvalue(&k, cast(void *, p));
-  setobj2s(L, L->top, luaH_get(hvalue(t), &k));
+  setobj2s(L, L->top, luaH_get(L, hvalue(t), &k));
   api_incr_top(L);
   lua_unlock(L);
   return ttnov(L->top - 1);
@@ -699,6 +819,64 @@ LUA_API void lua_createtable (lua_State *L, int narray, int nrec) {
 }
 
 
+/*
+** Pushes a new table with the contents and layout of the table at
+** 'idx' (but not its metatable); see 'luaH_copy'
+*/
+LUA_API void lua_clonetable (lua_State *L, int idx) {
+  Table *t;
+  Table *src;
+  lua_lock(L);
+  api_check(L, ttistable(index2addr(L, idx)), "table expected");
+  src = hvalue(index2addr(L, idx));
+  t = luaH_new(L);
+  sethvalue(L, L->top, t);
+  api_incr_top(L);
+  luaH_copy(L, t, src);
+  luaC_checkGC(L);
+  lua_unlock(L);
+}
+
+
+/*
+** Grows the parts of the table at 'idx' so that they hold at least
+** 'narray' and 'nrec' elements
+*/
+LUA_API void lua_reservetable (lua_State *L, int idx, int narray, int nrec) {
+  StkId o;
+  Table *t;
+  unsigned int nasize, nhsize;
+  lua_lock(L);
+  o = index2addr(L, idx);
+  api_check(L, ttistable(o), "table expected");
+  api_check(L, narray >= 0 && nrec >= 0, "invalid size");
+  t = hvalue(o);
+  nasize = t->sizearray;
+  nhsize = allocsizenode(t);
+  if (cast(unsigned int, narray) > nasize || cast(unsigned int, nrec) > nhsize) {
+    if (cast(unsigned int, narray) > nasize) nasize = narray;
+    if (cast(unsigned int, nrec) > nhsize) nhsize = nrec;
+    luaH_resize(L, t, nasize, nhsize);
+    luaC_checkGC(L);
+  }
+  lua_unlock(L);
+}
+
+
+/*
+** Removes all entries of the table at 'idx' (without metamethods),
+** keeping its memory for new entries
+*/
+LUA_API void lua_cleartable (lua_State *L, int idx) {
+  StkId o;
+  lua_lock(L);
+  o = index2addr(L, idx);
+  api_check(L, ttistable(o), "table expected");
+  luaH_clear(hvalue(o));
+  lua_unlock(L);
+}
+
+
 LUA_API int lua_getmetatable (lua_State *L, int objindex) {
   const TValue *obj;
   Table *mt;
@@ -745,9 +923,8 @@ LUA_API int lua_getuservalue (lua_State *L, int idx) {
 /*
 ** t[k] = value at the top of the stack (where 'k' is a string)
 */
-static void auxsetstr (lua_State *L, const TValue *t, const char *k) {
+static void auxsetstr (lua_State *L, const TValue *t, TString *str) {
   const TValue *slot;
-  TString *str = luaS_new(L, k);
   api_checknelems(L, 1);
   if (luaV_fastset(L, t, str, slot, luaH_getstr, L->top - 1))
     L->top--;  /* pop value */
@@ -764,7 +941,7 @@ static void auxsetstr (lua_State *L, const TValue *t, const char *k) {
 LUA_API void lua_setglobal (lua_State *L, const char *name) {
   Table *reg = hvalue(&G(L)->l_registry);
   lua_lock(L);  /* unlock done in 'auxsetstr' */
-  auxsetstr(L, luaH_getint(reg, LUA_RIDX_GLOBALS), name);
+  auxsetstr(L, luaH_getint(reg, LUA_RIDX_GLOBALS), luaS_new(L, name));
 }
 
 
@@ -781,7 +958,13 @@ LUA_API void lua_settable (lua_State *L, int idx) {
 
 LUA_API void lua_setfield (lua_State *L, int idx, const char *k) {
   lua_lock(L);  /* unlock done in 'auxsetstr' */
-  auxsetstr(L, index2addr(L, idx), k);
+  auxsetstr(L, index2addr(L, idx), luaS_new(L, k));
+}
+
+
+LUA_API void lua_setfieldk (lua_State *L, int idx, lua_Key k) {
+  lua_lock(L);  /* unlock done in 'auxsetstr' */
+  auxsetstr(L, index2addr(L, idx), cast(TString *, k));
 }
 
 
@@ -791,7 +974,7 @@ LUA_API void lua_seti (lua_State *L, int idx, lua_Integer n) {
   lua_lock(L);
   api_checknelems(L, 1);
   t = index2addr(L, idx);
-  if (luaV_fastset(L, t, n, slot, luaH_getint, L->top - 1))
+  if (luaV_fastset(L, t, n, slot, rawgetint, L->top - 1))
     L->top--;  /* pop value */
   else {
     setivalue(L->top, n);
@@ -832,6 +1015,42 @@ LUA_API void lua_rawseti (lua_State *L, int idx, lua_Integer n) {
 }
 
 
+/*
+** Sets t[i], ..., t[i + n - 1] to the integers in 'v', where 't' is the
+** table at index 'idx' (raw access). When the interval extends the
+** array part of 't' (it starts inside the array part or right after
+** it), that part is first grown to hold the whole interval, so the
+** values are stored directly in it. Integers need no barrier.
+*/
+LUA_API void lua_setiarray (lua_State *L, int idx, lua_Integer i,
+                            const lua_Integer *v, int n) {
+  StkId o;
+  Table *t;
+  lua_Integer last;
+  int k;
+  lua_lock(L);
+  o = index2addr(L, idx);
+  api_check(L, ttistable(o), "table expected");
+  api_check(L, n >= 0 && i <= LUA_MAXINTEGER - n, "invalid interval");
+  t = hvalue(o);
+  last = i + n - 1;
+  if (l_castS2U(i) - 1u <= t->sizearray &&
+      l_castS2U(last) > t->sizearray && l_castS2U(last) <= MAX_INT)
+    luaH_resizearray(L, t, cast(unsigned int, last));
+  for (k = 0; k < n; k++, i++) {
+    if (l_castS2U(i) - 1u < t->sizearray) {
+      setivalue(&t->array[i - 1], v[k]);
+    }
+    else {
+      TValue val;
+      setivalue(&val, v[k]);
+      luaH_setint(L, t, i, &val);
+    }
+  }
+  lua_unlock(L);
+}
+
+
 LUA_API void lua_rawsetp (lua_State *L, int idx, const void *p) {
   StkId o;
   TValue k, *slot;
@@ -879,6 +1098,8 @@ LUA_API int lua_setmetatable (lua_State *L, int objindex) {
     }
     default: {
       G(L)->mt[ttnov(obj)] = mt;
+      if (mt && islocal(mt))  /* a root with no barrier */
+        setescaped(mt);
       break;
     }
   }
@@ -920,6 +1141,7 @@ LUA_API void lua_callk (lua_State *L, int nargs, int nresults,
   api_checknelems(L, nargs+1);
   api_check(L, L->status == LUA_OK, "cannot do calls on non-normal thread");
   checkresults(L, nargs, nresults);
+  luaC_touchthread(L);  /* the call stores into the stack */
   func = L->top - (nargs+1);
   if (k != NULL && L->nny == 0) {  /* need to prepare continuation? */
     L->ci->u.c.k = k;  /* save continuation */
@@ -961,6 +1183,7 @@ LUA_API int lua_pcallk (lua_State *L, int nargs, int nresults, int errfunc,
   api_checknelems(L, nargs+1);
   api_check(L, L->status == LUA_OK, "cannot do calls on non-normal thread");
   checkresults(L, nargs, nresults);
+  luaC_touchthread(L);  /* the call stores into the stack */
   if (errfunc == 0)
     func = 0;
   else {
@@ -994,12 +1217,109 @@ LUA_API int lua_pcallk (lua_State *L, int nargs, int nresults, int errfunc,
 }
 
 
+/*
+** Execute a batch of calls: the function on the top is called once
+** for each of 'n' events, with the arguments pushed by 'push'; 'result'
+** gets the 'nresults' results of each call on the top of the stack.
+** All calls run inside one protected call; an error ends it after
+** passing the error object to 'result' (itself protected, with its
+** errors ignored), and a new protected call goes on with the next
+** event. So, only events that fail pay for a recover point. Returns the
+** number of events that failed.
+*/
+struct BatchS {  /* data to 'f_batch' and 'f_batcherror' */
+  ptrdiff_t func;
+  int i, n;
+  int nresults;
+  int status;  /* of the event that failed */
+  lua_Push push;
+  lua_Result result;
+  void *ud;
+};
+
+
+static void f_batch (lua_State *L, void *ud) {
+  struct BatchS *b = cast(struct BatchS *, ud);
+  for (; b->i < b->n; b->i++) {
+    StkId func;
+    int nargs;
+    if (L->ci->top < L->top + 1 + LUA_MINSTACK) {
+      luaD_checkstack(L, 1 + LUA_MINSTACK);  /* function and arguments */
+      L->ci->top = L->top + 1 + LUA_MINSTACK;
+    }
+    func = L->top;
+    setobjs2s(L, func, restorestack(L, b->func));
+    L->top++;
+    lua_unlock(L);
+    nargs = (*b->push)(L, b->i, b->ud);
+    lua_lock(L);
+    api_checknelems(L, nargs);
+    func = L->top - (nargs + 1);
+    luaD_callnoyield(L, func, b->nresults);
+    if (b->result != NULL) {
+      lua_unlock(L);
+      (*b->result)(L, b->i, LUA_OK, b->ud);
+      lua_lock(L);
+    }
+    L->top = restorestack(L, b->func) + 1;
+  }
+}
+
+
+static void f_batcherror (lua_State *L, void *ud) {
+  struct BatchS *b = cast(struct BatchS *, ud);
+  lua_unlock(L);
+  (*b->result)(L, b->i, b->status, b->ud);
+  lua_lock(L);
+}
+
+
+LUA_API int lua_pcallbatch (lua_State *L, int n, int nresults, int errfunc,
+                            lua_Push push, lua_Result result, void *ud) {
+  struct BatchS b;
+  ptrdiff_t func, citop;
+  int status, nerrors = 0;
+  lua_lock(L);
+  api_checknelems(L, 1);
+  api_check(L, L->status == LUA_OK, "cannot do calls on non-normal thread");
+  api_check(L, nresults >= 0, "invalid number of results");
+  luaC_touchthread(L);  /* the calls store into the stack */
+  if (errfunc == 0)
+    func = 0;
+  else {
+    StkId o = index2addr(L, errfunc);
+    api_checkstackindex(L, errfunc, o);
+    func = savestack(L, o);
+  }
+  b.func = savestack(L, L->top - 1);
+  b.i = 0; b.n = n;
+  b.nresults = nresults;
+  b.push = push; b.result = result; b.ud = ud;
+  citop = savestack(L, L->ci->top);  /* 'f_batch' may raise it */
+  while ((status = luaD_pcall(L, f_batch, &b, savestack(L, L->top),
+                              func)) != LUA_OK) {
+    nerrors++;
+    if (result != NULL) {
+      b.status = status;
+      luaD_pcall(L, f_batcherror, &b, savestack(L, L->top), 0);
+    }
+    L->top = restorestack(L, b.func) + 1;
+    b.i++;
+  }
+  L->top--;  /* remove function */
+  L->ci->top = restorestack(L, citop);
+  lua_unlock(L);
+  return nerrors;
+}
+
+
 LUA_API int lua_load (lua_State *L, lua_Reader reader, void *data,
                       const char *chunkname, const char *mode) {
   ZIO z;
   int status;
   lua_lock(L);
   if (!chunkname) chunkname = "?";
+  luaC_touchthread(L);  /* the parser stores into the stack */
   luaZ_init(L, &z, reader, data);
   status = luaD_protectedparser(L, &z, chunkname, mode);
   if (status == LUA_OK) {  /* no errors? */
@@ -1073,7 +1393,9 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
     case LUA_GCSTEP: {
       l_mem debt = 1;  /* =1 to signal that it did an actual step */
       lu_byte oldrunning = g->gcrunning;
+      lu_byte olddefer = g->gcdefer;
       g->gcrunning = 1;  /* allow GC to run */
+      g->gcdefer = GCDEFERNONE;  /* an explicit step is never deferred */
       if (data == 0) {
         luaE_setdebt(g, -GCSTEPSIZE);  /* to do a "small" step */
         luaC_step(L);
@@ -1084,10 +1406,43 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
         luaC_checkGC(L);
       }
       g->gcrunning = oldrunning;  /* restore previous state */
+      g->gcdefer = olddefer;
       if (debt > 0 && g->gcstate == GCSpause)  /* end of cycle? */
         res = 1;  /* signal it */
       break;
     }
+    case LUA_GCSTEPNS: {  /* steps within a budget of 'data' nanoseconds */
+      lu_byte oldrunning = g->gcrunning;
+      g->gcrunning = 1;  /* allow GC to run */
+      res = luaC_timedstep(L, cast(lu_mem, data > 0 ? data : 0));
+      g->gcrunning = oldrunning;  /* restore previous state */
+      break;
+    }
+    case LUA_GCGEN: case LUA_GCINC: {  /* change collector mode */
+      res = g->gcgen;
+      luaC_changemode(L, what == LUA_GCGEN);
+      break;
+    }
+    case LUA_GCSETMAJORINC: {
+      res = g->gcmajorinc;
+      if (data < 100) data = 100;  /* a major cycle needs some growth */
+      g->gcmajorinc = data;
+      break;
+    }
+    case LUA_GCDEFER: {
+      res = (g->gcdefer != GCDEFERNONE);
+      g->gcdefer = (data != 0) ? GCDEFERON : GCDEFERNONE;
+      break;
+    }
+    case LUA_GCDEFERSTEP: {  /* pay the debt recorded by a deferred step */
+      if (g->gcdefer == GCDEFERNONE)
+        break;  /* nothing was deferred */
+      g->gcdefer = GCDEFERNONE;
+      luaC_checkGC(L);
+      g->gcdefer = GCDEFERON;  /* next due step is deferred again */
+      res = (g->gcstate == GCSpause);
+      break;
+    }
     case LUA_GCSETPAUSE: {
       res = g->gcpause;
       g->gcpause = data;
@@ -1110,6 +1465,25 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
 }
 
 
+/*
+** Regions: tables and strings created until the matching
+** 'lua_endregion' are freed by it, unless they escaped (see lgc.c)
+*/
+LUA_API void lua_beginregion (lua_State *L) {
+  lua_lock(L);
+  luaC_beginregion(L);
+  lua_unlock(L);
+}
+
+
+LUA_API void lua_endregion (lua_State *L) {
+  lua_lock(L);
+  api_check(L, G(L)->regiondepth > 0, "no open region");
+  luaC_endregion(L);
+  lua_unlock(L);
+}
+
+
 
 /*
 ** miscellaneous functions
@@ -1142,10 +1516,34 @@ LUA_API int lua_next (lua_State *L, int idx) {
 }
 
 
+/*
+** 'lua_next' with '*cursor' as a hint for the position of the key: a
+** traversal that starts with '*cursor' set to 0 (or anything) and
+** calls it with the key it returned last does not look up that key at
+** each step
+*/
+LUA_API int lua_nextidx (lua_State *L, int idx, unsigned int *cursor) {
+  StkId t;
+  int more;
+  lua_lock(L);
+  t = index2addr(L, idx);
+  api_check(L, ttistable(t), "table expected");
+  more = luaH_nextidx(L, hvalue(t), cursor, L->top - 1);
+  if (more) {
+    api_incr_top(L);
+  }
+  else  /* no more elements */
+    L->top -= 1;  /* remove key */
+  lua_unlock(L);
+  return more;
+}
+
+
 LUA_API void lua_concat (lua_State *L, int n) {
   lua_lock(L);
   api_checknelems(L, n);
   if (n >= 2) {
+    luaC_touchthread(L);
     luaV_concat(L, n);
   }
   else if (n == 0) {  /* push empty string */
@@ -1186,6 +1584,143 @@ LUA_API void lua_setallocf (lua_State *L, lua_Alloc f, void *ud) {
 }
 
 
+/*
+** Set the maximum size of the stacks of all threads in the state; the
+** limit cannot be smaller than the stack of the running thread (nor
+** larger than LUAI_MAXSTACK, which also bounds pseudo-indices). Other
+** threads may have larger stacks, which cannot grow and shrink back
+** under the limit (see 'luaD_growstack'). Returns the previous limit.
+*/
+LUA_API int lua_setstacklimit (lua_State *L, int limit) {
+  global_State *g;
+  int res;
+  lua_lock(L);
+  g = G(L);
+  res = g->stacklimit;
+  if (limit > 0) {
+    if (limit > LUAI_MAXSTACK) limit = LUAI_MAXSTACK;
+    if (limit < L->stacksize && !L->inoverflow)  /* not in overflow? */
+      limit = L->stacksize;
+    g->stacklimit = limit;
+  }
+  lua_unlock(L);
+  return res;
+}
+
+
+/*
+** Sets the instruction budget of thread 'L' (inherited by the threads it
+** creates): every 'budget' backward jumps and calls to Lua functions, 'L'
+** yields, if 'yield' is true and it can yield, or calls 'luai_budgetyield'.
+** A 'budget' of 0 removes it. Returns the previous budget.
+*/
+LUA_API int lua_setbudget (lua_State *L, int budget, int yield) {
+  int res;
+  lua_lock(L);
+  res = L->basebudget;
+  countbudget(L);
+  L->basebudget = (budget > 0) ? budget : 0;
+  L->budgetyield = (yield != 0);
+  resetbudget(L);
+  lua_unlock(L);
+  return res;
+}
+
+
+/*
+** Returns the string 'k' as a key for 'lua_getfieldk'/'lua_setfieldk'.
+** The string is anchored in the reference store, so the key stays valid
+** until the state is closed.
+*/
+LUA_API lua_Key lua_internkey (lua_State *L, const char *k) {
+  lua_Key key;
+  api_check(L, k != NULL, "key must be a string");
+  lua_pushstring(L, k);
+  key = tsvalue(L->top - 1);
+  lua_ref(L);
+  return key;
+}
+
+
+/*
+** Set the geometry of the API string cache (used by 'lua_getfield',
+** 'lua_pushstring', etc.) to 'n' sets of 'm' entries; 0 keeps the
+** current value. Resets the statistics of 'lua_strcachestats'.
+*/
+LUA_API void lua_setstrcache (lua_State *L, int n, int m) {
+  global_State *g;
+  lua_lock(L);
+  g = G(L);
+  if (n <= 0) n = g->strcachen;
+  if (m <= 0) m = g->strcachem;
+  api_check(L, n <= MAX_INT / m, "string cache too large");
+  luaS_resizecache(L, n, m);
+  lua_unlock(L);
+}
+
+
+LUA_API void lua_strcachestats (lua_State *L, size_t *hits, size_t *misses) {
+  lua_lock(L);
+  if (hits) *hits = cast(size_t, G(L)->strcachehits);
+  if (misses) *misses = cast(size_t, G(L)->strcachemisses);
+  lua_unlock(L);
+}
+
+
+/*
+** Reference store: reference 'r' is slot 'refs[r - 1]' of a C array that
+** the collector marks as a root, so stores need no barriers. Free slots
+** hold the next free reference as an integer, forming a free list that
+** starts at 'freeref'.
+*/
+LUA_API int lua_ref (lua_State *L) {
+  global_State *g;
+  int ref;
+  lua_lock(L);
+  api_checknelems(L, 1);
+  g = G(L);
+  if (g->freeref != 0) {  /* reuse a free slot? */
+    ref = g->freeref;
+    g->freeref = cast_int(ivalue(&g->refs[ref - 1]));
+  }
+  else {
+    if (g->nrefs >= g->sizerefs)
+      luaM_growvector(L, g->refs, g->nrefs, g->sizerefs, TValue,
+                      MAX_INT, "references");
+    ref = ++g->nrefs;
+  }
+  setobj2n(L, &g->refs[ref - 1], L->top - 1);
+  luaC_escapevalue(L->top - 1);  /* a root with no barrier */
+  L->top--;
+  lua_unlock(L);
+  return ref;
+}
+
+
+LUA_API int lua_getref (lua_State *L, int ref) {
+  global_State *g;
+  lua_lock(L);
+  g = G(L);
+  api_check(L, 0 < ref && ref <= g->nrefs, "invalid reference");
+  setobj2s(L, L->top, &g->refs[ref - 1]);
+  api_incr_top(L);
+  lua_unlock(L);
+  return ttnov(L->top - 1);
+}
+
+
+LUA_API void lua_unref (lua_State *L, int ref) {
+  global_State *g;
+  if (ref <= 0) return;  /* LUA_NOREF, LUA_REFNIL or never created */
+  lua_lock(L);
+  g = G(L);
+  api_check(L, ref <= g->nrefs, "invalid reference");
+  setivalue(&g->refs[ref - 1], g->freeref);  /* add slot to the free list */
+  g->freeref = ref;
+  lua_unlock(L);
+}
+
+
 LUA_API void *lua_newuserdata (lua_State *L, size_t size) {
   Udata *u;
   lua_lock(L);
@@ -8,11 +8,13 @@
 #define lapi_h
 
 
+#include "lgc.h"
 #include "llimits.h"
 #include "lstate.h"
 
+/* (a push may store a new object into an idle thread) */
 #define api_incr_top(L)   {L->top++; api_check(L, L->top <= L->ci->top, \
-				"stack overflow");}
+				"stack overflow"); luaC_touchthread(L);}
 
 #define adjustresults(L,nres) \
     { if ((nres) == LUA_MULTRET && L->ci->top < L->top) L->ci->top = L->top; }
@@ -323,18 +323,25 @@ LUALIB_API void luaL_setmetatable (lua_State *L, const char *tname) {
 }
 
 
+/*
+** Type tag of the userdata type 'tname', i.e., the address of its
+** metatable, or NULL if there is no such type. Tags are only valid in
+** the state they come from, while the metatable is registered.
+*/
+LUALIB_API const void *luaL_udatatag (lua_State *L, const char *tname) {
+  const void *tag;
+  luaL_getmetatable(L, tname);
+  tag = lua_topointer(L, -1);
+  lua_pop(L, 1);
+  return tag;
+}
+
+
 LUALIB_API void *luaL_testudata (lua_State *L, int ud, const char *tname) {
-  void *p = lua_touserdata(L, ud);
-  if (p != NULL) {  /* value is a userdata? */
-    if (lua_getmetatable(L, ud)) {  /* does it have a metatable? */
-      luaL_getmetatable(L, tname);  /* get correct metatable */
-      if (!lua_rawequal(L, -1, -2))  /* not the same? */
-        p = NULL;  /* value is a userdata with wrong metatable */
-      lua_pop(L, 2);  /* remove both metatables */
-      return p;
-    }
-  }
-  return NULL;  /* value is not a userdata with a metatable */
+  const void *tag;
+  ud = lua_absindex(L, ud);
+  tag = luaL_udatatag(L, tname);
+  return (tag != NULL) ? lua_touserdatatag(L, ud, tag) : NULL;
 }
 
 
@@ -344,6 +351,19 @@ LUALIB_API void *luaL_checkudata (lua_State *L, int ud, const char *tname) {
   return p;
 }
 
+
+/*
+** Same as 'luaL_checkudata', but with the type given by its tag (see
+** 'luaL_udatatag'), so that checking is a single pointer comparison;
+** 'tname' is used only in the error message.
+*/
+LUALIB_API void *luaL_checkudatatag (lua_State *L, int ud, const void *tag,
+                                     const char *tname) {
+  void *p = lua_touserdatatag(L, ud, tag);
+  if (p == NULL) typeerror(L, ud, tname);
+  return p;
+}
+
 /* }====================================================== */
 
 
@@ -502,6 +522,58 @@ static void *newbox (lua_State *L, size_t newsize) {
 }
 
 
+/*
+** Largest box kept for reuse after its buffer is done with it (see
+** 'getbox').
+*/
+#if !defined(LUAL_SCRATCHSIZE)
+#define LUAL_SCRATCHSIZE	(16 * LUAL_BUFFERSIZE)
+#endif
+
+/* registry key for the spare box */
+static const char scratchkey = 0;
+
+
+/*
+** Push a box with room for at least 'newsize' bytes for a buffer that
+** spills out of its initial buffer. The box released by the last
+** finished buffer is kept in the registry and reused, keeping its
+** memory, so most spills neither create a userdata nor allocate. The
+** box leaves the registry while in use, so nested buffers get boxes
+** of their own and a buffer interrupted by an error just leaves its
+** box to the collector. Returns the box.
+*/
+static UBox *getbox (lua_State *L, size_t newsize) {
+  UBox *box;
+  if (lua_rawgetp(L, LUA_REGISTRYINDEX, &scratchkey) == LUA_TUSERDATA) {
+    lua_pushnil(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &scratchkey);  /* take it */
+    box = (UBox *)lua_touserdata(L, -1);
+    if (box->bsize < newsize)
+      resizebox(L, -1, newsize);
+  }
+  else {
+    lua_pop(L, 1);  /* remove 'nil' */
+    newbox(L, newsize);
+    box = (UBox *)lua_touserdata(L, -1);
+  }
+  return box;
+}
+
+
+/*
+** Keep box at index 'idx' for the next buffer that spills, releasing
+** its memory first if it is too large to be kept.
+*/
+static void releasebox (lua_State *L, int idx) {
+  UBox *box = (UBox *)lua_touserdata(L, idx);
+  if (box->bsize > LUAL_SCRATCHSIZE)
+    resizebox(L, idx, 0);
+  lua_pushvalue(L, idx);
+  lua_rawsetp(L, LUA_REGISTRYINDEX, &scratchkey);
+}
+
+
 /*
 ** check whether buffer is using a userdata on the stack as a temporary
 ** buffer
@@ -525,7 +597,9 @@ LUALIB_API char *luaL_prepbuffsize (luaL_Buffer *B, size_t sz) {
     if (buffonstack(B))
       newbuff = (char *)resizebox(L, -1, newsize);
     else {  /* no buffer yet */
-      newbuff = (char *)newbox(L, newsize);
+      UBox *box = getbox(L, newsize);
+      newbuff = (char *)box->box;
+      newsize = box->bsize;  /* use all room of a reused box */
       memcpy(newbuff, B->b, B->n * sizeof(char));  /* copy original content */
     }
     B->b = newbuff;
@@ -553,7 +627,7 @@ LUALIB_API void luaL_pushresult (luaL_Buffer *B) {
   lua_State *L = B->L;
   lua_pushlstring(L, B->b, B->n);
   if (buffonstack(B)) {
-    resizebox(L, -2, 0);  /* delete old buffer */
+    releasebox(L, -2);  /* keep old buffer for reuse */
     lua_remove(L, -2);  /* remove its header from the stack */
   }
 }
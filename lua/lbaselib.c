@@ -172,16 +172,57 @@ static int luaB_rawset (lua_State *L) {
 }
 
 
+/* pseudo option of 'collectgarbage': live memory by kind and block size */
+#define GCSTATS		(-1)
+
+static int memstats (lua_State *L) {
+  static const char *const kinds[LUA_MEMKINDS] = {"table", "string",
+    "longstring", "function", "cfunction", "userdata", "thread", "proto",
+    "other"};
+  lua_MemStats ms;
+  lua_Integer bound = 1;  /* 2^i */
+  int i;
+  lua_getmemstats(L, &ms);
+  lua_createtable(L, 0, LUA_MEMKINDS + 1);
+  for (i = 0; i < LUA_MEMKINDS; i++) {
+    lua_createtable(L, 0, 2);
+    lua_pushinteger(L, (lua_Integer)ms.count[i]);
+    lua_setfield(L, -2, "count");
+    lua_pushinteger(L, (lua_Integer)ms.bytes[i]);
+    lua_setfield(L, -2, "bytes");
+    lua_setfield(L, -2, kinds[i]);
+  }
+  lua_newtable(L);  /* sizes: blocks of up to 2^i bytes */
+  for (i = 0; i < LUA_MEMCLASSES; i++) {
+    if (ms.blocks[i] > 0) {  /* add to the class (it may be shared) */
+      lua_Integer n = (lua_rawgeti(L, -1, bound), lua_tointeger(L, -1));
+      lua_pushinteger(L, n + (lua_Integer)ms.blocks[i]);
+      lua_rawseti(L, -3, bound);
+      lua_pop(L, 1);
+    }
+    if (bound <= LUA_MAXINTEGER / 2)  /* else 2^i does not fit an integer */
+      bound *= 2;  /* and larger blocks go to the last class that fits */
+  }
+  lua_setfield(L, -2, "sizes");
+  return 1;
+}
+
+
 static int luaB_collectgarbage (lua_State *L) {
   static const char *const opts[] = {"stop", "restart", "collect",
     "count", "step", "setpause", "setstepmul",
-    "isrunning", NULL};
+    "isrunning", "stepns", "generational", "incremental",
+    "setmajorinc", "stats", NULL};
   static const int optsnum[] = {LUA_GCSTOP, LUA_GCRESTART, LUA_GCCOLLECT,
     LUA_GCCOUNT, LUA_GCSTEP, LUA_GCSETPAUSE, LUA_GCSETSTEPMUL,
-    LUA_GCISRUNNING};
+    LUA_GCISRUNNING, LUA_GCSTEPNS, LUA_GCGEN, LUA_GCINC,
+    LUA_GCSETMAJORINC, GCSTATS};
   int o = optsnum[luaL_checkoption(L, 1, "collect", opts)];
   int ex = (int)luaL_optinteger(L, 2, 0);
-  int res = lua_gc(L, o, ex);
+  int res;
+  if (o == GCSTATS)
+    return memstats(L);
+  res = lua_gc(L, o, ex);
   switch (o) {
     case LUA_GCCOUNT: {
       int b = lua_gc(L, LUA_GCCOUNTB, 0);
@@ -192,7 +233,8 @@ static int luaB_collectgarbage (lua_State *L) {
 #endif
       return 1;
     }
-    case LUA_GCSTEP: case LUA_GCISRUNNING: {
+    case LUA_GCSTEP: case LUA_GCISRUNNING: case LUA_GCSTEPNS:
+    case LUA_GCGEN: case LUA_GCINC: {
       lua_pushboolean(L, res);
       return 1;
     }
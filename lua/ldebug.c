@@ -23,6 +23,7 @@
 #include "ldebug.h"
 #include "ldo.h"
 #include "lfunc.h"
+#include "lmem.h"
 #include "lobject.h"
 #include "lopcodes.h"
 #include "lstate.h"
@@ -90,7 +91,7 @@ LUA_API void lua_sethook (lua_State *L, lua_Hook func, int mask, int count) {
   L->hook = func;
   L->basehookcount = count;
   resethookcount(L);
-  L->hookmask = cast_byte(mask);
+  L->hookmask = cast_byte(mask | (L->hookmask & LUAI_MASKCOUNTERS));
 }
 
 
@@ -100,7 +101,7 @@ LUA_API lua_Hook lua_gethook (lua_State *L) {
 
 
 LUA_API int lua_gethookmask (lua_State *L) {
-  return L->hookmask;
+  return L->hookmask & ~LUAI_MASKCOUNTERS;
 }
 
 
@@ -236,13 +237,14 @@ static void collectvalidlines (lua_State *L, Closure *f) {
   else {
     int i;
     TValue v;
-    int *lineinfo = f->l.p->lineinfo;
+    Proto *p = f->l.p;
+    int n = (p->lineinfo) ? p->sizelineinfo : p->sizelinedelta;
     Table *t = luaH_new(L);  /* new table to store active lines */
     sethvalue(L, L->top, t);  /* push it on stack */
     api_incr_top(L);
     setbvalue(&v, 1);  /* boolean 'true' to be the value of all indices */
-    for (i = 0; i < f->l.p->sizelineinfo; i++)  /* for all lines with code */
-      luaH_setint(L, t, lineinfo[i], &v);  /* table[line] = true */
+    for (i = 0; i < n; i++)  /* for all lines with code */
+      luaH_setint(L, t, getfuncline(p, i), &v);  /* table[line] = true */
   }
 }
 
@@ -448,7 +450,7 @@ static const char *getobjname (Proto *p, int lastpc, int reg,
           return getobjname(p, pc, b, name);  /* get name for 'b' */
         break;
       }
-      case OP_GETTABUP:
+      case OP_GETTABUP: case OP_GETTABUPF:
       case OP_GETTABLE: {
         int k = GETARG_C(i);  /* key index */
         int t = GETARG_B(i);  /* table index */
@@ -509,7 +511,7 @@ static const char *funcnamefromcode (lua_State *L, CallInfo *ci,
        return "for iterator";
     }
     /* other instructions can do calls through metamethods */
-    case OP_SELF: case OP_GETTABUP: case OP_GETTABLE:
+    case OP_SELF: case OP_GETTABUP: case OP_GETTABLE: case OP_GETTABUPF:
       tm = TM_INDEX;
       break;
     case OP_SETTABUP: case OP_SETTABLE:
@@ -526,6 +528,8 @@ static const char *funcnamefromcode (lua_State *L, CallInfo *ci,
       tm = cast(TMS, offset + cast_int(TM_ADD));  /* ORDER TM */
       break;
     }
+    case OP_MODP2: tm = TM_MOD; break;
+    case OP_IDIVP2: tm = TM_IDIV; break;
     case OP_UNM: tm = TM_UNM; break;
     case OP_BNOT: tm = TM_BNOT; break;
     case OP_LEN: tm = TM_LEN; break;
@@ -668,10 +672,199 @@ l_noret luaG_runerror (lua_State *L, const char *fmt, ...) {
 }
 
 
+/*
+** {======================================================
+** Per-function counters
+** =======================================================
+*/
+
+/* counters of 'p', created when it first runs with counters on */
+static size_t *getcounts (lua_State *L, Proto *p) {
+  if (p->counts == NULL) {
+    int i;
+    p->counts = luaM_newvector(L, p->sizecode + 1, size_t);
+    p->sizecounts = p->sizecode + 1;
+    for (i = 0; i < p->sizecounts; i++)
+      p->counts[i] = 0;
+  }
+  return p->counts;
+}
+
+
+void luaG_countcall (lua_State *L, Proto *p) {
+  getcounts(L, p)[0]++;
+}
+
+
+/*
+** Turns the counters of 'L' (inherited by the threads it creates) on or
+** off; they only cost the VM the check of 'hookmask' that it already
+** does for line and count hooks. Turning them off keeps the counts.
+** Returns whether they were on.
+*/
+LUA_API int lua_setcounters (lua_State *L, int on) {
+  int res = (L->hookmask & LUAI_MASKCOUNTERS) != 0;
+  if (on)
+    L->hookmask |= LUAI_MASKCOUNTERS;
+  else
+    L->hookmask &= cast_byte(~LUAI_MASKCOUNTERS);
+  return res;
+}
+
+
+/*
+** Calls 'f' for each function of the state that has run with counters
+** on, with the state locked; 'f' must not call the Lua API.
+*/
+LUA_API void lua_getcounters (lua_State *L, lua_Counters f, void *ud) {
+  GCObject *o;
+  lua_lock(L);
+  for (o = G(L)->allgc; o != NULL; o = o->next) {
+    if (o->tt == LUA_TPROTO && gco2p(o)->counts != NULL) {
+      Proto *p = gco2p(o);
+      char buff[LUA_IDSIZE];
+      if (p->source)
+        luaO_chunkid(buff, getstr(p->source), LUA_IDSIZE);
+      else
+        strcpy(buff, "=?");
+      (*f)(ud, buff, p->linedefined, p->counts[0], p->counts + 1,
+           p->lineinfo, p->sizecode);
+    }
+  }
+  lua_unlock(L);
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Compact line information: instead of the line of each instruction,
+** 'linedelta' keeps its difference from the line of the previous one
+** (or from 'linedefined'), in a byte. Where it does not fit, and at
+** least every MAXIWTHABS instructions, it is ABSLINEINFO and the line
+** is in 'abslineinfo', so that finding a line walks at most MAXIWTHABS
+** bytes.
+** =======================================================
+*/
+
+#define ABSLINEINFO	(-0x80)
+
+#define MAXIWTHABS	128
+
+
+/* line of the last anchor at or before 'pc', which goes to '*basepc' */
+static int getbaseline (const Proto *f, int pc, int *basepc) {
+  if (f->sizeabslineinfo == 0 || pc < f->abslineinfo[0].pc) {
+    *basepc = -1;  /* start from the beginning */
+    return f->linedefined;
+  }
+  else {
+    /* there is an anchor at least every MAXIWTHABS instructions */
+    int i = pc / MAXIWTHABS - 1;  /* so this is a low estimate */
+    lua_assert(i < 0 || f->abslineinfo[i].pc <= pc);
+    if (i < 0)
+      i = 0;
+    while (i + 1 < f->sizeabslineinfo && pc >= f->abslineinfo[i + 1].pc)
+      i++;
+    *basepc = f->abslineinfo[i].pc;
+    return f->abslineinfo[i].line;
+  }
+}
+
+
+/* line of instruction 'pc' of a function without full 'lineinfo' */
+int luaG_getfuncline (const Proto *f, int pc) {
+  if (f->linedelta == NULL || pc < 0 || pc >= f->sizelinedelta)
+    return -1;  /* no debug information */
+  else {
+    int basepc;
+    int line = getbaseline(f, pc, &basepc);
+    while (basepc++ < pc) {  /* walk until the given instruction */
+      lua_assert(f->linedelta[basepc] != ABSLINEINFO);
+      line += f->linedelta[basepc];
+    }
+    return line;
+  }
+}
+
+
+/*
+** Encodes the 'lineinfo' of 'f' into 'delta' and 'abs', if not NULL;
+** returns the number of anchors
+*/
+static int encodelines (const Proto *f, ls_byte *delta, AbsLineInfo *abs) {
+  int prev = f->linedefined;
+  int iwthabs = 0;  /* instructions since the last anchor */
+  int nabs = 0;
+  int pc;
+  for (pc = 0; pc < f->sizelineinfo; pc++) {
+    int line = f->lineinfo[pc];
+    int d = line - prev;
+    if (d <= ABSLINEINFO || d >= -ABSLINEINFO || iwthabs++ >= MAXIWTHABS) {
+      if (abs) {
+        abs[nabs].pc = pc;
+        abs[nabs].line = line;
+      }
+      nabs++;
+      d = ABSLINEINFO;
+      iwthabs = 1;
+    }
+    if (delta)
+      delta[pc] = cast(ls_byte, d);
+    prev = line;
+  }
+  return nabs;
+}
+
+
+/*
+** Drops the debug information of 'f' and of its nested functions, as
+** a stripped dump does, keeping their lines in compact form if 'lines'
+*/
+void luaG_stripdebug (lua_State *L, Proto *f, int lines) {
+  int i;
+  lua_assert(f->shared == NULL);
+  for (i = 0; i < f->sizep; i++)
+    luaG_stripdebug(L, f->p[i], lines);
+  if (!lines) {  /* drop compact lines too */
+    luaM_freearray(L, f->linedelta, f->sizelinedelta);
+    f->linedelta = NULL;
+    f->sizelinedelta = 0;
+    luaM_freearray(L, f->abslineinfo, f->sizeabslineinfo);
+    f->abslineinfo = NULL;
+    f->sizeabslineinfo = 0;
+  }
+  else if (f->lineinfo != NULL) {  /* (arrays set as allocated, not to leak) */
+    int nabs = encodelines(f, NULL, NULL);
+    f->linedelta = luaM_newvector(L, f->sizelineinfo, ls_byte);
+    f->sizelinedelta = f->sizelineinfo;
+    f->abslineinfo = luaM_newvector(L, nabs, AbsLineInfo);
+    f->sizeabslineinfo = nabs;
+    encodelines(f, f->linedelta, f->abslineinfo);
+  }
+  luaM_freearray(L, f->lineinfo, f->sizelineinfo);
+  f->lineinfo = NULL;
+  f->sizelineinfo = 0;
+  luaM_freearray(L, f->locvars, f->sizelocvars);
+  f->locvars = NULL;
+  f->sizelocvars = 0;
+  for (i = 0; i < f->sizeupvalues; i++)
+    f->upvalues[i].name = NULL;
+}
+
+/* }====================================================== */
+
+
 void luaG_traceexec (lua_State *L) {
   CallInfo *ci = L->ci;
   lu_byte mask = L->hookmask;
-  int counthook = (--L->hookcount == 0 && (mask & LUA_MASKCOUNT));
+  int counthook;
+  if (mask & LUAI_MASKCOUNTERS) {
+    Proto *p = ci_func(ci)->p;
+    getcounts(L, p)[pcRel(ci->u.l.savedpc, p) + 1]++;
+  }
+  counthook = (--L->hookcount == 0 && (mask & LUA_MASKCOUNT));
   if (counthook)
     resethookcount(L);  /* reset count */
   else if (!(mask & LUA_MASKLINE))
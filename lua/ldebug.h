@@ -13,10 +13,14 @@
 
 #define pcRel(pc, p)	(cast(int, (pc) - (p)->code) - 1)
 
-#define getfuncline(f,pc)	(((f)->lineinfo) ? (f)->lineinfo[pc] : -1)
+#define getfuncline(f,pc)	(((f)->lineinfo) ? (f)->lineinfo[pc] \
+					 : luaG_getfuncline(f, pc))
 
 #define resethookcount(L)	(L->hookcount = L->basehookcount)
 
+/* not a hook: the counters of 'lua_setcounters', kept by 'lua_sethook' */
+#define LUAI_MASKCOUNTERS	(1 << 7)
+
 
 LUAI_FUNC l_noret luaG_typeerror (lua_State *L, const TValue *o,
                                                 const char *opname);
@@ -34,6 +38,9 @@ LUAI_FUNC const char *luaG_addinfo (lua_State *L, const char *msg,
                                                   TString *src, int line);
 LUAI_FUNC l_noret luaG_errormsg (lua_State *L);
 LUAI_FUNC void luaG_traceexec (lua_State *L);
+LUAI_FUNC void luaG_countcall (lua_State *L, Proto *p);
+LUAI_FUNC int luaG_getfuncline (const Proto *f, int pc);
+LUAI_FUNC void luaG_stripdebug (lua_State *L, Proto *f, int lines);
 
 
 #endif
@@ -159,6 +159,7 @@ int luaD_rawrunprotected (lua_State *L, Pfunc f, void *ud) {
   );
   L->errorJmp = lj.previous;  /* restore old error handler */
   L->nCcalls = oldnCcalls;
+  countbudget(L);  /* including that of an error or a yield */
   return lj.status;
 }
 
@@ -185,16 +186,33 @@ static void correctstack (lua_State *L, TValue *oldstack) {
 }
 
 
+/* maximum stack size of the state (see 'lua_setstacklimit') */
+#define stacklimit(L)	(G(L)->stacklimit)
+
 /* some space for error handling */
-#define ERRORSTACKSIZE	(LUAI_MAXSTACK + 200)
+#define ERRORSTACKEXTRA		200
+#define ERRORSTACKSIZE(L)	(stacklimit(L) + ERRORSTACKEXTRA)
+
+
+/*
+** Stacks grow by doubling up to LUAI_STACKSTEP slots and then in steps
+** of LUAI_STACKSTEP slots, so that deep scripts do not keep allocating
+** (and copying) blocks twice as large as needed.
+*/
+#if !defined(LUAI_STACKSTEP)
+#define LUAI_STACKSTEP		LUAI_MAXSTACK
+#endif
 
 
 void luaD_reallocstack (lua_State *L, int newsize) {
   TValue *oldstack = L->stack;
   int lim = L->stacksize;
-  lua_assert(newsize <= LUAI_MAXSTACK || newsize == ERRORSTACKSIZE);
+  lua_assert(newsize <= stacklimit(L) || L->inoverflow ||
+             newsize == L->stacksize);  /* (over a limit that was lowered) */
   lua_assert(L->stack_last - L->stack == L->stacksize - EXTRA_STACK);
   luaM_reallocvector(L, L->stack, L->stacksize, newsize, TValue);
+  luai_tracestack(L, L->stacksize, newsize);
+  luai_statstack(L, newsize);
   for (; lim < newsize; lim++)
     setnilvalue(L->stack + lim); /* erase new segment */
   L->stacksize = newsize;
@@ -203,17 +221,26 @@ void luaD_reallocstack (lua_State *L, int newsize) {
 }
 
 
+/*
+** A stack may be larger than the limit without handling an overflow
+** ('inoverflow'), if the limit was lowered after it grew: then it cannot
+** grow any more, and shrinks back under the limit in the collector.
+*/
 void luaD_growstack (lua_State *L, int n) {
   int size = L->stacksize;
-  if (size > LUAI_MAXSTACK)  /* error after extra size? */
+  int limit = stacklimit(L);
+  if (L->inoverflow)  /* error after extra size? */
     luaD_throw(L, LUA_ERRERR);
   else {
     int needed = cast_int(L->top - L->stack) + n + EXTRA_STACK;
-    int newsize = 2 * size;
-    if (newsize > LUAI_MAXSTACK) newsize = LUAI_MAXSTACK;
+    int newsize = (size < LUAI_STACKSTEP) ? 2 * size : size + LUAI_STACKSTEP;
+    if (newsize > limit) newsize = limit;
     if (newsize < needed) newsize = needed;
-    if (newsize > LUAI_MAXSTACK) {  /* stack overflow? */
-      luaD_reallocstack(L, ERRORSTACKSIZE);
+    if (newsize > limit) {  /* stack overflow? */
+      L->inoverflow = 1;
+      /* a stack over a lowered limit gets its extra size on top of it */
+      luaD_reallocstack(L, (size <= limit) ? ERRORSTACKSIZE(L)
+                                           : size + ERRORSTACKEXTRA);
       luaG_runerror(L, "stack overflow");
     }
     else
@@ -236,17 +263,19 @@ static int stackinuse (lua_State *L) {
 void luaD_shrinkstack (lua_State *L) {
   int inuse = stackinuse(L);
   int goodsize = inuse + (inuse / 8) + 2*EXTRA_STACK;
-  if (goodsize > LUAI_MAXSTACK)
-    goodsize = LUAI_MAXSTACK;  /* respect stack limit */
-  if (L->stacksize > LUAI_MAXSTACK)  /* had been handling stack overflow? */
+  if (goodsize > stacklimit(L))
+    goodsize = stacklimit(L);  /* respect stack limit */
+  if (L->inoverflow)  /* had been handling stack overflow? */
     luaE_freeCI(L);  /* free all CIs (list grew because of an error) */
   else
     luaE_shrinkCI(L);  /* shrink list */
   /* if thread is currently not handling a stack overflow and its
      good size is smaller than current size, shrink its stack */
-  if (inuse <= (LUAI_MAXSTACK - EXTRA_STACK) &&
-      goodsize < L->stacksize)
+  if (inuse <= (stacklimit(L) - EXTRA_STACK) &&
+      goodsize < L->stacksize) {
     luaD_reallocstack(L, goodsize);
+    L->inoverflow = 0;  /* back under the limit */
+  }
   else  /* don't change stack */
     condmovestack(L,{},{});  /* (change only for debugging) */
 }
@@ -418,6 +447,40 @@ int luaD_poscall (lua_State *L, CallInfo *ci, StkId firstResult, int nres) {
     p = restorestack(L, t__))  /* 'pos' part: restore 'p' */
 
 
+/*
+** Calls C function 'f' at 'func' and moves its results into place.
+** With no hooks set, the call and return hooks and the bookkeeping
+** around them in 'luaD_poscall' are skipped; a hook installed by 'f'
+** itself still sees its return. Always returns 1, as 'luaD_precall'
+** does for C functions.
+*/
+int luaD_precallC (lua_State *L, StkId func, int nresults,
+                                 lua_CFunction f) {
+  int n;  /* number of returns */
+  CallInfo *ci;
+  checkstackp(L, LUA_MINSTACK, func);  /* ensure minimum stack size */
+  ci = next_ci(L);  /* now 'enter' new function */
+  ci->nresults = nresults;
+  ci->func = func;
+  ci->top = L->top + LUA_MINSTACK;
+  lua_assert(ci->top <= L->stack_last);
+  ci->callstatus = 0;
+  if (L->hookmask & LUA_MASKCALL)
+    luaD_hook(L, LUA_HOOKCALL, -1);
+  lua_unlock(L);
+  n = (*f)(L);  /* do the actual call */
+  lua_lock(L);
+  api_checknelems(L, n);
+  if (L->hookmask == 0) {  /* usual case: return straight to the caller */
+    L->ci = ci->previous;  /* 'ci->func' survives a stack reallocation */
+    moveresults(L, L->top - n, ci->func, n, nresults);
+  }
+  else
+    luaD_poscall(L, ci, L->top - n, n);
+  return 1;
+}
+
+
 /*
 ** Prepares a function call: checks the stack, creates a new CallInfo
 ** entry, fills in the relevant information, calls hook if needed.
@@ -426,32 +489,12 @@ int luaD_poscall (lua_State *L, CallInfo *ci, StkId firstResult, int nres) {
 ** calls.) Returns true iff function has been executed (C function).
 */
 int luaD_precall (lua_State *L, StkId func, int nresults) {
-  lua_CFunction f;
   CallInfo *ci;
   switch (ttype(func)) {
     case LUA_TCCL:  /* C closure */
-      f = clCvalue(func)->f;
-      goto Cfunc;
+      return luaD_precallC(L, func, nresults, clCvalue(func)->f);
     case LUA_TLCF:  /* light C function */
-      f = fvalue(func);
-     Cfunc: {
-      int n;  /* number of returns */
-      checkstackp(L, LUA_MINSTACK, func);  /* ensure minimum stack size */
-      ci = next_ci(L);  /* now 'enter' new function */
-      ci->nresults = nresults;
-      ci->func = func;
-      ci->top = L->top + LUA_MINSTACK;
-      lua_assert(ci->top <= L->stack_last);
-      ci->callstatus = 0;
-      if (L->hookmask & LUA_MASKCALL)
-        luaD_hook(L, LUA_HOOKCALL, -1);
-      lua_unlock(L);
-      n = (*f)(L);  /* do the actual call */
-      lua_lock(L);
-      api_checknelems(L, n);
-      luaD_poscall(L, ci, L->top - n, n);
-      return 1;
-    }
+      return luaD_precallC(L, func, nresults, fvalue(func));
     case LUA_TLCL: {  /* Lua function: prepare its call */
       StkId base;
       Proto *p = clLvalue(func)->p;
@@ -473,8 +516,13 @@ int luaD_precall (lua_State *L, StkId func, int nresults) {
       lua_assert(ci->top <= L->stack_last);
       ci->u.l.savedpc = p->code;  /* starting point */
       ci->callstatus = CIST_LUA;
-      if (L->hookmask & LUA_MASKCALL)
-        callhook(L, ci);
+      luai_tracecall(L, p);
+      if (L->hookmask & (LUA_MASKCALL | LUAI_MASKCOUNTERS)) {
+        if (L->hookmask & LUAI_MASKCOUNTERS)
+          luaG_countcall(L, p);
+        if (L->hookmask & LUA_MASKCALL)
+          callhook(L, ci);
+      }
       return 0;
     }
     default: {  /* not a function */
@@ -663,6 +711,7 @@ static void resume (lua_State *L, void *ud) {
 LUA_API int lua_resume (lua_State *L, lua_State *from, int nargs) {
   int status;
   unsigned short oldnny = L->nny;  /* save "number of non-yieldable" calls */
+  lua_State *oldrunning;
   lua_lock(L);
   if (L->status == LUA_OK) {  /* may be starting a coroutine */
     if (L->ci != &L->base_ci)  /* not in base level? */
@@ -673,8 +722,11 @@ LUA_API int lua_resume (lua_State *L, lua_State *from, int nargs) {
   L->nCcalls = (from) ? from->nCcalls + 1 : 1;
   if (L->nCcalls >= LUAI_MAXCCALLS)
     return resume_error(L, "C stack overflow", nargs);
+  luaC_touchthread(L);  /* it runs again */
   luai_userstateresume(L, nargs);
   L->nny = 0;  /* allow yields */
+  oldrunning = G(L)->running;
+  G(L)->running = L;  /* read by samplers, from any context */
   api_checknelems(L, (L->status == LUA_OK) ? nargs + 1 : nargs);
   status = luaD_rawrunprotected(L, resume, &nargs);
   if (status == -1)  /* error calling 'lua_resume'? */
@@ -685,6 +737,7 @@ LUA_API int lua_resume (lua_State *L, lua_State *from, int nargs) {
       status = luaD_rawrunprotected(L, unroll, &status);
     }
     if (errorstatus(status)) {  /* unrecoverable error? */
+      luai_staterror(L);
       L->status = cast_byte(status);  /* mark thread as 'dead' */
       seterrorobj(L, status, L->top);  /* push error message */
       L->ci->top = L->top;
@@ -692,6 +745,7 @@ LUA_API int lua_resume (lua_State *L, lua_State *from, int nargs) {
     else lua_assert(status == L->status);  /* normal end or yield */
   }
   L->nny = oldnny;  /* restore 'nny' */
+  G(L)->running = oldrunning;
   L->nCcalls--;
   lua_assert(L->nCcalls == ((from) ? from->nCcalls : 0));
   lua_unlock(L);
@@ -704,6 +758,46 @@ LUA_API int lua_isyieldable (lua_State *L) {
 }
 
 
+/*
+** Called when the instruction budget of 'L' runs out, after a backward
+** jump or a call to a Lua function (so, between instructions).
+** A thread with 'budgetyield' that can yield does so with no values, as
+** a hook does, and goes on with its next instruction when resumed; other
+** threads just let other contexts run.
+*/
+static void budget (lua_State *L) {
+  countbudget(L);
+  resetbudget(L);
+  if (L->basebudget == 0)
+    return;  /* no budget (counter wrapped around) */
+  if (L->budgetyield && L->nny == 0) {
+    CallInfo *ci = L->ci;
+    lua_assert(isLua(ci));
+    L->status = LUA_YIELD;
+    ci->extra = savestack(L, ci->func);  /* save current 'func' */
+    ci->func = L->top - 1;  /* protect stack below results */
+    luaD_throw(L, LUA_YIELD);
+  }
+  luai_budgetyield(L);
+}
+
+
+/*
+** Called by the VM every few units of the instruction budget (see
+** 'checkbudget' in lvm.c). A request for hooks ('hookreq'), usually set
+** asynchronously, is served by the running thread itself, so that it
+** may change its own hooks.
+*/
+void luaD_poll (lua_State *L) {
+  if (G(L)->hookreq) {
+    G(L)->hookreq = 0;
+    luai_hookreq(L);
+  }
+  if (L->budget == 0)
+    budget(L);
+}
+
+
 LUA_API int lua_yieldk (lua_State *L, int nresults, lua_KContext ctx,
                         lua_KFunction k) {
   CallInfo *ci = L->ci;
@@ -744,6 +838,7 @@ int luaD_pcall (lua_State *L, Pfunc func, void *u,
   status = luaD_rawrunprotected(L, func, u);
   if (status != LUA_OK) {  /* an error occurred? */
     StkId oldtop = restorestack(L, old_top);
+    luai_staterror(L);
     luaF_close(L, oldtop);  /* close possible pending closures */
     seterrorobj(L, status, oldtop);
     L->ci = old_ci;
@@ -784,13 +879,18 @@ static void f_parser (lua_State *L, void *ud) {
   int c = zgetc(p->z);  /* read first character */
   if (c == LUA_SIGNATURE[0]) {
     checkmode(L, p->mode, "binary");
-    cl = luaU_undump(L, p->z, p->name);
+    cl = luaU_undump(L, p->z, p->name,
+                     p->mode != NULL && strchr(p->mode, 'v') != NULL);
   }
   else {
     checkmode(L, p->mode, "text");
     cl = luaY_parser(L, p->z, &p->buff, &p->dyd, p->name, c);
   }
   lua_assert(cl->nupvalues == cl->p->sizeupvalues);
+  if (p->mode != NULL && strchr(p->mode, 's') != NULL)
+    luaG_stripdebug(L, cl->p, 0);  /* no debug information */
+  else if (p->mode != NULL && strchr(p->mode, 'c') != NULL)
+    luaG_stripdebug(L, cl->p, 1);  /* only compact lines */
   luaF_initupvals(L, cl);
 }
 
@@ -799,7 +899,9 @@ int luaD_protectedparser (lua_State *L, ZIO *z, const char *name,
                                         const char *mode) {
   struct SParser p;
   int status;
+  lu_byte regionbits = G(L)->regionbits;
   L->nny++;  /* cannot yield during parsing */
+  G(L)->regionbits = 0;  /* prototypes store strings with no barriers */
   p.z = z; p.name = name; p.mode = mode;
   p.dyd.actvar.arr = NULL; p.dyd.actvar.size = 0;
   p.dyd.gt.arr = NULL; p.dyd.gt.size = 0;
@@ -810,6 +912,7 @@ int luaD_protectedparser (lua_State *L, ZIO *z, const char *name,
   luaM_freearray(L, p.dyd.actvar.arr, p.dyd.actvar.size);
   luaM_freearray(L, p.dyd.gt.arr, p.dyd.gt.size);
   luaM_freearray(L, p.dyd.label.arr, p.dyd.label.size);
+  G(L)->regionbits = regionbits;
   L->nny--;
   return status;
 }
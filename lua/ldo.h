@@ -29,6 +29,18 @@
 
 
 
+/* refill the instruction budget (see 'lua_setbudget') */
+#define resetbudget(L) \
+	((L)->budgetmark = (L)->budget = \
+	   ((L)->basebudget > 0 ? (L)->basebudget : MAX_INT))
+
+/* count the units of budget spent since they were last counted */
+#define countbudget(L) \
+	{ if ((L)->budget != (L)->budgetmark) { \
+	    luai_statbudget(L, (L)->budgetmark - (L)->budget); \
+	    (L)->budgetmark = (L)->budget; } }
+
+
 #define savestack(L,p)		((char *)(p) - (char *)L->stack)
 #define restorestack(L,n)	((TValue *)((char *)L->stack + (n)))
 
@@ -40,6 +52,8 @@ LUAI_FUNC int luaD_protectedparser (lua_State *L, ZIO *z, const char *name,
                                                   const char *mode);
 LUAI_FUNC void luaD_hook (lua_State *L, int event, int line);
 LUAI_FUNC int luaD_precall (lua_State *L, StkId func, int nresults);
+LUAI_FUNC int luaD_precallC (lua_State *L, StkId func, int nresults,
+                                           lua_CFunction f);
 LUAI_FUNC void luaD_call (lua_State *L, StkId func, int nResults);
 LUAI_FUNC void luaD_callnoyield (lua_State *L, StkId func, int nResults);
 LUAI_FUNC int luaD_pcall (lua_State *L, Pfunc func, void *u,
@@ -50,6 +64,7 @@ LUAI_FUNC void luaD_reallocstack (lua_State *L, int newsize);
 LUAI_FUNC void luaD_growstack (lua_State *L, int n);
 LUAI_FUNC void luaD_shrinkstack (lua_State *L);
 LUAI_FUNC void luaD_inctop (lua_State *L);
+LUAI_FUNC void luaD_poll (lua_State *L);
 
 LUAI_FUNC l_noret luaD_throw (lua_State *L, int errcode);
 LUAI_FUNC int luaD_rawrunprotected (lua_State *L, Pfunc f, void *ud);
@@ -16,7 +16,9 @@
 
 #include "lua.h"
 
+#include "ldebug.h"
 #include "lobject.h"
+#include "lopcodes.h"
 #include "lstate.h"
 #include "lundump.h"
 
@@ -90,8 +92,12 @@ static void DumpString (const TString *s, DumpState *D) {
 
 
 static void DumpCode (const Proto *f, DumpState *D) {
+  int i;
   DumpInt(f->sizecode, D);
-  DumpVector(f->code, f->sizecode, D);
+  for (i = 0; i < f->sizecode; i++) {  /* dump fused opcodes in plain form */
+    Instruction inst = luaP_unfuse(f->code[i]);
+    DumpVar(inst, D);
+  }
 }
 
 
@@ -150,9 +156,17 @@ static void DumpUpvalues (const Proto *f, DumpState *D) {
 
 static void DumpDebug (const Proto *f, DumpState *D) {
   int i, n;
-  n = (D->strip) ? 0 : f->sizelineinfo;
-  DumpInt(n, D);
-  DumpVector(f->lineinfo, n, D);
+  if (f->lineinfo == NULL && f->linedelta != NULL) {  /* compact lines? */
+    n = (D->strip) ? 0 : f->sizelinedelta;
+    DumpInt(n, D);
+    for (i = 0; i < n; i++)  /* dumped in full, as the format has them */
+      DumpInt(getfuncline(f, i), D);
+  }
+  else {
+    n = (D->strip) ? 0 : f->sizelineinfo;
+    DumpInt(n, D);
+    DumpVector(f->lineinfo, n, D);
+  }
   n = (D->strip) ? 0 : f->sizelocvars;
   DumpInt(n, D);
   for (i = 0; i < n; i++) {
@@ -20,7 +20,9 @@
 #include "lgc.h"
 #include "lmem.h"
 #include "lobject.h"
+#include "lopcodes.h"
 #include "lstate.h"
+#include "ltable.h"
 
 
 
@@ -101,15 +103,27 @@ void luaF_close (lua_State *L, StkId level) {
 Proto *luaF_newproto (lua_State *L) {
   GCObject *o = luaC_newobj(L, LUA_TPROTO, sizeof(Proto));
   Proto *f = gco2p(o);
+  int i;
   f->k = NULL;
   f->sizek = 0;
   f->p = NULL;
   f->sizep = 0;
   f->code = NULL;
-  f->cache = NULL;
+  for (i = 0; i < NCLCACHE; i++)
+    f->cache[i] = NULL;
+  f->cachepos = 0;
+  f->icache = NULL;
+  f->sizeicache = 0;
+  f->counts = NULL;
+  f->sizecounts = 0;
+  f->shared = NULL;
   f->sizecode = 0;
   f->lineinfo = NULL;
   f->sizelineinfo = 0;
+  f->linedelta = NULL;
+  f->sizelinedelta = 0;
+  f->abslineinfo = NULL;
+  f->sizeabslineinfo = 0;
   f->upvalues = NULL;
   f->sizeupvalues = 0;
   f->numparams = 0;
@@ -125,16 +139,52 @@ Proto *luaF_newproto (lua_State *L) {
 
 
 void luaF_freeproto (lua_State *L, Proto *f) {
-  luaM_freearray(L, f->code, f->sizecode);
+  if (f->shared != NULL)  /* code borrowed from another block? */
+    luai_protounshare(L, f->shared);
+  else {
+    luaM_freearray(L, f->code, f->sizecode);
+    luaM_freearray(L, f->lineinfo, f->sizelineinfo);
+  }
+  luaM_freearray(L, f->linedelta, f->sizelinedelta);
+  luaM_freearray(L, f->abslineinfo, f->sizeabslineinfo);
   luaM_freearray(L, f->p, f->sizep);
   luaM_freearray(L, f->k, f->sizek);
-  luaM_freearray(L, f->lineinfo, f->sizelineinfo);
   luaM_freearray(L, f->locvars, f->sizelocvars);
   luaM_freearray(L, f->upvalues, f->sizeupvalues);
+  luaM_freearray(L, f->icache, f->sizeicache);
+  luaM_freearray(L, f->counts, f->sizecounts);
   luaM_free(L, f);
 }
 
 
+/*
+** Create the inline caches of a finished prototype, if it has any
+** table access with a constant short-string key ('GETTABUP'/'GETTABLE'
+** with a 'K' operand, or a method lookup by 'SELF'). Each cache entry
+** holds the node index where the key was last found; a hit is checked
+** against the current size and contents of the node array, so a resize
+** ('luaH_resize') or a table being replaced simply turns it into a miss.
+*/
+void luaF_initicache (lua_State *L, Proto *f) {
+  int pc;
+  for (pc = 0; pc < f->sizecode; pc++) {
+    Instruction i = f->code[pc];
+    OpCode op = GET_OPCODE(i);
+    if ((op == OP_GETTABUP || op == OP_GETTABUPF || op == OP_GETTABLE ||
+         op == OP_SELF) &&
+        ISK(GETARG_C(i)) &&
+        ttisshrstring(&f->k[INDEXK(GETARG_C(i))]))
+      break;
+  }
+  if (pc == f->sizecode)
+    return;  /* nothing to cache */
+  f->icache = luaM_newvector(L, f->sizecode, unsigned int);
+  f->sizeicache = f->sizecode;
+  for (pc = 0; pc < f->sizeicache; pc++)
+    f->icache[pc] = NOICACHE;
+}
+
+
 /*
 ** Look for n-th local variable at line 'line' in function 'func'.
 ** Returns NULL if not found.
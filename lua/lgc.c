@@ -28,6 +28,17 @@
 #include "ltm.h"
 
 
+/*
+** a monotonic clock in nanoseconds, for time-bounded steps
+** ('luaC_timedstep')
+*/
+#if !defined(luai_gcclock)
+#include <time.h>
+#define luai_gcclock()  \
+	(cast(l_clock, clock()) * (1000000000 / CLOCKS_PER_SEC))
+#endif
+
+
 /*
 ** internal state for collector while inside the atomic phase. The
 ** collector should never be in this state while running regular code.
@@ -65,7 +76,7 @@
 ** 'makewhite' erases all color bits then sets only the current white
 ** bit
 */
-#define maskcolors	(~(bitmask(BLACKBIT) | WHITEBITS))
+#define maskcolors	(~(bitmask(BLACKBIT) | WHITEBITS | bitmask(OLDBIT)))
 #define makewhite(g,x)	\
  (x->marked = cast_byte((x->marked & maskcolors) | luaC_white(g)))
 
@@ -75,7 +86,10 @@
 
 #define valiswhite(x)   (iscollectable(x) && iswhite(gcvalue(x)))
 
-#define checkdeadkey(n)	lua_assert(!ttisdeadkey(gkey(n)) || ttisnil(gval(n)))
+/* the collectable object of a value, or NULL */
+#define gcvalueN(o)	(iscollectable(o) ? gcvalue(o) : NULL)
+
+#define checkdeadkey(n)	lua_assert(!keyisdead(n) || ttisnil(gval(n)))
 
 
 #define checkconsistency(obj)  \
@@ -93,6 +107,9 @@
 */
 #define markobjectN(g,t)	{ if (t) markobject(g,t); }
 
+/* mark the key of node 'n' (if collectable) */
+#define markkey(g,n)	{ if (keyiscollectable(n)) markobject(g,gckey(n)); }
+
 static void reallymarkobject (global_State *g, GCObject *o);
 
 
@@ -126,8 +143,8 @@ static void reallymarkobject (global_State *g, GCObject *o);
 */
 static void removeentry (Node *n) {
   lua_assert(ttisnil(gval(n)));
-  if (valiswhite(gkey(n)))
-    setdeadvalue(wgkey(n));  /* unused and unmarked key; remove it */
+  if (keyiscollectable(n) && iswhite(gckey(n)))
+    setdeadkey(n);  /* unused and unmarked key; remove it */
 }
 
 
@@ -138,13 +155,13 @@ static void removeentry (Node *n) {
 ** other objects: if really collected, cannot keep them; for objects
 ** being finalized, keep them in keys, but not in values
 */
-static int iscleared (global_State *g, const TValue *o) {
-  if (!iscollectable(o)) return 0;
-  else if (ttisstring(o)) {
-    markobject(g, tsvalue(o));  /* strings are 'values', so are never weak */
+static int iscleared (global_State *g, GCObject *o) {
+  if (o == NULL) return 0;  /* non-collectable value */
+  else if (novariant(o->tt) == LUA_TSTRING) {
+    markobject(g, o);  /* strings are 'values', so are never weak */
     return 0;
   }
-  else return iswhite(gcvalue(o));
+  else return iswhite(o);
 }
 
 
@@ -178,6 +195,19 @@ void luaC_barrierback_ (lua_State *L, Table *t) {
 }
 
 
+/*
+** barrier for an idle thread, which only exists in generational mode
+** (see 'blackenthreads'): make it gray again, to be traversed by the
+** next collection
+*/
+void luaC_touchthread_ (lua_State *L) {
+  global_State *g = G(L);
+  lua_assert(g->gcgen && isblack(L));
+  black2gray(L);
+  linkgclist(L, g->grayagain);
+}
+
+
 /*
 ** barrier for assignments to closed upvalues. Because upvalues are
 ** shared among closures, it is impossible to know the color of all
@@ -188,6 +218,8 @@ void luaC_upvalbarrier_ (lua_State *L, UpVal *uv) {
   global_State *g = G(L);
   GCObject *o = gcvalue(uv->v);
   lua_assert(!upisopen(uv));  /* ensured by macro luaC_upvalbarrier */
+  if (islocal(o))  /* owners are unknown, so it may be out of the region */
+    setescaped(o);
   if (keepinvariant(g))
     markobject(g, o);
 }
@@ -196,6 +228,7 @@ void luaC_upvalbarrier_ (lua_State *L, UpVal *uv) {
 void luaC_fix (lua_State *L, GCObject *o) {
   global_State *g = G(L);
   lua_assert(g->allgc == o);  /* object must be 1st in 'allgc' list! */
+  lua_assert(!testbit(o->marked, REGIONBIT));
   white2gray(o);  /* they will be gray forever */
   g->allgc = o->next;  /* remove object from 'allgc' list */
   o->next = g->fixedgc;  /* link it to 'fixedgc' list */
@@ -205,12 +238,19 @@ void luaC_fix (lua_State *L, GCObject *o) {
 
 /*
 ** create a new collectable object (with given type and size) and link
-** it to 'allgc' list.
+** it to 'allgc' list. Inside a region, tables and strings are created
+** as region objects.
 */
 GCObject *luaC_newobj (lua_State *L, int tt, size_t sz) {
   global_State *g = G(L);
   GCObject *o = cast(GCObject *, luaM_newobject(L, novariant(tt), sz));
   o->marked = luaC_white(g);
+  if (g->regionbits &&
+      (novariant(tt) == LUA_TTABLE || novariant(tt) == LUA_TSTRING)) {
+    o->marked |= g->regionbits;
+    g->nregion++;
+    luaC_regionthread(g, L);
+  }
   o->tt = tt;
   o->next = g->allgc;
   g->allgc = o;
@@ -245,7 +285,7 @@ static void reallymarkobject (global_State *g, GCObject *o) {
     }
     case LUA_TLNGSTR: {
       gray2black(o);
-      g->GCmemtrav += sizelstring(gco2ts(o)->u.lnglen);
+      g->GCmemtrav += sizelngstr(gco2ts(o));
       break;
     }
     case LUA_TUSERDATA: {
@@ -295,6 +335,17 @@ static void markmt (global_State *g) {
 }
 
 
+/*
+** mark values held by the reference store ('lua_ref'); free slots hold
+** integers, which are not collectable
+*/
+static void markrefs (global_State *g) {
+  int i;
+  for (i = 0; i < g->nrefs; i++)
+    markvalue(g, &g->refs[i]);
+}
+
+
 /*
 ** mark all objects in list of being-finalized
 */
@@ -315,7 +366,8 @@ static void remarkupvals (global_State *g) {
   lua_State *thread;
   lua_State **p = &g->twups;
   while ((thread = *p) != NULL) {
-    lua_assert(!isblack(thread));  /* threads are never black */
+    /* threads with upvalues are never black */
+    lua_assert(!isblack(thread) || thread->openupval == NULL);
     if (isgray(thread) && thread->openupval != NULL)
       p = &thread->twups;  /* keep marked thread with upvalues in the list */
     else {  /* thread is not marked or without upvalues */
@@ -341,6 +393,7 @@ static void restartcollection (global_State *g) {
   g->weak = g->allweak = g->ephemeron = NULL;
   markobject(g, g->mainthread);
   markvalue(g, &g->l_registry);
+  markrefs(g);
   markmt(g);
   markbeingfnz(g);  /* mark any finalizing object left from previous cycle */
 }
@@ -370,9 +423,9 @@ static void traverseweakvalue (global_State *g, Table *h) {
     if (ttisnil(gval(n)))  /* entry is empty? */
       removeentry(n);  /* remove it */
     else {
-      lua_assert(!ttisnil(gkey(n)));
-      markvalue(g, gkey(n));  /* mark key */
-      if (!hasclears && iscleared(g, gval(n)))  /* is there a white value? */
+      lua_assert(!keyisnil(n));
+      markkey(g, n);  /* mark key */
+      if (!hasclears && iscleared(g, gcvalueN(gval(n))))  /* white value? */
         hasclears = 1;  /* table will have to be cleared */
     }
   }
@@ -380,6 +433,8 @@ static void traverseweakvalue (global_State *g, Table *h) {
     linkgclist(h, g->grayagain);  /* must retraverse it in atomic phase */
   else if (hasclears)
     linkgclist(h, g->weak);  /* has to be cleared later */
+  else
+    gray2black(h);  /* nothing to clear (and in no list) */
 }
 
 
@@ -411,7 +466,7 @@ static int traverseephemeron (global_State *g, Table *h) {
     checkdeadkey(n);
     if (ttisnil(gval(n)))  /* entry is empty? */
       removeentry(n);  /* remove it */
-    else if (iscleared(g, gkey(n))) {  /* key is not marked (yet)? */
+    else if (iscleared(g, gckeyN(n))) {  /* key is not marked (yet)? */
       hasclears = 1;  /* table must be cleared */
       if (valiswhite(gval(n)))  /* value not marked yet? */
         hasww = 1;  /* white-white entry */
@@ -428,6 +483,8 @@ static int traverseephemeron (global_State *g, Table *h) {
     linkgclist(h, g->ephemeron);  /* have to propagate again */
   else if (hasclears)  /* table has white keys? */
     linkgclist(h, g->allweak);  /* may have to clean white keys */
+  else
+    gray2black(h);  /* nothing to clear (and in no list) */
   return marked;
 }
 
@@ -442,8 +499,8 @@ static void traversestrongtable (global_State *g, Table *h) {
     if (ttisnil(gval(n)))  /* entry is empty? */
       removeentry(n);  /* remove it */
     else {
-      lua_assert(!ttisnil(gkey(n)));
-      markvalue(g, gkey(n));  /* mark key */
+      lua_assert(!keyisnil(n));
+      markkey(g, n);  /* mark key */
       markvalue(g, gval(n));  /* mark value */
     }
   }
@@ -480,8 +537,10 @@ static lu_mem traversetable (global_State *g, Table *h) {
 */
 static int traverseproto (global_State *g, Proto *f) {
   int i;
-  if (f->cache && iswhite(f->cache))
-    f->cache = NULL;  /* allow cache to be collected */
+  for (i = 0; i < NCLCACHE; i++) {
+    if (f->cache[i] && iswhite(f->cache[i]))
+      f->cache[i] = NULL;  /* allow cache to be collected */
+  }
   markobjectN(g, f->source);
   for (i = 0; i < f->sizek; i++)  /* mark literals */
     markvalue(g, &f->k[i]);
@@ -495,8 +554,12 @@ static int traverseproto (global_State *g, Proto *f) {
                          sizeof(Proto *) * f->sizep +
                          sizeof(TValue) * f->sizek +
                          sizeof(int) * f->sizelineinfo +
+                         sizeof(ls_byte) * f->sizelinedelta +
+                         sizeof(AbsLineInfo) * f->sizeabslineinfo +
                          sizeof(LocVar) * f->sizelocvars +
-                         sizeof(Upvaldesc) * f->sizeupvalues;
+                         sizeof(Upvaldesc) * f->sizeupvalues +
+                         sizeof(unsigned int) * f->sizeicache +
+                         sizeof(size_t) * f->sizecounts;
 }
 
 
@@ -556,7 +619,7 @@ static lu_mem traversethread (global_State *g, lua_State *th) {
 
 /*
 ** traverse one gray object, turning it to black (except for threads,
-** which are always gray).
+** which are left gray; see 'blackenthreads').
 */
 static void propagatemark (global_State *g) {
   lu_mem size;
@@ -643,7 +706,7 @@ static void clearkeys (global_State *g, GCObject *l, GCObject *f) {
     Table *h = gco2t(l);
     Node *n, *limit = gnodelast(h);
     for (n = gnode(h, 0); n < limit; n++) {
-      if (!ttisnil(gval(n)) && (iscleared(g, gkey(n)))) {
+      if (!ttisnil(gval(n)) && (iscleared(g, gckeyN(n)))) {
         setnilvalue(gval(n));  /* remove value ... */
         removeentry(n);  /* and remove entry from table */
       }
@@ -663,11 +726,11 @@ static void clearvalues (global_State *g, GCObject *l, GCObject *f) {
     unsigned int i;
     for (i = 0; i < h->sizearray; i++) {
       TValue *o = &h->array[i];
-      if (iscleared(g, o))  /* value was collected? */
+      if (iscleared(g, gcvalueN(o)))  /* value was collected? */
         setnilvalue(o);  /* remove value */
     }
     for (n = gnode(h, 0); n < limit; n++) {
-      if (!ttisnil(gval(n)) && iscleared(g, gval(n))) {
+      if (!ttisnil(gval(n)) && iscleared(g, gcvalueN(gval(n)))) {
         setnilvalue(gval(n));  /* remove value ... */
         removeentry(n);  /* and remove entry from table */
       }
@@ -696,6 +759,8 @@ static void freeLclosure (lua_State *L, LClosure *cl) {
 
 
 static void freeobj (lua_State *L, GCObject *o) {
+  if (testbit(o->marked, REGIONBIT))
+    G(L)->nregion--;
   switch (o->tt) {
     case LUA_TPROTO: luaF_freeproto(L, gco2p(o)); break;
     case LUA_TLCL: {
@@ -714,7 +779,7 @@ static void freeobj (lua_State *L, GCObject *o) {
       luaM_freemem(L, o, sizelstring(gco2ts(o)->shrlen));
       break;
     case LUA_TLNGSTR: {
-      luaM_freemem(L, o, sizelstring(gco2ts(o)->u.lnglen));
+      luaS_freelngstr(L, gco2ts(o));
       break;
     }
     default: lua_assert(0);
@@ -732,11 +797,15 @@ static GCObject **sweeplist (lua_State *L, GCObject **p, lu_mem count);
 ** white; change all non-dead objects back to white, preparing for next
 ** collection cycle. Return where to continue the traversal or NULL if
 ** list is finished.
+** In a minor collection (generational mode), live objects keep their
+** colors and become old instead, and the sweep stops at the first old
+** object: new objects are always in front of old ones in each list.
 */
 static GCObject **sweeplist (lua_State *L, GCObject **p, lu_mem count) {
   global_State *g = G(L);
   int ow = otherwhite(g);
   int white = luaC_white(g);  /* current white */
+  int minor = g->gcminor;
   while (*p != NULL && count-- > 0) {
     GCObject *curr = *p;
     int marked = curr->marked;
@@ -744,6 +813,12 @@ static GCObject **sweeplist (lua_State *L, GCObject **p, lu_mem count) {
       *p = curr->next;  /* remove 'curr' from list */
       freeobj(L, curr);  /* erase 'curr' */
     }
+    else if (minor) {  /* keep color and make it old */
+      if (testbit(marked, OLDBIT))
+        return NULL;  /* rest of the list is old */
+      l_setbit(curr->marked, OLDBIT);
+      p = &curr->next;  /* go to next element */
+    }
     else {  /* change mark to 'white' */
       curr->marked = cast_byte((marked & maskcolors) | white);
       p = &curr->next;  /* go to next element */
@@ -793,6 +868,7 @@ static GCObject *udata2finalize (global_State *g) {
   o->next = g->allgc;  /* return it to 'allgc' list */
   g->allgc = o;
   resetbit(o->marked, FINALIZEDBIT);  /* object is "normal" again */
+  resetbit(o->marked, OLDBIT);  /* not old at the head of 'allgc' */
   if (issweepphase(g))
     makewhite(g, o);  /* "sweep" object */
   return o;
@@ -915,9 +991,159 @@ void luaC_checkfinalizer (lua_State *L, GCObject *o, Table *mt) {
     /* search for pointer pointing to 'o' */
     for (p = &g->allgc; *p != o; p = &(*p)->next) { /* empty */ }
     *p = o->next;  /* remove 'o' from 'allgc' list */
+    if (testbit(o->marked, REGIONBIT)) {  /* leaving the region? */
+      resetbits(o->marked, REGIONBITS);
+      g->nregion--;
+      g->regionlost = 1;  /* what it refers to can no longer be tracked */
+    }
     o->next = g->finobj;  /* link it in 'finobj' list */
     g->finobj = o;
     l_setbit(o->marked, FINALIZEDBIT);  /* mark it as such */
+    resetbit(o->marked, OLDBIT);  /* not old at the head of 'finobj' */
+  }
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Regions
+** Tables and strings created between 'luaC_beginregion' and
+** 'luaC_endregion' are marked with REGIONBIT and, being the newest
+** objects, sit in front of 'allgc' (mixed only with objects coming back
+** from 'tobefnz'); 'nregion' counts them. A region object is "local"
+** until it is stored where the region cannot see: barriers, closed
+** upvalues and the API entries with no barrier set ESCAPEDBIT on it,
+** and when the region ends the stacks of the threads that created region
+** objects or reused local strings from the string table
+** ('regionthreads') are scanned, as is the stack of the thread ending it. The parser and undumper store strings into prototypes with
+** no barriers: they run with the region closed and escape any local
+** string they get from the string table. Whatever is
+** reachable from an escaped object escapes too; that closure is only
+** computed at the end. There, local objects still white are freed at
+** once; the others become regular objects, left to the collector.
+** =======================================================
+*/
+
+
+/*
+** mark as escaped the local values in the live part of a stack
+*/
+static void escapestack (lua_State *th) {
+  StkId o;
+  for (o = th->stack; o < th->top; o++)
+    luaC_escapevalue(o);
+}
+
+
+/*
+** mark as escaped the local objects referred by table 'h'; return
+** whether any of them is a table, whose contents must be visited too
+*/
+static int escapetable (Table *h) {
+  int more = 0;
+  unsigned int i;
+  Node *n, *limit = gnodelast(h);
+  if (h->metatable && islocal(h->metatable)) {
+    setescaped(h->metatable);
+    more = 1;
+  }
+  for (i = 0; i < h->sizearray; i++) {
+    TValue *o = &h->array[i];
+    if (iscollectable(o) && islocal(gcvalue(o))) {
+      setescaped(gcvalue(o));
+      more |= ttistable(o);
+    }
+  }
+  for (n = gnode(h, 0); n < limit; n++) {
+    if (!ttisnil(gval(n))) {
+      if (keyiscollectable(n) && islocal(gckey(n))) {
+        setescaped(gckey(n));
+        more |= (gckey(n)->tt == LUA_TTABLE);
+      }
+      if (iscollectable(gval(n)) && islocal(gcvalue(gval(n)))) {
+        setescaped(gcvalue(gval(n)));
+        more |= ttistable(gval(n));
+      }
+    }
+  }
+  return more;
+}
+
+
+/*
+** Close the set of escaped objects: a local object that is not white
+** may be in a gray list, or be referred by one that is, so it is kept
+** too. Repeat the pass over the region objects until no table escapes.
+*/
+static void escapeclosure (global_State *g) {
+  int more;
+  do {
+    GCObject *o;
+    lu_mem n = g->nregion;
+    more = 0;
+    for (o = g->allgc; n > 0; o = o->next) {
+      if (!testbit(o->marked, REGIONBIT))
+        continue;  /* object from 'tobefnz', not of the region */
+      n--;
+      if (islocal(o) && !iswhite(o)) {
+        setescaped(o);
+        more |= (o->tt == LUA_TTABLE);
+      }
+      if (!islocal(o) && o->tt == LUA_TTABLE)
+        more |= escapetable(gco2t(o));
+    }
+  } while (more);
+}
+
+
+void luaC_beginregion (lua_State *L) {
+  global_State *g = G(L);
+  if (g->regiondepth++ == 0) {
+    lua_assert(g->nregion == 0 && g->regionthreads == NULL);
+    g->regionbits = bitmask(REGIONBIT);
+    g->regionlost = 0;
+  }
+}
+
+
+void luaC_endregion (lua_State *L) {
+  global_State *g = G(L);
+  GCObject **p = &g->allgc;
+  lua_assert(g->regiondepth > 0);
+  if (--g->regiondepth > 0)
+    return;  /* an outer region owns the objects */
+  g->regionbits = 0;
+  if (!g->regionlost)
+    escapestack(L);
+  while (g->regionthreads != NULL) {  /* scan and empty 'regionthreads' */
+    lua_State *th = g->regionthreads;
+    if (!g->regionlost)
+      escapestack(th);
+    g->regionthreads = th->regionnext;
+    th->regionnext = th;
+  }
+  if (!g->regionlost)
+    escapeclosure(g);
+  while (g->nregion > 0) {
+    GCObject *curr = *p;
+    if (!testbit(curr->marked, REGIONBIT)) {
+      p = &curr->next;  /* not of the region */
+      continue;
+    }
+    if (islocal(curr) && !g->regionlost) {
+      if (g->sweepgc == &curr->next)  /* should not free 'sweepgc' object */
+        g->sweepgc = p;
+      *p = curr->next;  /* remove 'curr' from 'allgc' list */
+      freeobj(L, curr);  /* also decrements 'nregion' */
+    }
+    else {  /* keep it as a regular object */
+      resetbits(curr->marked, REGIONBITS);
+      g->nregion--;
+      p = &curr->next;
+    }
   }
 }
 
@@ -973,6 +1199,7 @@ void luaC_freeallobjects (lua_State *L) {
   lua_assert(g->tobefnz == NULL);
   g->currentwhite = WHITEBITS; /* this "white" makes all objects look dead */
   g->gckind = KGC_NORMAL;
+  g->gcgen = g->gcminor = 0;
   sweepwholelist(L, &g->finobj);
   sweepwholelist(L, &g->allgc);
   sweepwholelist(L, &g->fixedgc);  /* collect fixed objects */
@@ -987,11 +1214,13 @@ static l_mem atomic (lua_State *L) {
   GCObject *grayagain = g->grayagain;  /* save original list */
   lua_assert(g->ephemeron == NULL && g->weak == NULL);
   lua_assert(!iswhite(g->mainthread));
+  g->grayagain = NULL;  /* will collect the (gray) threads */
   g->gcstate = GCSinsideatomic;
   g->GCmemtrav = 0;  /* start counting work */
   markobject(g, L);  /* mark running thread */
-  /* registry and global metatables may be changed by API */
+  /* registry, references and global metatables may be changed by API */
   markvalue(g, &g->l_registry);
+  markrefs(g);  /* (stores into 'refs' have no barriers) */
   markmt(g);  /* mark global metatables */
   /* remark occasional upvalues of (maybe) dead threads */
   remarkupvals(g);
@@ -1043,7 +1272,7 @@ static lu_mem sweepstep (lua_State *L, global_State *g,
 }
 
 
-static lu_mem singlestep (lua_State *L) {
+static lu_mem dostep (lua_State *L) {
   global_State *g = G(L);
   switch (g->gcstate) {
     case GCSpause: {
@@ -1056,6 +1285,7 @@ static lu_mem singlestep (lua_State *L) {
       g->GCmemtrav = 0;
       lua_assert(g->gray);
       propagatemark(g);
+      luaS_rehashstep(L, 1);  /* move along a resize of the string table */
        if (g->gray == NULL)  /* no more gray objects? */
         g->gcstate = GCSatomic;  /* finish propagate phase */
       return g->GCmemtrav;  /* memory traversed in this step */
@@ -1078,7 +1308,8 @@ static lu_mem singlestep (lua_State *L) {
       return sweepstep(L, g, GCSswpend, NULL);
     }
     case GCSswpend: {  /* finish sweeps */
-      makewhite(g, g->mainthread);  /* sweep main thread */
+      if (!g->gcminor)  /* (in a minor one, it stays gray in 'grayagain') */
+        makewhite(g, g->mainthread);  /* sweep main thread */
       checkSizes(L, g);
       g->gcstate = GCScallfin;
       return 0;
@@ -1098,6 +1329,22 @@ static lu_mem singlestep (lua_State *L) {
 }
 
 
+/* performs one step, reporting the work of each state when it ends */
+static lu_mem singlestep (lua_State *L) {
+  global_State *g = G(L);
+  int state = g->gcstate;
+  lu_mem work = dostep(L);
+  g->GCphasework += work;
+  if (g->gcstate != state) {
+    luai_tracegc(L, state, g->gcstate, g->GCphasework);
+    g->GCphasework = 0;
+    if (g->gcstate == GCSpause)
+      luai_statcycle(L);
+  }
+  return work;
+}
+
+
 /*
 ** advances the garbage collector until it reaches a state allowed
 ** by 'statemask'
@@ -1109,6 +1356,138 @@ void luaC_runtilstate (lua_State *L, int statesmask) {
 }
 
 
+/*
+** {======================================================
+** Generational mode
+** Between collections the collector stays in GCSpropagate, so barriers
+** keep the invariant: old objects are black, and new objects stored
+** into them get marked (forward barrier) or send them to 'grayagain'
+** (backward barrier). A minor collection propagates only from those,
+** plus the threads in 'grayagain': those with calls in progress or open
+** upvalues, and idle ones touched since the last collection (stacks have
+** no barriers; see 'luaC_touchthread'). Then it frees dead new objects
+** and makes the survivors old, without touching the old part of the
+** lists. Old objects are only collected
+** by major (full) collections, done when the heap grows 'gcmajorinc'
+** percent over its size after the last one.
+** =======================================================
+*/
+
+/* new bytes allocated between minor collections, as a percentage of
+** the heap in use */
+#if !defined(LUAI_GENMINORMUL)
+#define LUAI_GENMINORMUL	20
+#endif
+
+
+/*
+** weak tables are left gray in their lists by 'atomic'; they were
+** already cleared, so make them black (old), to be caught by barriers
+*/
+static void blackenweak (GCObject *l) {
+  while (l) {
+    Table *h = gco2t(l);
+    gray2black(h);
+    l = h->gclist;
+  }
+}
+
+
+/*
+** after a minor collection, 'grayagain' holds the threads traversed by
+** 'atomic'; make idle ones black (old) and drop them from the list, so
+** that later minor collections neither traverse them nor keep alive the
+** values in their stacks, until they are touched. A thread running, or
+** in a call from which it will go on running, stays gray, as does one
+** with open upvalues, which other threads may assign.
+*/
+static void blackenthreads (global_State *g) {
+  GCObject **p = &g->grayagain;
+  while (*p != NULL) {
+    lua_State *th = gco2th(*p);
+    if (th->openupval == NULL &&
+        (th->status != LUA_OK || th->ci == &th->base_ci)) {  /* idle? */
+      *p = th->gclist;  /* remove it from the list */
+      gray2black(th);
+    }
+    else
+      p = &th->gclist;
+  }
+}
+
+
+static void youngcollection (lua_State *L, global_State *g) {
+  lua_assert(g->gcgen && g->gcstate == GCSpropagate);
+  if (g->gray == NULL)  /* nothing marked by barriers? */
+    g->gcstate = GCSatomic;
+  g->gcminor = 1;
+  luaC_runtilstate(L, bitmask(GCScallfin));  /* mark, atomic and sweep */
+  g->gcminor = 0;
+  /* skip restart: roots are marked again by 'atomic' */
+  blackenweak(g->weak);
+  blackenweak(g->allweak);
+  blackenweak(g->ephemeron);
+  g->weak = g->allweak = g->ephemeron = NULL;
+  blackenthreads(g);
+  g->gcstate = GCSpropagate;
+  luai_statcycle(L);
+}
+
+
+/*
+** major collection: turn all objects white (a normal sweep) and do a
+** complete cycle whose sweep makes every survivor old.
+*/
+static void fullgen (lua_State *L, global_State *g) {
+  if (keepinvariant(g))  /* black objects? */
+    entersweep(L);  /* sweep everything to turn them back to white */
+  luaC_runtilstate(L, bitmask(GCSpause));  /* finish any pending cycle */
+  luaC_runtilstate(L, bitmask(GCSpropagate));  /* mark roots */
+  youngcollection(L, g);
+  g->GCmajorbase = gettotalbytes(g);
+}
+
+
+static void setminordebt (global_State *g) {
+  luaE_setdebt(g, -(cast(l_mem, gettotalbytes(g) / 100) * LUAI_GENMINORMUL));
+}
+
+
+static void genstep (lua_State *L, global_State *g) {
+  if (gettotalbytes(g) > (g->GCmajorbase / 100) * g->gcmajorinc)
+    fullgen(L, g);
+  else
+    youngcollection(L, g);
+  callallpendingfinalizers(L);
+  setminordebt(g);
+}
+
+
+/*
+** change collector mode: to generational ('gen' true) or incremental
+*/
+void luaC_changemode (lua_State *L, int gen) {
+  global_State *g = G(L);
+  if (gen == g->gcgen)
+    return;  /* nothing to be done */
+  if (gen) {
+    luaC_runtilstate(L, bitmask(GCSpause));  /* finish current cycle */
+    g->gcgen = 1;
+    fullgen(L, g);
+    callallpendingfinalizers(L);
+    setminordebt(g);
+  }
+  else {
+    g->gcgen = 0;
+    entersweep(L);  /* turn old (black) objects back to white */
+    luaC_runtilstate(L, bitmask(GCSpause));
+    setpause(g);
+  }
+}
+
+/* }====================================================== */
+
+
 /*
 ** get GC debt and convert it from Kb to 'work units' (avoid zero debt
 ** and overflows)
@@ -1130,14 +1509,29 @@ static l_mem getdebt (global_State *g) {
 void luaC_step (lua_State *L) {
   global_State *g = G(L);
   l_mem debt = getdebt(g);  /* GC deficit (be paid now) */
+  l_clock start;
   if (!g->gcrunning) {  /* not running? */
     luaE_setdebt(g, -GCSTEPSIZE * 10);  /* avoid being called too often */
     return;
   }
+  if (g->gcdefer != GCDEFERNONE) {  /* steps are deferred? */
+    if (g->gcdefer == GCDEFERON) {
+      g->gcdefer = GCDEFERPENDING;
+      luai_gcdefer(L);
+    }
+    return;  /* keep the debt until 'LUA_GCDEFERSTEP' */
+  }
+  start = luai_statclock();
+  if (g->gcgen) {
+    genstep(L, g);
+    luai_statgc(L, luai_statclock() - start);
+    return;
+  }
   do {  /* repeat until pause or enough "credit" (negative debt) */
     lu_mem work = singlestep(L);  /* perform one single step */
     debt -= work;
   } while (debt > -GCSTEPSIZE && g->gcstate != GCSpause);
+  luai_statgc(L, luai_statclock() - start);
   if (g->gcstate == GCSpause)
     setpause(g);  /* pause until next cycle */
   else {
@@ -1148,6 +1542,37 @@ void luaC_step (lua_State *L) {
 }
 
 
+/*
+** Performs single steps until the end of a cycle or until 'ns'
+** nanoseconds have passed, whichever comes first; the work done is
+** discounted from the debt as in 'luaC_step'. A single step is never
+** interrupted, so the atomic phase may still overrun the budget.
+** Returns true if the cycle finished.
+*/
+int luaC_timedstep (lua_State *L, lu_mem ns) {
+  global_State *g = G(L);
+  l_mem debt = getdebt(g);
+  l_clock start = luai_gcclock();
+  if (g->gcgen) {  /* a minor collection is already bounded by the young */
+    genstep(L, g);
+    luai_statgc(L, luai_gcclock() - start);
+    return 1;
+  }
+  do {
+    debt -= singlestep(L);
+  } while (g->gcstate != GCSpause && luai_gcclock() - start < ns);
+  luai_statgc(L, luai_gcclock() - start);
+  if (g->gcstate == GCSpause) {
+    setpause(g);  /* pause until next cycle */
+    return 1;
+  }
+  debt = (debt / g->gcstepmul) * STEPMULADJ;  /* convert 'work units' to Kb */
+  luaE_setdebt(g, debt);
+  runafewfinalizers(L);
+  return 0;
+}
+
+
 /*
 ** Performs a full GC cycle; if 'isemergency', set a flag to avoid
 ** some operations which could change the interpreter state in some
@@ -1159,7 +1584,20 @@ void luaC_step (lua_State *L) {
 */
 void luaC_fullgc (lua_State *L, int isemergency) {
   global_State *g = G(L);
+  l_clock start = luai_statclock();
   lua_assert(g->gckind == KGC_NORMAL);
+  if (g->gcgen) {
+    if (g->gcminor)
+      return;  /* inside a minor collection (emergency); cannot restart */
+    if (isemergency) g->gckind = KGC_EMERGENCY;  /* set flag */
+    fullgen(L, g);
+    g->gckind = KGC_NORMAL;
+    luai_statgc(L, luai_statclock() - start);
+    if (!isemergency)
+      callallpendingfinalizers(L);
+    setminordebt(g);
+    return;
+  }
   if (isemergency) g->gckind = KGC_EMERGENCY;  /* set flag */
   if (keepinvariant(g)) {  /* black objects? */
     entersweep(L); /* sweep everything to turn them back to white */
@@ -1173,6 +1611,7 @@ void luaC_fullgc (lua_State *L, int isemergency) {
   luaC_runtilstate(L, bitmask(GCSpause));  /* finish collection */
   g->gckind = KGC_NORMAL;
   setpause(g);
+  luai_statgc(L, luai_statclock() - start);
 }
 
 /* }====================================================== */
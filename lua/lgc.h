@@ -50,6 +50,16 @@
 	(GCSswpallgc <= (g)->gcstate && (g)->gcstate <= GCSswpend)
 
 
+/*
+** kinds of 'gcdefer': with GCDEFERON, 'luaC_step' only records the debt
+** and calls 'luai_gcdefer' (once, moving to GCDEFERPENDING); the step
+** itself is done later by 'lua_gc(L, LUA_GCDEFERSTEP, 0)'
+*/
+#define GCDEFERNONE	0
+#define GCDEFERON	1
+#define GCDEFERPENDING	2
+
+
 /*
 ** macro to tell when main invariant (white objects cannot point to black
 ** ones) must be kept. During a collection, the sweep
@@ -79,6 +89,9 @@
 #define WHITE1BIT	1  /* object is white (type 1) */
 #define BLACKBIT	2  /* object is black */
 #define FINALIZEDBIT	3  /* object has been marked for finalization */
+#define OLDBIT		4  /* object is old (generational mode) */
+#define REGIONBIT	5  /* object was created in the open region */
+#define ESCAPEDBIT	6  /* region object was stored outside the region */
 /* bit 7 is currently used by tests (luaL_checkmemory) */
 
 #define WHITEBITS	bit2mask(WHITE0BIT, WHITE1BIT)
@@ -91,6 +104,14 @@
 
 #define tofinalize(x)	testbit((x)->marked, FINALIZEDBIT)
 
+#define isold(x)	testbit((x)->marked, OLDBIT)
+
+#define REGIONBITS	bit2mask(REGIONBIT, ESCAPEDBIT)
+
+/* object created in the open region that may still be freed with it */
+#define islocal(x)	(((x)->marked & REGIONBITS) == bitmask(REGIONBIT))
+#define setescaped(x)	l_setbit((x)->marked, ESCAPEDBIT)
+
 #define otherwhite(g)	((g)->currentwhite ^ WHITEBITS)
 #define isdeadm(ow,m)	(!(((m) ^ WHITEBITS) & (ow)))
 #define isdead(g,v)	isdeadm(otherwhite(g), (v)->marked)
@@ -115,15 +136,40 @@
 #define luaC_checkGC(L)		luaC_condGC(L,(void)0,(void)0)
 
 
+/*
+** a local object stored into an object that is not local escapes the
+** region; every barrier checks it before the color test, which needs
+** no more than the 'marked' byte already loaded for it
+*/
+#define luaC_regionbarrier(p,o)  \
+	((islocal(o) && !islocal(p)) ? cast_void(setescaped(o)) : cast_void(0))
+
+/*
+** the stack of 'L' may hold region objects: list it to be scanned at the
+** end of the region (if it is not listed yet)
+*/
+#define luaC_regionthread(g,L)  \
+	{ if ((L)->regionnext == (L)) {  \
+	    (L)->regionnext = (g)->regionthreads; (g)->regionthreads = (L); } }
+
+/* for stores into places with no barrier (stacks, C arrays, ...) */
+#define luaC_escapevalue(v)  \
+	((iscollectable(v) && islocal(gcvalue(v))) ? \
+	 cast_void(setescaped(gcvalue(v))) : cast_void(0))
+
+
 #define luaC_barrier(L,p,v) (  \
-	(iscollectable(v) && isblack(p) && iswhite(gcvalue(v))) ?  \
-	luaC_barrier_(L,obj2gco(p),gcvalue(v)) : cast_void(0))
+	iscollectable(v) ? (luaC_regionbarrier(p,gcvalue(v)), \
+	(isblack(p) && iswhite(gcvalue(v))) ?  \
+	luaC_barrier_(L,obj2gco(p),gcvalue(v)) : cast_void(0)) : cast_void(0))
 
 #define luaC_barrierback(L,p,v) (  \
-	(iscollectable(v) && isblack(p) && iswhite(gcvalue(v))) ? \
-	luaC_barrierback_(L,p) : cast_void(0))
+	iscollectable(v) ? (luaC_regionbarrier(p,gcvalue(v)), \
+	(isblack(p) && iswhite(gcvalue(v))) ? \
+	luaC_barrierback_(L,p) : cast_void(0)) : cast_void(0))
 
 #define luaC_objbarrier(L,p,o) (  \
+	luaC_regionbarrier(p,o), \
 	(isblack(p) && iswhite(o)) ? \
 	luaC_barrier_(L,obj2gco(p),obj2gco(o)) : cast_void(0))
 
@@ -131,17 +177,30 @@
 	(iscollectable((uv)->v) && !upisopen(uv)) ? \
          luaC_upvalbarrier_(L,uv) : cast_void(0))
 
+/*
+** barrier for stores into the stack of a thread: in generational mode,
+** an idle thread is black after a minor collection, which then skips it
+** until something may store into its stack again
+*/
+#define luaC_touchthread(L)  \
+	(isblack(L) ? luaC_touchthread_(L) : cast_void(0))
+
 LUAI_FUNC void luaC_fix (lua_State *L, GCObject *o);
 LUAI_FUNC void luaC_freeallobjects (lua_State *L);
 LUAI_FUNC void luaC_step (lua_State *L);
+LUAI_FUNC int luaC_timedstep (lua_State *L, lu_mem ns);
 LUAI_FUNC void luaC_runtilstate (lua_State *L, int statesmask);
 LUAI_FUNC void luaC_fullgc (lua_State *L, int isemergency);
+LUAI_FUNC void luaC_changemode (lua_State *L, int gen);
 LUAI_FUNC GCObject *luaC_newobj (lua_State *L, int tt, size_t sz);
 LUAI_FUNC void luaC_barrier_ (lua_State *L, GCObject *o, GCObject *v);
 LUAI_FUNC void luaC_barrierback_ (lua_State *L, Table *o);
 LUAI_FUNC void luaC_upvalbarrier_ (lua_State *L, UpVal *uv);
+LUAI_FUNC void luaC_touchthread_ (lua_State *L);
 LUAI_FUNC void luaC_checkfinalizer (lua_State *L, GCObject *o, Table *mt);
 LUAI_FUNC void luaC_upvdeccount (lua_State *L, UpVal *uv);
+LUAI_FUNC void luaC_beginregion (lua_State *L);
+LUAI_FUNC void luaC_endregion (lua_State *L);
 
 
 #endif
@@ -41,32 +41,148 @@
 ** these libs are loaded by lua.c and are readily available to any Lua
 ** program
 */
-static const luaL_Reg loadedlibs[] = {
-  {"_G", luaopen_base},
-  {LUA_LOADLIBNAME, luaopen_package},
-  {LUA_COLIBNAME, luaopen_coroutine},
-  {LUA_TABLIBNAME, luaopen_table},
+static const struct {
+  const char *name;
+  lua_CFunction func;
+  int mask;  /* bit of the library in 'luaL_openselectedlibs' masks */
+} loadedlibs[] = {
+  {"_G", luaopen_base, LUA_GLIBK},
+  {LUA_LOADLIBNAME, luaopen_package, LUA_LOADLIBK},
+  {LUA_COLIBNAME, luaopen_coroutine, LUA_COLIBK},
+  {LUA_TABLIBNAME, luaopen_table, LUA_TABLIBK},
 #ifndef _KERNEL
-  {LUA_IOLIBNAME, luaopen_io},
+  {LUA_IOLIBNAME, luaopen_io, LUA_IOLIBK},
 #endif /* _KERNEL */
-  {LUA_OSLIBNAME, luaopen_os},
-  {LUA_STRLIBNAME, luaopen_string},
-  {LUA_MATHLIBNAME, luaopen_math},
-  {LUA_UTF8LIBNAME, luaopen_utf8},
-  {LUA_DBLIBNAME, luaopen_debug},
+  {LUA_OSLIBNAME, luaopen_os, LUA_OSLIBK},
+  {LUA_STRLIBNAME, luaopen_string, LUA_STRLIBK},
+  {LUA_MATHLIBNAME, luaopen_math, LUA_MATHLIBK},
+  {LUA_UTF8LIBNAME, luaopen_utf8, LUA_UTF8LIBK},
+  {LUA_INTMAPLIBNAME, luaopen_intmap, LUA_INTMAPLIBK},
+  {LUA_DBLIBNAME, luaopen_debug, LUA_DBLIBK},
 #if defined(LUA_COMPAT_BITLIB)
-  {LUA_BITLIBNAME, luaopen_bit32},
+  {LUA_BITLIBNAME, luaopen_bit32, LUA_BITLIBK},
 #endif
-  {NULL, NULL}
+  {NULL, NULL, 0}
 };
 
 
-LUALIB_API void luaL_openlibs (lua_State *L) {
-  const luaL_Reg *lib;
-  /* "require" functions from 'loadedlibs' and set results to global table */
-  for (lib = loadedlibs; lib->func; lib++) {
-    luaL_requiref(L, lib->name, lib->func, 1);
-    lua_pop(L, 1);  /* remove lib */
+/* "require" library 'i' and set the result to the global table */
+static void openlib (lua_State *L, int i) {
+  luaL_requiref(L, loadedlibs[i].name, loadedlibs[i].func, 1);
+  lua_pop(L, 1);  /* remove lib */
+}
+
+
+/*
+** {======================================================
+** Lazy libraries: the global table and the LOADED table get an
+** '__index' metamethod that opens a library when its name is first
+** looked up. Its upvalue maps the names of the libraries not opened yet
+** (and 'require', for package) to their indices in 'loadedlibs'.
+** =======================================================
+*/
+
+/* opens the lazy library named by the value at index 'k', if any */
+static void openlazy (lua_State *L, int k) {
+  int i;
+  lua_pushvalue(L, k);
+  if (lua_rawget(L, lua_upvalueindex(1)) != LUA_TNUMBER) {
+    lua_pop(L, 1);
+    return;  /* not the name of a lazy library */
+  }
+  i = (int)lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  lua_pushnil(L);  /* forget all names of library 'i' */
+  while (lua_next(L, lua_upvalueindex(1))) {
+    if (lua_tointeger(L, -1) == i) {
+      lua_pushvalue(L, -2);
+      lua_pushnil(L);
+      lua_rawset(L, lua_upvalueindex(1));
+    }
+    lua_pop(L, 1);
+  }
+  openlib(L, i);
+}
+
+
+/* '__index' of the global and LOADED tables */
+static int lazyindex (lua_State *L) {
+  openlazy(L, 2);
+  lua_settop(L, 2);
+  lua_rawget(L, 1);
+  return 1;
+}
+
+
+/* '__index' of strings while the string library is not open */
+static int lazystrindex (lua_State *L) {
+  lua_pushliteral(L, LUA_STRLIBNAME);
+  openlazy(L, 3);
+  lua_getfield(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+  lua_getfield(L, -1, LUA_STRLIBNAME);
+  lua_pushvalue(L, 2);
+  lua_gettable(L, -2);
+  return 1;
+}
+
+
+static void setlazy (lua_State *L, int lazy) {
+  int i;
+  lua_newtable(L);  /* names of lazy libraries */
+  for (i = 0; loadedlibs[i].func; i++) {
+    if (lazy & loadedlibs[i].mask) {
+      lua_pushinteger(L, i);
+      lua_setfield(L, -2, loadedlibs[i].name);
+      if (loadedlibs[i].mask == LUA_LOADLIBK) {
+        lua_pushinteger(L, i);
+        lua_setfield(L, -2, "require");
+      }
+    }
+  }
+  if (lazy & LUA_STRLIBK) {  /* strings need the library as metatable */
+    lua_pushliteral(L, "");
+    lua_createtable(L, 0, 1);
+    lua_pushvalue(L, -3);
+    lua_pushcclosure(L, lazystrindex, 1);
+    lua_setfield(L, -2, "__index");
+    lua_setmetatable(L, -2);
+    lua_pop(L, 1);  /* pop dummy string */
   }
+  lua_createtable(L, 0, 1);  /* metatable for global and LOADED tables */
+  lua_insert(L, -2);
+  lua_pushcclosure(L, lazyindex, 1);
+  lua_setfield(L, -2, "__index");
+  lua_pushglobaltable(L);
+  lua_pushvalue(L, -2);
+  lua_setmetatable(L, -2);
+  lua_pop(L, 1);  /* pop global table */
+  luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+  lua_insert(L, -2);
+  lua_setmetatable(L, -2);
+  lua_pop(L, 1);  /* pop LOADED table */
+}
+
+/* }====================================================== */
+
+
+/*
+** open the libraries in 'load' and make the ones in 'lazy' open on
+** their first use (the base library cannot be lazy)
+*/
+LUALIB_API void luaL_openselectedlibs (lua_State *L, int load, int lazy) {
+  int i;
+  load |= lazy & LUA_GLIBK;
+  lazy &= ~load;
+  for (i = 0; loadedlibs[i].func; i++) {
+    if (load & loadedlibs[i].mask)
+      openlib(L, i);
+  }
+  if (lazy != 0)
+    setlazy(L, lazy);
+}
+
+
+LUALIB_API void luaL_openlibs (lua_State *L) {
+  luaL_openselectedlibs(L, ~0, 0);
 }
 
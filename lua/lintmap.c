@@ -0,0 +1,376 @@
+/*
+** Integer-keyed hash maps
+** See Copyright Notice in lua.h
+*/
+
+#define lintmap_c
+#define LUA_LIB
+
+#include "lprefix.h"
+
+
+#ifndef _KERNEL
+#include <limits.h>
+#endif /* _KERNEL */
+
+#include "lua.h"
+
+#include "lauxlib.h"
+#include "lualib.h"
+
+
+/*
+** An intmap maps integers to Lua values with open addressing and linear
+** probing. The keys live in a C array (a plain userdata); the value of
+** the key in slot 'i' is at index 'i + 1' of a table kept as the user
+** value of the map, created with all those indices in its array part.
+** Empty slots hold EMPTYKEY, so a probe reads only the key array; the key
+** EMPTYKEY itself is kept aside, with its value at index 'size + 1'.
+** A removed key stays in its slot with a nil value (a dead key, as in
+** tables), so keys never move during a traversal; dead keys are dropped
+** when the map is rebuilt, once its slots run out.
+*/
+
+#define INTMAP		"intmap"
+
+#define EMPTYKEY	LUA_MININTEGER
+
+/* slots of a new map: 2^MINSIZEBITS */
+#define MINSIZEBITS	2
+
+/* the array of values needs 'size + 1' to fit in an 'int' */
+#define MAXSIZEBITS	30
+
+/* maximum number of used slots (live or dead keys) in 'size' slots */
+#define maxcount(size)	((size) / 4 * 3)
+
+#define UNSIGNEDBITS	((int)(sizeof(lua_Unsigned) * 8))
+
+/* 2^UNSIGNEDBITS / golden ratio (for 64 or 32 bits) */
+#define GOLDEN	(sizeof(lua_Unsigned) > 4 ? \
+	(((lua_Unsigned)0x9E3779B9u << 16 << 16) | 0x7F4A7C15u) : \
+	(lua_Unsigned)0x9E3779B9u)
+
+
+typedef struct IntMap {
+  lua_Integer *keys;  /* key of each slot (EMPTYKEY if empty) */
+  unsigned int size;  /* number of slots (a power of 2) */
+  unsigned int count;  /* number of live keys other than EMPTYKEY */
+  unsigned int used;  /* number of slots with keys, live or dead */
+  int lsize;  /* log2 of 'size' */
+  int hasempty;  /* true if key EMPTYKEY is present */
+} IntMap;
+
+
+/* main slot of key 'k' (Fibonacci hashing) */
+static unsigned int mainslot (const IntMap *m, lua_Integer k) {
+  return (unsigned int)(((lua_Unsigned)k * GOLDEN) >>
+                        (UNSIGNEDBITS - m->lsize));
+}
+
+
+/* slot of key 'k', or the empty slot where it would be inserted */
+static unsigned int findslot (const IntMap *m, lua_Integer k) {
+  unsigned int mask = m->size - 1;
+  unsigned int i = mainslot(m, k);
+  while (m->keys[i] != k && m->keys[i] != EMPTYKEY)
+    i = (i + 1) & mask;
+  return i;
+}
+
+
+/*
+** Creates the key array and the value table of 2^lsize slots for 'm';
+** pushes the value table (which anchors the key array at index 0).
+** 'm' is only changed after both allocations succeed.
+*/
+static void newparts (lua_State *L, IntMap *m, int lsize) {
+  unsigned int i, size;
+  lua_Integer *keys;
+  if (lsize > MAXSIZEBITS)
+    luaL_error(L, "intmap overflow");
+  size = 1u << lsize;
+  keys = (lua_Integer *)lua_newuserdata(L, size * sizeof(lua_Integer));
+  for (i = 0; i < size; i++)
+    keys[i] = EMPTYKEY;
+  lua_createtable(L, (int)size + 1, 1);
+  lua_insert(L, -2);
+  lua_rawseti(L, -2, 0);  /* values[0] = keys */
+  m->keys = keys;
+  m->size = size;
+  m->lsize = lsize;
+}
+
+
+/*
+** Rebuilds the map 'm' at index 'idx' with 2^lsize slots, dropping its
+** dead keys
+*/
+static void rebuild (lua_State *L, int idx, IntMap *m, int lsize) {
+  lua_Integer *oldkeys = m->keys;
+  unsigned int i, oldsize = m->size;
+  lua_getuservalue(L, idx);  /* old values (anchor 'oldkeys') */
+  newparts(L, m, lsize);
+  m->used = 0;
+  for (i = 0; i < oldsize; i++) {
+    if (oldkeys[i] != EMPTYKEY) {
+      if (lua_rawgeti(L, -2, i + 1) == LUA_TNIL)  /* dead key? */
+        lua_pop(L, 1);
+      else {
+        unsigned int j = findslot(m, oldkeys[i]);
+        m->keys[j] = oldkeys[i];
+        lua_rawseti(L, -2, j + 1);
+        m->used++;
+      }
+    }
+  }
+  if (m->hasempty) {
+    lua_rawgeti(L, -2, oldsize + 1);
+    lua_rawseti(L, -2, m->size + 1);
+  }
+  lua_setuservalue(L, idx);
+  lua_pop(L, 1);  /* old values */
+}
+
+
+/* pushes the value of key 'k' in the map 'm' at index 'idx' */
+static int getvalue (lua_State *L, int idx, IntMap *m, lua_Integer k) {
+  unsigned int i;
+  int t;
+  if (k == EMPTYKEY)
+    i = m->size;
+  else {
+    i = findslot(m, k);
+    if (m->keys[i] == EMPTYKEY) {  /* absent? */
+      lua_pushnil(L);
+      return LUA_TNIL;
+    }
+  }
+  lua_getuservalue(L, idx);
+  t = lua_rawgeti(L, -1, i + 1);
+  lua_remove(L, -2);
+  return t;
+}
+
+
+/*
+** sets key 'k' of the map 'm' at index 'idx' to the value at the top; a
+** nil value leaves a dead key
+*/
+static void setvalue (lua_State *L, int idx, IntMap *m, lua_Integer k) {
+  unsigned int i;
+  int isnil = lua_isnil(L, -1);
+  lua_getuservalue(L, idx);
+  if (k == EMPTYKEY) {
+    i = m->size;
+    m->hasempty = !isnil;
+  }
+  else {
+    i = findslot(m, k);
+    if (m->keys[i] == EMPTYKEY) {  /* new key? */
+      if (isnil) {  /* nothing to remove */
+        lua_pop(L, 2);
+        return;
+      }
+      if (m->used + 1 > maxcount(m->size)) {  /* no free slot? */
+        lua_pop(L, 1);
+        /* grow only if live keys would take more than half the slots */
+        rebuild(L, idx, m, m->lsize + (m->count + 1 > maxcount(m->size) / 2));
+        lua_getuservalue(L, idx);
+        i = findslot(m, k);
+      }
+      m->keys[i] = k;
+      m->used++;
+      m->count++;
+    }
+    else {  /* live or dead key */
+      int wasnil = (lua_rawgeti(L, -1, i + 1) == LUA_TNIL);
+      lua_pop(L, 1);
+      if (wasnil && !isnil)
+        m->count++;
+      else if (!wasnil && isnil)
+        m->count--;
+    }
+  }
+  lua_insert(L, -2);
+  lua_rawseti(L, -2, i + 1);
+  lua_pop(L, 1);
+}
+
+
+/*
+** map methods have the map metatable as their first upvalue, so
+** checking their arguments is a pointer comparison with its tag
+*/
+#define tomap(L,arg)	((IntMap *)luaL_checkudatatag(L, arg, \
+	lua_topointer(L, lua_upvalueindex(1)), INTMAP))
+
+
+static int map_index (lua_State *L) {
+  IntMap *m = tomap(L, 1);
+  getvalue(L, 1, m, luaL_checkinteger(L, 2));
+  return 1;
+}
+
+
+static int map_newindex (lua_State *L) {
+  IntMap *m = tomap(L, 1);
+  lua_Integer k = luaL_checkinteger(L, 2);
+  lua_settop(L, 3);
+  setvalue(L, 1, m, k);
+  return 0;
+}
+
+
+static int map_len (lua_State *L) {
+  IntMap *m = tomap(L, 1);
+  lua_pushinteger(L, (lua_Integer)m->count + m->hasempty);
+  return 1;
+}
+
+
+/*
+** traversal: live keys in slot order, then key EMPTYKEY. Keys do not
+** move when others are removed (they only die), so nil may be assigned
+** to any key during a traversal.
+*/
+static int map_next (lua_State *L) {
+  IntMap *m = tomap(L, 1);
+  unsigned int i = 0;
+  if (!lua_isnoneornil(L, 2)) {  /* not the first call? */
+    lua_Integer k = luaL_checkinteger(L, 2);
+    if (k == EMPTYKEY)
+      return 0;  /* it is always the last one */
+    i = findslot(m, k);
+    luaL_argcheck(L, m->keys[i] == k, 2, "invalid key to 'next'");
+    i++;
+  }
+  lua_settop(L, 2);
+  lua_getuservalue(L, 1);
+  for (; i < m->size; i++) {
+    if (m->keys[i] != EMPTYKEY) {
+      if (lua_rawgeti(L, 3, i + 1) != LUA_TNIL) {  /* live key? */
+        lua_pushinteger(L, m->keys[i]);
+        lua_insert(L, -2);
+        return 2;
+      }
+      lua_pop(L, 1);
+    }
+  }
+  if (m->hasempty) {
+    lua_pushinteger(L, EMPTYKEY);
+    lua_rawgeti(L, 3, m->size + 1);
+    return 2;
+  }
+  return 0;
+}
+
+
+static int map_pairs (lua_State *L) {
+  tomap(L, 1);
+  lua_pushvalue(L, lua_upvalueindex(1));
+  lua_pushcclosure(L, map_next, 1);
+  lua_pushvalue(L, 1);
+  lua_pushnil(L);
+  return 3;
+}
+
+
+/* a copy made by 'lua_clonestate' takes the key array of its values */
+static int map_clone (lua_State *L) {
+  IntMap *m = tomap(L, 1);
+  lua_getuservalue(L, 1);
+  lua_rawgeti(L, -1, 0);
+  m->keys = (lua_Integer *)lua_touserdata(L, -1);
+  return 0;
+}
+
+
+static const luaL_Reg map_meta[] = {
+  {"__index", map_index},
+  {"__newindex", map_newindex},
+  {"__len", map_len},
+  {"__pairs", map_pairs},
+  {"__clone", map_clone},
+  {NULL, NULL}
+};
+
+
+/* pushes the metatable of maps, creating it if needed */
+static void pushmeta (lua_State *L) {
+  if (luaL_newmetatable(L, INTMAP)) {
+    lua_pushvalue(L, -1);
+    luaL_setfuncs(L, map_meta, 1);
+  }
+}
+
+
+static IntMap *checkmap (lua_State *L, int idx) {
+  return (IntMap *)luaL_checkudata(L, idx, INTMAP);
+}
+
+
+/*
+** {======================================================
+** C API
+** =======================================================
+*/
+
+/* pushes a new map with room for 'n' keys */
+LUALIB_API void luaL_newintmap (lua_State *L, int n) {
+  IntMap *m;
+  int lsize = MINSIZEBITS;
+  while (lsize < MAXSIZEBITS && (lua_Integer)maxcount(1u << lsize) < n)
+    lsize++;
+  luaL_checkstack(L, 4, "too many nested calls");
+  m = (IntMap *)lua_newuserdata(L, sizeof(IntMap));
+  m->keys = NULL;
+  m->size = m->count = m->used = 0;
+  m->lsize = 0;
+  m->hasempty = 0;
+  pushmeta(L);
+  lua_setmetatable(L, -2);
+  newparts(L, m, lsize);
+  lua_setuservalue(L, -2);
+}
+
+
+/* pushes the value of key 'k' of the map at index 'idx'; returns its type */
+LUALIB_API int luaL_intmapget (lua_State *L, int idx, lua_Integer k) {
+  idx = lua_absindex(L, idx);
+  luaL_checkstack(L, 2, "too many nested calls");
+  return getvalue(L, idx, checkmap(L, idx), k);
+}
+
+
+/* pops a value and sets it as the value of key 'k' of the map at 'idx' */
+LUALIB_API void luaL_intmapset (lua_State *L, int idx, lua_Integer k) {
+  idx = lua_absindex(L, idx);
+  luaL_checkstack(L, 4, "too many nested calls");
+  setvalue(L, idx, checkmap(L, idx), k);
+}
+
+/* }====================================================== */
+
+
+static int map_new (lua_State *L) {
+  lua_Integer n = luaL_optinteger(L, 1, 0);
+  luaL_argcheck(L, 0 <= n && n <= INT_MAX, 1, "invalid size");
+  luaL_newintmap(L, (int)n);
+  return 1;
+}
+
+
+static const luaL_Reg intmap_funcs[] = {
+  {"new", map_new},
+  {NULL, NULL}
+};
+
+
+LUAMOD_API int luaopen_intmap (lua_State *L) {
+  pushmeta(L);
+  lua_pop(L, 1);
+  luaL_newlib(L, intmap_funcs);
+  return 1;
+}
+
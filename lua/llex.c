@@ -50,6 +50,24 @@ static const char *const luaX_tokens [] = {
 };
 
 
+/*
+** reserved word (its order plus 1, or 0 if none) of each value of
+** 'kwslot' for the names in 'luaX_tokens': a perfect hash, checked by
+** 'luaX_init'
+*/
+static const lu_byte kwtable[64] = {
+   0, 21,  0,  0,  0,  0,  6,  0,  9,  0,  0, 22, 20,  0,  0,  0,
+   0, 13,  0, 10,  8,  0, 15,  0, 16,  7,  0,  0,  0,  4,  0,  0,
+   0,  0,  0,  5,  2,  0,  1,  0,  0,  0,  3,  0, 18,  0,  0,  0,
+   0,  0,  0,  0, 17,  0,  0,  0,  0, 19,  0,  0, 14, 11, 12,  0
+};
+
+/* hash of a name, computed as it is read */
+#define addhash(h,c)	((h) * 33 + cast(unsigned int, c))
+
+#define kwslot(h)	(((h) >> 3) & 63)
+
+
 #define save_and_next(ls) (save(ls, ls->current), next(ls))
 
 
@@ -77,6 +95,16 @@ void luaX_init (lua_State *L) {
     TString *ts = luaS_new(L, luaX_tokens[i]);
     luaC_fix(L, obj2gco(ts));  /* reserved words are never collected */
     ts->extra = cast_byte(i+1);  /* reserved word */
+#if defined(LUA_DEBUG)
+    {
+      unsigned int h = 0;
+      const char *p;
+      for (p = luaX_tokens[i]; *p; p++)
+        h = addhash(h, cast_uchar(*p));
+      lua_assert(kwtable[kwslot(h)] == i + 1 &&
+                 strlen(luaX_tokens[i]) <= MAXRESERVEDLEN);
+    }
+#endif
   }
 }
 
@@ -143,7 +171,7 @@ TString *luaX_newstring (LexState *ls, const char *str, size_t l) {
     luaC_checkGC(L);
   }
   else {  /* string already present */
-    ts = tsvalue(keyfromval(o));  /* re-use value previously stored */
+    ts = keystrval(nodefromval(o));  /* re-use value previously stored */
   }
   L->top--;  /* remove string from stack */
   return ts;
@@ -167,6 +195,7 @@ static void inclinenumber (LexState *ls) {
 
 void luaX_setinput (lua_State *L, LexState *ls, ZIO *z, TString *source,
                     int firstchar) {
+  int i;
   ls->t.token = 0;
   ls->L = L;
   ls->current = firstchar;
@@ -177,6 +206,8 @@ void luaX_setinput (lua_State *L, LexState *ls, ZIO *z, TString *source,
   ls->lastline = 1;
   ls->source = source;
   ls->envn = luaS_newliteral(L, LUA_ENV);  /* get env name */
+  for (i = 0; i < LUAI_IDCACHE; i++)
+    ls->idcache[i] = NULL;
   luaZ_resizebuffer(ls->L, ls->buff, LUA_MINBUFFER);  /* initialize buffer */
 }
 
@@ -251,17 +282,37 @@ static int read_numeral (LexState *ls, SemInfo *seminfo) {
 
 #else /* _KERNEL */
 
+/*
+** integer numerals are converted as they are read; only those that may
+** not fit (or are ill-formed) go through 'luaO_str2num'
+*/
 static int read_numeral (LexState *ls, SemInfo *seminfo) {
   TValue obj;
+  lua_Unsigned a = 0;
+  int fast = 1;  /* value in 'a' is the numeral? */
   int first = ls->current;
   lua_assert(lisdigit(ls->current));
   save_and_next(ls);
-  if (first == '0')
-    check_next2(ls, "xX");  /* hexadecimal? */
-  for (;;) {
-    if (lisxdigit(ls->current))
+  if (first == '0' && check_next2(ls, "xX")) {  /* hexadecimal? */
+    fast = lisxdigit(ls->current);  /* at least one digit */
+    while (lisxdigit(ls->current)) {  /* wraps around, as 'l_str2int' */
+      a = a * 16 + luaO_hexavalue(ls->current);
       save_and_next(ls);
-    else break;
+    }
+  }
+  else {
+    a = first - '0';
+    while (lisxdigit(ls->current)) {
+      if (!lisdigit(ls->current) || a >= cast(lua_Unsigned, LUA_MAXINTEGER) / 10)
+        fast = 0;  /* ill-formed or may overflow */
+      else
+        a = a * 10 + (ls->current - '0');
+      save_and_next(ls);
+    }
+  }
+  if (fast) {
+    seminfo->i = l_castU2S(a);
+    return TK_INT;
   }
   save(ls, '\0');
   if (luaO_str2num(luaZ_buffer(ls->buff), &obj) == 0)  /* format error? */
@@ -455,6 +506,33 @@ static void read_string (LexState *ls, int del, SemInfo *seminfo) {
 }
 
 
+/*
+** Finishes a name in the buffer, whose hash is 'h'. Reserved words are
+** found by a perfect hash before creating any string; other names are
+** looked up in a small cache of the last names seen (anchored in 'ls->h'),
+** so the common case of repeated names skips 'luaX_newstring'.
+*/
+static int read_name (LexState *ls, SemInfo *seminfo, unsigned int h) {
+  const char *s = luaZ_buffer(ls->buff);
+  size_t l = luaZ_bufflen(ls->buff);
+  TString **c = &ls->idcache[h & (LUAI_IDCACHE - 1)];
+  TString *ts;
+  if (l <= MAXRESERVEDLEN) {
+    int i = kwtable[kwslot(h)];
+    if (i > 0) {
+      const char *kw = luaX_tokens[i - 1];
+      if (strncmp(kw, s, l) == 0 && kw[l] == '\0')  /* reserved word? */
+        return i - 1 + FIRST_RESERVED;
+    }
+  }
+  ts = *c;
+  if (ts == NULL || tsslen(ts) != l || memcmp(getstr(ts), s, l) != 0)
+    *c = ts = luaX_newstring(ls, s, l);  /* not in the cache */
+  seminfo->ts = ts;
+  return TK_NAME;
+}
+
+
 static int llex (LexState *ls, SemInfo *seminfo) {
   luaZ_resetbuffer(ls->buff);
   for (;;) {
@@ -555,18 +633,12 @@ static int llex (LexState *ls, SemInfo *seminfo) {
       }
       default: {
         if (lislalpha(ls->current)) {  /* identifier or reserved word? */
-          TString *ts;
+          unsigned int h = 0;
           do {
+            h = addhash(h, ls->current);
             save_and_next(ls);
           } while (lislalnum(ls->current));
-          ts = luaX_newstring(ls, luaZ_buffer(ls->buff),
-                                  luaZ_bufflen(ls->buff));
-          seminfo->ts = ts;
-          if (isreserved(ts))  /* reserved word? */
-            return ts->extra - 1 + FIRST_RESERVED;
-          else {
-            return TK_NAME;
-          }
+          return read_name(ls, seminfo, h);
         }
         else {  /* single-char tokens (+ - / ...) */
           int c = ls->current;
@@ -43,6 +43,14 @@ enum RESERVED {
 /* number of reserved words */
 #define NUM_RESERVED	(cast(int, TK_WHILE-FIRST_RESERVED+1))
 
+/* length of the longest reserved word ("function") */
+#define MAXRESERVEDLEN	8
+
+/* size of the cache of identifiers of the lexer (a power of 2) */
+#if !defined(LUAI_IDCACHE)
+#define LUAI_IDCACHE	32
+#endif
+
 
 typedef union {
   lua_Number r;
@@ -73,6 +81,7 @@ typedef struct LexState {
   struct Dyndata *dyd;  /* dynamic structures used by the parser */
   TString *source;  /* current source name */
   TString *envn;  /* environment variable name */
+  TString *idcache[LUAI_IDCACHE];  /* last identifiers, by hash */
 } LexState;
 
 
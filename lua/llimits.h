@@ -33,8 +33,21 @@ typedef long l_mem;
 #endif				/* } */
 
 
+/*
+** 'l_clock' is an unsigned integer for the readings of the nanosecond
+** clocks 'luai_gcclock' and 'luai_statclock'; they may wrap around, so
+** only differences of readings are meaningful
+*/
+#if defined(LUAI_CLOCK)
+typedef LUAI_CLOCK l_clock;
+#else
+typedef lu_mem l_clock;
+#endif
+
+
 /* chars used as small naturals (so that 'char' is reserved for characters) */
 typedef unsigned char lu_byte;
+typedef signed char ls_byte;
 
 
 /* maximum value for size_t */
@@ -200,16 +213,26 @@ typedef unsigned long Instruction;
 
 
 /*
-** Size of cache for strings in the API. 'N' is the number of
+** Default size of cache for strings in the API. 'N' is the number of
 ** sets (better be a prime) and "M" is the size of each set (M == 1
-** makes a direct cache.)
+** makes a direct cache.) It can be changed per state with
+** 'lua_setstrcache'.
 */
 #if !defined(STRCACHE_N)
-#define STRCACHE_N		53
+#define STRCACHE_N		127
 #define STRCACHE_M		2
 #endif
 
 
+/*
+** Number of recently created closures kept by each prototype for
+** reuse (see 'getcached' in lvm.c).
+*/
+#if !defined(NCLCACHE)
+#define NCLCACHE	4
+#endif
+
+
 /* minimum size for string buffer */
 #if !defined(LUA_MINBUFFER)
 #define LUA_MINBUFFER	32
@@ -233,6 +256,56 @@ typedef unsigned long Instruction;
 #define luai_threadyield(L)	{lua_unlock(L); lua_lock(L);}
 #endif
 
+/*
+** luai_budgetyield is called, with the state locked, when the instruction
+** budget of a thread that cannot yield runs out (see 'lua_setbudget')
+*/
+#if !defined(luai_budgetyield)
+#define luai_budgetyield(L)	luai_threadyield(L)
+#endif
+
+/*
+** luai_hookreq is called by the thread running in a state, within 256
+** backward jumps or calls to Lua functions, once 'hookreq' of the state
+** was set (maybe asynchronously, as by a timer), so that it may set a
+** hook on itself
+*/
+#if !defined(luai_hookreq)
+#define luai_hookreq(L)		((void)(L))
+#endif
+
+
+/*
+** tracing points: entries to and returns from Lua functions (tail calls
+** and errors have no return), changes of GC state, with the work done in
+** the state that ends, stack and string-table resizes, and allocations
+*/
+#if !defined(luai_tracecall)
+#define luai_tracecall(L,p)		((void)0)
+#define luai_tracereturn(L,p)		((void)0)
+#define luai_tracegc(L,from,to,work)	((void)0)
+#define luai_tracestack(L,osize,nsize)	((void)0)
+#define luai_tracestrt(L,osize,nsize)	((void)0)
+#define luai_tracealloc(L,b,nb,osize,nsize)	((void)0)
+#endif
+
+
+/*
+** runtime statistics, all called with the state locked: the collector ran
+** for 'ns' nanoseconds (measured with luai_statclock) or completed a
+** cycle, a protected call or a coroutine failed, 'n' units of instruction
+** budget were spent (counted at each refill and when the VM returns to C,
+** normally or not), and a stack was resized to 'size' slots
+*/
+#if !defined(luai_statgc)
+#define luai_statclock()		0
+#define luai_statgc(L,ns)		((void)(ns))
+#define luai_statcycle(L)		((void)0)
+#define luai_staterror(L)		((void)0)
+#define luai_statbudget(L,n)		((void)0)
+#define luai_statstack(L,size)		((void)0)
+#endif
+
 
 /*
 ** these macros allow user-specific actions on threads when you defined
@@ -255,6 +328,22 @@ typedef unsigned long Instruction;
 #define luai_userstatefree(L,L1)	((void)L)
 #endif
 
+/*
+** luai_protounshare is called when a prototype whose 'code' and
+** 'lineinfo' belong to an external block ('Proto.shared') is freed
+*/
+#if !defined(luai_protounshare)
+#define luai_protounshare(L,s)	((void)L)
+#endif
+
+/*
+** luai_protoshare is called when a copy of such a prototype (made by
+** 'lua_clonestate') borrows the same block
+*/
+#if !defined(luai_protoshare)
+#define luai_protoshare(L,s)	((void)L)
+#endif
+
 #if !defined(luai_userstateresume)
 #define luai_userstateresume(L,n)	((void)L)
 #endif
@@ -264,6 +353,16 @@ typedef unsigned long Instruction;
 #endif
 
 
+/*
+** luai_gcdefer is called, with the state locked, when a GC step is due
+** in a state whose steps are deferred (see 'LUA_GCDEFER'); it should
+** arrange for a later 'lua_gc(L, LUA_GCDEFERSTEP, 0)'
+*/
+#if !defined(luai_gcdefer)
+#define luai_gcdefer(L)		((void)L)
+#endif
+
+
 
 /*
 ** The luai_num* macros define the primitive operations over numbers.
@@ -13,6 +13,8 @@
 #ifndef _KERNEL
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
+#include <time.h>
 #endif /* _KERNEL */
 
 #include "lua.h"
@@ -27,19 +29,6 @@
 #endif /* _KERNEL */
 
 
-#if !defined(l_rand)		/* { */
-#if defined(LUA_USE_POSIX)
-#define l_rand()	random()
-#define l_srand(x)	srandom(x)
-#define L_RANDMAX	2147483647	/* (2^31 - 1), following POSIX */
-#else
-#define l_rand()	rand()
-#define l_srand(x)	srand(x)
-#define L_RANDMAX	RAND_MAX
-#endif
-#endif				/* } */
-
-
 #ifndef _KERNEL
 static int math_abs (lua_State *L) {
   if (lua_isinteger(L, 1)) {
@@ -246,20 +235,92 @@ static int math_max (lua_State *L) {
 }
 
 /*
-** This function uses 'double' (instead of 'lua_Number') to ensure that
-** all bits from 'l_rand' can be represented, and that 'RANDMAX + 1.0'
-** will keep full precision (ensuring that 'r' is always less than 1.0.)
+** {==================================================================
+** Pseudo-random number generator: 'xoshiro128**', kept by each state
+** (as a userdata upvalue of the functions that use it) and seeded from
+** 'l_randombytes' when the library is opened. It only needs 32-bit
+** operations, and 'project' reduces its values to an interval with a
+** multiplication and a shift instead of a division, so that 32-bit
+** kernels need no 64-bit division helpers.
+** ===================================================================
+*/
+
+/* (unsigned int has at least 32 bits in all the targets of Lunatik) */
+typedef unsigned int Rand32;
+
+#define trim32(x)	((x) & 0xffffffffu)
+
+#define rotl(x,n)	(trim32((x) << (n)) | (trim32(x) >> (32 - (n))))
+
+
+typedef struct RanState {
+  Rand32 s[4];
+} RanState;
+
+
+static Rand32 nextrand (Rand32 *s) {
+  Rand32 res = trim32(rotl(trim32(s[1] * 5), 7) * 9);
+  Rand32 t = trim32(s[1] << 9);
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rotl(s[3], 11);
+  return res;
+}
+
+
+/*
+** Projects a random value into the interval [0, n]. Up to 2^32 - 1,
+** with Lemire's multiply-shift: the high half of 'r * (n + 1)' is in
+** [0, n], and the few values of 'r' that would make it biased (those
+** whose low half is below 2^32 mod (n + 1)) are rejected; the 32-bit
+** modulo that finds them only runs when the low half is below n + 1.
+** Larger intervals take the bits of two values that are under the
+** smallest 2^b - 1 not less than 'n', rejecting those above 'n'.
 */
+static lua_Unsigned project (Rand32 *s, lua_Unsigned n) {
+  if (n < 0xffffffffu) {
+    Rand32 lim = (Rand32)n + 1;
+    unsigned long long m = (unsigned long long)nextrand(s) * lim;
+    if (trim32((Rand32)m) < lim) {  /* may be biased? */
+      Rand32 t = trim32(0u - lim) % lim;  /* 2^32 mod 'lim' */
+      while (trim32((Rand32)m) < t)
+        m = (unsigned long long)nextrand(s) * lim;
+    }
+    return (lua_Unsigned)(m >> 32);
+  }
+  else if (n == 0xffffffffu)
+    return nextrand(s);
+  else {  /* (only with 64-bit integers) */
+    lua_Unsigned lim = n, r;
+    lim |= (lim >> 1);
+    lim |= (lim >> 2);
+    lim |= (lim >> 4);
+    lim |= (lim >> 8);
+    lim |= (lim >> 16);
+    lim |= (lim >> 16) >> 16;  /* (avoids a shift as wide as 32 bits) */
+    do {
+      r = (((lua_Unsigned)nextrand(s) << 16) << 16) | nextrand(s);
+    } while ((r &= lim) > n);
+    return r;
+  }
+}
+
+
 static int math_random (lua_State *L) {
   lua_Integer low, up;
+  Rand32 *s = ((RanState *)lua_touserdata(L, lua_upvalueindex(1)))->s;
+  switch (lua_gettop(L)) {  /* check number of arguments */
+    case 0: {  /* no arguments */
 #ifndef _KERNEL
-  double r = (double)l_rand() * (1.0 / ((double)L_RANDMAX + 1.0));
+      /* Number between 0 and 1 */
+      lua_pushnumber(L, (lua_Number)(nextrand(s) * (1.0 / 4294967296.0)));
 #else
-  lua_Integer r = (lua_Integer) l_rand();
+      /* 32 random bits, or 31 if they do not fit a non-negative integer */
+      lua_pushinteger(L, (lua_Integer)(nextrand(s) & LUA_MAXINTEGER));
 #endif /* _KERNEL */
-  switch (lua_gettop(L)) {  /* check number of arguments */
-    case 0: {  /* no arguments */
-      lua_pushnumber(L, (lua_Number)r);  /* Number between 0 and 1 */
       return 1;
     }
     case 1: {  /* only upper limit */
@@ -278,23 +339,86 @@ static int math_random (lua_State *L) {
   luaL_argcheck(L, low <= up, 1, "interval is empty");
   luaL_argcheck(L, low >= 0 || up <= LUA_MAXINTEGER + low, 1,
                    "interval too large");
-#ifndef _KERNEL
-  r *= (double)(up - low) + 1.0;
-#else
-  r = lunatik_imod(r, (up - low));
-#endif /* _KERNEL */
-  lua_pushinteger(L, (lua_Integer)r + low);
+  lua_pushinteger(L, (lua_Integer)(project(s, (lua_Unsigned)up - low) +
+                                   (lua_Unsigned)low));
   return 1;
 }
 
 
+static void setseed (Rand32 *s, lua_Unsigned n1, lua_Unsigned n2) {
+  int i;
+  s[0] = trim32((Rand32)n1);
+  s[1] = 0xff;  /* avoid a zero state */
+  s[2] = trim32((Rand32)n2);
+  s[3] = trim32((Rand32)((n1 >> 16) >> 16));
+  for (i = 0; i < 16; i++)
+    nextrand(s);  /* discard initial values to "spread" seed */
+}
+
+
 static int math_randomseed (lua_State *L) {
-  l_srand((unsigned int)(lua_Integer)luaL_checknumber(L, 1));
-  (void)l_rand(); /* discard first value to avoid undesirable correlations */
+  RanState *g = (RanState *)lua_touserdata(L, lua_upvalueindex(1));
+  setseed(g->s, (lua_Unsigned)(lua_Integer)luaL_checknumber(L, 1), 0);
   return 0;
 }
 
 
+/*
+** Returns a string of 'n' pseudo-random bytes (not suitable for keys or
+** anything else that must be unpredictable), filled 4 bytes at a time
+*/
+static int math_randombytes (lua_State *L) {
+  lua_Integer n = luaL_checkinteger(L, 1);
+  Rand32 *s = ((RanState *)lua_touserdata(L, lua_upvalueindex(1)))->s;
+  luaL_argcheck(L, 0 <= n && (lua_Unsigned)n <= (size_t)-1 / 2, 1,
+                   "out of range");
+  {
+    size_t len = (size_t)n, i;
+    luaL_Buffer b;
+    char *res = lua_pushlongstring(L, len);  /* build it in place? */
+    char *p = (res != NULL) ? res : luaL_buffinitsize(L, &b, len);
+    for (i = 0; i + 4 <= len; i += 4) {
+      Rand32 r = nextrand(s);
+      memcpy(p + i, &r, 4);
+    }
+    if (i < len) {  /* last partial word */
+      Rand32 r = nextrand(s);
+      memcpy(p + i, &r, len - i);
+    }
+    if (res == NULL)
+      luaL_pushresultsize(&b, len);
+  }
+  return 1;
+}
+
+
+static const luaL_Reg randfuncs[] = {
+  {"random", math_random},
+  {"randomseed", math_randomseed},
+  {"randombytes", math_randombytes},
+  {NULL, NULL}
+};
+
+
+/*
+** Registers the functions of 'randfuncs' in the table on the top, with
+** a new generator as their upvalue
+*/
+static void setrandfunc (lua_State *L) {
+  RanState *g = (RanState *)lua_newuserdata(L, sizeof(RanState));
+#if defined(l_randombytes)
+  l_randombytes(g->s, sizeof(g->s));
+  if ((g->s[0] | g->s[1] | g->s[2] | g->s[3]) == 0)
+    g->s[0] = 1;  /* (the only state it never leaves) */
+#else
+  setseed(g->s, (lua_Unsigned)time(NULL), (lua_Unsigned)(size_t)L);
+#endif
+  luaL_setfuncs(L, randfuncs, 1);
+}
+
+/* }================================================================== */
+
+
 #ifndef _KERNEL
 static int math_type (lua_State *L) {
   if (lua_type(L, 1) == LUA_TNUMBER) {
@@ -387,8 +511,10 @@ static const luaL_Reg mathlib[] = {
   {"modf",   math_modf},
   {"rad",   math_rad},
 #endif /* _KERNEL */
-  {"random",     math_random},
-  {"randomseed", math_randomseed},
+  /* placeholders */
+  {"random", NULL},
+  {"randomseed", NULL},
+  {"randombytes", NULL},
 #ifndef _KERNEL
   {"sin",   math_sin},
   {"sqrt",  math_sqrt},
@@ -419,6 +545,7 @@ static const luaL_Reg mathlib[] = {
 */
 LUAMOD_API int luaopen_math (lua_State *L) {
   luaL_newlib(L, mathlib);
+  setrandfunc(L);
 #ifndef _KERNEL
   lua_pushnumber(L, PI);
   lua_setfield(L, -2, "pi");
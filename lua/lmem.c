@@ -96,6 +96,7 @@ void *luaM_realloc_ (lua_State *L, void *block, size_t osize, size_t nsize) {
       luaD_throw(L, LUA_ERRMEM);
   }
   lua_assert((nsize == 0) == (newblock == NULL));
+  luai_tracealloc(L, block, newblock, realosize, nsize);
   g->GCdebt = (g->GCdebt + nsize) - realosize;
   return newblock;
 }
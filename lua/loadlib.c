@@ -227,8 +227,46 @@ static void lsys_unloadlib (void *lib) {
   symbol_put_addr(lib);
 }
 
+/*
+** luai_lookupsym finds the kernel symbol 'path' and holds the module of
+** its code (if any), to be put by 'lsys_unloadlib'; it returns NULL if
+** the symbol is not found or its module is going away. Lunatik caches
+** the symbols found and the loaders registered by modules (lunatik_sym.c)
+*/
+#if !defined(luai_lookupsym)
+/*
+** whether 'a' is in the core kernel text, whose bounds are found by name
+** ('core_kernel_text' is not exported to modules)
+*/
+static int lsys_coretext (unsigned long a) {
+  static unsigned long stext, etext;
+  unsigned long e = smp_load_acquire(&etext);
+  if (e == 0) {  /* first call? (racing calls find the same bounds) */
+    WRITE_ONCE(stext, kallsyms_lookup_name("_stext"));
+    e = kallsyms_lookup_name("_etext");
+    smp_store_release(&etext, e);  /* published after 'stext' */
+  }
+  return READ_ONCE(stext) <= a && a < e;
+}
+
+/* the module is held by its address, as 'symbol_put_addr' finds it */
+static void *lsys_getaddr (void *lib) {
+  struct module *mod;
+  int ok;
+  if (lib == NULL || lsys_coretext((unsigned long) lib))
+    return lib;
+  preempt_disable();
+  mod = __module_text_address((unsigned long) lib);
+  ok = (mod != NULL && try_module_get(mod));
+  preempt_enable();
+  return ok ? lib : NULL;
+}
+
+#define luai_lookupsym(path)	lsys_getaddr((void *) kallsyms_lookup_name(path))
+#endif
+
 static void *lsys_load (lua_State *L, const char *path, int seeglb) {
-  void *lib = (void *) kallsyms_lookup_name(path);
+  void *lib = luai_lookupsym(path);
   (void)(seeglb);  /* not used */
   if (lib == NULL)
     lua_pushfstring(L, "%s not found in kernel symbol table", path);
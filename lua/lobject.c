@@ -124,6 +124,7 @@ static lua_Number numarith (lua_State *L, int op, lua_Number v1,
 #endif /* _KERNEL */
 
 
+#ifndef _KERNEL
 void luaO_arith (lua_State *L, int op, const TValue *p1, const TValue *p2,
                  TValue *res) {
   switch (op) {
@@ -137,7 +138,6 @@ void luaO_arith (lua_State *L, int op, const TValue *p1, const TValue *p2,
       }
       else break;  /* go to the end */
     }
-#ifndef _KERNEL
     case LUA_OPDIV: case LUA_OPPOW: {  /* operate only on floats */
       lua_Number n1; lua_Number n2;
       if (tonumber(p1, &n1) && tonumber(p2, &n2)) {
@@ -146,9 +146,7 @@ void luaO_arith (lua_State *L, int op, const TValue *p1, const TValue *p2,
       }
       else break;  /* go to the end */
     }
-#endif /* _KERNEL */
     default: {  /* other operations */
-#ifndef _KERNEL
       lua_Number n1; lua_Number n2;
       if (ttisinteger(p1) && ttisinteger(p2)) {
         setivalue(res, intarith(L, op, ivalue(p1), ivalue(p2)));
@@ -158,13 +156,6 @@ void luaO_arith (lua_State *L, int op, const TValue *p1, const TValue *p2,
         setfltvalue(res, numarith(L, op, n1, n2));
         return;
       }
-#else /* _KERNEL */
-      lua_Integer i1; lua_Integer i2;
-      if (tointeger(p1, &i1) && tointeger(p2, &i2)) {
-        setivalue(res, intarith(L, op, i1, i2));
-        return;
-      }
-#endif /* _KERNEL */
       else break;  /* go to the end */
     }
   }
@@ -172,6 +163,20 @@ void luaO_arith (lua_State *L, int op, const TValue *p1, const TValue *p2,
   lua_assert(L != NULL);  /* should not fail when folding (compile time) */
   luaT_trybinTM(L, p1, p2, res, cast(TMS, (op - LUA_OPADD) + TM_ADD));
 }
+#else /* _KERNEL */
+/* all operations are integer ones; there is no float variant to try */
+void luaO_arith (lua_State *L, int op, const TValue *p1, const TValue *p2,
+                 TValue *res) {
+  lua_Integer i1; lua_Integer i2;
+  if (tointeger(p1, &i1) && tointeger(p2, &i2)) {
+    setivalue(res, intarith(L, op, i1, i2));
+    return;
+  }
+  /* could not perform raw operation; try metamethod */
+  lua_assert(L != NULL);  /* should not fail when folding (compile time) */
+  luaT_trybinTM(L, p1, p2, res, cast(TMS, (op - LUA_OPADD) + TM_ADD));
+}
+#endif /* _KERNEL */
 
 
 int luaO_hexavalue (int c) {
@@ -387,6 +392,87 @@ int luaO_utf8esc (char *buff, unsigned long x) {
 #define MAXNUMBER2STR	50
 
 
+/*
+** luai_udivmod divides the unsigned 'n' by 'd' (below 2^32), leaving
+** the remainder in '*r'; Lunatik uses 'div_u64_rem' on 32-bit kernels,
+** which have no 64-bit division
+*/
+#if !defined(luai_udivmod)
+#define luai_udivmod(n,d,r)	(*(r) = (unsigned int)((n) % (d)), (n) /= (d))
+#endif
+
+
+static const char digitpairs[] =
+  "00010203040506070809" "10111213141516171819" "20212223242526272829"
+  "30313233343536373839" "40414243444546474849" "50515253545556575859"
+  "60616263646566676869" "70717273747576777879" "80818283848586878889"
+  "90919293949596979899";
+
+
+/*
+** Formats integer 'x' in decimal into 'buff' (with room for
+** LUA_INTBUFFSIZE chars), two digits at a time from the table of pairs
+** and with 32-bit divisions by 100 but for the top 8-digit groups of
+** large 64-bit values; returns the length, without the final '\0'
+*/
+int luaO_int2str (char *buff, lua_Integer x) {
+  char tmp[LUA_INTBUFFSIZE];
+  char *p = tmp + sizeof(tmp);
+  lua_Unsigned u = (x < 0) ? 0u - l_castS2U(x) : l_castS2U(x);
+  unsigned int v;
+  int len;
+  while (u > 0xffffffffu) {  /* does not fit in 32 bits? */
+    unsigned int r;
+    int i;
+    luai_udivmod(u, 100000000u, &r);  /* split off the low 8 digits */
+    for (i = 0; i < 4; i++) {
+      p -= 2;
+      memcpy(p, digitpairs + (r % 100) * 2, 2);
+      r /= 100;
+    }
+  }
+  v = cast(unsigned int, u);
+  while (v >= 100) {
+    p -= 2;
+    memcpy(p, digitpairs + (v % 100) * 2, 2);
+    v /= 100;
+  }
+  if (v >= 10) {
+    p -= 2;
+    memcpy(p, digitpairs + v * 2, 2);
+  }
+  else
+    *--p = cast(char, '0' + v);
+  if (x < 0)
+    *--p = '-';
+  len = cast_int(tmp + sizeof(tmp) - p);
+  memcpy(buff, p, len);
+  buff[len] = '\0';
+  return len;
+}
+
+
+/*
+** Length of the decimal form of integer 'x' (as 'luaO_int2str'), by
+** comparisons with powers of 10, with no division
+*/
+int luaO_intlen (lua_Integer x) {
+  static const unsigned long long pow10[] = {
+    1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull,
+    10000000ull, 100000000ull, 1000000000ull, 10000000000ull,
+    100000000000ull, 1000000000000ull, 10000000000000ull,
+    100000000000000ull, 1000000000000000ull, 10000000000000000ull,
+    100000000000000000ull, 1000000000000000000ull,
+    10000000000000000000ull
+  };
+  lua_Unsigned u = (x < 0) ? 0u - l_castS2U(x) : l_castS2U(x);
+  int len = 1;
+  while (len < 20 && u >= pow10[len])
+    len++;
+  return len + (x < 0);
+}
+
+
 /*
 ** Convert a number object to a string
 */
@@ -396,7 +482,7 @@ void luaO_tostring (lua_State *L, StkId obj) {
   lua_assert(ttisnumber(obj));
 #ifndef _KERNEL
   if (ttisinteger(obj))
-    len = lua_integer2str(buff, sizeof(buff), ivalue(obj));
+    len = luaO_int2str(buff, ivalue(obj));
   else {
     len = lua_number2str(buff, sizeof(buff), fltvalue(obj));
 #if !defined(LUA_COMPAT_FLOATSTRING)
@@ -408,7 +494,7 @@ void luaO_tostring (lua_State *L, StkId obj) {
   }
 #else /* _KERNEL */
   lua_assert(ttisinteger(obj));
-  len = lua_integer2str(buff, sizeof(buff), ivalue(obj));
+  len = luaO_int2str(buff, ivalue(obj));
 #endif /* _KERNEL */
   setsvalue2s(L, obj, luaS_newlstr(L, buff, len));
 }
@@ -446,22 +532,24 @@ const char *luaO_pushvfstring (lua_State *L, const char *fmt, va_list argp) {
         break;
       }
       case 'd': {  /* an 'int' */
-        setivalue(L->top, va_arg(argp, int));
-        goto top2str;
+        char buff[LUA_INTBUFFSIZE];
+        pushstr(L, buff, luaO_int2str(buff, va_arg(argp, int)));
+        break;
       }
       case 'I': {  /* a 'lua_Integer' */
-        setivalue(L->top, cast(lua_Integer, va_arg(argp, l_uacInt)));
-#ifndef _KERNEL
-        goto top2str;
+        char buff[LUA_INTBUFFSIZE];
+        lua_Integer i = cast(lua_Integer, va_arg(argp, l_uacInt));
+        pushstr(L, buff, luaO_int2str(buff, i));
+        break;
       }
+#ifndef _KERNEL
       case 'f': {  /* a 'lua_Number' */
         setfltvalue(L->top, cast_num(va_arg(argp, l_uacNumber)));
-#endif /* _KERNEL */
-      top2str:  /* convert the top element to a string */
         luaD_inctop(L);
         luaO_tostring(L, L->top - 1);
         break;
       }
+#endif /* _KERNEL */
       case 'p': {  /* a pointer */
         char buff[4*sizeof(void *) + 8]; /* should be enough space for a '%p' */
         int l = l_sprintf(buff, sizeof(buff), "%p", va_arg(argp, void *));
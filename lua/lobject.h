@@ -111,7 +111,7 @@ typedef union Value {
 } Value;
 
 
-#define TValuefields	Value value_; int tt_
+#define TValuefields	Value value_; lu_byte tt_
 
 
 typedef struct lua_TValue {
@@ -268,8 +268,13 @@ typedef struct lua_TValue {
 
 
 
+/*
+** copies the fields one by one: a whole 'TValue' must not be written
+** over the value of a 'Node', which keeps key fields in its padding
+*/
 #define setobj(L,obj1,obj2) \
-	{ TValue *io1=(obj1); *io1 = *(obj2); \
+	{ TValue *io1=(obj1); const TValue *io2=(obj2); \
+	  io1->value_ = io2->value_; settt_(io1, io2->tt_); \
 	  (void)L; checkliveness(L,io1); }
 
 
@@ -291,7 +296,8 @@ typedef struct lua_TValue {
 #define setsvalue2n	setsvalue
 
 /* to table (define it as an expression to be used in macros) */
-#define setobj2t(L,o1,o2)  ((void)L, *(o1)=*(o2), checkliveness(L,(o1)))
+#define setobj2t(L,o1,o2)  ((void)L, val_(o1)=val_(o2), \
+			    settt_(o1, rttype(o2)), checkliveness(L,(o1)))
 
 
 
@@ -333,12 +339,29 @@ typedef union UTString {
 } UTString;
 
 
+/*
+** External strings are long strings whose bytes belong to the caller
+** (see 'lua_pushexternalstring'); their header is followed by this
+** structure instead of the bytes, and bit EXTSTRBIT is set in 'extra'
+** (which short strings only use for reserved words, below that bit)
+*/
+typedef struct ExtString {
+  const char *contents;
+  lua_Release release;  /* called when the string is collected, or NULL */
+  void *ud;  /* auxiliary data to 'release' */
+} ExtString;
+
+#define EXTSTRBIT	(1 << 7)
+#define isextstr(ts)	((ts)->extra & EXTSTRBIT)
+#define getextstr(ts)	cast(ExtString *, cast(char *, (ts)) + sizeof(UTString))
+
+
 /*
 ** Get the actual string (array of bytes) from a 'TString'.
 ** (Access to 'extra' ensures that value is really a 'TString'.)
 */
-#define getstr(ts)  \
-  check_exp(sizeof((ts)->extra), cast(char *, (ts)) + sizeof(UTString))
+#define getstr(ts)  (isextstr(ts) ? cast(char *, getextstr(ts)->contents) \
+                                  : cast(char *, (ts)) + sizeof(UTString))
 
 
 /* get the actual string (array of bytes) from a Lua value */
@@ -399,6 +422,7 @@ typedef struct Upvaldesc {
   TString *name;  /* upvalue name (for debug information) */
   lu_byte instack;  /* whether it is in stack (register) */
   lu_byte idx;  /* index of upvalue (in stack or in outer function's list) */
+  lu_byte ro;  /* whether the variable is never assigned after creation */
 } Upvaldesc;
 
 
@@ -413,6 +437,18 @@ typedef struct LocVar {
 } LocVar;
 
 
+/*
+** Absolute line of instruction 'pc' in compact line information, kept
+** every MAXIWTHABS instructions and wherever the line changes too much
+** for a byte (see 'encodelines' in ldebug.c,
+** used by 'luaG_stripdebug')
+*/
+typedef struct AbsLineInfo {
+  int pc;
+  int line;
+} AbsLineInfo;
+
+
 /*
 ** Function Prototypes
 */
@@ -421,21 +457,31 @@ typedef struct Proto {
   lu_byte numparams;  /* number of fixed parameters */
   lu_byte is_vararg;
   lu_byte maxstacksize;  /* number of registers needed by this function */
+  lu_byte cachepos;  /* next entry of 'cache' to be replaced */
   int sizeupvalues;  /* size of 'upvalues' */
   int sizek;  /* size of 'k' */
   int sizecode;
   int sizelineinfo;
+  int sizelinedelta;  /* size of 'linedelta' (0 or 'sizecode') */
+  int sizeabslineinfo;  /* size of 'abslineinfo' */
   int sizep;  /* size of 'p' */
   int sizelocvars;
+  int sizeicache;  /* size of 'icache' (0 or 'sizecode') */
+  int sizecounts;  /* size of 'counts' (0 or 'sizecode' + 1) */
   int linedefined;  /* debug information  */
   int lastlinedefined;  /* debug information  */
   TValue *k;  /* constants used by the function */
   Instruction *code;  /* opcodes */
   struct Proto **p;  /* functions defined inside the function */
   int *lineinfo;  /* map from opcodes to source lines (debug information) */
+  ls_byte *linedelta;  /* compact 'lineinfo': line change at each opcode */
+  AbsLineInfo *abslineinfo;  /* anchors for 'linedelta' */
   LocVar *locvars;  /* information about local variables (debug information) */
   Upvaldesc *upvalues;  /* upvalue information */
-  struct LClosure *cache;  /* last-created closure with this prototype */
+  struct LClosure *cache[NCLCACHE];  /* last closures with this prototype */
+  unsigned int *icache;  /* node index of last hit for constant keys, by pc */
+  size_t *counts;  /* calls, then executions by pc ('lua_setcounters') */
+  void *shared;  /* external block owning 'code' and 'lineinfo', or NULL */
   TString  *source;  /* used for debug information */
   GCObject *gclist;
 } Proto;
@@ -484,26 +530,34 @@ typedef union Closure {
 ** Tables
 */
 
-typedef union TKey {
-  struct {
-    TValuefields;
+/*
+** Nodes for hash tables: the key is not a 'TValue', so that its tag and
+** the chain offset fit in the padding of the value, making a node of
+** three words (instead of four).
+*/
+typedef union Node {
+  struct NodeKey {
+    TValuefields;  /* fields for value */
+    lu_byte key_tt;  /* key type */
     int next;  /* for chaining (offset for next node) */
-  } nk;
-  TValue tvk;
-} TKey;
+    Value key_val;  /* key value */
+  } u;
+  TValue i_val;  /* direct access to node's value as a proper 'TValue' */
+} Node;
 
 
-/* copy a value into a key without messing up field 'next' */
-#define setnodekey(L,key,obj) \
-	{ TKey *k_=(key); const TValue *io_=(obj); \
-	  k_->nk.value_ = io_->value_; k_->nk.tt_ = io_->tt_; \
+/* copy a value into a key */
+#define setnodekey(L,node,obj) \
+	{ Node *n_=(node); const TValue *io_=(obj); \
+	  n_->u.key_val = io_->value_; n_->u.key_tt = io_->tt_; \
 	  (void)L; checkliveness(L,io_); }
 
 
-typedef struct Node {
-  TValue i_val;
-  TKey i_key;
-} Node;
+/* copy a key into a value */
+#define getnodekey(L,obj,node) \
+	{ TValue *io_=(obj); const Node *n_=(node); \
+	  io_->value_ = n_->u.key_val; io_->tt_ = n_->u.key_tt; \
+	  (void)L; checkliveness(L,io_); }
 
 
 typedef struct Table {
@@ -550,6 +604,8 @@ LUAI_FUNC void luaO_arith (lua_State *L, int op, const TValue *p1,
                            const TValue *p2, TValue *res);
 LUAI_FUNC size_t luaO_str2num (const char *s, TValue *o);
 LUAI_FUNC int luaO_hexavalue (int c);
+LUAI_FUNC int luaO_int2str (char *buff, lua_Integer x);
+LUAI_FUNC int luaO_intlen (lua_Integer x);
 LUAI_FUNC void luaO_tostring (lua_State *L, StkId obj);
 LUAI_FUNC const char *luaO_pushvfstring (lua_State *L, const char *fmt,
                                                        va_list argp);
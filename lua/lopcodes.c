@@ -14,6 +14,7 @@
 #include <stddef.h>
 #endif /* _KERNEL */
 
+#include "lobject.h"
 #include "lopcodes.h"
 
 
@@ -69,6 +70,9 @@ LUAI_DDEF const char *const luaP_opnames[NUM_OPCODES+1] = {
   "CLOSURE",
   "VARARG",
   "EXTRAARG",
+  "GETTABUPF",
+  "MODP2",
+  "IDIVP2",
   NULL
 };
 
@@ -126,5 +130,66 @@ LUAI_DDEF const lu_byte luaP_opmodes[NUM_OPCODES] = {
  ,opmode(0, 1, OpArgU, OpArgN, iABx)		/* OP_CLOSURE */
  ,opmode(0, 1, OpArgU, OpArgN, iABC)		/* OP_VARARG */
  ,opmode(0, 0, OpArgU, OpArgU, iAx)		/* OP_EXTRAARG */
+ ,opmode(0, 1, OpArgU, OpArgK, iABC)		/* OP_GETTABUPF */
+ ,opmode(0, 1, OpArgK, OpArgK, iABC)		/* OP_MODP2 */
+ ,opmode(0, 1, OpArgK, OpArgK, iABC)		/* OP_IDIVP2 */
 };
 
+
+/* true if RK(C) of 'i' is a constant positive power of 2 */
+static int isKpow2 (const Proto *f, Instruction i) {
+  const TValue *o;
+  if (!ISK(GETARG_C(i)) || INDEXK(GETARG_C(i)) >= f->sizek)
+    return 0;
+  o = &f->k[INDEXK(GETARG_C(i))];
+  return ttisinteger(o) && ivalue(o) > 0 &&
+         (l_castS2U(ivalue(o)) & (l_castS2U(ivalue(o)) - 1)) == 0;
+}
+
+
+/*
+** turn each OP_GETTABUP whose result is indexed by the next
+** instruction into an OP_GETTABUPF, and each OP_MOD and OP_IDIV by a
+** power of 2 into an OP_MODP2 or OP_IDIVP2 ('f->k' must be complete)
+*/
+void luaP_fuse (Proto *f, int n) {
+  Instruction *code = f->code;
+  int pc;
+  for (pc = 0; pc < n; pc++) {
+    Instruction i = code[pc];
+    switch (GET_OPCODE(i)) {
+      case OP_GETTABUP: {
+        if (pc + 1 < n && GET_OPCODE(code[pc + 1]) == OP_GETTABLE &&
+            GETARG_B(code[pc + 1]) == GETARG_A(i))
+          SET_OPCODE(code[pc], OP_GETTABUPF);
+        break;
+      }
+      case OP_MOD: {
+        if (isKpow2(f, i))
+          SET_OPCODE(code[pc], OP_MODP2);
+        break;
+      }
+      case OP_IDIV: {
+        if (isKpow2(f, i))
+          SET_OPCODE(code[pc], OP_IDIVP2);
+        break;
+      }
+      default: break;
+    }
+  }
+}
+
+
+/*
+** plain form of an instruction, as stored in binary chunks
+*/
+Instruction luaP_unfuse (Instruction i) {
+  switch (GET_OPCODE(i)) {
+    case OP_GETTABUPF: SET_OPCODE(i, OP_GETTABUP); break;
+    case OP_MODP2: SET_OPCODE(i, OP_MOD); break;
+    case OP_IDIVP2: SET_OPCODE(i, OP_IDIV); break;
+    default: break;
+  }
+  return i;
+}
+
@@ -232,11 +232,15 @@ OP_CLOSURE,/*	A Bx	R(A) := closure(KPROTO[Bx])			*/
 
 OP_VARARG,/*	A B	R(A), R(A+1), ..., R(A+B-2) = vararg		*/
 
-OP_EXTRAARG/*	Ax	extra (larger) argument for previous opcode	*/
+OP_EXTRAARG,/*	Ax	extra (larger) argument for previous opcode	*/
+
+OP_GETTABUPF,/*	A B C	R(A) := UpValue[B][RK(C)]; then next GETTABLE	*/
+OP_MODP2,/*	A B C	R(A) := RK(B) % RK(C), with RK(C) == 2^n		*/
+OP_IDIVP2/*	A B C	R(A) := RK(B) // RK(C), with RK(C) == 2^n	*/
 } OpCode;
 
 
-#define NUM_OPCODES	(cast(int, OP_EXTRAARG) + 1)
+#define NUM_OPCODES	(cast(int, OP_IDIVP2) + 1)
 
 
 
@@ -259,7 +263,20 @@ OP_EXTRAARG/*	Ax	extra (larger) argument for previous opcode	*/
   (*) For comparisons, A specifies what condition the test should accept
   (true or false).
 
-  (*) All 'skips' (pc++) assume that next instruction is a jump.
+  (*) All 'skips' (pc++) assume that next instruction is a jump. The
+  VM executes that jump in the same dispatch as the test, so test+jump
+  pairs need no fused opcode.
+
+  (*) OP_GETTABUPF is an OP_GETTABUP whose next instruction is an
+  OP_GETTABLE indexing R(A) (e.g., 'glob.field'); the VM executes both
+  in one dispatch. It is created by 'luaP_fuse' once a function is
+  complete, never leaves the VM in binary chunks ('luaP_unfuse'), and
+  the OP_GETTABLE is kept in place, so jumps into it are still valid.
+
+  (*) OP_MODP2 and OP_IDIVP2 are an OP_MOD and an OP_IDIV whose C is a
+  constant positive power of 2, also created by 'luaP_fuse'. For an
+  integer RK(B), the VM computes them with a mask and a shift; anything
+  else takes the path of the plain opcode.
 
 ===========================================================================*/
 
@@ -292,6 +309,12 @@ LUAI_DDEC const lu_byte luaP_opmodes[NUM_OPCODES];
 LUAI_DDEC const char *const luaP_opnames[NUM_OPCODES+1];  /* opcode names */
 
 
+struct Proto;
+
+LUAI_FUNC void luaP_fuse (struct Proto *f, int n);
+LUAI_FUNC Instruction luaP_unfuse (Instruction i);
+
+
 /* number of list items to accumulate before a SETLIST instruction */
 #define LFIELDS_PER_FLUSH	50
 
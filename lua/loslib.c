@@ -100,6 +100,40 @@ static time_t l_checktime (lua_State *L, int arg) {
 
 #endif				/* } */
 
+
+#if !defined(l_monotonic)	/* { */
+/*
+** Monotonic clocks in nanoseconds, precise ('l_monotonic') and coarse
+** but cheaper ('l_coarse'): by default, POSIX 'clock_gettime', or else
+** the processor time of 'clock'
+*/
+
+#if defined(LUA_USE_POSIX) && defined(CLOCK_MONOTONIC)	/* { */
+
+static lua_Integer l_clockns (clockid_t id) {
+  struct timespec ts;
+  clock_gettime(id, &ts);
+  return (lua_Integer)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#define l_monotonic()		l_clockns(CLOCK_MONOTONIC)
+#if defined(CLOCK_MONOTONIC_COARSE)
+#define l_coarse()		l_clockns(CLOCK_MONOTONIC_COARSE)
+#else
+#define l_coarse()		l_monotonic()
+#endif
+
+#else				/* }{ */
+
+/* ISO C definitions */
+#define l_monotonic()	\
+	((lua_Integer)((double)clock() * (1e9 / CLOCKS_PER_SEC)))
+#define l_coarse()		l_monotonic()
+
+#endif				/* } */
+
+#endif				/* } */
+
 /* }================================================================== */
 
 
@@ -354,8 +388,15 @@ static int os_time (lua_State *L) {
   lua_Integer res;
 
   luai_time(t);
-  lua_pushinteger(L, (lua_Integer)t.tv_sec);
+#if defined(LUA_32BITS)
+  /* the time in nanoseconds does not fit: return the nanoseconds part */
+  if (t.tv_sec > LUA_MAXINTEGER)
+    luaL_error(L, "time result cannot be represented in this installation");
+  res = t.tv_nsec;
+#else
   res = t.tv_sec * NSEC_PER_SEC + t.tv_nsec;
+#endif /* LUA_32BITS */
+  lua_pushinteger(L, (lua_Integer)t.tv_sec);
   lua_pushinteger(L, res);
 
   return 2;
@@ -363,6 +404,32 @@ static int os_time (lua_State *L) {
 }
 
 
+/*
+** Monotonic clocks, for intervals: they never jump back, unlike
+** 'os.time', and allocate nothing. With 32-bit integers, they wrap
+** around (every 4.3 seconds), but the result of 'os.elapsed' is still
+** right for intervals under 2.1 seconds.
+*/
+static int os_monotonic_ns (lua_State *L) {
+  lua_pushinteger(L, (lua_Integer)l_monotonic());
+  return 1;
+}
+
+
+static int os_coarse_ns (lua_State *L) {
+  lua_pushinteger(L, (lua_Integer)l_coarse());
+  return 1;
+}
+
+
+/* nanoseconds since 'start', a value of 'os.monotonic_ns' */
+static int os_elapsed (lua_State *L) {
+  lua_Unsigned start = (lua_Unsigned)luaL_checkinteger(L, 1);
+  lua_pushinteger(L, (lua_Integer)((lua_Unsigned)l_monotonic() - start));
+  return 1;
+}
+
+
 #ifndef _KERNEL
 static int os_difftime (lua_State *L) {
   time_t t1 = l_checktime(L, 1);
@@ -403,11 +470,20 @@ static int os_exit (lua_State *L) {
 static const luaL_Reg syslib[] = {
 #ifndef _KERNEL
   {"clock",     os_clock},
+#endif /* _KERNEL */
+  {"coarse_ns", os_coarse_ns},
+#ifndef _KERNEL
   {"date",      os_date},
   {"difftime",  os_difftime},
+#endif /* _KERNEL */
+  {"elapsed",   os_elapsed},
+#ifndef _KERNEL
   {"execute",   os_execute},
   {"exit",      os_exit},
   {"getenv",    os_getenv},
+#endif /* _KERNEL */
+  {"monotonic_ns", os_monotonic_ns},
+#ifndef _KERNEL
   {"remove",    os_remove},
   {"rename",    os_rename},
   {"setlocale", os_setlocale},
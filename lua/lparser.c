@@ -182,7 +182,9 @@ static void new_localvar (LexState *ls, TString *name) {
                   MAXVARS, "local variables");
   luaM_growvector(ls->L, dyd->actvar.arr, dyd->actvar.n + 1,
                   dyd->actvar.size, Vardesc, MAX_INT, "local variables");
-  dyd->actvar.arr[dyd->actvar.n++].idx = cast(short, reg);
+  dyd->actvar.arr[dyd->actvar.n].idx = cast(short, reg);
+  dyd->actvar.arr[dyd->actvar.n].captured = 0;
+  dyd->actvar.arr[dyd->actvar.n++].assigned = 0;
 }
 
 
@@ -194,8 +196,13 @@ static void new_localvarliteral_ (LexState *ls, const char *name, size_t sz) {
 	new_localvarliteral_(ls, "" v, (sizeof(v)/sizeof(char))-1)
 
 
+static Vardesc *getvardesc (FuncState *fs, int i) {
+  return &fs->ls->dyd->actvar.arr[fs->firstlocal + i];
+}
+
+
 static LocVar *getlocvar (FuncState *fs, int i) {
-  int idx = fs->ls->dyd->actvar.arr[fs->firstlocal + i].idx;
+  int idx = getvardesc(fs, i)->idx;
   lua_assert(idx < fs->nlocvars);
   return &fs->f->locvars[idx];
 }
@@ -233,10 +240,17 @@ static int newupvalue (FuncState *fs, TString *name, expdesc *v) {
   checklimit(fs, fs->nups + 1, MAXUPVAL, "upvalues");
   luaM_growvector(fs->ls->L, f->upvalues, fs->nups, f->sizeupvalues,
                   Upvaldesc, MAXUPVAL, "upvalues");
-  while (oldsize < f->sizeupvalues)
+  while (oldsize < f->sizeupvalues) {
+    f->upvalues[oldsize].ro = 0;
     f->upvalues[oldsize++].name = NULL;
+  }
   f->upvalues[fs->nups].instack = (v->k == VLOCAL);
   f->upvalues[fs->nups].idx = cast_byte(v->u.info);
+  if (v->k == VLOCAL)  /* 'fs->prev' is NULL for the main function */
+    f->upvalues[fs->nups].ro = (fs->prev != NULL &&
+                                !getvardesc(fs->prev, v->u.info)->assigned);
+  else
+    f->upvalues[fs->nups].ro = fs->prev->f->upvalues[v->u.info].ro;
   f->upvalues[fs->nups].name = name;
   luaC_objbarrier(fs->ls->L, f, name);
   return fs->nups++;
@@ -265,6 +279,52 @@ static void markupval (FuncState *fs, int level) {
 }
 
 
+/*
+** Clear the 'ro' flag of the upvalues of the functions nested in 'f'
+** that refer to the variable given by 'instack' and 'idx', and of the
+** upvalues that refer to those in turn.
+*/
+static void clearro (Proto *f, int instack, int idx) {
+  int i, j;
+  for (i = 0; i < f->sizep; i++) {
+    Proto *c = f->p[i];
+    if (c == NULL)  /* prototype array still being built? */
+      continue;
+    for (j = 0; j < c->sizeupvalues; j++) {
+      Upvaldesc *up = &c->upvalues[j];
+      if (up->ro && up->instack == instack && up->idx == idx) {
+        up->ro = 0;
+        clearro(c, 0, j);
+      }
+    }
+  }
+}
+
+
+/*
+** Variable 'v' is being assigned: upvalues referring to it, already
+** created or not, can no longer be considered read-only.
+*/
+static void markassigned (FuncState *fs, expdesc *v) {
+  if (v->k == VLOCAL) {
+    Vardesc *vd = getvardesc(fs, v->u.info);
+    if (!vd->assigned) {
+      vd->assigned = 1;
+      if (vd->captured)
+        clearro(fs->f, 1, v->u.info);
+    }
+  }
+  else if (v->k == VUPVAL) {
+    Upvaldesc *up = &fs->f->upvalues[v->u.info];
+    if (up->ro) {  /* not marked yet? (then 'fs->prev' is not NULL) */
+      expdesc e;
+      init_exp(&e, up->instack ? VLOCAL : VUPVAL, up->idx);
+      markassigned(fs->prev, &e);  /* also clears 'up->ro' */
+    }
+  }
+}
+
+
 /*
   Find variable with given name 'n'. If it is an upvalue, add this
   upvalue into all intermediate functions.
@@ -276,8 +336,10 @@ static void singlevaraux (FuncState *fs, TString *n, expdesc *var, int base) {
     int v = searchvar(fs, n);  /* look up locals at current level */
     if (v >= 0) {  /* found? */
       init_exp(var, VLOCAL, v);  /* variable is local */
-      if (!base)
+      if (!base) {
         markupval(fs, v);  /* local will be used as an upval */
+        getvardesc(fs, v)->captured = 1;
+      }
     }
     else {  /* not found as local at current level; try upvalues */
       int idx = searchupvalue(fs, n);  /* try existing upvalues */
@@ -557,6 +619,7 @@ static void close_func (LexState *ls) {
   Proto *f = fs->f;
   luaK_ret(fs, 0, 0);  /* final return */
   leaveblock(fs);
+  luaP_fuse(f, fs->pc);
   luaM_reallocvector(L, f->code, f->sizecode, fs->pc, Instruction);
   f->sizecode = fs->pc;
   luaM_reallocvector(L, f->lineinfo, f->sizelineinfo, fs->pc, int);
@@ -569,6 +632,7 @@ static void close_func (LexState *ls) {
   f->sizelocvars = fs->nlocvars;
   luaM_reallocvector(L, f->upvalues, f->sizeupvalues, fs->nups, Upvaldesc);
   f->sizeupvalues = fs->nups;
+  luaF_initicache(L, f);
   lua_assert(fs->bl == NULL);
   ls->fs = fs->prev;
   luaC_checkGC(L);
@@ -1159,6 +1223,7 @@ static void check_conflict (LexState *ls, struct LHS_assign *lh, expdesc *v) {
 static void assignment (LexState *ls, struct LHS_assign *lh, int nvars) {
   expdesc e;
   check_condition(ls, vkisvar(lh->v.k), "syntax error");
+  markassigned(ls->fs, &lh->v);
   if (testnext(ls, ',')) {  /* assignment -> ',' suffixedexp assignment */
     struct LHS_assign nv;
     nv.prev = lh;
@@ -1445,6 +1510,8 @@ static void localfunc (LexState *ls) {
   FuncState *fs = ls->fs;
   new_localvar(ls, str_checkname(ls));  /* new local variable */
   adjustlocalvars(ls, 1);  /* enter its scope */
+  /* the function may capture the variable before it is assigned */
+  getvardesc(fs, fs->nactvar - 1)->assigned = 1;
   body(ls, &b, 0, ls->linenumber);  /* function created in next register */
   /* debug information will only see the variable after this point! */
   getlocvar(fs, b.u.info)->startpc = fs->pc;
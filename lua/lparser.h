@@ -73,6 +73,8 @@ typedef struct expdesc {
 /* description of active local variable */
 typedef struct Vardesc {
   short idx;  /* variable index in stack */
+  lu_byte captured;  /* whether some closure uses it as an upvalue */
+  lu_byte assigned;  /* whether it is assigned after its creation */
 } Vardesc;
 
 
@@ -34,6 +34,30 @@
 #define LUAI_GCPAUSE	200  /* 200% */
 #endif
 
+/*
+** maximum number of dead threads kept (with their stacks) for reuse
+** by 'lua_newthread', and the largest stack and 'ci' list they keep
+*/
+#if !defined(LUAI_MAXTHREADCACHE)
+#define LUAI_MAXTHREADCACHE	32
+#endif
+
+#define THREADCACHESTACK	(4*BASIC_STACK_SIZE)
+#define THREADCACHECI		8
+
+/*
+** number of 'CallInfo' entries added to a thread's list at a time, so
+** that a deepening call chain does not allocate on every new level
+*/
+#if !defined(LUAI_CICHUNK)
+#define LUAI_CICHUNK		8
+#endif
+
+
+#if !defined(LUAI_GCMAJOR)
+#define LUAI_GCMAJOR	200  /* 200% (heap doubles before a major collection) */
+#endif
+
 #if !defined(LUAI_GCMUL)
 #define LUAI_GCMUL	200 /* GC runs 'twice the speed' of memory allocation */
 #endif
@@ -107,14 +131,25 @@ void luaE_setdebt (global_State *g, l_mem debt) {
 }
 
 
+/*
+** Append LUAI_CICHUNK new entries after 'L->ci' and return the first one.
+** Each entry is still a separate block, so 'luaE_shrinkCI' and
+** 'luaE_freeCI' can release them individually; an allocation error
+** leaves the entries linked so far in the list.
+*/
 CallInfo *luaE_extendCI (lua_State *L) {
-  CallInfo *ci = luaM_new(L, CallInfo);
-  lua_assert(L->ci->next == NULL);
-  L->ci->next = ci;
-  ci->previous = L->ci;
-  ci->next = NULL;
-  L->nci++;
-  return ci;
+  CallInfo *prev = L->ci;
+  int i;
+  lua_assert(prev->next == NULL);
+  for (i = 0; i < LUAI_CICHUNK; i++) {
+    CallInfo *ci = luaM_new(L, CallInfo);
+    prev->next = ci;
+    ci->previous = prev;
+    ci->next = NULL;
+    L->nci++;
+    prev = ci;
+  }
+  return L->ci->next;
 }
 
 
@@ -226,14 +261,21 @@ static void preinit_thread (lua_State *L, global_State *g) {
   L->ci = NULL;
   L->nci = 0;
   L->stacksize = 0;
+  L->inoverflow = 0;
   L->twups = L;  /* thread has no upvalues */
+  L->regionnext = L;  /* thread created no region objects */
   L->errorJmp = NULL;
+  L->nexttable = NULL;
+  L->nextcursor = 0;
   L->nCcalls = 0;
   L->hook = NULL;
   L->hookmask = 0;
   L->basehookcount = 0;
   L->allowhook = 1;
   resethookcount(L);
+  L->basebudget = 0;
+  L->budgetyield = 0;
+  resetbudget(L);
   L->openupval = NULL;
   L->nny = 1;
   L->status = LUA_OK;
@@ -241,26 +283,76 @@ static void preinit_thread (lua_State *L, global_State *g) {
 }
 
 
+static void freethreadcache (lua_State *L) {
+  global_State *g = G(L);
+  while (g->threadcache != NULL) {
+    lua_State *L1 = g->threadcache;
+    g->threadcache = L1->twups;
+    freestack(L1);
+    luaM_free(L, fromstate(L1));
+  }
+  g->nthreadcache = 0;
+}
+
+
 static void close_state (lua_State *L) {
   global_State *g = G(L);
   luaF_close(L, L->stack);  /* close all upvalues for this thread */
   luaC_freeallobjects(L);  /* collect all objects */
+  freethreadcache(L);
   if (g->version)  /* closing a fully built state? */
     luai_userstateclose(L);
   luaM_freearray(L, G(L)->strt.hash, G(L)->strt.size);
+  luaM_freearray(L, G(L)->strt.oldhash, G(L)->strt.oldsize);
+  luaM_freearray(L, g->refs, g->sizerefs);
+  luaM_freearray(L, g->strcache, g->strcachen * g->strcachem);
   freestack(L);
   lua_assert(gettotalbytes(g) == sizeof(LG));
   (*g->frealloc)(g->ud, fromstate(L), sizeof(LG), 0);  /* free main block */
 }
 
 
+/*
+** reset a thread from 'threadcache' to a fresh state, keeping its stack
+** and 'ci' list
+*/
+static void reusethread (lua_State *L1, global_State *g) {
+  TValue *stack = L1->stack;
+  int i, stacksize = L1->stacksize;
+  unsigned short nci = L1->nci;
+  CallInfo *ci;
+  preinit_thread(L1, g);
+  L1->stack = stack;
+  L1->stacksize = stacksize;
+  for (i = 0; i < stacksize; i++)
+    setnilvalue(stack + i);  /* erase old stack */
+  L1->top = stack;
+  L1->stack_last = stack + stacksize - EXTRA_STACK;
+  L1->nci = nci;
+  ci = &L1->base_ci;  /* 'base_ci.next' keeps the old list */
+  ci->previous = NULL;
+  ci->callstatus = 0;
+  ci->func = L1->top;
+  setnilvalue(L1->top++);  /* 'function' entry for this 'ci' */
+  ci->top = L1->top + LUA_MINSTACK;
+  L1->ci = ci;
+}
+
+
 LUA_API lua_State *lua_newthread (lua_State *L) {
   global_State *g = G(L);
   lua_State *L1;
   lua_lock(L);
   luaC_checkGC(L);
-  /* create new thread */
-  L1 = &cast(LX *, luaM_newobject(L, LUA_TTHREAD, sizeof(LX)))->l;
+  /* create new thread, reusing a dead one if possible */
+  if ((L1 = g->threadcache) != NULL) {
+    g->threadcache = L1->twups;
+    g->nthreadcache--;
+  }
+  else {
+    L1 = &cast(LX *, luaM_newobject(L, LUA_TTHREAD, sizeof(LX)))->l;
+    L1->stack = NULL;
+  }
   L1->marked = luaC_white(g);
   L1->tt = LUA_TTHREAD;
   /* link it on list 'allgc' */
@@ -269,26 +361,57 @@ LUA_API lua_State *lua_newthread (lua_State *L) {
   /* anchor it on L stack */
   setthvalue(L, L->top, L1);
   api_incr_top(L);
-  preinit_thread(L1, g);
+  if (L1->stack != NULL)
+    reusethread(L1, g);
+  else
+    preinit_thread(L1, g);
   L1->hookmask = L->hookmask;
   L1->basehookcount = L->basehookcount;
   L1->hook = L->hook;
   resethookcount(L1);
+  L1->basebudget = L->basebudget;  /* but it does not yield */
+  resetbudget(L1);
   /* initialize L1 extra space */
   memcpy(lua_getextraspace(L1), lua_getextraspace(g->mainthread),
          LUA_EXTRASPACE);
   luai_userstatethread(L, L1);
-  stack_init(L1, L);  /* init stack */
+  if (L1->stack == NULL)
+    stack_init(L1, L);  /* init stack */
   lua_unlock(L);
   return L1;
 }
 
 
+/*
+** Dead threads with small stacks go to 'threadcache' (still accounted as
+** allocated memory), so that programs creating many short-lived
+** coroutines do not allocate and free a stack for each of them.
+*/
 void luaE_freethread (lua_State *L, lua_State *L1) {
+  global_State *g = G(L);
   LX *l = fromstate(L1);
   luaF_close(L1, L1->stack);  /* close all upvalues for this thread */
   lua_assert(L1->openupval == NULL);
   luai_userstatefree(L, L1);
+  if (g->running == L1)  /* left by an interleaved resume? */
+    g->running = g->mainthread;
+  if (L1->regionnext != L1) {  /* in 'regionthreads' list? */
+    lua_State **p = &g->regionthreads;
+    while (*p != L1)
+      p = &(*p)->regionnext;
+    *p = L1->regionnext;  /* remove it */
+    L1->regionnext = L1;
+  }
+  if (g->nthreadcache < LUAI_MAXTHREADCACHE && L1->stack != NULL &&
+      L1->stacksize <= THREADCACHESTACK) {  /* keep it for reuse? */
+    L1->ci = &L1->base_ci;
+    if (L1->nci > THREADCACHECI)
+      luaE_freeCI(L1);
+    L1->twups = g->threadcache;  /* (dead threads have no upvalues) */
+    g->threadcache = L1;
+    g->nthreadcache++;
+    return;
+  }
   freestack(L1);
   luaM_free(L, l);
 }
@@ -310,12 +433,30 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->frealloc = f;
   g->ud = ud;
   g->mainthread = L;
+  g->running = L;
   g->seed = makeseed(L);
+  g->hashkey[0] = makeseed(L);
+  g->hashkey[1] = makeseed(L);
   g->gcrunning = 0;  /* no GC while building state */
+  g->gcdefer = GCDEFERNONE;
+  g->hookreq = 0;
+  g->gcgen = g->gcminor = 0;
+  g->regionbits = g->regionlost = 0;
+  g->regiondepth = 0;
+  g->nregion = 0;
+  g->regionthreads = NULL;
   g->GCestimate = 0;
+  g->GCphasework = 0;
+  g->GCmajorbase = 0;
   g->strt.size = g->strt.nuse = 0;
-  g->strt.hash = NULL;
+  g->strt.hash = g->strt.oldhash = NULL;
+  g->strt.oldsize = g->strt.rehash = 0;
   setnilvalue(&g->l_registry);
+  g->strcache = NULL;
+  g->strcachen = g->strcachem = 0;
+  g->strcachehits = g->strcachemisses = 0;
+  g->refs = NULL;
+  g->sizerefs = g->nrefs = g->freeref = 0;
   g->panic = NULL;
   g->version = NULL;
   g->gcstate = GCSpause;
@@ -325,12 +466,19 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->gray = g->grayagain = NULL;
   g->weak = g->ephemeron = g->allweak = NULL;
   g->twups = NULL;
+  g->threadcache = NULL;
+  g->nthreadcache = 0;
   g->totalbytes = sizeof(LG);
   g->GCdebt = 0;
   g->gcfinnum = 0;
   g->gcpause = LUAI_GCPAUSE;
   g->gcstepmul = LUAI_GCMUL;
-  for (i=0; i < LUA_NUMTAGS; i++) g->mt[i] = NULL;
+  g->gcmajorinc = LUAI_GCMAJOR;
+  g->stacklimit = LUAI_MAXSTACK;
+  for (i=0; i < LUA_NUMTAGS; i++) {
+    g->mt[i] = NULL;
+    g->tmicache[i] = NOICACHE;
+  }
   if (luaD_rawrunprotected(L, f_luaopen, NULL) != LUA_OK) {
     /* memory allocation error: free partial state */
     close_state(L);
@@ -347,3 +495,547 @@ LUA_API void lua_close (lua_State *L) {
 }
 
 
+
+
+/*
+** {======================================================
+** State cloning
+** =======================================================
+*/
+
+/*
+** 'lua_clonestate' copies the objects of a state in two passes over its
+** lists of objects: the first one creates an empty copy of each object
+** and records it in a map from the addresses of the originals to their
+** copies (open addressing, at most half full); the second one fills the
+** copies, translating each reference through the map. The copy gets the
+** hash keys of the original, so strings keep their hashes and tables
+** keep the layout of their originals, unless they have keys hashed by
+** address (such as tables or functions), which are then rehashed.
+** Objects with finalizers, which may own resources that cannot be
+** duplicated, are not copied: references to them become nil. At last,
+** userdata with a '__clone' metamethod can fix their copies.
+*/
+typedef struct Clone {
+  lua_State *L;  /* state being cloned */
+  lua_State *to;  /* state receiving the copy */
+  void **map;  /* pairs (original, copy) */
+  size_t sizemap;  /* number of pairs ('2^lsizemap') */
+  int lsizemap;
+} Clone;
+
+
+static void **mapslot (Clone *c, const void *o) {
+  size_t mask = c->sizemap - 1;
+  size_t i = cast(unsigned int, point2uint(o) * 2654435769u) >>
+             (32 - c->lsizemap);  /* (Fibonacci hashing) */
+  while (c->map[2 * i] != NULL && c->map[2 * i] != o)
+    i = (i + 1) & mask;
+  return &c->map[2 * i];
+}
+
+
+/* copy of object 'o', or NULL if it was not copied */
+#define getcopy(c,o)	(mapslot(c, o)[1])
+
+
+static void setcopy (Clone *c, const void *o, void *n) {
+  void **slot = mapslot(c, o);
+  slot[0] = cast(void *, o);
+  slot[1] = n;
+}
+
+
+static l_noret cloneerror (Clone *c, const char *msg) {
+  setsvalue2s(c->to, c->to->top, luaS_new(c->to, msg));
+  luaD_inctop(c->to);
+  luaD_throw(c->to, LUA_ERRRUN);
+}
+
+
+/*
+** makes value 'o', copied from the original state, refer to the copies
+** (until then, it is a value of the original, so it is copied with
+** 'setobj(c->L, ...)')
+*/
+static void relocate (Clone *c, TValue *o) {
+  if (iscollectable(o)) {
+    GCObject *n = cast(GCObject *, getcopy(c, gcvalue(o)));
+    if (n != NULL)
+      val_(o).gc = n;
+    else
+      setnilvalue(o);  /* object was not copied */
+  }
+}
+
+
+static TString *copystr (Clone *c, TString *ts) {
+  return (ts == NULL) ? NULL : gco2ts(cast(GCObject *, getcopy(c, ts)));
+}
+
+
+static Table *copymt (Clone *c, Table *mt) {
+  GCObject *n = (mt == NULL) ? NULL : cast(GCObject *, getcopy(c, mt));
+  return (n == NULL) ? NULL : gco2t(n);
+}
+
+
+static size_t countobjects (GCObject *o, size_t *nupvals) {
+  size_t n = 0;
+  for (; o != NULL; o = o->next, n++) {
+    if (o->tt == LUA_TLCL)
+      *nupvals += gco2lcl(o)->nupvalues;
+  }
+  return n;
+}
+
+
+/* first pass: creates an empty copy of object 'o' */
+static void newcopy (Clone *c, GCObject *o) {
+  lua_State *to = c->to;
+  GCObject *n;
+  switch (o->tt) {
+    case LUA_TSHRSTR: {
+      TString *ts = gco2ts(o);
+      TString *nts = luaS_newshrhash(to, getstr(ts), ts->shrlen, ts->hash);
+      n = obj2gco(nts);
+      break;
+    }
+    case LUA_TLNGSTR: {  /* external strings get their own bytes */
+      TString *ts = gco2ts(o);
+      TString *nts = luaS_createlngstrobj(to, ts->u.lnglen);
+      memcpy(getstr(nts), getstr(ts), ts->u.lnglen * sizeof(char));
+      nts->hash = ts->hash;
+      nts->extra = cast_byte(ts->extra & ~EXTSTRBIT);
+      n = obj2gco(nts);
+      break;
+    }
+    case LUA_TUSERDATA: {
+      Udata *u = gco2u(o);
+      Udata *nu = luaS_newudata(to, u->len);
+      memcpy(getudatamem(nu), getudatamem(u), u->len);
+      n = obj2gco(nu);
+      break;
+    }
+    case LUA_TTABLE: {
+      Table *t = luaH_new(to);
+      n = obj2gco(t);
+      break;
+    }
+    case LUA_TLCL: {
+      LClosure *ncl = luaF_newLclosure(to, gco2lcl(o)->nupvalues);
+      n = obj2gco(ncl);
+      break;
+    }
+    case LUA_TCCL: {
+      CClosure *cl = gco2ccl(o);
+      CClosure *ncl = luaF_newCclosure(to, cl->nupvalues);
+      ncl->f = cl->f;
+      n = obj2gco(ncl);
+      break;
+    }
+    case LUA_TPROTO: {
+      Proto *f = luaF_newproto(to);
+      n = obj2gco(f);
+      break;
+    }
+    default: {
+      lua_assert(o->tt == LUA_TTHREAD);
+      cloneerror(c, "cannot clone a state with coroutines");
+    }
+  }
+  setcopy(c, o, n);
+}
+
+
+static void copytable (Clone *c, Table *t, Table *nt) {
+  int rehash = 0;
+  unsigned int i;
+  luaH_copy(c->to, nt, t);
+  for (i = 0; i < nt->sizearray; i++)
+    relocate(c, &nt->array[i]);
+  for (i = 0; i < cast(unsigned int, allocsizenode(nt)); i++) {
+    Node *n = gnode(nt, i);
+    relocate(c, gval(n));
+    if (keyisdead(n))
+      gckey(n) = NULL;  /* (it referred to an object of the original) */
+    else if (keyiscollectable(n)) {
+      GCObject *k = cast(GCObject *, getcopy(c, gckey(n)));
+      if (novariant(keytt(n)) != LUA_TSTRING)
+        rehash = 1;  /* key is hashed by its address */
+      gckey(n) = k;
+      if (k == NULL) {  /* key was not copied? */
+        setnilvalue(gval(n));
+        setdeadkey(n);  /* (node stays in its chain) */
+      }
+    }
+  }
+  nt->metatable = copymt(c, t->metatable);
+  if (rehash)  /* insert all keys again, in their new positions */
+    luaH_resize(c->to, nt, nt->sizearray, allocsizenode(nt));
+  nt->flags = t->flags;
+}
+
+
+static UpVal *copyupval (Clone *c, UpVal *uv) {
+  UpVal *nuv;
+  if (uv == NULL)
+    return NULL;
+  nuv = cast(UpVal *, getcopy(c, uv));
+  if (nuv == NULL) {  /* first closure using it? */
+    nuv = luaM_new(c->to, UpVal);
+    nuv->refcount = 0;
+    nuv->v = &nuv->u.value;  /* make it closed */
+    setobj(c->L, nuv->v, uv->v);
+    relocate(c, nuv->v);
+    setcopy(c, uv, nuv);
+  }
+  nuv->refcount++;
+  return nuv;
+}
+
+
+static void copyproto (Clone *c, Proto *f, Proto *nf) {
+  lua_State *to = c->to;
+  int i;
+  nf->numparams = f->numparams;
+  nf->is_vararg = f->is_vararg;
+  nf->maxstacksize = f->maxstacksize;
+  nf->linedefined = f->linedefined;
+  nf->lastlinedefined = f->lastlinedefined;
+  nf->source = copystr(c, f->source);
+  nf->k = luaM_newvector(to, f->sizek, TValue);
+  nf->sizek = f->sizek;
+  for (i = 0; i < f->sizek; i++) {
+    setobj(c->L, &nf->k[i], &f->k[i]);
+    relocate(c, &nf->k[i]);
+  }
+  nf->p = luaM_newvector(to, f->sizep, Proto *);
+  nf->sizep = f->sizep;
+  for (i = 0; i < f->sizep; i++)
+    nf->p[i] = gco2p(cast(GCObject *, getcopy(c, f->p[i])));
+  nf->upvalues = luaM_newvector(to, f->sizeupvalues, Upvaldesc);
+  nf->sizeupvalues = f->sizeupvalues;
+  for (i = 0; i < f->sizeupvalues; i++) {
+    nf->upvalues[i] = f->upvalues[i];
+    nf->upvalues[i].name = copystr(c, f->upvalues[i].name);
+  }
+  nf->locvars = luaM_newvector(to, f->sizelocvars, LocVar);
+  nf->sizelocvars = f->sizelocvars;
+  for (i = 0; i < f->sizelocvars; i++) {
+    nf->locvars[i] = f->locvars[i];
+    nf->locvars[i].varname = copystr(c, f->locvars[i].varname);
+  }
+  nf->icache = luaM_newvector(to, f->sizeicache, unsigned int);
+  nf->sizeicache = f->sizeicache;
+  memcpy(nf->icache, f->icache, f->sizeicache * sizeof(unsigned int));
+  nf->linedelta = luaM_newvector(to, f->sizelinedelta, ls_byte);
+  nf->sizelinedelta = f->sizelinedelta;
+  memcpy(nf->linedelta, f->linedelta, f->sizelinedelta * sizeof(ls_byte));
+  nf->abslineinfo = luaM_newvector(to, f->sizeabslineinfo, AbsLineInfo);
+  nf->sizeabslineinfo = f->sizeabslineinfo;
+  memcpy(nf->abslineinfo, f->abslineinfo,
+         f->sizeabslineinfo * sizeof(AbsLineInfo));
+  if (f->shared != NULL) {  /* borrow the same code */
+    luai_protoshare(to, f->shared);
+    nf->code = f->code;
+    nf->lineinfo = f->lineinfo;
+    nf->shared = f->shared;
+  }
+  else {
+    nf->code = luaM_newvector(to, f->sizecode, Instruction);
+    memcpy(nf->code, f->code, f->sizecode * sizeof(Instruction));
+    nf->sizecode = f->sizecode;  /* (in case 'lineinfo' fails) */
+    nf->lineinfo = luaM_newvector(to, f->sizelineinfo, int);
+    memcpy(nf->lineinfo, f->lineinfo, f->sizelineinfo * sizeof(int));
+  }
+  nf->sizecode = f->sizecode;
+  nf->sizelineinfo = f->sizelineinfo;
+}
+
+
+/* second pass: fills the copy of object 'o' */
+static void fillcopy (Clone *c, GCObject *o) {
+  GCObject *n = cast(GCObject *, getcopy(c, o));
+  switch (o->tt) {
+    case LUA_TUSERDATA: {
+      TValue uv;
+      getuservalue(c->L, gco2u(o), &uv);
+      relocate(c, &uv);
+      setuservalue(c->to, gco2u(n), &uv);
+      gco2u(n)->metatable = copymt(c, gco2u(o)->metatable);
+      break;
+    }
+    case LUA_TTABLE: {
+      copytable(c, gco2t(o), gco2t(n));
+      break;
+    }
+    case LUA_TLCL: {
+      LClosure *cl = gco2lcl(o);
+      LClosure *ncl = gco2lcl(n);
+      int i;
+      ncl->p = gco2p(cast(GCObject *, getcopy(c, cl->p)));
+      for (i = 0; i < cl->nupvalues; i++)
+        ncl->upvals[i] = copyupval(c, cl->upvals[i]);
+      break;
+    }
+    case LUA_TCCL: {
+      CClosure *cl = gco2ccl(o);
+      CClosure *ncl = gco2ccl(n);
+      int i;
+      for (i = 0; i < cl->nupvalues; i++) {
+        setobj(c->L, &ncl->upvalue[i], &cl->upvalue[i]);
+        relocate(c, &ncl->upvalue[i]);
+      }
+      break;
+    }
+    case LUA_TPROTO: {
+      copyproto(c, gco2p(o), gco2p(n));
+      break;
+    }
+    default: break;  /* strings are complete */
+  }
+}
+
+
+static void copyglobal (Clone *c) {
+  global_State *g = G(c->L);
+  global_State *ng = G(c->to);
+  int i;
+  setobj(c->L, &ng->l_registry, &g->l_registry);
+  relocate(c, &ng->l_registry);
+  for (i = 0; i < LUA_NUMTAGS; i++)
+    ng->mt[i] = copymt(c, g->mt[i]);
+  ng->refs = luaM_newvector(c->to, g->sizerefs, TValue);
+  ng->sizerefs = g->sizerefs;
+  for (i = 0; i < g->nrefs; i++) {
+    setobj(c->L, &ng->refs[i], &g->refs[i]);
+    relocate(c, &ng->refs[i]);
+  }
+  ng->nrefs = g->nrefs;
+  ng->freeref = g->freeref;
+  ng->gcpause = g->gcpause;
+  ng->gcstepmul = g->gcstepmul;
+  ng->gcmajorinc = g->gcmajorinc;
+  ng->stacklimit = g->stacklimit;
+}
+
+
+/*
+** third pass: calls the '__clone' metamethods of the copied userdata
+** (with the copy as argument), which can restore C pointers into other
+** objects, as the memory of userdata is copied byte by byte
+*/
+static void callclone (Clone *c) {
+  lua_State *to = c->to;
+  GCObject *o;
+  setsvalue2s(to, to->top, luaS_newliteral(to, "__clone"));
+  luaD_inctop(to);  /* (anchor the name) */
+  for (o = G(c->L)->allgc; o != NULL; o = o->next) {
+    if (o->tt == LUA_TUSERDATA) {
+      Udata *u = gco2u(cast(GCObject *, getcopy(c, o)));
+      const TValue *tm = (u->metatable == NULL) ? luaO_nilobject :
+                         luaH_getshortstr(u->metatable, tsvalue(to->top - 1));
+      if (!ttisnil(tm)) {
+        luaD_checkstack(to, 2);
+        setobj2s(to, to->top, tm);
+        setuvalue(to, to->top + 1, u);
+        to->top += 2;
+        luaD_callnoyield(to, to->top - 2, 0);
+      }
+    }
+  }
+  to->top--;
+}
+
+
+static void f_clone (lua_State *to, void *ud) {
+  Clone *c = cast(Clone *, ud);
+  global_State *g = G(c->L);
+  size_t nupvals = 0;
+  size_t n = 1;  /* the main thread */
+  size_t i;
+  GCObject *o;
+  if (g->mainthread->openupval != NULL)
+    cloneerror(c, "cannot clone a state with open upvalues");
+  n += countobjects(g->fixedgc, &nupvals);
+  n += countobjects(g->allgc, &nupvals);
+  n += nupvals;
+  for (c->lsizemap = 1; (cast(size_t, 1) << c->lsizemap) < 2 * n; )
+    if (++c->lsizemap == 32)
+      luaM_toobig(to);
+  c->map = luaM_newvector(to, 2 * (cast(size_t, 1) << c->lsizemap), void *);
+  c->sizemap = cast(size_t, 1) << c->lsizemap;
+  for (i = 0; i < 2 * c->sizemap; i++)
+    c->map[i] = NULL;
+  if (G(to)->strt.size < g->strt.size)
+    luaS_resize(to, g->strt.size);
+  luaS_rekey(to, g->seed, g->hashkey);
+  setcopy(c, g->mainthread, G(to)->mainthread);
+  for (o = g->fixedgc; o != NULL; o = o->next)
+    newcopy(c, o);
+  for (o = g->allgc; o != NULL; o = o->next)
+    newcopy(c, o);
+  for (o = g->fixedgc; o != NULL; o = o->next)
+    fillcopy(c, o);
+  for (o = g->allgc; o != NULL; o = o->next)
+    fillcopy(c, o);
+  copyglobal(c);
+  callclone(c);
+}
+
+
+/*
+** Copies all objects of 'L' into 'to', which must be a state just
+** created by 'lua_newstate', and makes them its registry, globals and
+** basic-type metatables. On errors, the error message is pushed on 'to'
+** and the state 'to' can only be closed.
+*/
+LUA_API int lua_clonestate (lua_State *L, lua_State *to) {
+  global_State *g = G(L);
+  global_State *ng = G(to);
+  const lua_Number *version = ng->version;
+  Clone c;
+  int status;
+  lua_lock(L);
+  lua_lock(to);
+  api_check(L, g != ng, "cannot clone a state into itself");
+  api_check(L, ng->gcstate == GCSpause && !ng->gcgen, "state is not new");
+  if (issweepphase(g))  /* dead objects may refer to freed ones? */
+    luaC_runtilstate(L, bitmask(GCScallfin));  /* finish the sweep */
+  c.L = L;
+  c.to = to;
+  c.map = NULL;
+  c.sizemap = 0;
+  ng->version = NULL;  /* no emergency collections while copying... */
+  ng->gcrunning = 0;  /* ...nor steps (copies are not anchored) */
+  status = luaD_rawrunprotected(to, f_clone, &c);
+  luaM_freearray(to, c.map, 2 * c.sizemap);
+  ng->version = version;
+  ng->gcrunning = 1;
+  if (status == LUA_ERRMEM) {
+    setsvalue2s(to, to->top, ng->memerrmsg);
+    api_incr_top(to);
+  }
+  lua_unlock(to);
+  lua_unlock(L);
+  return status;
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Memory statistics ('lua_getmemstats'): a walk over all objects, so
+** allocations pay nothing for them
+** =======================================================
+*/
+
+static void countblock (lua_MemStats *ms, int kind, size_t size) {
+  if (size > 0) {
+    ms->bytes[kind] += size;
+    ms->blocks[size > (1u << (LUA_MEMCLASSES - 1)) ? LUA_MEMCLASSES - 1
+                     : luaO_ceillog2(cast(unsigned int, size))]++;
+  }
+}
+
+
+static void countthread (lua_MemStats *ms, lua_State *L1, size_t size) {
+  countblock(ms, LUA_MEMTHREAD, size);
+  countblock(ms, LUA_MEMTHREAD, sizeof(TValue) * L1->stacksize);
+  ms->bytes[LUA_MEMTHREAD] += sizeof(CallInfo) * L1->nci;
+  ms->blocks[luaO_ceillog2(sizeof(CallInfo))] += L1->nci;
+  ms->count[LUA_MEMTHREAD]++;
+}
+
+
+static void countproto (lua_MemStats *ms, Proto *p) {
+  countblock(ms, LUA_MEMPROTO, sizeof(Proto));
+  if (p->shared == NULL) {  /* owns its code? */
+    countblock(ms, LUA_MEMPROTO, sizeof(Instruction) * p->sizecode);
+    countblock(ms, LUA_MEMPROTO, sizeof(int) * p->sizelineinfo);
+  }
+  countblock(ms, LUA_MEMPROTO, sizeof(ls_byte) * p->sizelinedelta);
+  countblock(ms, LUA_MEMPROTO, sizeof(AbsLineInfo) * p->sizeabslineinfo);
+  countblock(ms, LUA_MEMPROTO, sizeof(TValue) * p->sizek);
+  countblock(ms, LUA_MEMPROTO, sizeof(Proto *) * p->sizep);
+  countblock(ms, LUA_MEMPROTO, sizeof(LocVar) * p->sizelocvars);
+  countblock(ms, LUA_MEMPROTO, sizeof(Upvaldesc) * p->sizeupvalues);
+  countblock(ms, LUA_MEMPROTO, sizeof(unsigned int) * p->sizeicache);
+  countblock(ms, LUA_MEMPROTO, sizeof(size_t) * p->sizecounts);
+  ms->count[LUA_MEMPROTO]++;
+}
+
+
+static void countobj (lua_MemStats *ms, GCObject *o) {
+  switch (o->tt) {
+    case LUA_TTABLE: {
+      Table *t = gco2t(o);
+      countblock(ms, LUA_MEMTABLE, sizeof(Table));
+      countblock(ms, LUA_MEMTABLE, sizeof(TValue) * t->sizearray);
+      countblock(ms, LUA_MEMTABLE, sizeof(Node) * allocsizenode(t));
+      ms->count[LUA_MEMTABLE]++;
+      break;
+    }
+    case LUA_TSHRSTR:
+      countblock(ms, LUA_MEMSTRING, sizelstring(gco2ts(o)->shrlen));
+      ms->count[LUA_MEMSTRING]++;
+      break;
+    case LUA_TLNGSTR:
+      countblock(ms, LUA_MEMLNGSTR, sizelngstr(gco2ts(o)));
+      ms->count[LUA_MEMLNGSTR]++;
+      break;
+    case LUA_TLCL:
+      countblock(ms, LUA_MEMLCL, sizeLclosure(gco2lcl(o)->nupvalues));
+      ms->count[LUA_MEMLCL]++;
+      break;
+    case LUA_TCCL:
+      countblock(ms, LUA_MEMCCL, sizeCclosure(gco2ccl(o)->nupvalues));
+      ms->count[LUA_MEMCCL]++;
+      break;
+    case LUA_TUSERDATA:
+      countblock(ms, LUA_MEMUDATA, sizeudata(gco2u(o)));
+      ms->count[LUA_MEMUDATA]++;
+      break;
+    case LUA_TTHREAD:
+      countthread(ms, gco2th(o), sizeof(LX));
+      break;
+    case LUA_TPROTO:
+      countproto(ms, gco2p(o));
+      break;
+    default: lua_assert(0);
+  }
+}
+
+
+static void countlist (lua_MemStats *ms, GCObject *o) {
+  for (; o != NULL; o = o->next)
+    countobj(ms, o);
+}
+
+
+/*
+** Fills 'ms' with the objects not yet freed (dead ones not yet swept
+** included); the rest of the memory in use goes to LUA_MEMOTHER.
+*/
+LUA_API void lua_getmemstats (lua_State *L, lua_MemStats *ms) {
+  global_State *g = G(L);
+  lu_mem total, owned = 0;
+  int i;
+  lua_lock(L);
+  memset(ms, 0, sizeof(*ms));
+  countthread(ms, g->mainthread, sizeof(LG));
+  countlist(ms, g->allgc);
+  countlist(ms, g->finobj);
+  countlist(ms, g->tobefnz);
+  countlist(ms, g->fixedgc);  /* (short strings are also in these lists) */
+  for (i = 0; i < LUA_MEMOTHER; i++)
+    owned += ms->bytes[i];
+  total = gettotalbytes(g);
+  ms->bytes[LUA_MEMOTHER] = (total > owned) ? total - owned : 0;
+  lua_unlock(L);
+}
+
+/* }====================================================== */
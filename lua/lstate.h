@@ -57,8 +57,11 @@ struct lua_longjmp;  /* defined in ldo.c */
 
 typedef struct stringtable {
   TString **hash;
-  int nuse;  /* number of elements */
+  int nuse;  /* number of elements (in 'hash' and 'oldhash') */
   int size;
+  TString **oldhash;  /* buckets being moved to 'hash' (NULL if none) */
+  int oldsize;  /* size of 'oldhash' */
+  int rehash;  /* buckets of 'oldhash' before this one were moved */
 } stringtable;
 
 
@@ -123,13 +126,29 @@ typedef struct global_State {
   l_mem GCdebt;  /* bytes allocated not yet compensated by the collector */
   lu_mem GCmemtrav;  /* memory traversed by the GC */
   lu_mem GCestimate;  /* an estimate of the non-garbage memory in use */
+  lu_mem GCphasework;  /* work done in the current GC state (for tracing) */
+  lu_mem GCmajorbase;  /* memory in use after last major collection */
   stringtable strt;  /* hash table for strings */
   TValue l_registry;
-  unsigned int seed;  /* randomized seed for hashes */
+  TValue *refs;  /* dense reference store ('lua_ref') */
+  int sizerefs;  /* size of 'refs' */
+  int nrefs;  /* number of slots of 'refs' in use or in the free list */
+  int freeref;  /* first free reference (0 if none) */
+  unsigned int seed;  /* randomized seed for hashes of long strings */
+  unsigned int hashkey[2];  /* randomized key for hashes of short strings */
   lu_byte currentwhite;
   lu_byte gcstate;  /* state of garbage collector */
   lu_byte gckind;  /* kind of GC running */
   lu_byte gcrunning;  /* true if GC is running */
+  lu_byte gcdefer;  /* GCDEFER* mode of 'luaC_step' */
+  volatile lu_byte hookreq;  /* request for 'luai_hookreq' */
+  lu_byte gcgen;  /* true in generational mode */
+  lu_byte gcminor;  /* true during a minor collection */
+  lu_byte regionbits;  /* REGIONBIT while new objects go to the region */
+  lu_byte regionlost;  /* true if a region object left 'allgc' */
+  unsigned int regiondepth;  /* nesting of 'lua_beginregion' calls */
+  lu_mem nregion;  /* number of region objects in 'allgc' */
+  struct lua_State *regionthreads;  /* threads that created them */
   GCObject *allgc;  /* list of all collectable objects */
   GCObject **sweepgc;  /* current position of sweep in list */
   GCObject *finobj;  /* list of collectable objects with finalizers */
@@ -141,16 +160,26 @@ typedef struct global_State {
   GCObject *tobefnz;  /* list of userdata to be GC */
   GCObject *fixedgc;  /* list of objects not to be collected */
   struct lua_State *twups;  /* list of threads with open upvalues */
+  struct lua_State *threadcache;  /* dead threads for reuse (by 'twups') */
+  unsigned int nthreadcache;  /* number of threads in 'threadcache' */
   unsigned int gcfinnum;  /* number of finalizers to call in each GC step */
   int gcpause;  /* size of pause between successive GCs */
   int gcstepmul;  /* GC 'granularity' */
+  int gcmajorinc;  /* heap growth (%) that triggers a major collection */
+  int stacklimit;  /* maximum size of Lua stacks (at most LUAI_MAXSTACK) */
   lua_CFunction panic;  /* to be called in unprotected errors */
   struct lua_State *mainthread;
+  struct lua_State *running;  /* innermost thread being resumed, or main */
   const lua_Number *version;  /* pointer to version number */
   TString *memerrmsg;  /* memory-error message */
   TString *tmname[TM_N];  /* array with tag-method names */
   struct Table *mt[LUA_NUMTAGS];  /* metatables for basic types */
-  TString *strcache[STRCACHE_N][STRCACHE_M];  /* cache for strings in API */
+  unsigned int tmicache[LUA_NUMTAGS];  /* node of '__index' in metatables */
+  TString **strcache;  /* cache for strings in API ('strcachen' sets) */
+  int strcachen;  /* number of sets of 'strcache' */
+  int strcachem;  /* number of entries of each set */
+  lu_mem strcachehits;  /* lookups of 'strcache' that found the string */
+  lu_mem strcachemisses;  /* lookups of 'strcache' that did not */
 } global_State;
 
 
@@ -170,17 +199,25 @@ struct lua_State {
   UpVal *openupval;  /* list of open upvalues in this stack */
   GCObject *gclist;
   struct lua_State *twups;  /* list of threads with open upvalues */
+  struct lua_State *regionnext;  /* list of threads with region objects */
   struct lua_longjmp *errorJmp;  /* current error recover point */
+  struct Table *nexttable;  /* table of the last key from 'luaH_next' */
   CallInfo base_ci;  /* CallInfo for first level (C calling Lua) */
   volatile lua_Hook hook;
   ptrdiff_t errfunc;  /* current error handling function (stack index) */
   int stacksize;
   int basehookcount;
   int hookcount;
+  int basebudget;  /* budget given on each refill (0 if none) */
+  int budget;  /* units left of the instruction budget */
+  int budgetmark;  /* value of 'budget' when its use was last counted */
+  unsigned int nextcursor;  /* position of that key in 'nexttable' */
   unsigned short nny;  /* number of non-yieldable calls in stack */
   unsigned short nCcalls;  /* number of nested C calls */
   l_signalT hookmask;
   lu_byte allowhook;
+  lu_byte budgetyield;  /* yield when the budget runs out */
+  lu_byte inoverflow;  /* stack grown past the limit for an overflow error */
 };
 
 
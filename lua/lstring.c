@@ -28,8 +28,19 @@
 
 
 /*
-** Lua will use at most ~(2^LUAI_HASHLIMIT) bytes from a string to
-** compute its hash
+** number of buckets of the old string table moved to the new one in
+** each insertion; it must be at least 4, so that a resize finishes
+** before the next one is due (after a shrink, at least 'oldsize / 4'
+** strings are inserted before the table grows again)
+*/
+#if !defined(LUAI_STRTABSTEP)
+#define LUAI_STRTABSTEP		4
+#endif
+
+
+/*
+** 'luaS_hash' will use at most ~(2^LUAI_HASHLIMIT) bytes from a string
+** to compute its hash
 */
 #if !defined(LUAI_HASHLIMIT)
 #define LUAI_HASHLIMIT		5
@@ -37,13 +48,16 @@
 
 
 /*
-** equality for long strings
+** equality for long strings; when both already have their hashes
+** (e.g., table keys), different hashes tell them apart without reading
+** their contents
 */
 int luaS_eqlngstr (TString *a, TString *b) {
   size_t len = a->u.lnglen;
   lua_assert(a->tt == LUA_TLNGSTR && b->tt == LUA_TLNGSTR);
   return (a == b) ||  /* same instance or... */
     ((len == b->u.lnglen) &&  /* equal length and ... */
+     !((a->extra & b->extra & 1) && a->hash != b->hash) &&  /* hashes and */
      (memcmp(getstr(a), getstr(b), len) == 0));  /* equal contents */
 }
 
@@ -57,44 +71,169 @@ unsigned int luaS_hash (const char *str, size_t l, unsigned int seed) {
 }
 
 
-unsigned int luaS_hashlongstr (TString *ts) {
+/*
+** Keyed hash for short strings: HalfSipHash-1-3 (the 32-bit SipHash
+** variant used by the kernel's 'hsiphash'), consuming 4 bytes per round
+** and every byte of the string. With a random key, colliding strings
+** cannot be crafted without knowing the key.
+*/
+#define rotl32(x,n)	(((x) << (n)) | ((x) >> (32 - (n))))
+
+#define hsipround(v0,v1,v2,v3) { \
+  v0 += v1; v1 = rotl32(v1, 5); v1 ^= v0; v0 = rotl32(v0, 16); \
+  v2 += v3; v3 = rotl32(v3, 8); v3 ^= v2; \
+  v0 += v3; v3 = rotl32(v3, 7); v3 ^= v0; \
+  v2 += v1; v1 = rotl32(v1, 13); v1 ^= v2; v2 = rotl32(v2, 16); }
+
+unsigned int luaS_hashshort (const char *str, size_t l,
+                             const unsigned int *key) {
+  unsigned int v0 = key[0];
+  unsigned int v1 = key[1];
+  unsigned int v2 = key[0] ^ 0x6c796765u;
+  unsigned int v3 = key[1] ^ 0x74656462u;
+  unsigned int b = cast(unsigned int, l) << 24;
+  unsigned int m;
+  for (; l >= 4; l -= 4, str += 4) {
+    memcpy(&m, str, 4);  /* (compiles to a single, maybe unaligned, load) */
+    v3 ^= m;
+    hsipround(v0, v1, v2, v3);
+    v0 ^= m;
+  }
+  switch (l) {  /* last 0-3 bytes */
+    case 3: b |= cast(unsigned int, cast_byte(str[2])) << 16;  /* FALLTHROUGH */
+    case 2: b |= cast(unsigned int, cast_byte(str[1])) << 8;  /* FALLTHROUGH */
+    case 1: b |= cast_byte(str[0]);
+  }
+  v3 ^= b;
+  hsipround(v0, v1, v2, v3);
+  v0 ^= b;
+  v2 ^= 0xff;
+  hsipround(v0, v1, v2, v3);
+  hsipround(v0, v1, v2, v3);
+  hsipround(v0, v1, v2, v3);
+  return v1 ^ v3;
+}
+
+
+/*
+** Hash of a long string, computed when it is first needed (usually when
+** the string becomes a table key) and kept in the string. It uses every
+** byte, as 'luaS_hashshort' does, so that strings that differ only in a
+** few bytes (such as digests or payloads with a common header) do not
+** collide, and with the same key ('hashkey' of the state of 'L'); until
+** then, 'hash' holds the seed of the state.
+*/
+unsigned int luaS_hashlongstr (lua_State *L, TString *ts) {
   lua_assert(ts->tt == LUA_TLNGSTR);
-  if (ts->extra == 0) {  /* no hash? */
-    ts->hash = luaS_hash(getstr(ts), ts->u.lnglen, ts->hash);
-    ts->extra = 1;  /* now it has its hash */
+  if (!(ts->extra & 1)) {  /* no hash? */
+    ts->hash = luaS_hashshort(getstr(ts), ts->u.lnglen, G(L)->hashkey);
+    ts->extra |= 1;  /* now it has its hash */
   }
   return ts->hash;
 }
 
 
 /*
-** resizes the string table
+** move the strings of bucket 'i' of the old string table to the new one
+*/
+static void movebucket (stringtable *tb, int i) {
+  TString *p = tb->oldhash[i];
+  tb->oldhash[i] = NULL;
+  while (p) {  /* for each node in the list */
+    TString *hnext = p->u.hnext;  /* save next */
+    unsigned int h = lmod(p->hash, tb->size);  /* new position */
+    p->u.hnext = tb->hash[h];  /* chain it */
+    tb->hash[h] = p;
+    p = hnext;
+  }
+}
+
+
+/*
+** move up to 'n' buckets of an ongoing resize of the string table;
+** frees the old buckets when all of them were moved
+*/
+void luaS_rehashstep (lua_State *L, int n) {
+  stringtable *tb = &G(L)->strt;
+  if (tb->oldhash == NULL) return;  /* no resize going on */
+  for (; n > 0 && tb->rehash < tb->oldsize; n--)
+    movebucket(tb, tb->rehash++);
+  if (tb->rehash == tb->oldsize) {  /* done? */
+    luaM_freearray(L, tb->oldhash, tb->oldsize);
+    tb->oldhash = NULL;
+    tb->oldsize = tb->rehash = 0;
+  }
+}
+
+
+/*
+** resizes the string table. The strings are moved to the new buckets
+** incrementally, by 'luaS_rehashstep', and until then lookups probe both
+** tables. Shrinking is called by the collector, so it cannot raise errors
+** nor collect: if the allocation fails, the table keeps its size.
 */
 void luaS_resize (lua_State *L, int newsize) {
+  global_State *g = G(L);
+  stringtable *tb = &g->strt;
+  TString **newhash;
   int i;
-  stringtable *tb = &G(L)->strt;
-  if (newsize > tb->size) {  /* grow table if needed */
-    luaM_reallocvector(L, tb->hash, tb->size, newsize, TString *);
-    for (i = tb->size; i < newsize; i++)
-      tb->hash[i] = NULL;
+  if (newsize < tb->size) {  /* shrink? */
+    size_t sz = cast(size_t, newsize) * sizeof(TString *);
+    newhash = cast(TString **, (*g->frealloc)(g->ud, NULL, 0, sz));
+    if (newhash == NULL) return;  /* try again later */
+    g->GCdebt += sz;
+  }
+  else
+    newhash = luaM_newvector(L, newsize, TString *);
+  for (i = 0; i < newsize; i++)
+    newhash[i] = NULL;
+  luaS_rehashstep(L, tb->oldsize);  /* finish previous resize */
+  luai_tracestrt(L, tb->size, newsize);
+  if (tb->size > 0) {  /* current buckets become the old ones */
+    tb->oldhash = tb->hash;
+    tb->oldsize = tb->size;
+    tb->rehash = 0;
   }
-  for (i = 0; i < tb->size; i++) {  /* rehash */
+  tb->hash = newhash;
+  tb->size = newsize;
+}
+
+
+/*
+** Replace the hash keys of the state by 'seed' and 'key', rehashing its
+** short strings in place. Tables keep the positions of their keys, so
+** this is only valid in a state with no strings used as table keys nor
+** long strings with a hash (as a state that was just created, before
+** 'lua_clonestate' gives it the keys of the state being cloned).
+*/
+void luaS_rekey (lua_State *L, unsigned int seed, const unsigned int *key) {
+  global_State *g = G(L);
+  stringtable *tb = &g->strt;
+  TString *list = NULL;
+  int i;
+  luaS_rehashstep(L, tb->oldsize);  /* finish any resize */
+  g->seed = seed;
+  g->hashkey[0] = key[0];
+  g->hashkey[1] = key[1];
+  for (i = 0; i < tb->size; i++) {  /* unlink all strings */
     TString *p = tb->hash[i];
     tb->hash[i] = NULL;
-    while (p) {  /* for each node in the list */
-      TString *hnext = p->u.hnext;  /* save next */
-      unsigned int h = lmod(p->hash, newsize);  /* new position */
-      p->u.hnext = tb->hash[h];  /* chain it */
-      tb->hash[h] = p;
+    while (p) {
+      TString *hnext = p->u.hnext;
+      p->u.hnext = list;
+      list = p;
       p = hnext;
     }
   }
-  if (newsize < tb->size) {  /* shrink table if needed */
-    /* vanishing slice should be empty */
-    lua_assert(tb->hash[newsize] == NULL && tb->hash[tb->size - 1] == NULL);
-    luaM_reallocvector(L, tb->hash, tb->size, newsize, TString *);
+  while (list) {  /* insert them back with their new hashes */
+    TString *hnext = list->u.hnext;
+    unsigned int h;
+    list->hash = luaS_hashshort(getstr(list), list->shrlen, g->hashkey);
+    h = lmod(list->hash, tb->size);
+    list->u.hnext = tb->hash[h];
+    tb->hash[h] = list;
+    list = hnext;
   }
-  tb->size = newsize;
 }
 
 
@@ -103,12 +242,28 @@ void luaS_resize (lua_State *L, int newsize) {
 ** a non-collectable string.)
 */
 void luaS_clearcache (global_State *g) {
-  int i, j;
-  for (i = 0; i < STRCACHE_N; i++)
-    for (j = 0; j < STRCACHE_M; j++) {
-    if (iswhite(g->strcache[i][j]))  /* will entry be collected? */
-      g->strcache[i][j] = g->memerrmsg;  /* replace it with something fixed */
-    }
+  int i;
+  for (i = 0; i < g->strcachen * g->strcachem; i++) {
+    if (iswhite(g->strcache[i]))  /* will entry be collected? */
+      g->strcache[i] = g->memerrmsg;  /* replace it with something fixed */
+  }
+}
+
+
+/*
+** Replace the API string cache by one with 'n' sets of 'm' entries
+*/
+void luaS_resizecache (lua_State *L, int n, int m) {
+  global_State *g = G(L);
+  TString **cache = luaM_newvector(L, n * m, TString *);
+  int i;
+  for (i = 0; i < n * m; i++)  /* fill cache with valid strings */
+    cache[i] = g->memerrmsg;
+  luaM_freearray(L, g->strcache, g->strcachen * g->strcachem);
+  g->strcache = cache;
+  g->strcachen = n;
+  g->strcachem = m;
+  g->strcachehits = g->strcachemisses = 0;
 }
 
 
@@ -117,14 +272,11 @@ void luaS_clearcache (global_State *g) {
 */
 void luaS_init (lua_State *L) {
   global_State *g = G(L);
-  int i, j;
   luaS_resize(L, MINSTRTABSIZE);  /* initial size of string table */
   /* pre-create memory-error message */
   g->memerrmsg = luaS_newliteral(L, MEMERRMSG);
   luaC_fix(L, obj2gco(g->memerrmsg));  /* it should never be collected */
-  for (i = 0; i < STRCACHE_N; i++)  /* fill cache with valid strings */
-    for (j = 0; j < STRCACHE_M; j++)
-      g->strcache[i][j] = g->memerrmsg;
+  luaS_resizecache(L, STRCACHE_N, STRCACHE_M);
 }
 
 
@@ -153,38 +305,92 @@ TString *luaS_createlngstrobj (lua_State *L, size_t l) {
 }
 
 
+/*
+** creates a long string over external memory ('s[l]' must be '\0');
+** 'l' must be larger than LUAI_MAXSHORTLEN, as short strings are always
+** internalized
+*/
+TString *luaS_newextstr (lua_State *L, const char *s, size_t l,
+                         lua_Release release, void *ud) {
+  GCObject *o = luaC_newobj(L, LUA_TLNGSTR, sizeextstring);
+  TString *ts = gco2ts(o);
+  ExtString *es = getextstr(ts);
+  lua_assert(l > LUAI_MAXSHORTLEN && s[l] == '\0');
+  ts->hash = G(L)->seed;
+  ts->extra = EXTSTRBIT;
+  ts->u.lnglen = l;
+  es->contents = s;
+  es->release = release;
+  es->ud = ud;
+  return ts;
+}
+
+
+void luaS_freelngstr (lua_State *L, TString *ts) {
+  if (isextstr(ts)) {
+    ExtString *es = getextstr(ts);
+    if (es->release != NULL)
+      (*es->release)(es->ud, es->contents, ts->u.lnglen);
+  }
+  luaM_freemem(L, ts, sizelngstr(ts));
+}
+
+
 void luaS_remove (lua_State *L, TString *ts) {
   stringtable *tb = &G(L)->strt;
   TString **p = &tb->hash[lmod(ts->hash, tb->size)];
-  while (*p != ts)  /* find previous element */
+  while (*p != ts && *p != NULL)  /* find previous element */
     p = &(*p)->u.hnext;
+  if (*p == NULL) {  /* not moved yet? */
+    lua_assert(tb->oldhash != NULL);
+    p = &tb->oldhash[lmod(ts->hash, tb->oldsize)];
+    while (*p != ts)
+      p = &(*p)->u.hnext;
+  }
   *p = (*p)->u.hnext;  /* remove element from its list */
   tb->nuse--;
 }
 
 
+static TString *findshrstr (TString *ts, const char *str, size_t l,
+                            unsigned int h) {
+  for (; ts != NULL; ts = ts->u.hnext) {
+    if (h == ts->hash && l == ts->shrlen &&
+        (memcmp(str, getstr(ts), l * sizeof(char)) == 0))
+      break;  /* found! */
+  }
+  return ts;
+}
+
+
 /*
 ** checks whether short string exists and reuses it or creates a new one
 */
-static TString *internshrstr (lua_State *L, const char *str, size_t l) {
+static TString *internshrstr (lua_State *L, const char *str, size_t l,
+                              unsigned int h) {
   TString *ts;
   global_State *g = G(L);
-  unsigned int h = luaS_hash(str, l, g->seed);
-  TString **list = &g->strt.hash[lmod(h, g->strt.size)];
+  stringtable *tb = &g->strt;
+  TString **list;
   lua_assert(str != NULL);  /* otherwise 'memcmp'/'memcpy' are undefined */
-  for (ts = *list; ts != NULL; ts = ts->u.hnext) {
-    if (l == ts->shrlen &&
-        (memcmp(str, getstr(ts), l * sizeof(char)) == 0)) {
-      /* found! */
-      if (isdead(g, ts))  /* dead (but not collected yet)? */
-        changewhite(ts);  /* resurrect it */
-      return ts;
+  ts = findshrstr(tb->hash[lmod(h, tb->size)], str, l, h);
+  if (ts == NULL && tb->oldhash != NULL)  /* resizing? */
+    ts = findshrstr(tb->oldhash[lmod(h, tb->oldsize)], str, l, h);
+  if (ts != NULL) {
+    if (isdead(g, ts))  /* dead (but not collected yet)? */
+      changewhite(ts);  /* resurrect it */
+    if (islocal(ts)) {
+      if (!g->regionbits)  /* region closed for the parser? */
+        setescaped(ts);  /* it may be stored with no barrier */
+      else  /* 'L' may not have created region objects */
+        luaC_regionthread(g, L);
     }
+    return ts;
   }
-  if (g->strt.nuse >= g->strt.size && g->strt.size <= MAX_INT/2) {
-    luaS_resize(L, g->strt.size * 2);
-    list = &g->strt.hash[lmod(h, g->strt.size)];  /* recompute with new size */
-  }
+  luaS_rehashstep(L, LUAI_STRTABSTEP);
+  if (tb->nuse >= tb->size && tb->size <= MAX_INT/2)
+    luaS_resize(L, tb->size * 2);
+  list = &tb->hash[lmod(h, tb->size)];
   ts = createstrobj(L, l, LUA_TSHRSTR, h);
   memcpy(getstr(ts), str, l * sizeof(char));
   ts->shrlen = cast_byte(l);
@@ -195,12 +401,23 @@ static TString *internshrstr (lua_State *L, const char *str, size_t l) {
 }
 
 
+/*
+** short string with an already known hash (computed with the hash keys
+** of the state, as when copying strings in 'lua_clonestate')
+*/
+TString *luaS_newshrhash (lua_State *L, const char *str, size_t l,
+                          unsigned int h) {
+  lua_assert(l <= LUAI_MAXSHORTLEN);
+  return internshrstr(L, str, l, h);
+}
+
+
 /*
 ** new string (with explicit length)
 */
 TString *luaS_newlstr (lua_State *L, const char *str, size_t l) {
   if (l <= LUAI_MAXSHORTLEN)  /* short string? */
-    return internshrstr(L, str, l);
+    return internshrstr(L, str, l, luaS_hashshort(str, l, G(L)->hashkey));
   else {
     TString *ts;
     if (l >= (MAX_SIZE - sizeof(TString))/sizeof(char))
@@ -216,22 +433,31 @@ TString *luaS_newlstr (lua_State *L, const char *str, size_t l) {
 ** Create or reuse a zero-terminated string, first checking in the
 ** cache (using the string address as a key). The cache can contain
 ** only zero-terminated strings, so it is safe to use 'strcmp' to
-** check hits.
+** check hits. Strings local to a region are not cached, as the cache
+** does not keep them alive.
 */
 TString *luaS_new (lua_State *L, const char *str) {
-  unsigned int i = point2uint(str) % STRCACHE_N;  /* hash */
+  global_State *g = G(L);
+  unsigned int i = point2uint(str) % cast(unsigned int, g->strcachen);
   int j;
-  TString **p = G(L)->strcache[i];
-  for (j = 0; j < STRCACHE_M; j++) {
-    if (strcmp(str, getstr(p[j])) == 0)  /* hit? */
+  TString *ts;
+  TString **p = &g->strcache[i * g->strcachem];  /* set of 'str' */
+  for (j = 0; j < g->strcachem; j++) {
+    if (strcmp(str, getstr(p[j])) == 0) {  /* hit? */
+      g->strcachehits++;
       return p[j];  /* that is it */
+    }
   }
   /* normal route */
-  for (j = STRCACHE_M - 1; j > 0; j--)
+  g->strcachemisses++;
+  ts = luaS_newlstr(L, str, strlen(str));
+  if (islocal(ts))  /* freed at the end of the region? */
+    return ts;  /* do not cache it */
+  for (j = g->strcachem - 1; j > 0; j--)
     p[j] = p[j - 1];  /* move out last element */
   /* new element is first in the list */
-  p[0] = luaS_newlstr(L, str, strlen(str));
-  return p[0];
+  p[0] = ts;
+  return ts;
 }
 
 
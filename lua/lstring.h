@@ -13,6 +13,11 @@
 
 
 #define sizelstring(l)  (sizeof(union UTString) + ((l) + 1) * sizeof(char))
+#define sizeextstring	(sizeof(union UTString) + sizeof(ExtString))
+
+/* size of a long string object */
+#define sizelngstr(ts)	(isextstr(ts) ? sizeextstring \
+                                      : sizelstring((ts)->u.lnglen))
 
 #define sizeludata(l)	(sizeof(union UUdata) + (l))
 #define sizeudata(u)	sizeludata((u)->len)
@@ -34,16 +39,27 @@
 
 
 LUAI_FUNC unsigned int luaS_hash (const char *str, size_t l, unsigned int seed);
-LUAI_FUNC unsigned int luaS_hashlongstr (TString *ts);
+LUAI_FUNC unsigned int luaS_hashshort (const char *str, size_t l,
+                                       const unsigned int *key);
+LUAI_FUNC unsigned int luaS_hashlongstr (lua_State *L, TString *ts);
 LUAI_FUNC int luaS_eqlngstr (TString *a, TString *b);
 LUAI_FUNC void luaS_resize (lua_State *L, int newsize);
+LUAI_FUNC void luaS_rehashstep (lua_State *L, int n);
+LUAI_FUNC void luaS_rekey (lua_State *L, unsigned int seed,
+                          const unsigned int *key);
 LUAI_FUNC void luaS_clearcache (global_State *g);
+LUAI_FUNC void luaS_resizecache (lua_State *L, int n, int m);
 LUAI_FUNC void luaS_init (lua_State *L);
 LUAI_FUNC void luaS_remove (lua_State *L, TString *ts);
 LUAI_FUNC Udata *luaS_newudata (lua_State *L, size_t s);
 LUAI_FUNC TString *luaS_newlstr (lua_State *L, const char *str, size_t l);
+LUAI_FUNC TString *luaS_newshrhash (lua_State *L, const char *str, size_t l,
+                                   unsigned int h);
 LUAI_FUNC TString *luaS_new (lua_State *L, const char *str);
 LUAI_FUNC TString *luaS_createlngstrobj (lua_State *L, size_t l);
+LUAI_FUNC TString *luaS_newextstr (lua_State *L, const char *s, size_t l,
+                                   lua_Release release, void *ud);
+LUAI_FUNC void luaS_freelngstr (lua_State *L, TString *ts);
 
 
 #endif
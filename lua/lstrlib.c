@@ -136,7 +136,8 @@ static int str_rep (lua_State *L) {
   else {
     size_t totallen = (size_t)n * l + (size_t)(n - 1) * lsep;
     luaL_Buffer b;
-    char *p = luaL_buffinitsize(L, &b, totallen);
+    char *res = lua_pushlongstring(L, totallen);  /* build it in place? */
+    char *p = (res != NULL) ? res : luaL_buffinitsize(L, &b, totallen);
     while (n-- > 1) {  /* first n-1 copies (followed by separator) */
       memcpy(p, s, l * sizeof(char)); p += l;
       if (lsep > 0) {  /* empty 'memcpy' is not that cheap */
@@ -145,7 +146,8 @@ static int str_rep (lua_State *L) {
       }
     }
     memcpy(p, s, l * sizeof(char));  /* last copy (not followed by separator) */
-    luaL_pushresultsize(&b, totallen);
+    if (res == NULL)
+      luaL_pushresultsize(&b, totallen);
   }
   return 1;
 }
@@ -531,10 +533,55 @@ static const char *match (MatchState *ms, const char *s, const char *p) {
 
 
 
+/*
+** Needles at least this long are searched with Horspool's algorithm
+** in subjects at least 'LMEMFIND_MINSUBJECT' bytes long; shorter
+** searches use 'memchr' for the first character plus 'memcmp', which
+** do not pay for the setup of the shift table.
+*/
+#if !defined(LMEMFIND_HORSPOOL)
+#define LMEMFIND_HORSPOOL	8
+#endif
+
+#define LMEMFIND_MINSUBJECT	256
+
+
+/*
+** Horspool search: compare the last character of 's2' first and, on
+** a mismatch, shift by the distance from the last occurrence in 's2'
+** of the subject character under that position to the end of 's2'.
+** Shifts are kept in bytes; larger ones are clipped, which is safe.
+*/
+static const char *horspool (const char *s1, size_t l1,
+                             const char *s2, size_t l2) {
+  unsigned char shift[UCHAR_MAX + 1];
+  size_t i;
+  size_t last = l2 - 1;
+  int dflt = (l2 < UCHAR_MAX) ? (int)l2 : UCHAR_MAX;
+  const char *e = s1 + (l1 - l2);  /* last possible start */
+  memset(shift, dflt, sizeof(shift));
+  for (i = 0; i < last; i++) {
+    size_t d = last - i;
+    shift[uchar(s2[i])] = (d < UCHAR_MAX) ? (unsigned char)d : UCHAR_MAX;
+  }
+  while (s1 <= e) {
+    int c = uchar(s1[last]);
+    if (c == uchar(s2[last]) && memcmp(s1, s2, last) == 0)
+      return s1;
+    if ((size_t)(e - s1) < shift[c])
+      break;
+    s1 += shift[c];
+  }
+  return NULL;  /* not found */
+}
+
+
 static const char *lmemfind (const char *s1, size_t l1,
                                const char *s2, size_t l2) {
   if (l2 == 0) return s1;  /* empty strings are everywhere */
   else if (l2 > l1) return NULL;  /* avoids a negative 'l1' */
+  else if (l2 >= LMEMFIND_HORSPOOL && l1 >= LMEMFIND_MINSUBJECT)
+    return horspool(s1, l1, s2, l2);
   else {
     const char *init;  /* to search for a '*s2' inside 's1' */
     l2--;  /* 1st char will be checked by 'memchr' */
@@ -594,6 +641,149 @@ static int nospecials (const char *p, size_t l) {
 }
 
 
+/*
+** {======================================================
+** Cache of pattern information
+** =======================================================
+*/
+
+/*
+** 'find', 'match', 'gmatch', and 'gsub' share a direct-mapped cache
+** (their first upvalue) with what can be learned from a pattern
+** before matching it: whether it has special characters, whether it
+** is anchored, and its literal prefix, i.e., the characters that any
+** match must start with. Unanchored searches use the prefix to skip
+** straight to the positions where a match can start instead of trying
+** 'match' at every position. As in the cache of compiled formats,
+** entries are keyed by the pattern string itself (its address as given
+** by 'lua_topointer', not that of its contents, which external strings
+** may share), and the cache anchors it in its user value.
+*/
+
+#if !defined(LUAL_PATTCACHE)
+#define LUAL_PATTCACHE		16	/* number of entries */
+#endif
+
+#if !defined(LUAL_PATTPREFIX)
+#define LUAL_PATTPREFIX		15	/* maximum length of a literal prefix */
+#endif
+
+
+typedef struct PattInfo {
+  const void *key;  /* pattern string (NULL for an empty entry) */
+  unsigned char plain;  /* pattern has no special characters */
+  unsigned char anchor;  /* pattern starts with '^' */
+  unsigned char lprefix;  /* length of literal prefix */
+  char prefix[LUAL_PATTPREFIX];
+} PattInfo;
+
+
+typedef struct PattCache {
+  PattInfo entry[LUAL_PATTCACHE];
+} PattCache;
+
+
+/* a copy made by 'lua_clonestate' has other strings: empty it */
+static int pattcache_clone (lua_State *L) {
+  PattCache *pc = (PattCache *)lua_touserdata(L, 1);
+  int i;
+  for (i = 0; i < LUAL_PATTCACHE; i++)
+    pc->entry[i].key = NULL;
+  return 0;
+}
+
+
+/* sets a metatable with 'f' as '__clone' for the cache on the top */
+static void setcachemeta (lua_State *L, lua_CFunction f) {
+  lua_createtable(L, 0, 1);
+  lua_pushcfunction(L, f);
+  lua_setfield(L, -2, "__clone");
+  lua_setmetatable(L, -2);
+}
+
+
+static void newpattcache (lua_State *L) {
+  PattCache *pc = (PattCache *)lua_newuserdata(L, sizeof(PattCache));
+  int i;
+  for (i = 0; i < LUAL_PATTCACHE; i++)
+    pc->entry[i].key = NULL;
+  lua_createtable(L, LUAL_PATTCACHE, 0);  /* anchors cached patterns */
+  lua_setuservalue(L, -2);
+  setcachemeta(L, pattcache_clone);
+}
+
+
+/*
+** Collect the literal prefix of pattern 'p' (after its anchor): the
+** single characters (perhaps escaped) without a quantifier, plus one
+** more for a character followed by '+'. The scan stops at anything
+** else; in particular it never raises errors, which are left to the
+** matcher.
+*/
+static void analyzepattern (PattInfo *pi, const char *p, size_t lp) {
+  const char *pe = p + lp;
+  pi->plain = (unsigned char)nospecials(p, lp);
+  pi->anchor = (*p == '^');
+  pi->lprefix = 0;
+  if (pi->anchor) p++;
+  while (p < pe && pi->lprefix < LUAL_PATTPREFIX) {
+    int c = uchar(*p);
+    const char *ep = p + 1;  /* end of item */
+    if (c == L_ESC) {
+      if (ep == pe || isalnum(uchar(*ep)))
+        break;  /* class, '%b', '%f', back reference, or malformed */
+      c = uchar(*ep++);
+    }
+    else if (c == '\0' || strchr(SPECIALS ")", c) != NULL)
+      break;
+    if (ep < pe && (*ep == '*' || *ep == '?' || *ep == '-'))
+      break;  /* optional character */
+    pi->prefix[pi->lprefix++] = (char)c;
+    if (ep < pe && *ep == '+')
+      break;  /* rest of the repetition is not literal */
+    p = ep;
+  }
+}
+
+
+/*
+** Get the information about the pattern at index 2 (with length 'lp'),
+** analyzing and caching it if needed.
+*/
+static const PattInfo *getpattinfo (lua_State *L, size_t lp) {
+  PattCache *pc = (PattCache *)lua_touserdata(L, lua_upvalueindex(1));
+  const void *key = lua_topointer(L, 2);
+  size_t a = (size_t)key;
+  int i = (int)(((a >> 4) ^ (a >> 10)) % LUAL_PATTCACHE);
+  PattInfo *pi = &pc->entry[i];
+  if (pi->key != key) {  /* miss? */
+    analyzepattern(pi, lua_tostring(L, 2), lp);
+    lua_getuservalue(L, lua_upvalueindex(1));
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, i + 1);  /* anchor new key (releasing old one) */
+    lua_pop(L, 1);
+    pi->key = key;
+  }
+  return pi;
+}
+
+
+/*
+** Find the first position in [s, e) where a match for a pattern with
+** the (non empty) literal prefix of 'pi' can start, or NULL if there
+** is none.
+*/
+static const char *findprefix (const PattInfo *pi, const char *s,
+                                                   const char *e) {
+  if (pi->lprefix == 1)
+    return (const char *)memchr(s, uchar(pi->prefix[0]), e - s);
+  else
+    return lmemfind(s, e - s, pi->prefix, pi->lprefix);
+}
+
+/* }====================================================== */
+
+
 static void prepstate (MatchState *ms, lua_State *L,
                        const char *s, size_t ls, const char *p, size_t lp) {
   ms->L = L;
@@ -615,13 +805,14 @@ static int str_find_aux (lua_State *L, int find) {
   const char *s = luaL_checklstring(L, 1, &ls);
   const char *p = luaL_checklstring(L, 2, &lp);
   lua_Integer init = posrelat(luaL_optinteger(L, 3, 1), ls);
+  const PattInfo *pi = getpattinfo(L, lp);
   if (init < 1) init = 1;
   else if (init > (lua_Integer)ls + 1) {  /* start after string's end? */
     lua_pushnil(L);  /* cannot find anything */
     return 1;
   }
   /* explicit request or no special characters? */
-  if (find && (lua_toboolean(L, 4) || nospecials(p, lp))) {
+  if (find && (lua_toboolean(L, 4) || pi->plain)) {
     /* do a plain search */
     const char *s2 = lmemfind(s + init - 1, ls - (size_t)init + 1, p, lp);
     if (s2) {
@@ -633,13 +824,16 @@ static int str_find_aux (lua_State *L, int find) {
   else {
     MatchState ms;
     const char *s1 = s + init - 1;
-    int anchor = (*p == '^');
+    int anchor = pi->anchor;
+    int prefilter = (!anchor && pi->lprefix > 0);
     if (anchor) {
       p++; lp--;  /* skip anchor character */
     }
     prepstate(&ms, L, s, ls, p, lp);
     do {
       const char *res;
+      if (prefilter && (s1 = findprefix(pi, s1, ms.src_end)) == NULL)
+        break;  /* no more places where a match can start */
       reprepstate(&ms);
       if ((res=match(&ms, s1, p)) != NULL) {
         if (find) {
@@ -672,6 +866,7 @@ typedef struct GMatchState {
   const char *src;  /* current position */
   const char *p;  /* pattern */
   const char *lastmatch;  /* end of last match */
+  PattInfo pi;  /* information about the pattern */
   MatchState ms;  /* match state */
 } GMatchState;
 
@@ -682,6 +877,9 @@ static int gmatch_aux (lua_State *L) {
   gm->ms.L = L;
   for (src = gm->src; src <= gm->ms.src_end; src++) {
     const char *e;
+    if (gm->pi.lprefix > 0 &&
+        (src = findprefix(&gm->pi, src, gm->ms.src_end)) == NULL)
+      break;  /* no more places where a match can start */
     reprepstate(&gm->ms);
     if ((e = match(&gm->ms, src, gm->p)) != NULL && e != gm->lastmatch) {
       gm->src = gm->lastmatch = e;
@@ -696,11 +894,15 @@ static int gmatch (lua_State *L) {
   size_t ls, lp;
   const char *s = luaL_checklstring(L, 1, &ls);
   const char *p = luaL_checklstring(L, 2, &lp);
+  const PattInfo *pi = getpattinfo(L, lp);
   GMatchState *gm;
   lua_settop(L, 2);  /* keep them on closure to avoid being collected */
   gm = (GMatchState *)lua_newuserdata(L, sizeof(GMatchState));
   prepstate(&gm->ms, L, s, ls, p, lp);
   gm->src = s; gm->p = p; gm->lastmatch = NULL;
+  gm->pi = *pi;  /* copy it, as the entry may be reused */
+  if (pi->anchor)  /* 'gmatch' does not anchor; '^' is a literal there */
+    gm->pi.lprefix = 0;
   lua_pushcclosure(L, gmatch_aux, 3);
   return 1;
 }
@@ -772,7 +974,9 @@ static int str_gsub (lua_State *L) {
   const char *lastmatch = NULL;  /* end of last match */
   int tr = lua_type(L, 3);  /* replacement type */
   lua_Integer max_s = luaL_optinteger(L, 4, srcl + 1);  /* max replacements */
-  int anchor = (*p == '^');
+  PattInfo pi = *getpattinfo(L, lp);  /* (replacements may reuse entry) */
+  int anchor = pi.anchor;
+  int prefilter = (!anchor && pi.lprefix > 0);
   lua_Integer n = 0;  /* replacement count */
   MatchState ms;
   luaL_Buffer b;
@@ -786,6 +990,12 @@ static int str_gsub (lua_State *L) {
   prepstate(&ms, L, src, srcl, p, lp);
   while (n < max_s) {
     const char *e;
+    if (prefilter) {  /* copy what cannot start a match */
+      const char *c = findprefix(&pi, src, ms.src_end);
+      if (c == NULL) c = ms.src_end;
+      luaL_addlstring(&b, src, c - src);
+      src = c;
+    }
     reprepstate(&ms);  /* (re)prepare state for new match */
     if ((e = match(&ms, src, p)) != NULL && e != lastmatch) {  /* match? */
       n++;
@@ -1029,8 +1239,18 @@ static int str_format (lua_State *L) {
   size_t sfl;
   const char *strfrmt = luaL_checklstring(L, arg, &sfl);
   const char *strfrmt_end = strfrmt+sfl;
+  size_t hint = sfl;  /* guess of the result length */
   luaL_Buffer b;
-  luaL_buffinit(L, &b);
+  for (arg = 2; arg <= top; arg++) {  /* count strings to be formatted */
+    if (lua_type(L, arg) == LUA_TSTRING) {
+      size_t l = lua_rawlen(L, arg);
+      if (l > MAXSIZE - hint)
+        break;
+      hint += l;
+    }
+  }
+  arg = 1;
+  luaL_buffinitsize(L, &b, hint);
   while (strfrmt < strfrmt_end) {
     if (*strfrmt != L_ESC)
       luaL_addchar(&b, *strfrmt++);
@@ -1051,6 +1271,10 @@ static int str_format (lua_State *L) {
         case 'd': case 'i':
         case 'o': case 'u': case 'x': case 'X': {
           lua_Integer n = luaL_checkinteger(L, arg);
+          if (form[2] == '\0' && (form[1] == 'd' || form[1] == 'i')) {
+            nb = lua_integer2buff(buff, n);  /* plain decimal */
+            break;
+          }
           addlenmod(form, LUA_INTEGER_FRMLEN);
           nb = l_sprintf(buff, MAX_ITEM, form, (LUAI_UACINT)n);
           break;
@@ -1281,16 +1505,16 @@ static KOption getoption (Header *h, const char **fmt, int *size) {
 
 
 /*
-** Read, classify, and fill other details about the next option.
-** 'psize' is filled with option's size, 'notoalign' with its
-** alignment requirements.
-** Local variable 'size' gets the size to be aligned. (Kpadal option
+** Read and classify the next option, filling its size in 'psize' and
+** its alignment in 'palign' (always a power of 2; 1 when the option
+** needs no alignment).
+** Local variable 'align' gets the size to be aligned. (Kpadal option
 ** always gets its full alignment, other options are limited by
 ** the maximum alignment ('maxalign'). Kchar option needs no alignment
 ** despite its size.
 */
-static KOption getdetails (Header *h, size_t totalsize,
-                           const char **fmt, int *psize, int *ntoalign) {
+static KOption getoptalign (Header *h, const char **fmt,
+                            int *psize, int *palign) {
   KOption opt = getoption(h, fmt, psize);
   int align = *psize;  /* usually, alignment follows size */
   if (opt == Kpaddalign) {  /* 'X' gets alignment from following option */
@@ -1298,18 +1522,179 @@ static KOption getdetails (Header *h, size_t totalsize,
       luaL_argerror(h->L, 1, "invalid next option for option 'X'");
   }
   if (align <= 1 || opt == Kchar)  /* need no alignment? */
-    *ntoalign = 0;
+    align = 1;
   else {
     if (align > h->maxalign)  /* enforce maximum alignment */
       align = h->maxalign;
     if ((align & (align - 1)) != 0)  /* is 'align' not a power of 2? */
       luaL_argerror(h->L, 1, "format asks for alignment not power of 2");
-    *ntoalign = (align - (int)(totalsize & (align - 1))) & (align - 1);
   }
+  *palign = align;
   return opt;
 }
 
 
+/* number of padding bytes to align 'pos' to 'align' */
+#define toalign(pos,align)	\
+	((int)(((align) - (int)((pos) & ((align) - 1))) & ((align) - 1)))
+
+
+/*
+** Read, classify, and fill other details about the next option.
+** 'psize' is filled with option's size, 'notoalign' with its
+** alignment requirements.
+*/
+static KOption getdetails (Header *h, size_t totalsize,
+                           const char **fmt, int *psize, int *ntoalign) {
+  int align;
+  KOption opt = getoptalign(h, fmt, psize, &align);
+  *ntoalign = toalign(totalsize, align);
+  return opt;
+}
+
+
+/*
+** {======================================================
+** Cache of compiled formats
+** =======================================================
+*/
+
+/*
+** 'pack', 'packsize', and 'unpack' share a direct-mapped cache of
+** compiled formats (their first upvalue). A compiled format is a list
+** of options with their sizes, alignments, and endianness already
+** solved, so calls with a cached format do not parse it again. Entries
+** are keyed by the format string itself (as given by 'lua_topointer');
+** the cache anchors each format it holds in its user value, so that
+** address cannot be reused by another string while the entry is alive.
+** As short strings are interned, all uses of a literal format share one
+** entry.
+*/
+
+#if !defined(LUAL_PACKCACHE)
+#define LUAL_PACKCACHE		16	/* number of entries */
+#endif
+
+#if !defined(LUAL_PACKCACHEOPS)
+#define LUAL_PACKCACHEOPS	16	/* maximum options in a cached format */
+#endif
+
+
+typedef struct PackOp {
+  unsigned char opt;  /* KOption */
+  unsigned char islittle;
+  unsigned char align;  /* a power of 2 (1 for no alignment) */
+  int size;
+} PackOp;
+
+
+/* what 'packsize' must do with a compiled format */
+#define PSFIXED		0	/* return 'packsize' */
+#define PSVARLEN	1	/* raise "variable-length format" */
+#define PSTOOLARGE	2	/* raise "format result too large" */
+
+typedef struct PackFormat {
+  const void *key;  /* format string (NULL for an empty entry) */
+  int nops;  /* number of options (-1 if format is too long to cache) */
+  int sizestatus;
+  size_t packsize;
+  PackOp op[LUAL_PACKCACHEOPS];
+} PackFormat;
+
+
+typedef struct PackCache {
+  PackFormat entry[LUAL_PACKCACHE];
+} PackCache;
+
+
+/* a copy made by 'lua_clonestate' has other strings: empty it */
+static int packcache_clone (lua_State *L) {
+  PackCache *pc = (PackCache *)lua_touserdata(L, 1);
+  int i;
+  for (i = 0; i < LUAL_PACKCACHE; i++)
+    pc->entry[i].key = NULL;
+  return 0;
+}
+
+
+static void newpackcache (lua_State *L) {
+  PackCache *pc = (PackCache *)lua_newuserdata(L, sizeof(PackCache));
+  int i;
+  for (i = 0; i < LUAL_PACKCACHE; i++)
+    pc->entry[i].key = NULL;
+  lua_createtable(L, LUAL_PACKCACHE, 0);  /* anchors cached formats */
+  lua_setuservalue(L, -2);
+  setcachemeta(L, packcache_clone);
+}
+
+
+/*
+** Compile format 'fmt' into 'pf', also computing what 'packsize'
+** would return for it. Noop options are dropped; endianness changes
+** are folded into the options that follow them. Returns 0 when the
+** format has too many options to fit in an entry.
+*/
+static int compileformat (Header *h, const char *fmt, PackFormat *pf) {
+  size_t totalsize = 0;
+  pf->nops = 0;
+  pf->sizestatus = PSFIXED;
+  while (*fmt != '\0') {
+    int size, align;
+    KOption opt = getoptalign(h, &fmt, &size, &align);
+    if (pf->sizestatus == PSFIXED) {  /* same steps as 'str_packsize' */
+      int sz = size + toalign(totalsize, align);
+      if (totalsize > MAXSIZE - sz)
+        pf->sizestatus = PSTOOLARGE;
+      else if (opt == Kstring || opt == Kzstr)
+        pf->sizestatus = PSVARLEN;
+      totalsize += sz;
+    }
+    if (opt == Knop)
+      continue;
+    if (pf->nops == LUAL_PACKCACHEOPS)
+      return 0;
+    pf->op[pf->nops].opt = (unsigned char)opt;
+    pf->op[pf->nops].islittle = (unsigned char)h->islittle;
+    pf->op[pf->nops].align = (unsigned char)align;
+    pf->op[pf->nops].size = size;
+    pf->nops++;
+  }
+  pf->packsize = totalsize;
+  return 1;
+}
+
+
+/*
+** Get the compiled form of the format at index 1, compiling and
+** caching it if needed. Returns NULL when the format cannot be
+** cached; the caller then interprets the format string itself. (Too
+** long formats are cached as such, so they are compiled only once.)
+*/
+static const PackFormat *getformat (lua_State *L) {
+  PackCache *pc = (PackCache *)lua_touserdata(L, lua_upvalueindex(1));
+  const char *fmt = luaL_checkstring(L, 1);
+  const void *key = lua_topointer(L, 1);
+  size_t p = (size_t)key;
+  int i = (int)(((p >> 4) ^ (p >> 10)) % LUAL_PACKCACHE);
+  PackFormat *pf = &pc->entry[i];
+  if (pf->key != key) {  /* miss? */
+    Header h;
+    pf->key = NULL;  /* entry is invalid while compiling */
+    initheader(L, &h);
+    if (!compileformat(&h, fmt, pf))
+      pf->nops = -1;
+    lua_getuservalue(L, lua_upvalueindex(1));
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, -2, i + 1);  /* anchor new key (releasing old one) */
+    lua_pop(L, 1);
+    pf->key = key;
+  }
+  return (pf->nops >= 0) ? pf : NULL;
+}
+
+/* }====================================================== */
+
+
 /*
 ** Pack integer 'n' with 'size' bytes and 'islittle' endianness.
 ** The final 'if' handles the case when 'size' is larger than
@@ -1353,88 +1738,113 @@ static void copywithendian (volatile char *dest, volatile const char *src,
 #endif /* _KERNEL */
 
 
+/*
+** Pack argument 'arg' as an item of kind 'opt' (after its alignment).
+** Variable-length items add their contents to 'totalsize'. Returns
+** whether the option consumed the argument.
+*/
+static int packitem (lua_State *L, luaL_Buffer *b, KOption opt, int size,
+                     int islittle, int arg, size_t *totalsize) {
+  switch (opt) {
+    case Kint: {  /* signed integers */
+      lua_Integer n = luaL_checkinteger(L, arg);
+      if (size < SZINT) {  /* need overflow check? */
+        lua_Integer lim = (lua_Integer)1 << ((size * NB) - 1);
+        luaL_argcheck(L, -lim <= n && n < lim, arg, "integer overflow");
+      }
+      packint(b, (lua_Unsigned)n, islittle, size, (n < 0));
+      return 1;
+    }
+    case Kuint: {  /* unsigned integers */
+      lua_Integer n = luaL_checkinteger(L, arg);
+      if (size < SZINT)  /* need overflow check? */
+        luaL_argcheck(L, (lua_Unsigned)n < ((lua_Unsigned)1 << (size * NB)),
+                         arg, "unsigned overflow");
+      packint(b, (lua_Unsigned)n, islittle, size, 0);
+      return 1;
+    }
+#ifndef _KERNEL
+    case Kfloat: {  /* floating-point options */
+      volatile Ftypes u;
+      char *buff = luaL_prepbuffsize(b, size);
+      lua_Number n = luaL_checknumber(L, arg);  /* get argument */
+      if (size == sizeof(u.f)) u.f = (float)n;  /* copy it into 'u' */
+      else if (size == sizeof(u.d)) u.d = (double)n;
+      else u.n = n;
+      /* move 'u' to final result, correcting endianness if needed */
+      copywithendian(buff, u.buff, size, islittle);
+      luaL_addsize(b, size);
+      return 1;
+    }
+#endif /* _KERNEL */
+    case Kchar: {  /* fixed-size string */
+      size_t len;
+      const char *s = luaL_checklstring(L, arg, &len);
+      luaL_argcheck(L, len <= (size_t)size, arg,
+                       "string longer than given size");
+      luaL_addlstring(b, s, len);  /* add string */
+      while (len++ < (size_t)size)  /* pad extra space */
+        luaL_addchar(b, LUAL_PACKPADBYTE);
+      return 1;
+    }
+    case Kstring: {  /* strings with length count */
+      size_t len;
+      const char *s = luaL_checklstring(L, arg, &len);
+      luaL_argcheck(L, size >= (int)sizeof(size_t) ||
+                       len < ((size_t)1 << (size * NB)),
+                       arg, "string length does not fit in given size");
+      packint(b, (lua_Unsigned)len, islittle, size, 0);  /* pack length */
+      luaL_addlstring(b, s, len);
+      *totalsize += len;
+      return 1;
+    }
+    case Kzstr: {  /* zero-terminated string */
+      size_t len;
+      const char *s = luaL_checklstring(L, arg, &len);
+      luaL_argcheck(L, strlen(s) == len, arg, "string contains zeros");
+      luaL_addlstring(b, s, len);
+      luaL_addchar(b, '\0');  /* add zero at the end */
+      *totalsize += len + 1;
+      return 1;
+    }
+    case Kpadding: luaL_addchar(b, LUAL_PACKPADBYTE);  /* FALLTHROUGH */
+    case Kpaddalign: case Knop:
+      break;
+  }
+  return 0;
+}
+
+
 static int str_pack (lua_State *L) {
   luaL_Buffer b;
-  Header h;
-  const char *fmt = luaL_checkstring(L, 1);  /* format string */
-  int arg = 1;  /* current argument to pack */
+  const PackFormat *pf = getformat(L);
+  int arg = 1;  /* last argument packed */
   size_t totalsize = 0;  /* accumulate total size of result */
-  initheader(L, &h);
   lua_pushnil(L);  /* mark to separate arguments from string buffer */
   luaL_buffinit(L, &b);
-  while (*fmt != '\0') {
-    int size, ntoalign;
-    KOption opt = getdetails(&h, totalsize, &fmt, &size, &ntoalign);
-    totalsize += ntoalign + size;
-    while (ntoalign-- > 0)
-     luaL_addchar(&b, LUAL_PACKPADBYTE);  /* fill alignment */
-    arg++;
-    switch (opt) {
-      case Kint: {  /* signed integers */
-        lua_Integer n = luaL_checkinteger(L, arg);
-        if (size < SZINT) {  /* need overflow check? */
-          lua_Integer lim = (lua_Integer)1 << ((size * NB) - 1);
-          luaL_argcheck(L, -lim <= n && n < lim, arg, "integer overflow");
-        }
-        packint(&b, (lua_Unsigned)n, h.islittle, size, (n < 0));
-        break;
-      }
-      case Kuint: {  /* unsigned integers */
-        lua_Integer n = luaL_checkinteger(L, arg);
-        if (size < SZINT)  /* need overflow check? */
-          luaL_argcheck(L, (lua_Unsigned)n < ((lua_Unsigned)1 << (size * NB)),
-                           arg, "unsigned overflow");
-        packint(&b, (lua_Unsigned)n, h.islittle, size, 0);
-        break;
-      }
-#ifndef _KERNEL
-      case Kfloat: {  /* floating-point options */
-        volatile Ftypes u;
-        char *buff = luaL_prepbuffsize(&b, size);
-        lua_Number n = luaL_checknumber(L, arg);  /* get argument */
-        if (size == sizeof(u.f)) u.f = (float)n;  /* copy it into 'u' */
-        else if (size == sizeof(u.d)) u.d = (double)n;
-        else u.n = n;
-        /* move 'u' to final result, correcting endianness if needed */
-        copywithendian(buff, u.buff, size, h.islittle);
-        luaL_addsize(&b, size);
-        break;
-      }
-#endif /* _KERNEL */
-      case Kchar: {  /* fixed-size string */
-        size_t len;
-        const char *s = luaL_checklstring(L, arg, &len);
-        luaL_argcheck(L, len <= (size_t)size, arg,
-                         "string longer than given size");
-        luaL_addlstring(&b, s, len);  /* add string */
-        while (len++ < (size_t)size)  /* pad extra space */
-          luaL_addchar(&b, LUAL_PACKPADBYTE);
-        break;
-      }
-      case Kstring: {  /* strings with length count */
-        size_t len;
-        const char *s = luaL_checklstring(L, arg, &len);
-        luaL_argcheck(L, size >= (int)sizeof(size_t) ||
-                         len < ((size_t)1 << (size * NB)),
-                         arg, "string length does not fit in given size");
-        packint(&b, (lua_Unsigned)len, h.islittle, size, 0);  /* pack length */
-        luaL_addlstring(&b, s, len);
-        totalsize += len;
-        break;
-      }
-      case Kzstr: {  /* zero-terminated string */
-        size_t len;
-        const char *s = luaL_checklstring(L, arg, &len);
-        luaL_argcheck(L, strlen(s) == len, arg, "string contains zeros");
-        luaL_addlstring(&b, s, len);
-        luaL_addchar(&b, '\0');  /* add zero at the end */
-        totalsize += len + 1;
-        break;
-      }
-      case Kpadding: luaL_addchar(&b, LUAL_PACKPADBYTE);  /* FALLTHROUGH */
-      case Kpaddalign: case Knop:
-        arg--;  /* undo increment */
-        break;
+  if (pf != NULL) {  /* compiled format? */
+    int i;
+    for (i = 0; i < pf->nops; i++) {
+      const PackOp *op = &pf->op[i];
+      int ntoalign = toalign(totalsize, op->align);
+      totalsize += ntoalign + op->size;
+      while (ntoalign-- > 0)
+        luaL_addchar(&b, LUAL_PACKPADBYTE);  /* fill alignment */
+      arg += packitem(L, &b, (KOption)op->opt, op->size, op->islittle,
+                         arg + 1, &totalsize);
+    }
+  }
+  else {
+    Header h;
+    const char *fmt = lua_tostring(L, 1);  /* format string */
+    initheader(L, &h);
+    while (*fmt != '\0') {
+      int size, ntoalign;
+      KOption opt = getdetails(&h, totalsize, &fmt, &size, &ntoalign);
+      totalsize += ntoalign + size;
+      while (ntoalign-- > 0)
+       luaL_addchar(&b, LUAL_PACKPADBYTE);  /* fill alignment */
+      arg += packitem(L, &b, opt, size, h.islittle, arg + 1, &totalsize);
     }
   }
   luaL_pushresult(&b);
@@ -1444,8 +1854,17 @@ static int str_pack (lua_State *L) {
 
 static int str_packsize (lua_State *L) {
   Header h;
-  const char *fmt = luaL_checkstring(L, 1);  /* format string */
+  const PackFormat *pf = getformat(L);
+  const char *fmt = lua_tostring(L, 1);  /* format string */
   size_t totalsize = 0;  /* accumulate total size of result */
+  if (pf != NULL) {  /* compiled format? */
+    luaL_argcheck(L, pf->sizestatus != PSTOOLARGE, 1,
+                     "format result too large");
+    luaL_argcheck(L, pf->sizestatus != PSVARLEN, 1,
+                     "variable-length format");
+    lua_pushinteger(L, (lua_Integer)pf->packsize);
+    return 1;
+  }
   initheader(L, &h);
   while (*fmt != '\0') {
     int size, ntoalign;
@@ -1501,66 +1920,101 @@ static lua_Integer unpackint (lua_State *L, const char *str,
 }
 
 
+/*
+** Unpack an item of kind 'opt' at position '*pos' of 'data' (after
+** its alignment). Variable-length items skip their contents in '*pos'.
+** Returns the number of values pushed.
+*/
+static int unpackitem (lua_State *L, const char *data, size_t ld,
+                       KOption opt, int size, int islittle, size_t *pos) {
+  switch (opt) {
+    case Kint:
+    case Kuint: {
+      lua_Integer res = unpackint(L, data + *pos, islittle, size,
+                                     (opt == Kint));
+      lua_pushinteger(L, res);
+      return 1;
+    }
+#ifndef _KERNEL
+    case Kfloat: {
+      volatile Ftypes u;
+      lua_Number num;
+      copywithendian(u.buff, data + *pos, size, islittle);
+      if (size == sizeof(u.f)) num = (lua_Number)u.f;
+      else if (size == sizeof(u.d)) num = (lua_Number)u.d;
+      else num = u.n;
+      lua_pushnumber(L, num);
+      return 1;
+    }
+#endif /* _KERNEL */
+    case Kchar: {
+      lua_pushlstring(L, data + *pos, size);
+      return 1;
+    }
+    case Kstring: {
+      size_t len = (size_t)unpackint(L, data + *pos, islittle, size, 0);
+      luaL_argcheck(L, *pos + len + size <= ld, 2, "data string too short");
+      lua_pushlstring(L, data + *pos + size, len);
+      *pos += len;  /* skip string */
+      return 1;
+    }
+    case Kzstr: {
+      size_t len = (int)strlen(data + *pos);
+      lua_pushlstring(L, data + *pos, len);
+      *pos += len + 1;  /* skip string plus final '\0' */
+      return 1;
+    }
+    case Kpaddalign: case Kpadding: case Knop:
+      break;
+  }
+  return 0;
+}
+
+
 static int str_unpack (lua_State *L) {
-  Header h;
-  const char *fmt = luaL_checkstring(L, 1);
+  const PackFormat *pf = getformat(L);
   size_t ld;
   const char *data = luaL_checklstring(L, 2, &ld);
   size_t pos = (size_t)posrelat(luaL_optinteger(L, 3, 1), ld) - 1;
   int n = 0;  /* number of results */
   luaL_argcheck(L, pos <= ld, 3, "initial position out of string");
-  initheader(L, &h);
-  while (*fmt != '\0') {
-    int size, ntoalign;
-    KOption opt = getdetails(&h, pos, &fmt, &size, &ntoalign);
-    if ((size_t)ntoalign + size > ~pos || pos + ntoalign + size > ld)
-      luaL_argerror(L, 2, "data string too short");
-    pos += ntoalign;  /* skip alignment */
-    /* stack space for item + next position */
-    luaL_checkstack(L, 2, "too many results");
-    n++;
-    switch (opt) {
-      case Kint:
-      case Kuint: {
-        lua_Integer res = unpackint(L, data + pos, h.islittle, size,
-                                       (opt == Kint));
-        lua_pushinteger(L, res);
-        break;
-      }
-#ifndef _KERNEL
-      case Kfloat: {
-        volatile Ftypes u;
-        lua_Number num;
-        copywithendian(u.buff, data + pos, size, h.islittle);
-        if (size == sizeof(u.f)) num = (lua_Number)u.f;
-        else if (size == sizeof(u.d)) num = (lua_Number)u.d;
-        else num = u.n;
-        lua_pushnumber(L, num);
-        break;
-      }
-#endif /* _KERNEL */
-      case Kchar: {
-        lua_pushlstring(L, data + pos, size);
-        break;
-      }
-      case Kstring: {
-        size_t len = (size_t)unpackint(L, data + pos, h.islittle, size, 0);
-        luaL_argcheck(L, pos + len + size <= ld, 2, "data string too short");
-        lua_pushlstring(L, data + pos + size, len);
-        pos += len;  /* skip string */
-        break;
-      }
-      case Kzstr: {
-        size_t len = (int)strlen(data + pos);
-        lua_pushlstring(L, data + pos, len);
-        pos += len + 1;  /* skip string plus final '\0' */
-        break;
+  if (pf != NULL) {  /* compiled format? */
+    int i;
+    /* stack space for all items + next position */
+    luaL_checkstack(L, pf->nops + 1, "too many results");
+    for (i = 0; i < pf->nops; i++) {
+      const PackOp *op = &pf->op[i];
+      int size = op->size;
+      int ntoalign = toalign(pos, op->align);
+      if ((size_t)ntoalign + size > ~pos || pos + ntoalign + size > ld)
+        luaL_argerror(L, 2, "data string too short");
+      pos += ntoalign;  /* skip alignment */
+      if (op->opt <= Kuint) {  /* integers go straight to the stack */
+        lua_pushinteger(L, unpackint(L, data + pos, op->islittle, size,
+                                        (op->opt == Kint)));
+        n++;
       }
-      case Kpaddalign: case Kpadding: case Knop:
-        n--;  /* undo increment */
-        break;
+      else
+        n += unpackitem(L, data, ld, (KOption)op->opt, size, op->islittle,
+                           &pos);
+      pos += size;
+    }
+  }
+  else {
+    Header h;
+    const char *fmt = lua_tostring(L, 1);
+    initheader(L, &h);
+    while (*fmt != '\0') {
+      int size, ntoalign;
+      KOption opt = getdetails(&h, pos, &fmt, &size, &ntoalign);
+      if ((size_t)ntoalign + size > ~pos || pos + ntoalign + size > ld)
+        luaL_argerror(L, 2, "data string too short");
+      pos += ntoalign;  /* skip alignment */
+      /* stack space for item + next position */
+      luaL_checkstack(L, 2, "too many results");
+      n += unpackitem(L, data, ld, opt, size, h.islittle, &pos);
+      pos += size;
     }
-    pos += size;
   }
   lua_pushinteger(L, pos + 1);  /* next position */
   return n + 1;
@@ -1573,17 +2027,29 @@ static const luaL_Reg strlib[] = {
   {"byte", str_byte},
   {"char", str_char},
   {"dump", str_dump},
-  {"find", str_find},
   {"format", str_format},
-  {"gmatch", gmatch},
-  {"gsub", str_gsub},
   {"len", str_len},
   {"lower", str_lower},
-  {"match", str_match},
   {"rep", str_rep},
   {"reverse", str_reverse},
   {"sub", str_sub},
   {"upper", str_upper},
+  {NULL, NULL}
+};
+
+
+/* functions sharing the cache of pattern information as their upvalue */
+static const luaL_Reg pattlib[] = {
+  {"find", str_find},
+  {"gmatch", gmatch},
+  {"gsub", str_gsub},
+  {"match", str_match},
+  {NULL, NULL}
+};
+
+
+/* functions sharing the cache of compiled formats as their upvalue */
+static const luaL_Reg packlib[] = {
   {"pack", str_pack},
   {"packsize", str_packsize},
   {"unpack", str_unpack},
@@ -1608,6 +2074,10 @@ static void createmetatable (lua_State *L) {
 */
 LUAMOD_API int luaopen_string (lua_State *L) {
   luaL_newlib(L, strlib);
+  newpattcache(L);
+  luaL_setfuncs(L, pattlib, 1);
+  newpackcache(L);
+  luaL_setfuncs(L, packlib, 1);
   createmetatable(L);
   return 1;
 }
@@ -26,6 +26,7 @@
 #ifndef _KERNEL
 #include <math.h>
 #include <limits.h>
+#include <string.h>
 #endif /* _KERNEL */
 
 #include "lua.h"
@@ -77,8 +78,8 @@
 #define dummynode		(&dummynode_)
 
 static const Node dummynode_ = {
-  {NILCONSTANT},  /* value */
-  {{NILCONSTANT, 0}}  /* key */
+  {{NULL}, LUA_TNIL,  /* value's value and type */
+   LUA_TNIL, 0, {NULL}}  /* key type, next, and key value */
 };
 
 
@@ -118,7 +119,7 @@ static int l_hashfloat (lua_Number n) {
 ** returns the 'main' position of an element in a table (that is, the index
 ** of its hash value)
 */
-static Node *mainposition (const Table *t, const TValue *key) {
+static Node *mainposition (lua_State *L, const Table *t, const TValue *key) {
   switch (ttype(key)) {
     case LUA_TNUMINT:
       return hashint(t, ivalue(key));
@@ -129,7 +130,7 @@ static Node *mainposition (const Table *t, const TValue *key) {
     case LUA_TSHRSTR:
       return hashstr(t, tsvalue(key));
     case LUA_TLNGSTR:
-      return hashpow2(t, luaS_hashlongstr(tsvalue(key)));
+      return hashpow2(t, luaS_hashlongstr(L, tsvalue(key)));
     case LUA_TBOOLEAN:
       return hashboolean(t, bvalue(key));
     case LUA_TLIGHTUSERDATA:
@@ -147,13 +148,56 @@ static Node *mainposition (const Table *t, const TValue *key) {
 ** returns the index for 'key' if 'key' is an appropriate key to live in
 ** the array part of the table, 0 otherwise.
 */
-static unsigned int arrayindex (const TValue *key) {
-  if (ttisinteger(key)) {
-    lua_Integer k = ivalue(key);
-    if (0 < k && (lua_Unsigned)k <= MAXASIZE)
-      return cast(unsigned int, k);  /* 'key' is an appropriate array index */
+static unsigned int arrayindex (lua_Integer k) {
+  if (0 < k && (lua_Unsigned)k <= MAXASIZE)
+    return cast(unsigned int, k);  /* 'key' is an appropriate array index */
+  else
+    return 0;  /* 'key' did not match some condition */
+}
+
+
+/* returns the 'main' position of the key of node 'n' */
+static Node *mainpositionfromnode (lua_State *L, const Table *t,
+                                   const Node *n) {
+  TValue key;
+  getnodekey(L, &key, n);
+  return mainposition(L, t, &key);
+}
+
+
+/*
+** Check whether key 'k1' is equal to the key in node 'n2'. This
+** equality is raw, so there are no metamethods. Floats with integer
+** values have been normalized, so integers cannot be equal to
+** floats. It is assumed that 'eqshrstr' is simply pointer equality, so
+** that short strings are handled in the default case.
+** A true 'deadok' means to accept dead keys as equal to their original
+** values (they keep their 'gc' field), as 'next' may get one of them.
+*/
+static int equalkey (const TValue *k1, const Node *n2, int deadok) {
+  if (rttype(k1) != keytt(n2))  /* not the same variants? */
+    return deadok && keyisdead(n2) && iscollectable(k1) &&
+           gcvalue(k1) == gckey(n2);
+  switch (ttype(k1)) {
+    case LUA_TNIL:
+      return 1;
+    case LUA_TNUMINT:
+      return (ivalue(k1) == keyival(n2));
+#ifndef _KERNEL
+    case LUA_TNUMFLT:
+      return luai_numeq(fltvalue(k1), keyval(n2).n);
+#endif /* _KERNEL */
+    case LUA_TBOOLEAN:
+      return bvalue(k1) == keyval(n2).b;
+    case LUA_TLIGHTUSERDATA:
+      return pvalue(k1) == keyval(n2).p;
+    case LUA_TLCF:
+      return fvalue(k1) == keyval(n2).f;
+    case LUA_TLNGSTR:
+      return luaS_eqlngstr(tsvalue(k1), keystrval(n2));
+    default:
+      return gcvalue(k1) == gckey(n2);
   }
-  return 0;  /* 'key' did not match some condition */
 }
 
 
@@ -165,17 +209,15 @@ static unsigned int arrayindex (const TValue *key) {
 static unsigned int findindex (lua_State *L, Table *t, StkId key) {
   unsigned int i;
   if (ttisnil(key)) return 0;  /* first iteration */
-  i = arrayindex(key);
+  i = ttisinteger(key) ? arrayindex(ivalue(key)) : 0;
   if (i != 0 && i <= t->sizearray)  /* is 'key' inside array part? */
     return i;  /* yes; that's the index */
   else {
     int nx;
-    Node *n = mainposition(t, key);
+    Node *n = mainposition(L, t, key);
     for (;;) {  /* check whether 'key' is somewhere in the chain */
       /* key may be dead already, but it is ok to use it in 'next' */
-      if (luaV_rawequalobj(gkey(n), key) ||
-            (ttisdeadkey(gkey(n)) && iscollectable(key) &&
-             deadvalue(gkey(n)) == gcvalue(key))) {
+      if (equalkey(key, n, 1)) {
         i = cast_int(n - gnode(t, 0));  /* key index in hash table */
         /* hash elements are numbered after array ones */
         return (i + 1) + t->sizearray;
@@ -189,26 +231,66 @@ static unsigned int findindex (lua_State *L, Table *t, StkId key) {
 }
 
 
-int luaH_next (lua_State *L, Table *t, StkId key) {
-  unsigned int i = findindex(L, t, key);  /* find original element */
+/*
+** pushes the first element at or after position 'i' (as numbered by
+** 'findindex') into 'key' and 'key + 1'; returns the position after it,
+** or 0 if there are no more elements
+*/
+static unsigned int nextfrom (lua_State *L, Table *t, unsigned int i,
+                              StkId key) {
   for (; i < t->sizearray; i++) {  /* try first array part */
     if (!ttisnil(&t->array[i])) {  /* a non-nil value? */
       setivalue(key, i + 1);
       setobj2s(L, key+1, &t->array[i]);
-      return 1;
+      return i + 1;
     }
   }
   for (i -= t->sizearray; cast_int(i) < sizenode(t); i++) {  /* hash part */
     if (!ttisnil(gval(gnode(t, i)))) {  /* a non-nil value? */
-      setobj2s(L, key, gkey(gnode(t, i)));
+      getnodekey(L, key, gnode(t, i));
       setobj2s(L, key+1, gval(gnode(t, i)));
-      return 1;
+      return (i + 1) + t->sizearray;
     }
   }
   return 0;  /* no more elements */
 }
 
 
+/*
+** '*cursor' is a hint for the position of 'key' (as returned by a
+** previous call): when the hint is right, which is checked with a single
+** comparison, the key is not looked up again. '*cursor' gets the
+** position of the element returned.
+*/
+int luaH_nextidx (lua_State *L, Table *t, unsigned int *cursor, StkId key) {
+  unsigned int i = *cursor;
+  if (ttisnil(key))
+    i = 0;  /* first iteration */
+  else if (i == 0 || i > t->sizearray + sizenode(t) ||
+           !(i <= t->sizearray ?
+               ttisinteger(key) && l_castS2U(ivalue(key)) == i :
+               equalkey(key, gnode(t, i - 1 - t->sizearray), 0)))
+    i = findindex(L, t, key);  /* wrong hint */
+  *cursor = nextfrom(L, t, i, key);
+  return *cursor != 0;
+}
+
+
+/*
+** 'luaH_nextidx' with a one-entry hint kept by the thread: the table and
+** position of the last key it returned, so that a loop with 'next' (as
+** returned by 'pairs') does not look up each key again. Other traversals
+** in between only cost that lookup.
+*/
+int luaH_next (lua_State *L, Table *t, StkId key) {
+  unsigned int i = (L->nexttable == t) ? L->nextcursor : 0;
+  int more = luaH_nextidx(L, t, &i, key);
+  L->nexttable = t;
+  L->nextcursor = i;
+  return more;
+}
+
+
 /*
 ** {=============================================================
 ** Rehash
@@ -244,7 +326,7 @@ static unsigned int computesizes (unsigned int nums[], unsigned int *pna) {
 }
 
 
-static int countint (const TValue *key, unsigned int *nums) {
+static int countint (lua_Integer key, unsigned int *nums) {
   unsigned int k = arrayindex(key);
   if (k != 0) {  /* is 'key' an appropriate array index? */
     nums[luaO_ceillog2(k)]++;  /* count as such */
@@ -293,7 +375,8 @@ static int numusehash (const Table *t, unsigned int *nums, unsigned int *pna) {
   while (i--) {
     Node *n = &t->node[i];
     if (!ttisnil(gval(n))) {
-      ause += countint(gkey(n), nums);
+      if (keyisinteger(n))
+        ause += countint(keyival(n), nums);
       totaluse++;
     }
   }
@@ -327,7 +410,7 @@ static void setnodevector (lua_State *L, Table *t, unsigned int size) {
     for (i = 0; i < (int)size; i++) {
       Node *n = gnode(t, i);
       gnext(n) = 0;
-      setnilvalue(wgkey(n));
+      setnilkey(n);
       setnilvalue(gval(n));
     }
     t->lsizenode = cast_byte(lsize);
@@ -363,7 +446,9 @@ void luaH_resize (lua_State *L, Table *t, unsigned int nasize,
     if (!ttisnil(gval(old))) {
       /* doesn't need barrier/invalidate cache, as entry was
          already present in the table */
-      setobjt2t(L, luaH_set(L, t, gkey(old)), gval(old));
+      TValue k;
+      getnodekey(L, &k, old);
+      setobjt2t(L, luaH_set(L, t, &k), gval(old));
     }
   }
   if (oldhsize > 0)  /* not the dummy node? */
@@ -378,6 +463,10 @@ void luaH_resizearray (lua_State *L, Table *t, unsigned int nasize) {
 
 /*
 ** nums[i] = number of keys 'k' where 2^(i - 1) < k <= 2^i
+** The hash part is counted first: when neither it nor the extra key
+** hold candidates to the array part, the array part keeps its size and
+** is not scanned, so that growing the hash part of a table with a large
+** array part costs only the size of the hash part.
 */
 static void rehash (lua_State *L, Table *t, const TValue *ek) {
   unsigned int asize;  /* optimal size for array part */
@@ -386,12 +475,19 @@ static void rehash (lua_State *L, Table *t, const TValue *ek) {
   int i;
   int totaluse;
   for (i = 0; i <= MAXABITS; i++) nums[i] = 0;  /* reset counts */
-  na = numusearray(t, nums);  /* count keys in array part */
-  totaluse = na;  /* all those keys are integer keys */
-  totaluse += numusehash(t, nums, &na);  /* count keys in hash part */
+  na = 0;
+  totaluse = numusehash(t, nums, &na);  /* count keys in hash part */
   /* count extra key */
-  na += countint(ek, nums);
+  if (ttisinteger(ek))
+    na += countint(ivalue(ek), nums);
   totaluse++;
+  if (na == 0) {  /* no integer key can move to the array part? */
+    luaH_resize(L, t, t->sizearray, totaluse);  /* only grow hash part */
+    return;
+  }
+  i = numusearray(t, nums);  /* count keys in array part */
+  na += i;
+  totaluse += i;  /* all those keys are integer keys */
   /* compute new size for array part */
   asize = computesizes(nums, &na);
   /* resize the table to new computed sizes */
@@ -417,6 +513,46 @@ Table *luaH_new (lua_State *L) {
 }
 
 
+/*
+** Remove all entries of table 't', keeping its array and hash parts
+** allocated for new entries
+*/
+void luaH_clear (Table *t) {
+  unsigned int i;
+  for (i = 0; i < t->sizearray; i++)
+    setnilvalue(&t->array[i]);
+  if (!isdummy(t)) {
+    int size = sizenode(t);
+    for (i = 0; i < cast(unsigned int, size); i++) {
+      Node *n = gnode(t, i);
+      gnext(n) = 0;
+      setnilkey(n);
+      setnilvalue(gval(n));
+    }
+    t->lastfree = gnode(t, size);  /* all positions are free */
+  }
+}
+
+
+/*
+** Copy the contents of table 'src' to the new (empty) table 't', with the
+** same layout: each key of 't' is in the same node as in 'src', so the
+** inline caches of field accesses ('icache') hit in both tables, and no
+** key is rehashed. 't' must be white (as a new table), so that the copy
+** needs no barriers.
+*/
+void luaH_copy (lua_State *L, Table *t, Table *src) {
+  lua_assert(t->sizearray == 0 && isdummy(t) && iswhite(t));
+  luaH_resize(L, t, src->sizearray, allocsizenode(src));
+  if (src->sizearray > 0)
+    memcpy(t->array, src->array, src->sizearray * sizeof(TValue));
+  if (!isdummy(src)) {
+    memcpy(t->node, src->node, sizenode(src) * sizeof(Node));
+    t->lastfree = gnode(t, src->lastfree - src->node);
+  }
+}
+
+
 void luaH_free (lua_State *L, Table *t) {
   if (!isdummy(t))
     luaM_freearray(L, t->node, cast(size_t, sizenode(t)));
@@ -429,7 +565,7 @@ static Node *getfreepos (Table *t) {
   if (!isdummy(t)) {
     while (t->lastfree > t->node) {
       t->lastfree--;
-      if (ttisnil(gkey(t->lastfree)))
+      if (keyisnil(t->lastfree))
         return t->lastfree;
     }
   }
@@ -462,7 +598,7 @@ TValue *luaH_newkey (lua_State *L, Table *t, const TValue *key) {
       luaG_runerror(L, "table index is NaN");
   }
 #endif /* _KERNEL */
-  mp = mainposition(t, key);
+  mp = mainposition(L, t, key);
   if (!ttisnil(gval(mp)) || isdummy(t)) {  /* main position is taken? */
     Node *othern;
     Node *f = getfreepos(t);  /* get a free place */
@@ -472,7 +608,7 @@ TValue *luaH_newkey (lua_State *L, Table *t, const TValue *key) {
       return luaH_set(L, t, key);  /* insert key into grown table */
     }
     lua_assert(!isdummy(t));
-    othern = mainposition(t, gkey(mp));
+    othern = mainpositionfromnode(L, t, mp);
     if (othern != mp) {  /* is colliding node out of its main position? */
       /* yes; move colliding node into free position */
       while (othern + gnext(othern) != mp)  /* find previous */
@@ -494,7 +630,7 @@ TValue *luaH_newkey (lua_State *L, Table *t, const TValue *key) {
       mp = f;
     }
   }
-  setnodekey(L, &mp->i_key, key);
+  setnodekey(L, mp, key);
   luaC_barrierback(L, t, key);
   lua_assert(ttisnil(gval(mp)));
   return gval(mp);
@@ -511,7 +647,7 @@ const TValue *luaH_getint (Table *t, lua_Integer key) {
   else {
     Node *n = hashint(t, key);
     for (;;) {  /* check whether 'key' is somewhere in the chain */
-      if (ttisinteger(gkey(n)) && ivalue(gkey(n)) == key)
+      if (keyisinteger(n) && keyival(n) == key)
         return gval(n);  /* that's it */
       else {
         int nx = gnext(n);
@@ -531,8 +667,7 @@ const TValue *luaH_getshortstr (Table *t, TString *key) {
   Node *n = hashstr(t, key);
   lua_assert(key->tt == LUA_TSHRSTR);
   for (;;) {  /* check whether 'key' is somewhere in the chain */
-    const TValue *k = gkey(n);
-    if (ttisshrstring(k) && eqshrstr(tsvalue(k), key))
+    if (keyisshrstr(n) && eqshrstr(keystrval(n), key))
       return gval(n);  /* that's it */
     else {
       int nx = gnext(n);
@@ -544,14 +679,40 @@ const TValue *luaH_getshortstr (Table *t, TString *key) {
 }
 
 
+/*
+** search function for short strings, updating inline cache 'ic'
+*/
+const TValue *luaH_getshortstrcached (Table *t, TString *key,
+                                      unsigned int *ic) {
+  Node *n;
+  if (icachehit(t, key, *ic))
+    return gval(gnode(t, *ic));
+  n = hashstr(t, key);
+  lua_assert(key->tt == LUA_TSHRSTR);
+  for (;;) {  /* check whether 'key' is somewhere in the chain */
+    if (keyisshrstr(n) && eqshrstr(keystrval(n), key)) {
+      *ic = cast(unsigned int, n - gnode(t, 0));
+      return gval(n);  /* that's it */
+    }
+    else {
+      int nx = gnext(n);
+      if (nx == 0)
+        return luaO_nilobject;  /* not found */
+      n += nx;
+    }
+  }
+}
+
+
 /*
 ** "Generic" get version. (Not that generic: not valid for integers,
 ** which may be in array part, nor for floats with integral values.)
 */
-static const TValue *getgeneric (Table *t, const TValue *key) {
-  Node *n = mainposition(t, key);
+static const TValue *getgeneric (lua_State *L, Table *t,
+                                const TValue *key) {
+  Node *n = mainposition(L, t, key);
   for (;;) {  /* check whether 'key' is somewhere in the chain */
-    if (luaV_rawequalobj(gkey(n), key))
+    if (equalkey(key, n, 0))
       return gval(n);  /* that's it */
     else {
       int nx = gnext(n);
@@ -563,13 +724,13 @@ static const TValue *getgeneric (Table *t, const TValue *key) {
 }
 
 
-const TValue *luaH_getstr (Table *t, TString *key) {
+const TValue *luaH_getstr (lua_State *L, Table *t, TString *key) {
   if (key->tt == LUA_TSHRSTR)
     return luaH_getshortstr(t, key);
   else {  /* for long strings, use generic case */
     TValue ko;
-    setsvalue(cast(lua_State *, NULL), &ko, key);
-    return getgeneric(t, &ko);
+    setsvalue(L, &ko, key);
+    return getgeneric(L, t, &ko);
   }
 }
 
@@ -577,7 +738,7 @@ const TValue *luaH_getstr (Table *t, TString *key) {
 /*
 ** main search function
 */
-const TValue *luaH_get (Table *t, const TValue *key) {
+const TValue *luaH_get (lua_State *L, Table *t, const TValue *key) {
   switch (ttype(key)) {
     case LUA_TSHRSTR: return luaH_getshortstr(t, tsvalue(key));
     case LUA_TNUMINT: return luaH_getint(t, ivalue(key));
@@ -591,7 +752,7 @@ const TValue *luaH_get (Table *t, const TValue *key) {
     }  /* FALLTHROUGH */
 #endif /* _KERNEL */
     default:
-      return getgeneric(t, key);
+      return getgeneric(L, t, key);
   }
 }
 
@@ -601,7 +762,7 @@ const TValue *luaH_get (Table *t, const TValue *key) {
 ** barrier and invalidate the TM cache.
 */
 TValue *luaH_set (lua_State *L, Table *t, const TValue *key) {
-  const TValue *p = luaH_get(t, key);
+  const TValue *p = luaH_get(L, t, key);
   if (p != luaO_nilobject)
     return cast(TValue *, p);
   else return luaH_newkey(L, t, key);
@@ -672,8 +833,8 @@ int luaH_getn (Table *t) {
 
 #if defined(LUA_DEBUG)
 
-Node *luaH_mainposition (const Table *t, const TValue *key) {
-  return mainposition(t, key);
+Node *luaH_mainposition (lua_State *L, const Table *t, const TValue *key) {
+  return mainposition(L, t, key);
 }
 
 int luaH_isdummy (const Table *t) { return isdummy(t); }
@@ -12,17 +12,32 @@
 
 #define gnode(t,i)	(&(t)->node[i])
 #define gval(n)		(&(n)->i_val)
-#define gnext(n)	((n)->i_key.nk.next)
+#define gnext(n)	((n)->u.next)
 
 
-/* 'const' to avoid wrong writings that can mess up field 'next' */
-#define gkey(n)		cast(const TValue*, (&(n)->i_key.tvk))
-
 /*
-** writable version of 'gkey'; allows updates to individual fields,
-** but not to the whole (which has incompatible type)
+** Keys of nodes (see 'Node'): they are not 'TValue's, so they are
+** accessed with these macros and copied out with 'getnodekey'
 */
-#define wgkey(n)		(&(n)->i_key.nk)
+#define keytt(n)	((n)->u.key_tt)
+#define keyval(n)	((n)->u.key_val)
+
+#define keyisnil(n)		(keytt(n) == LUA_TNIL)
+#define keyisinteger(n)		(keytt(n) == LUA_TNUMINT)
+#define keyival(n)		(keyval(n).i)
+#define keyisshrstr(n)		(keytt(n) == ctb(LUA_TSHRSTR))
+#define keystrval(n)		(gco2ts(keyval(n).gc))
+#define keyisdead(n)		(keytt(n) == LUA_TDEADKEY)
+
+#define keyiscollectable(n)	(keytt(n) & BIT_ISCOLLECTABLE)
+#define gckey(n)		(keyval(n).gc)
+#define gckeyN(n)		(keyiscollectable(n) ? gckey(n) : NULL)
+
+#define setnilkey(n)		(keytt(n) = LUA_TNIL)
+
+/* a dead key keeps its 'gc' field, still valid for 'next' */
+#define setdeadkey(n)		(keytt(n) = LUA_TDEADKEY)
+
 
 #define invalidateTMcache(t)	((t)->flags = 0)
 
@@ -35,30 +50,48 @@
 #define allocsizenode(t)	(isdummy(t) ? 0 : sizenode(t))
 
 
-/* returns the key, given the value of a table entry */
-#define keyfromval(v) \
-  (gkey(cast(Node *, cast(char *, (v)) - offsetof(Node, i_val))))
+/*
+** inline caches: node index where a short-string key was last found;
+** a hit must still be inside the node array and hold the same key
+*/
+#define NOICACHE	(~0u)
+
+#define icachehit(t,key,ic) \
+  ((ic) < cast(unsigned int, sizenode(t)) && \
+   keyisshrstr(gnode(t, ic)) && keystrval(gnode(t, ic)) == (key))
+
+
+/* returns the node, given the value of a table entry */
+#define nodefromval(v)	cast(Node *, (v))
 
 
 LUAI_FUNC const TValue *luaH_getint (Table *t, lua_Integer key);
 LUAI_FUNC void luaH_setint (lua_State *L, Table *t, lua_Integer key,
                                                     TValue *value);
 LUAI_FUNC const TValue *luaH_getshortstr (Table *t, TString *key);
-LUAI_FUNC const TValue *luaH_getstr (Table *t, TString *key);
-LUAI_FUNC const TValue *luaH_get (Table *t, const TValue *key);
+LUAI_FUNC const TValue *luaH_getshortstrcached (Table *t, TString *key,
+                                                unsigned int *ic);
+LUAI_FUNC const TValue *luaH_getstr (lua_State *L, Table *t, TString *key);
+LUAI_FUNC const TValue *luaH_get (lua_State *L, Table *t,
+                                 const TValue *key);
 LUAI_FUNC TValue *luaH_newkey (lua_State *L, Table *t, const TValue *key);
 LUAI_FUNC TValue *luaH_set (lua_State *L, Table *t, const TValue *key);
 LUAI_FUNC Table *luaH_new (lua_State *L);
+LUAI_FUNC void luaH_copy (lua_State *L, Table *t, Table *src);
+LUAI_FUNC void luaH_clear (Table *t);
 LUAI_FUNC void luaH_resize (lua_State *L, Table *t, unsigned int nasize,
                                                     unsigned int nhsize);
 LUAI_FUNC void luaH_resizearray (lua_State *L, Table *t, unsigned int nasize);
 LUAI_FUNC void luaH_free (lua_State *L, Table *t);
 LUAI_FUNC int luaH_next (lua_State *L, Table *t, StkId key);
+LUAI_FUNC int luaH_nextidx (lua_State *L, Table *t, unsigned int *cursor,
+                           StkId key);
 LUAI_FUNC int luaH_getn (Table *t);
 
 
 #if defined(LUA_DEBUG)
-LUAI_FUNC Node *luaH_mainposition (const Table *t, const TValue *key);
+LUAI_FUNC Node *luaH_mainposition (lua_State *L, const Table *t,
+                                   const TValue *key);
 LUAI_FUNC int luaH_isdummy (const Table *t);
 #endif
 
@@ -168,6 +168,74 @@ static void addfield (lua_State *L, luaL_Buffer *b, lua_Integer i) {
 }
 
 
+/*
+** Compute in '*len' the length of the result of 'concat' over the
+** non-empty interval [i, last]. Returns 1 when the length is exact,
+** i.e., when the table has no metatable (reading it cannot call
+** metamethods) and all values are strings or numbers; otherwise '*len'
+** is only the length up to the first other value (which is an error
+** for 'addfield' to raise).
+*/
+static int concatlen (lua_State *L, lua_Integer i, lua_Integer last,
+                      size_t lsep, size_t *len) {
+  size_t sz = 0;
+  *len = 0;
+  if (lua_getmetatable(L, 1)) {
+    lua_pop(L, 1);
+    return 0;
+  }
+  for (;;) {
+    size_t l;
+    int isstr = (lua_rawgeti(L, 1, i) == LUA_TSTRING || lua_isnumber(L, -1));
+    if (isstr)
+      lua_tolstring(L, -1, &l);  /* (numbers are converted again later) */
+    lua_pop(L, 1);
+    if (!isstr || l > (~(size_t)0 - lsep) - sz)
+      return 0;
+    sz += l;
+    *len = sz;
+    if (i++ == last)
+      return 1;
+    sz += lsep;
+  }
+}
+
+
+/*
+** Copy the values of 'concat' over [i, last] into 'p', the contents of
+** a new string with the length 'len' computed by 'concatlen'. Creating
+** that string (or converting a number) may run a finalizer that changes
+** the table, so each value is checked again against the room left;
+** returns 0 (with 'p' partially filled) when they no longer fit exactly.
+*/
+static int concatinto (lua_State *L, char *p, size_t len, lua_Integer i,
+                       lua_Integer last, const char *sep, size_t lsep) {
+  for (;;) {
+    size_t l;
+    const char *s;
+    int t = lua_rawgeti(L, 1, i);
+    if ((t != LUA_TSTRING && t != LUA_TNUMBER) ||
+        (s = lua_tolstring(L, -1, &l), l > len)) {
+      lua_pop(L, 1);
+      return 0;
+    }
+    memcpy(p, s, l * sizeof(char));
+    p += l;
+    len -= l;
+    lua_pop(L, 1);
+    if (i++ == last)
+      return (len == 0);
+    if (lsep > len)
+      return 0;
+    if (lsep > 0) {  /* empty 'memcpy' is not that cheap */
+      memcpy(p, sep, lsep * sizeof(char));
+      p += lsep;
+      len -= lsep;
+    }
+  }
+}
+
+
 static int tconcat (lua_State *L) {
   luaL_Buffer b;
   lua_Integer last = aux_getn(L, 1, TAB_R);
@@ -175,7 +243,19 @@ static int tconcat (lua_State *L) {
   const char *sep = luaL_optlstring(L, 2, "", &lsep);
   lua_Integer i = luaL_optinteger(L, 3, 1);
   last = luaL_optinteger(L, 4, last);
-  luaL_buffinit(L, &b);
+  if (i <= last) {
+    size_t len;
+    char *p;
+    if (concatlen(L, i, last, lsep, &len) &&
+        (p = lua_pushlongstring(L, len)) != NULL) {  /* exact and long? */
+      if (concatinto(L, p, len, i, last, sep, lsep))
+        return 1;
+      lua_pop(L, 1);  /* table changed meanwhile; use a buffer */
+    }
+    luaL_buffinitsize(L, &b, len);
+  }
+  else
+    luaL_buffinit(L, &b);
   for (; i < last; i++) {
     addfield(L, &b, i);
     luaL_addlstring(&b, sep, lsep);
@@ -221,6 +301,49 @@ static int unpack (lua_State *L) {
   return (int)n;
 }
 
+static int checksize (lua_State *L, int arg) {
+  lua_Integer n = luaL_optinteger(L, arg, 0);
+  luaL_argcheck(L, 0 <= n && n <= INT_MAX, arg, "invalid size");
+  return (int)n;
+}
+
+
+static int tcreate (lua_State *L) {
+  int narr = checksize(L, 1);
+  int nrec = checksize(L, 2);
+  lua_createtable(L, narr, nrec);
+  return 1;
+}
+
+
+static int treserve (lua_State *L) {
+  int narr, nrec;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  narr = checksize(L, 2);
+  nrec = checksize(L, 3);
+  lua_reservetable(L, 1, narr, nrec);
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+static int tclear (lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_cleartable(L, 1);
+  return 0;
+}
+
+
+/*
+** table.clone(t): a copy of 't' built with the same layout, so that it is
+** a cheap way to create records from a template with the same fields
+*/
+static int tclone (lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_clonetable(L, 1);
+  return 1;
+}
+
 /* }====================================================== */
 
 
@@ -354,13 +477,94 @@ static IdxT choosePivot (IdxT lo, IdxT up, unsigned int rnd) {
 
 
 /*
-** QuickSort algorithm (recursive function)
+** Sort small intervals by insertion.
+*/
+static void insertionsort (lua_State *L, IdxT lo, IdxT up) {
+  IdxT i;
+  for (i = lo + 1; i <= up; i++) {
+    IdxT j = i;
+    lua_geti(L, 1, i);  /* value to be inserted */
+    while (j > lo) {
+      lua_geti(L, 1, j - 1);
+      if (!sort_comp(L, -2, -1)) {  /* not a[i] < a[j - 1]? */
+        lua_pop(L, 1);
+        break;
+      }
+      lua_seti(L, 1, j);  /* a[j] = a[j - 1] */
+      j--;
+    }
+    if (j != i)
+      lua_seti(L, 1, j);  /* put value in its place */
+    else
+      lua_pop(L, 1);  /* already in place */
+  }
+}
+
+
+/*
+** Sift the value at heap position 'i' (from 1) down the heap with 'n'
+** elements stored from 'lo'.
+*/
+static void siftdown (lua_State *L, IdxT lo, IdxT i, IdxT n) {
+  lua_geti(L, 1, lo + i - 1);  /* value to sift */
+  while (i <= n / 2) {
+    IdxT c = 2 * i;  /* larger child */
+    lua_geti(L, 1, lo + c - 1);
+    if (c < n) {
+      lua_geti(L, 1, lo + c);
+      if (sort_comp(L, -2, -1)) {  /* left child < right child? */
+        lua_remove(L, -2);
+        c++;
+      }
+      else
+        lua_pop(L, 1);
+    }
+    if (!sort_comp(L, -2, -1)) {  /* not value < child? */
+      lua_pop(L, 1);
+      break;
+    }
+    lua_seti(L, 1, lo + i - 1);  /* move child up */
+    i = c;
+  }
+  lua_seti(L, 1, lo + i - 1);
+}
+
+
+/*
+** Heapsort, for intervals where quicksort went too deep
+*/
+static void heapsort (lua_State *L, IdxT lo, IdxT up) {
+  IdxT n = up - lo + 1;
+  IdxT i;
+  for (i = n / 2; i > 0; i--)
+    siftdown(L, lo, i, n);
+  for (i = n; i > 1; i--) {
+    lua_geti(L, 1, lo);
+    lua_geti(L, 1, lo + i - 1);
+    set2(L, lo, lo + i - 1);  /* move largest to the end */
+    siftdown(L, lo, 1, i - 1);
+  }
+}
+
+
+/* intervals up to this size are sorted by insertion */
+#define SORTINSERT	8u
+
+
+/*
+** QuickSort algorithm (recursive function). After 'depth' partitions,
+** the interval being sorted goes to 'heapsort', which bounds the
+** worst case to O(n log n) whatever the choice of pivots.
 */
 static void auxsort (lua_State *L, IdxT lo, IdxT up,
-                                   unsigned int rnd) {
-  while (lo < up) {  /* loop for tail recursion */
+                                   unsigned int rnd, int depth) {
+  while (up - lo >= SORTINSERT) {  /* loop for tail recursion */
     IdxT p;  /* Pivot index */
     IdxT n;  /* to be used later */
+    if (depth-- == 0) {  /* too many partitions? */
+      heapsort(L, lo, up);
+      return;
+    }
     /* sort elements 'lo', 'p', and 'up' */
     lua_geti(L, 1, lo);
     lua_geti(L, 1, up);
@@ -368,8 +572,6 @@ static void auxsort (lua_State *L, IdxT lo, IdxT up,
       set2(L, lo, up);  /* swap a[lo] - a[up] */
     else
       lua_pop(L, 2);  /* remove both values */
-    if (up - lo == 1)  /* only 2 elements? */
-      return;  /* already sorted */
     if (up - lo < RANLIMIT || rnd == 0)  /* small interval or no randomize? */
       p = (lo + up)/2;  /* middle element is a good pivot */
     else  /* for larger intervals, it is worth a random pivot */
@@ -386,8 +588,6 @@ static void auxsort (lua_State *L, IdxT lo, IdxT up,
       else
         lua_pop(L, 2);
     }
-    if (up - lo == 2)  /* only 3 elements? */
-      return;  /* already sorted */
     lua_geti(L, 1, p);  /* get middle element (Pivot) */
     lua_pushvalue(L, -1);  /* push Pivot */
     lua_geti(L, 1, up - 1);  /* push a[up - 1] */
@@ -395,29 +595,248 @@ static void auxsort (lua_State *L, IdxT lo, IdxT up,
     p = partition(L, lo, up);
     /* a[lo .. p - 1] <= a[p] == P <= a[p + 1 .. up] */
     if (p - lo < up - p) {  /* lower interval is smaller? */
-      auxsort(L, lo, p - 1, rnd);  /* call recursively for lower interval */
+      if (p > lo)
+        auxsort(L, lo, p - 1, rnd, depth);  /* call recursively for lower */
       n = p - lo;  /* size of smaller interval */
       lo = p + 1;  /* tail call for [p + 1 .. up] (upper interval) */
     }
     else {
-      auxsort(L, p + 1, up, rnd);  /* call recursively for upper interval */
+      if (p < up)
+        auxsort(L, p + 1, up, rnd, depth);  /* call recursively for upper */
       n = up - p;  /* size of smaller interval */
       up = p - 1;  /* tail call for [lo .. p - 1]  (lower interval) */
     }
     if ((up - lo) / 128 > n) /* partition too imbalanced? */
       rnd = l_randomizePivot();  /* try a new randomization */
-  }  /* tail call auxsort(L, lo, up, rnd) */
+  }  /* tail call auxsort(L, lo, up, rnd, depth) */
+  if (lo < up)
+    insertionsort(L, lo, up);
+}
+
+
+/*
+** {======================================================
+** Direct sort
+** =======================================================
+*/
+
+/*
+** Without an order function, arrays of integers only or of strings
+** only, in tables without a metatable, are copied to a C array of keys
+** and sorted there, comparing keys directly instead of going through
+** 'lua_compare' and the table for each step. (A metatable could make
+** reads and writes call metamethods.) Arrays with more than
+** LUAL_SORTDIRECT elements are sorted in place as usual, to bound the
+** size of the temporary array.
+*/
+#if !defined(LUAL_SORTDIRECT)
+#define LUAL_SORTDIRECT		(1u << 16)
+#endif
+
+
+typedef struct SortKey {
+  const char *s;  /* contents of a string (NULL for integers) */
+  size_t l;  /* length of a string */
+  lua_Integer i;  /* integer, or original index of a string */
+} SortKey;
+
+
+/*
+** Compare two strings like the virtual machine does: 'strcoll' on each
+** segment between embedded zeros.
+*/
+static int keystrcmp (const SortKey *a, const SortKey *b) {
+  const char *l = a->s;
+  size_t ll = a->l;
+  const char *r = b->s;
+  size_t lr = b->l;
+  for (;;) {  /* for each segment */
+    int temp = strcoll(l, r);
+    if (temp != 0)  /* not equal? */
+      return temp;  /* done */
+    else {  /* strings are equal up to a '\0' */
+      size_t len = strlen(l);  /* index of first '\0' in both strings */
+      if (len == lr)  /* 'rs' is finished? */
+        return (len == ll) ? 0 : 1;  /* check 'ls' */
+      else if (len == ll)  /* 'ls' is finished? */
+        return -1;  /* 'ls' is less than 'rs' ('rs' is not finished) */
+      /* both strings longer than 'len'; go on comparing after the '\0' */
+      len++;
+      l += len; ll -= len; r += len; lr -= len;
+    }
+  }
+}
+
+
+#define keylt(a,b)	((a)->s == NULL ? (a)->i < (b)->i : keystrcmp(a, b) < 0)
+
+
+static void keyswap (SortKey *a, SortKey *b) {
+  SortKey t = *a;
+  *a = *b;
+  *b = t;
+}
+
+
+static void keyinsertion (SortKey *a, IdxT n) {
+  IdxT i, j;
+  for (i = 1; i < n; i++) {
+    SortKey v = a[i];
+    for (j = i; j > 0 && keylt(&v, &a[j - 1]); j--)
+      a[j] = a[j - 1];
+    a[j] = v;
+  }
+}
+
+
+static void keysift (SortKey *a, IdxT i, IdxT n) {  /* 'i' from 0 */
+  SortKey v = a[i];
+  while (i < n / 2) {
+    IdxT c = 2 * i + 1;  /* larger child */
+    if (c + 1 < n && keylt(&a[c], &a[c + 1]))
+      c++;
+    if (!keylt(&v, &a[c]))
+      break;
+    a[i] = a[c];
+    i = c;
+  }
+  a[i] = v;
+}
+
+
+static void keyheapsort (SortKey *a, IdxT n) {
+  IdxT i;
+  for (i = n / 2; i > 0; i--)
+    keysift(a, i - 1, n);
+  for (i = n - 1; i > 0; i--) {
+    keyswap(&a[0], &a[i]);
+    keysift(a, 0, i);
+  }
+}
+
+
+/*
+** Introsort of the 'n' keys in 'a': quicksort with median-of-three
+** pivots, heapsort after 'depth' partitions, insertion sort for small
+** intervals.
+*/
+static void keysort (SortKey *a, IdxT n, int depth) {
+  while (n > 2 * SORTINSERT) {
+    IdxT i = 0, j = n - 1, m = n / 2;
+    SortKey p;
+    if (depth-- == 0) {
+      keyheapsort(a, n);
+      return;
+    }
+    /* order a[0] <= a[m] <= a[n - 1], which also stops the scans below */
+    if (keylt(&a[m], &a[0])) keyswap(&a[m], &a[0]);
+    if (keylt(&a[n - 1], &a[m])) {
+      keyswap(&a[n - 1], &a[m]);
+      if (keylt(&a[m], &a[0])) keyswap(&a[m], &a[0]);
+    }
+    p = a[m];
+    for (;;) {  /* a[0 .. i] <= p <= a[j .. n - 1] */
+      do i++; while (keylt(&a[i], &p));
+      do j--; while (keylt(&p, &a[j]));
+      if (i >= j) break;
+      keyswap(&a[i], &a[j]);
+    }
+    /* a[0 .. j] <= p <= a[j + 1 .. n - 1]; recurse into smaller part */
+    if (j + 1 < n - j - 1) {
+      keysort(a, j + 1, depth);
+      a += j + 1;
+      n -= j + 1;
+    }
+    else {
+      keysort(a + j + 1, n - j - 1, depth);
+      n = j + 1;
+    }
+  }
+  keyinsertion(a, n);
 }
 
 
+/*
+** Try to sort the 'n' elements of the table directly (see above).
+** Returns 0 if the array does not qualify.
+*/
+static int sortdirect (lua_State *L, IdxT n, int depth) {
+  SortKey *a;
+  IdxT i;
+  int t;
+  if (!lua_isnil(L, 2) || n > LUAL_SORTDIRECT)
+    return 0;
+  if (lua_getmetatable(L, 1)) {
+    lua_pop(L, 1);
+    return 0;
+  }
+  t = lua_rawgeti(L, 1, 1);
+  if (t == LUA_TNUMBER && !lua_isinteger(L, -1))
+    t = LUA_TNIL;  /* floats go the usual way */
+  lua_pop(L, 1);
+  if (t != LUA_TNUMBER && t != LUA_TSTRING)
+    return 0;
+  a = (SortKey *)lua_newuserdata(L, n * sizeof(SortKey));
+  for (i = 0; i < n; i++) {
+    if (lua_rawgeti(L, 1, i + 1) != t ||
+        (t == LUA_TNUMBER && !lua_isinteger(L, -1))) {
+      lua_pop(L, 2);  /* value and keys */
+      return 0;
+    }
+    if (t == LUA_TNUMBER) {
+      a[i].s = NULL;
+      a[i].i = lua_tointeger(L, -1);
+    }
+    else {  /* string; the table keeps it alive */
+      a[i].s = lua_tolstring(L, -1, &a[i].l);
+      a[i].i = i + 1;
+    }
+    lua_pop(L, 1);
+  }
+  keysort(a, n, depth);
+  if (t == LUA_TNUMBER) {
+    for (i = 0; i < n; i++) {
+      lua_pushinteger(L, a[i].i);
+      lua_rawseti(L, 1, i + 1);
+    }
+  }
+  else {  /* move strings following the cycles of the permutation */
+    for (i = 0; i < n; i++) {
+      IdxT j = i;
+      if (a[i].s == NULL)  /* already moved? */
+        continue;
+      lua_rawgeti(L, 1, i + 1);  /* keep the value of the cycle start */
+      for (;;) {
+        IdxT from = (IdxT)a[j].i - 1;  /* a[j] comes from position 'from' */
+        a[j].s = NULL;  /* mark as moved */
+        if (from == i) break;
+        lua_rawgeti(L, 1, from + 1);
+        lua_rawseti(L, 1, j + 1);
+        j = from;
+      }
+      lua_rawseti(L, 1, j + 1);
+    }
+  }
+  lua_pop(L, 1);  /* keys */
+  return 1;
+}
+
+/* }====================================================== */
+
+
 static int sort (lua_State *L) {
   lua_Integer n = aux_getn(L, 1, TAB_RW);
   if (n > 1) {  /* non-trivial interval? */
+    int depth = 0;
+    lua_Integer m;
     luaL_argcheck(L, n < INT_MAX, 1, "array too big");
     if (!lua_isnoneornil(L, 2))  /* is there a 2nd argument? */
       luaL_checktype(L, 2, LUA_TFUNCTION);  /* must be a function */
     lua_settop(L, 2);  /* make sure there are two arguments */
-    auxsort(L, 1, (IdxT)n, 0);
+    for (m = n; m > 1; m >>= 1)  /* partitions allowed: 2*log2(n) */
+      depth += 2;
+    if (!sortdirect(L, (IdxT)n, depth))
+      auxsort(L, 1, (IdxT)n, 0, depth);
   }
   return 0;
 }
@@ -426,7 +845,10 @@ static int sort (lua_State *L) {
 
 
 static const luaL_Reg tab_funcs[] = {
+  {"clear", tclear},
+  {"clone", tclone},
   {"concat", tconcat},
+  {"create", tcreate},
 #if defined(LUA_COMPAT_MAXN)
   {"maxn", maxn},
 #endif
@@ -434,6 +856,7 @@ static const luaL_Reg tab_funcs[] = {
   {"pack", pack},
   {"unpack", unpack},
   {"remove", tremove},
+  {"reserve", treserve},
   {"move", tmove},
   {"sort", sort},
   {NULL, NULL}
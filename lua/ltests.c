@@ -232,8 +232,10 @@ static void checktable (global_State *g, Table *h) {
     checkvalref(g, hgc, &h->array[i]);
   for (n = gnode(h, 0); n < limit; n++) {
     if (!ttisnil(gval(n))) {
-      lua_assert(!ttisnil(gkey(n)));
-      checkvalref(g, hgc, gkey(n));
+      TValue k;
+      getnodekey(g->mainthread, &k, n);
+      lua_assert(!keyisnil(n));
+      checkvalref(g, hgc, &k);
       checkvalref(g, hgc, gval(n));
     }
   }
@@ -247,7 +249,8 @@ static void checktable (global_State *g, Table *h) {
 static void checkproto (global_State *g, Proto *f) {
   int i;
   GCObject *fgc = obj2gco(f);
-  checkobjref(g, fgc, f->cache);
+  for (i=0; i<NCLCACHE; i++)
+    checkobjref(g, fgc, f->cache[i]);
   checkobjref(g, fgc, f->source);
   for (i=0; i<f->sizek; i++) {
     if (ttisstring(f->k + i))
@@ -665,7 +668,7 @@ static int hash_query (lua_State *L) {
     Table *t;
     luaL_checktype(L, 2, LUA_TTABLE);
     t = hvalue(obj_at(L, 2));
-    lua_pushinteger(L, luaH_mainposition(t, o) - t->node);
+    lua_pushinteger(L, luaH_mainposition(L, t, o) - t->node);
   }
   return 1;
 }
@@ -697,9 +700,11 @@ static int table_query (lua_State *L) {
   }
   else if ((i -= t->sizearray) < sizenode(t)) {
     if (!ttisnil(gval(gnode(t, i))) ||
-        ttisnil(gkey(gnode(t, i))) ||
-        ttisnumber(gkey(gnode(t, i)))) {
-      pushobject(L, gkey(gnode(t, i)));
+        keyisnil(gnode(t, i)) ||
+        novariant(keytt(gnode(t, i))) == LUA_TNUMBER) {
+      TValue k;
+      getnodekey(L, &k, gnode(t, i));
+      pushobject(L, &k);
     }
     else
       lua_pushliteral(L, "<undef>");
@@ -721,14 +726,22 @@ static int string_query (lua_State *L) {
     lua_pushinteger(L ,tb->nuse);
     return 2;
   }
-  else if (s < tb->size) {
+  else if (s < tb->size || s < tb->oldsize) {
     TString *ts;
     int n = 0;
-    for (ts = tb->hash[s]; ts != NULL; ts = ts->u.hnext) {
+    for (ts = (s < tb->size) ? tb->hash[s] : NULL; ts != NULL;
+         ts = ts->u.hnext) {
       setsvalue2s(L, L->top, ts);
       api_incr_top(L);
       n++;
     }
+    if (s < tb->oldsize) {  /* strings not moved yet by a resize */
+      for (ts = tb->oldhash[s]; ts != NULL; ts = ts->u.hnext) {
+        setsvalue2s(L, L->top, ts);
+        api_incr_top(L);
+        n++;
+      }
+    }
     return n;
   }
   else return 0;
@@ -1095,6 +1108,9 @@ static int runC (lua_State *L, lua_State *L1, const char *pc) {
       op = strchr(ops, *pc++) - ops;
       lua_arith(L1, op);
     }
+    else if EQ("beginregion") {
+      lua_beginregion(L1);
+    }
     else if EQ("call") {
       int narg = getnum;
       int nres = getnum;
@@ -1128,6 +1144,9 @@ static int runC (lua_State *L, lua_State *L1, const char *pc) {
       int f = getindex;
       lua_copy(L1, f, getindex);
     }
+    else if EQ("endregion") {
+      lua_endregion(L1);
+    }
     else if EQ("func2num") {
       lua_CFunction func = lua_tocfunction(L1, getindex);
       lua_pushnumber(L1, cast(size_t, func));
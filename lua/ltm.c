@@ -74,6 +74,10 @@ const TValue *luaT_gettm (Table *events, TMS event, TString *ename) {
 }
 
 
+/*
+** The absence of the first metamethods (up to TM_EQ) is cached in the
+** 'flags' of the metatable, whatever the type of 'o'.
+*/
 const TValue *luaT_gettmbyobj (lua_State *L, const TValue *o, TMS event) {
   Table *mt;
   switch (ttnov(o)) {
@@ -86,7 +90,52 @@ const TValue *luaT_gettmbyobj (lua_State *L, const TValue *o, TMS event) {
     default:
       mt = G(L)->mt[ttnov(o)];
   }
-  return (mt ? luaH_getshortstr(mt, G(L)->tmname[event]) : luaO_nilobject);
+  if (mt == NULL)
+    return luaO_nilobject;
+  else if (event <= TM_EQ) {
+    const TValue *tm = fasttm(L, mt, event);
+    return (tm == NULL) ? luaO_nilobject : tm;
+  }
+  else return luaH_getshortstr(mt, G(L)->tmname[event]);
+}
+
+
+/*
+** Fast path of 'o[key]' for a value 'o' that is not a table (a string
+** method, a userdata field), when the '__index' of its metatable is a
+** table holding short string 'key'. The absence of '__index' is cached
+** in the metatable 'flags' and its node in 'tmicache'; 'ic' is the
+** inline cache of the instruction, for 'key' in the '__index' table.
+** Both are hints checked on each use, so metatables may change freely.
+** Returns NULL when the lookup must go through 'luaV_finishget'.
+*/
+const TValue *luaT_fastindex (lua_State *L, const TValue *o, TString *key,
+                                            unsigned int *ic) {
+  global_State *g = G(L);
+  int t = ttnov(o);
+  Table *mt = (t == LUA_TUSERDATA) ? uvalue(o)->metatable : g->mt[t];
+  const TValue *tm;
+  lua_assert(!ttistable(o));
+  if (mt == NULL || (mt->flags & (1u << TM_INDEX)))
+    return NULL;  /* no '__index' */
+  if (icachehit(mt, g->tmname[TM_INDEX], g->tmicache[t]))
+    tm = gval(gnode(mt, g->tmicache[t]));
+  else {
+    tm = luaH_getshortstrcached(mt, g->tmname[TM_INDEX], &g->tmicache[t]);
+    if (!ttistable(tm)) {
+      if (ttisnil(tm))
+        mt->flags |= cast_byte(1u << TM_INDEX);  /* cache its absence */
+      return NULL;
+    }
+  }
+  if (!ttistable(tm))  /* '__index' is a function? */
+    return NULL;
+  else {
+    Table *h = hvalue(tm);
+    tm = icachehit(h, key, *ic) ? gval(gnode(h, *ic))
+                                : luaH_getshortstrcached(h, key, ic);
+    return ttisnil(tm) ? NULL : tm;
+  }
 }
 
 
@@ -131,6 +131,52 @@ typedef const char * (*lua_Reader) (lua_State *L, void *ud, size_t *sz);
 typedef int (*lua_Writer) (lua_State *L, const void *p, size_t sz, void *ud);
 
 
+/*
+** Type for functions that release the memory of external strings
+*/
+typedef void (*lua_Release) (void *ud, const char *s, size_t len);
+
+
+/*
+** Live memory of a state ('lua_getmemstats'): objects of each kind, with
+** the bytes of the blocks they own, and blocks of every size class (up
+** to 2^i bytes); LUA_MEMOTHER has the blocks not owned by any object
+*/
+#define LUA_MEMTABLE	0
+#define LUA_MEMSTRING	1	/* short strings */
+#define LUA_MEMLNGSTR	2	/* long strings */
+#define LUA_MEMLCL	3	/* Lua closures */
+#define LUA_MEMCCL	4	/* C closures */
+#define LUA_MEMUDATA	5
+#define LUA_MEMTHREAD	6	/* with their stacks */
+#define LUA_MEMPROTO	7	/* with their code */
+#define LUA_MEMOTHER	8	/* upvalues, string table, caches... */
+#define LUA_MEMKINDS	9
+
+#define LUA_MEMCLASSES	32
+
+typedef struct lua_MemStats {
+  size_t count[LUA_MEMKINDS];
+  size_t bytes[LUA_MEMKINDS];
+  size_t blocks[LUA_MEMCLASSES];  /* of objects only */
+} lua_MemStats;
+
+
+/*
+** Types for functions that push the arguments of an event and take its
+** results in a batch of calls ('lua_pcallbatch')
+*/
+typedef int (*lua_Push) (lua_State *L, int i, void *ud);
+
+typedef void (*lua_Result) (lua_State *L, int i, int status, void *ud);
+
+
+/*
+** Type for pre-interned string keys (see 'lua_internkey')
+*/
+typedef const struct TString *lua_Key;
+
+
 /*
 ** Type for memory-allocation functions
 */
@@ -157,6 +203,8 @@ extern const char lua_ident[];
 */
 LUA_API lua_State *(lua_newstate) (lua_Alloc f, void *ud);
 LUA_API void       (lua_close) (lua_State *L);
+LUA_API int        (lua_clonestate) (lua_State *L, lua_State *to);
+LUA_API void       (lua_getmemstats) (lua_State *L, lua_MemStats *ms);
 LUA_API lua_State *(lua_newthread) (lua_State *L);
 
 LUA_API lua_CFunction (lua_atpanic) (lua_State *L, lua_CFunction panicf);
@@ -202,6 +250,8 @@ LUA_API const char     *(lua_tolstring) (lua_State *L, int idx, size_t *len);
 LUA_API size_t          (lua_rawlen) (lua_State *L, int idx);
 LUA_API lua_CFunction   (lua_tocfunction) (lua_State *L, int idx);
 LUA_API void	       *(lua_touserdata) (lua_State *L, int idx);
+LUA_API void	       *(lua_touserdatatag) (lua_State *L, int idx,
+                                             const void *tag);
 LUA_API lua_State      *(lua_tothread) (lua_State *L, int idx);
 LUA_API const void     *(lua_topointer) (lua_State *L, int idx);
 
@@ -257,6 +307,9 @@ LUA_API void        (lua_pushnumber) (lua_State *L, lua_Number n);
 #endif /* _KERNEL */
 LUA_API void        (lua_pushinteger) (lua_State *L, lua_Integer n);
 LUA_API const char *(lua_pushlstring) (lua_State *L, const char *s, size_t len);
+LUA_API const char *(lua_pushexternalstring) (lua_State *L, const char *s,
+                                   size_t len, lua_Release release, void *ud);
+LUA_API char       *(lua_pushlongstring) (lua_State *L, size_t len);
 LUA_API const char *(lua_pushstring) (lua_State *L, const char *s);
 LUA_API const char *(lua_pushvfstring) (lua_State *L, const char *fmt,
                                                       va_list argp);
@@ -273,12 +326,18 @@ LUA_API int   (lua_pushthread) (lua_State *L);
 LUA_API int (lua_getglobal) (lua_State *L, const char *name);
 LUA_API int (lua_gettable) (lua_State *L, int idx);
 LUA_API int (lua_getfield) (lua_State *L, int idx, const char *k);
+LUA_API int (lua_getfieldk) (lua_State *L, int idx, lua_Key k);
 LUA_API int (lua_geti) (lua_State *L, int idx, lua_Integer n);
 LUA_API int (lua_rawget) (lua_State *L, int idx);
 LUA_API int (lua_rawgeti) (lua_State *L, int idx, lua_Integer n);
+LUA_API int (lua_getiarray) (lua_State *L, int idx, lua_Integer i,
+                             lua_Integer *v, int n);
 LUA_API int (lua_rawgetp) (lua_State *L, int idx, const void *p);
 
 LUA_API void  (lua_createtable) (lua_State *L, int narr, int nrec);
+LUA_API void  (lua_clonetable) (lua_State *L, int idx);
+LUA_API void  (lua_reservetable) (lua_State *L, int idx, int narr, int nrec);
+LUA_API void  (lua_cleartable) (lua_State *L, int idx);
 LUA_API void *(lua_newuserdata) (lua_State *L, size_t sz);
 LUA_API int   (lua_getmetatable) (lua_State *L, int objindex);
 LUA_API int  (lua_getuservalue) (lua_State *L, int idx);
@@ -290,9 +349,12 @@ LUA_API int  (lua_getuservalue) (lua_State *L, int idx);
 LUA_API void  (lua_setglobal) (lua_State *L, const char *name);
 LUA_API void  (lua_settable) (lua_State *L, int idx);
 LUA_API void  (lua_setfield) (lua_State *L, int idx, const char *k);
+LUA_API void  (lua_setfieldk) (lua_State *L, int idx, lua_Key k);
 LUA_API void  (lua_seti) (lua_State *L, int idx, lua_Integer n);
 LUA_API void  (lua_rawset) (lua_State *L, int idx);
 LUA_API void  (lua_rawseti) (lua_State *L, int idx, lua_Integer n);
+LUA_API void  (lua_setiarray) (lua_State *L, int idx, lua_Integer i,
+                               const lua_Integer *v, int n);
 LUA_API void  (lua_rawsetp) (lua_State *L, int idx, const void *p);
 LUA_API int   (lua_setmetatable) (lua_State *L, int objindex);
 LUA_API void  (lua_setuservalue) (lua_State *L, int idx);
@@ -308,6 +370,9 @@ LUA_API void  (lua_callk) (lua_State *L, int nargs, int nresults,
 LUA_API int   (lua_pcallk) (lua_State *L, int nargs, int nresults, int errfunc,
                             lua_KContext ctx, lua_KFunction k);
 #define lua_pcall(L,n,r,f)	lua_pcallk(L, (n), (r), (f), 0, NULL)
+LUA_API int   (lua_pcallbatch) (lua_State *L, int n, int nresults,
+                                int errfunc, lua_Push push, lua_Result result,
+                                void *ud);
 
 LUA_API int   (lua_load) (lua_State *L, lua_Reader reader, void *dt,
                           const char *chunkname, const char *mode);
@@ -340,8 +405,16 @@ LUA_API int (lua_isyieldable) (lua_State *L);
 #define LUA_GCSETPAUSE		6
 #define LUA_GCSETSTEPMUL	7
 #define LUA_GCISRUNNING		9
+#define LUA_GCDEFER		10
+#define LUA_GCDEFERSTEP		11
+#define LUA_GCSTEPNS		12
+#define LUA_GCGEN		13
+#define LUA_GCINC		14
+#define LUA_GCSETMAJORINC	15
 
 LUA_API int (lua_gc) (lua_State *L, int what, int data);
+LUA_API void (lua_beginregion) (lua_State *L);
+LUA_API void (lua_endregion) (lua_State *L);
 
 
 /*
@@ -351,15 +424,33 @@ LUA_API int (lua_gc) (lua_State *L, int what, int data);
 LUA_API int   (lua_error) (lua_State *L);
 
 LUA_API int   (lua_next) (lua_State *L, int idx);
+LUA_API int   (lua_nextidx) (lua_State *L, int idx, unsigned int *cursor);
 
 LUA_API void  (lua_concat) (lua_State *L, int n);
 LUA_API void  (lua_len)    (lua_State *L, int idx);
 
 LUA_API size_t   (lua_stringtonumber) (lua_State *L, const char *s);
 
+/* room for any integer formatted by 'lua_integer2buff', with its '\0' */
+#define LUA_INTBUFFSIZE	24
+
+LUA_API int   (lua_integer2buff) (char *buff, lua_Integer n);
+
 LUA_API lua_Alloc (lua_getallocf) (lua_State *L, void **ud);
 LUA_API void      (lua_setallocf) (lua_State *L, lua_Alloc f, void *ud);
 
+LUA_API int   (lua_setstacklimit) (lua_State *L, int limit);
+LUA_API int   (lua_setbudget) (lua_State *L, int budget, int yield);
+
+LUA_API int   (lua_ref) (lua_State *L);
+LUA_API int   (lua_getref) (lua_State *L, int ref);
+LUA_API void  (lua_unref) (lua_State *L, int ref);
+
+LUA_API lua_Key (lua_internkey) (lua_State *L, const char *k);
+LUA_API void  (lua_setstrcache) (lua_State *L, int n, int m);
+LUA_API void  (lua_strcachestats) (lua_State *L, size_t *hits,
+                                   size_t *misses);
+
 
 
 /*
@@ -469,6 +560,18 @@ LUA_API lua_Hook (lua_gethook) (lua_State *L);
 LUA_API int (lua_gethookmask) (lua_State *L);
 LUA_API int (lua_gethookcount) (lua_State *L);
 
+/*
+** Per-function counters: calls of a Lua function and executions of each
+** of its instructions ('counts[pc]'), reported with its short source
+** and line info (NULL if stripped or compact) by 'lua_getcounters'
+*/
+typedef void (*lua_Counters) (void *ud, const char *src, int linedefined,
+                              size_t calls, const size_t *counts,
+                              const int *lineinfo, int n);
+
+LUA_API int (lua_setcounters) (lua_State *L, int on);
+LUA_API void (lua_getcounters) (lua_State *L, lua_Counters f, void *ud);
+
 
 struct lua_Debug {
   int event;
@@ -804,12 +804,25 @@
 #undef LUA_MAXINTEGER
 #undef LUA_MININTEGER
 
+/*
+** LUA_32BITS (LUNATIK_INT=32, allowed only on 32-bit kernels) uses 'int'
+** so that integer arithmetic needs no 64-bit helpers
+*/
+#if defined(LUA_32BITS)
+#define LUA_INTEGER		int
+#define LUA_INTEGER_FRMLEN	""
+#define LUA_UNSIGNED	        unsigned int
+#define LUA_MAXUNSIGNED		UINT_MAX
+#define LUA_MAXINTEGER		INT_MAX
+#define LUA_MININTEGER		INT_MIN
+#else
 #define LUA_INTEGER		long long
 #define LUA_INTEGER_FRMLEN	"ll"
 #define LUA_UNSIGNED	        unsigned long long
 #define LUA_MAXUNSIGNED		ULLONG_MAX
 #define LUA_MAXINTEGER		LLONG_MAX
 #define LUA_MININTEGER		LLONG_MIN
+#endif /* LUA_32BITS */
 
 #define LUAI_UACNUMBER		LUA_INTEGER
 #define LUA_NUMBER		LUA_INTEGER
@@ -820,18 +833,32 @@
 
 /* math.h */
 #include <linux/random.h>
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,8,0)
-#define l_rand()		prandom_u32()
-#define l_srand(x)		prandom_seed(x)
-#else
-#define l_rand()		random32()
-#define l_srand(x)		srandom32(x)
+#define l_randombytes(b,n)	get_random_bytes(b,n)
+
+/*
+** setjmp.h: the buffer holds only what arch/$(ARCH)/setjmp.S saves, that
+** is, the callee-saved registers, the stack pointer and the return
+** address (in words); this keeps 'lua_longjmp' small on the C stack
+*/
+#if defined(CONFIG_X86_64)
+#define LUAI_JMPBUFSIZE		8	/* rbx, rsp, rbp, r12-r15, rip */
+#elif defined(CONFIG_X86_32)
+#define LUAI_JMPBUFSIZE		6	/* ebx, esp, ebp, esi, edi, eip */
+#elif defined(CONFIG_ARM64)
+#define LUAI_JMPBUFSIZE		13	/* x19-x30, sp */
+#elif defined(CONFIG_ARM)
+#define LUAI_JMPBUFSIZE		11	/* r4-r14 */
 #endif
 
-/* setjmp.h */
+#ifdef LUAI_JMPBUFSIZE
+struct __jmp_buf {
+  unsigned long val[LUAI_JMPBUFSIZE];
+};
+#else
 struct __jmp_buf {
   unsigned long long val[14];
 };
+#endif
 typedef struct __jmp_buf luai_jmpbuf[1];
 extern int setjmp(luai_jmpbuf);
 extern void longjmp(luai_jmpbuf);
@@ -844,13 +871,19 @@ extern void longjmp(luai_jmpbuf);
 #include <linux/time.h>
 typedef struct timespec time_t;
 #define luai_time(t)		getnstimeofday(&t)
-#elif defined(LUA_32BITS)
-#error "kernel versions >= 5.6.0 do not support 32-bit time values"
-#else
+#else  /* 64-bit seconds, also on 32-bit kernels (see 'os_time') */
 typedef struct timespec64 time_t;
 #define luai_time(t)		ktime_get_real_ts64(&t)
 #endif
 
+/* clocks of 'os.monotonic_ns' and 'os.coarse_ns' */
+#define l_monotonic()		ktime_get_ns()
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,3,0)
+#define l_coarse()		ktime_get_coarse_ns()
+#else
+#define l_coarse()		ktime_to_ns(ktime_get_coarse())
+#endif
+
 static inline int time(void *p)
 {
   time_t t;
@@ -858,7 +891,16 @@ static inline int time(void *p)
   luai_time(t);
   return t.tv_sec;
 }
-#define luai_makeseed()	        cast(unsigned int, time(NULL))
+
+static inline unsigned int l_makeseed(void)
+{
+  unsigned int seed;
+  get_random_bytes(&seed, sizeof(seed));
+  return seed;
+}
+#define luai_makeseed()	        l_makeseed()
+#define LUAI_CLOCK		u64	/* 'lu_mem' wraps in 4s on 32 bits */
+#define luai_gcclock()		cast(l_clock, ktime_get_ns())
 
 /* stdio.h */
 #include <linux/printk.h>
@@ -882,21 +924,162 @@ static inline int time(void *p)
 #define UCHAR_MAX	(255)
 #define CHAR_BIT	(8)
 
+/* room for a formatted item ('MAX_ITEM' in lstrlib.c) and then some */
 #undef LUAL_BUFFERSIZE
-#define LUAL_BUFFERSIZE		(64)
+#define LUAL_BUFFERSIZE		(256)
 
-#ifndef __LP64__
+/* 'table.sort' copies at most 1024 keys (24 KiB on 64 bits) to sort them */
+#define LUAL_SORTDIRECT		(1u << 10)
+
+/* stacks beyond 2048 slots (32 KiB) grow in 32 KiB steps (see ldo.c) */
+#define LUAI_STACKSTEP		(2048)
+
+/* computed-goto dispatch for 'luaV_execute' (see ljumptab.h) */
+#if !defined(LUAI_USEJUMPTABLE) && \
+	(defined(CONFIG_X86) || defined(CONFIG_ARM64) || defined(CONFIG_MIPS))
+#define LUAI_USEJUMPTABLE
+#endif
+
+/*
+** State locking (see 'lua_lock' in llimits.h): with LUNATIK_SPINLOCK or
+** LUNATIK_MUTEX, the first word of the extra space of every thread points
+** to the lock of its state; states without a lock (e.g., created by
+** 'luaL_newstate') are left unlocked.
+*/
+#if defined(LUNATIK_SPINLOCK) || defined(LUNATIK_MUTEX)
+#define LUNATIK_LOCK
+#ifdef LUNATIK_SPINLOCK
+#include <linux/spinlock.h>
+struct lunatik_lock {
+  spinlock_t lock;
+  unsigned long flags;  /* saved by the lock holder */
+};
+#define lunatik_lockinit(l)	spin_lock_init(&(l)->lock)
+#define lunatik_lock_(l)	spin_lock_irqsave(&(l)->lock, (l)->flags)
+#define lunatik_unlock_(l)	spin_unlock_irqrestore(&(l)->lock, (l)->flags)
+#define lunatik_yield_()	((void)0)
+#else
+#include <linux/mutex.h>
+#include <linux/sched.h>
+struct lunatik_lock {
+  struct mutex lock;
+};
+#define lunatik_lockinit(l)	mutex_init(&(l)->lock)
+#define lunatik_lock_(l)	mutex_lock(&(l)->lock)
+#define lunatik_unlock_(l)	mutex_unlock(&(l)->lock)
+#define lunatik_yield_()	cond_resched()
+#endif /* LUNATIK_SPINLOCK */
+
+/* the second word points to the task running in the thread, if any */
+#undef LUA_EXTRASPACE
+#define LUA_EXTRASPACE		(2 * sizeof(void *))
+
+#define lunatik_getlock(L)	(*(struct lunatik_lock **)lua_getextraspace(L))
+#define lunatik_gettask_(L)	(((void **)lua_getextraspace(L))[1])
+
+#define lua_lock(L)	\
+	{ struct lunatik_lock *l_ = lunatik_getlock(L); if (l_) lunatik_lock_(l_); }
+#define lua_unlock(L)	\
+	{ struct lunatik_lock *l_ = lunatik_getlock(L); if (l_) lunatik_unlock_(l_); }
+#define luai_threadyield(L)	{ lua_unlock(L); lunatik_yield_(); lua_lock(L); }
+
+/* 'lua_close' never leaves the core */
+#define luai_userstateopen(L)	\
+	(lunatik_getlock(L) = NULL, lunatik_gettask_(L) = NULL)
+#define luai_userstateclose(L)	lua_unlock(L)
+
+/* deferred GC steps (see 'LUA_GCDEFER') are queued on a workqueue */
+struct lua_State;
+void lunatik_gcdefer(struct lua_State *L);
+#define luai_gcdefer(L)		lunatik_gcdefer(L)
+#endif /* LUNATIK_SPINLOCK || LUNATIK_MUTEX */
+
+/* cached symbol lookup of 'package.loadlib' (see lunatik_sym.c) */
+void *lunatik_lookupsym(const char *name);
+#define luai_lookupsym(path)	lunatik_lookupsym(path)
+
+/* instruction budget out in a thread that cannot yield (see lunatik_core.c) */
+struct lua_State;
+void lunatik_budgetyield(struct lua_State *L);
+#define luai_budgetyield(L)	lunatik_budgetyield(L)
+
+/* samples requested by the profiler timer (see lunatik_prof.c) */
+void lunatik_profreq(struct lua_State *L);
+#define luai_hookreq(L)		lunatik_profreq(L)
+
+/* tracepoints of the core (see lunatik_trace.h) */
+#if defined(LUA_CORE)
+#include "lunatik_trace.h"
+#define lunatik_tracesrc(p)	((p)->source ? getstr((p)->source) : "?")
+#define luai_tracecall(L,p)	\
+	trace_lunatik_call(L, lunatik_tracesrc(p), (p)->linedefined)
+#define luai_tracereturn(L,p)	\
+	trace_lunatik_return(L, lunatik_tracesrc(p), (p)->linedefined)
+#define luai_tracegc(L,from,to,work)	\
+	trace_lunatik_gcstate(L, from, to, (size_t)(work))
+#define luai_tracestack(L,osize,nsize)	trace_lunatik_stack(L, osize, nsize)
+#define luai_tracestrt(L,osize,nsize)	trace_lunatik_strtab(L, osize, nsize)
+#define luai_tracealloc(L,b,nb,osize,nsize)	\
+	trace_lunatik_realloc(L, b, nb, osize, nsize)
+#endif
+
+/* runtime statistics of the states of 'lunatik_newstate' (lunatik_core.c) */
+struct lua_State;
+void lunatik_statgc(struct lua_State *L, u64 ns);
+void lunatik_statcycle(struct lua_State *L);
+void lunatik_staterror(struct lua_State *L);
+void lunatik_statbudget(struct lua_State *L, u64 n);
+void lunatik_statstack(struct lua_State *L, int size);
+#define luai_statclock()	luai_gcclock()
+#define luai_statgc(L,ns)	lunatik_statgc(L, ns)
+#define luai_statcycle(L)	lunatik_statcycle(L)
+#define luai_staterror(L)	lunatik_staterror(L)
+#define luai_statbudget(L,n)	lunatik_statbudget(L, n)
+#define luai_statstack(L,size)	lunatik_statstack(L, size)
+
+/* code shared by the states of a pool (see LUNATIK_POOL_SHARE) */
+void lunatik_share(void *shared);
+void lunatik_unshare(void *shared);
+#define luai_protoshare(L,s)	lunatik_share(s)
+#define luai_protounshare(L,s)	lunatik_unshare(s)
+
+#if !defined(__LP64__) && !defined(LUA_32BITS)
 #include <asm/div64.h>
 
 /* llvm */
 s64 __modti3(s64 a, s64 b);
 
-#define lunatik_idiv(n, m)	((lua_Integer) div64_s64((s64) n, (s64) m))
-#define lunatik_imod(n, m)	((lua_Integer) __modti3((s64) n, (s64) m))
-#else
+/*
+** operands that fit in 32 bits use the native 32-bit division instead of
+** the 64-bit helpers ('m' == -1 is excluded, as INT_MIN / -1 overflows)
+*/
+#define lunatik_fits32(n)	((s64) (s32) (n) == (s64) (n))
+
+static inline LUA_INTEGER lunatik_idiv(LUA_INTEGER n, LUA_INTEGER m)
+{
+  if (lunatik_fits32(n) && lunatik_fits32(m) && m != -1)
+    return (s32) n / (s32) m;
+  return (LUA_INTEGER) div64_s64((s64) n, (s64) m);
+}
+
+static inline LUA_INTEGER lunatik_imod(LUA_INTEGER n, LUA_INTEGER m)
+{
+  if (lunatik_fits32(n) && lunatik_fits32(m) && m != -1)
+    return (s32) n % (s32) m;
+  return (LUA_INTEGER) __modti3((s64) n, (s64) m);
+}
+
+/* 64-bit by 32-bit division of 'luaO_int2str' */
+#include <linux/math64.h>
+#define luai_udivmod(n,d,r)	((n) = div_u64_rem((n), (d), (r)))
+#else  /* native division for 64-bit kernels and for 32-bit integers */
 #define lunatik_idiv(n, m)	((n) / (m))
 #define lunatik_imod(n, m)	((n) % (m))
-#endif /* __LP64__ */
+#endif /* !__LP64__ && !LUA_32BITS */
+
+/* index of the lowest set bit of a (non-zero) integer */
+#include <linux/bitops.h>
+#define lunatik_ctz(n)		((int) __ffs64((u64) (n)))
 
 /* keep this as the last ifdef to prevent incorrect undefs on linux's headers */
 #if defined(llex_c) || defined(lstate_c) || defined(lcode_c) || \
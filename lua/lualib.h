@@ -15,42 +15,63 @@
 #define LUA_VERSUFFIX          "_" LUA_VERSION_MAJOR "_" LUA_VERSION_MINOR
 
 
+#define LUA_GLIBK		1
 LUAMOD_API int (luaopen_base) (lua_State *L);
 
 #define LUA_COLIBNAME	"coroutine"
+#define LUA_COLIBK		(LUA_GLIBK << 2)
 LUAMOD_API int (luaopen_coroutine) (lua_State *L);
 
 #define LUA_TABLIBNAME	"table"
+#define LUA_TABLIBK		(LUA_GLIBK << 3)
 LUAMOD_API int (luaopen_table) (lua_State *L);
 
 #define LUA_IOLIBNAME	"io"
+#define LUA_IOLIBK		(LUA_GLIBK << 4)
 LUAMOD_API int (luaopen_io) (lua_State *L);
 
 #define LUA_OSLIBNAME	"os"
+#define LUA_OSLIBK		(LUA_GLIBK << 5)
 LUAMOD_API int (luaopen_os) (lua_State *L);
 
 #define LUA_STRLIBNAME	"string"
+#define LUA_STRLIBK		(LUA_GLIBK << 6)
 LUAMOD_API int (luaopen_string) (lua_State *L);
 
 #define LUA_UTF8LIBNAME	"utf8"
+#define LUA_UTF8LIBK		(LUA_GLIBK << 7)
 LUAMOD_API int (luaopen_utf8) (lua_State *L);
 
+#define LUA_INTMAPLIBNAME	"intmap"
+#define LUA_INTMAPLIBK		(LUA_GLIBK << 8)
+LUAMOD_API int (luaopen_intmap) (lua_State *L);
+LUALIB_API void (luaL_newintmap) (lua_State *L, int n);
+LUALIB_API int (luaL_intmapget) (lua_State *L, int idx, lua_Integer k);
+LUALIB_API void (luaL_intmapset) (lua_State *L, int idx, lua_Integer k);
+
 #define LUA_BITLIBNAME	"bit32"
+#define LUA_BITLIBK		(LUA_GLIBK << 9)
 LUAMOD_API int (luaopen_bit32) (lua_State *L);
 
 #define LUA_MATHLIBNAME	"math"
+#define LUA_MATHLIBK		(LUA_GLIBK << 10)
 LUAMOD_API int (luaopen_math) (lua_State *L);
 
 #define LUA_DBLIBNAME	"debug"
+#define LUA_DBLIBK		(LUA_GLIBK << 11)
 LUAMOD_API int (luaopen_debug) (lua_State *L);
 
 #define LUA_LOADLIBNAME	"package"
+#define LUA_LOADLIBK		(LUA_GLIBK << 1)
 LUAMOD_API int (luaopen_package) (lua_State *L);
 
 
 /* open all previous libraries */
 LUALIB_API void (luaL_openlibs) (lua_State *L);
 
+/* open the libraries in 'load' and, on their first use, those in 'lazy' */
+LUALIB_API void (luaL_openselectedlibs) (lua_State *L, int load, int lazy);
+
 
 
 #if !defined(lua_assert)
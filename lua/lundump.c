@@ -21,20 +21,17 @@
 #include "lfunc.h"
 #include "lmem.h"
 #include "lobject.h"
+#include "lopcodes.h"
 #include "lstring.h"
 #include "lundump.h"
 #include "lzio.h"
 
 
-#if !defined(luai_verifycode)
-#define luai_verifycode(L,b,f)  /* empty */
-#endif
-
-
 typedef struct {
   lua_State *L;
   ZIO *Z;
   const char *name;
+  int verify;  /* check the bounds of the code? */
 } LoadState;
 
 
@@ -51,7 +48,13 @@ static l_noret error(LoadState *S, const char *why) {
 #define LoadVector(S,b,n)	LoadBlock(S,b,(n)*sizeof((b)[0]))
 
 static void LoadBlock (LoadState *S, void *b, size_t size) {
-  if (luaZ_read(S->Z, b, size) != 0)
+  ZIO *z = S->Z;
+  if (size <= z->n) {  /* all in the current block? (the usual case) */
+    memcpy(b, z->p, size);
+    z->n -= size;
+    z->p += size;
+  }
+  else if (luaZ_read(z, b, size) != 0)
     error(S, "truncated");
 }
 
@@ -59,6 +62,10 @@ static void LoadBlock (LoadState *S, void *b, size_t size) {
 #define LoadVar(S,x)		LoadVector(S,&x,1)
 
 
+/* empty arrays (e.g., the locals and protos of most functions) cost nothing */
+#define NewVector(S,n,t)	((n) != 0 ? luaM_newvector(S->L, n, t) : NULL)
+
+
 static lu_byte LoadByte (LoadState *S) {
   lu_byte x;
   LoadVar(S, x);
@@ -95,6 +102,13 @@ static TString *LoadString (LoadState *S) {
     return NULL;
   else if (--size <= LUAI_MAXSHORTLEN) {  /* short string? */
     char buff[LUAI_MAXSHORTLEN];
+    ZIO *z = S->Z;
+    if (size <= z->n) {  /* intern it straight from the input */
+      TString *ts = luaS_newlstr(S->L, z->p, size);
+      z->n -= size;
+      z->p += size;
+      return ts;
+    }
     LoadVector(S, buff, size);
     return luaS_newlstr(S->L, buff, size);
   }
@@ -108,7 +122,7 @@ static TString *LoadString (LoadState *S) {
 
 static void LoadCode (LoadState *S, Proto *f) {
   int n = LoadInt(S);
-  f->code = luaM_newvector(S->L, n, Instruction);
+  f->code = NewVector(S, n, Instruction);
   f->sizecode = n;
   LoadVector(S, f->code, n);
 }
@@ -120,7 +134,7 @@ static void LoadFunction(LoadState *S, Proto *f, TString *psource);
 static void LoadConstants (LoadState *S, Proto *f) {
   int i;
   int n = LoadInt(S);
-  f->k = luaM_newvector(S->L, n, TValue);
+  f->k = NewVector(S, n, TValue);
   f->sizek = n;
   for (i = 0; i < n; i++)
     setnilvalue(&f->k[i]);
@@ -143,10 +157,16 @@ static void LoadConstants (LoadState *S, Proto *f) {
       setivalue(o, LoadInteger(S));
       break;
     case LUA_TSHRSTR:
-    case LUA_TLNGSTR:
-      setsvalue2n(S->L, o, LoadString(S));
+    case LUA_TLNGSTR: {
+      TString *ts = LoadString(S);
+      if (ts == NULL)  /* (only a source name may be missing) */
+        error(S, "bad constant in");
+      setsvalue2n(S->L, o, ts);
       break;
+    }
     default:
+      if (S->verify)
+        error(S, "bad constant in");
       lua_assert(0);
     }
   }
@@ -156,7 +176,7 @@ static void LoadConstants (LoadState *S, Proto *f) {
 static void LoadProtos (LoadState *S, Proto *f) {
   int i;
   int n = LoadInt(S);
-  f->p = luaM_newvector(S->L, n, Proto *);
+  f->p = NewVector(S, n, Proto *);
   f->sizep = n;
   for (i = 0; i < n; i++)
     f->p[i] = NULL;
@@ -170,13 +190,14 @@ static void LoadProtos (LoadState *S, Proto *f) {
 static void LoadUpvalues (LoadState *S, Proto *f) {
   int i, n;
   n = LoadInt(S);
-  f->upvalues = luaM_newvector(S->L, n, Upvaldesc);
+  f->upvalues = NewVector(S, n, Upvaldesc);
   f->sizeupvalues = n;
   for (i = 0; i < n; i++)
     f->upvalues[i].name = NULL;
   for (i = 0; i < n; i++) {
     f->upvalues[i].instack = LoadByte(S);
     f->upvalues[i].idx = LoadByte(S);
+    f->upvalues[i].ro = 0;  /* not saved in binary chunks */
   }
 }
 
@@ -184,11 +205,11 @@ static void LoadUpvalues (LoadState *S, Proto *f) {
 static void LoadDebug (LoadState *S, Proto *f) {
   int i, n;
   n = LoadInt(S);
-  f->lineinfo = luaM_newvector(S->L, n, int);
+  f->lineinfo = NewVector(S, n, int);
   f->sizelineinfo = n;
   LoadVector(S, f->lineinfo, n);
   n = LoadInt(S);
-  f->locvars = luaM_newvector(S->L, n, LocVar);
+  f->locvars = NewVector(S, n, LocVar);
   f->sizelocvars = n;
   for (i = 0; i < n; i++)
     f->locvars[i].varname = NULL;
@@ -198,11 +219,177 @@ static void LoadDebug (LoadState *S, Proto *f) {
     f->locvars[i].endpc = LoadInt(S);
   }
   n = LoadInt(S);
+  if (S->verify && n > f->sizeupvalues)
+    error(S, "bad code in");
   for (i = 0; i < n; i++)
     f->upvalues[i].name = LoadString(S);
 }
 
 
+/*
+** {======================================================
+** Bounds verification, for chunks loaded with a 'v' in their mode: every
+** register, constant, upvalue and nested function used by the code of
+** 'f' must exist and every jump must land on an instruction, so that the
+** VM never indexes out of its arrays. The types of values in registers
+** are not checked, so this does not make untrusted code safe to run.
+** =======================================================
+*/
+
+#define checkv(S,c)	((c) ? (void)0 : error(S, "bad code in"))
+
+#define checkreg(S,f,r)	checkv(S, (r) < (f)->maxstacksize)
+
+
+static void checkRK (LoadState *S, const Proto *f, int x) {
+  if (ISK(x))
+    checkv(S, INDEXK(x) < f->sizek);
+  else
+    checkreg(S, f, x);
+}
+
+
+static void checkarg (LoadState *S, const Proto *f, enum OpArgMask m,
+                      int x) {
+  if (m == OpArgR)
+    checkreg(S, f, x);
+  else if (m == OpArgK)
+    checkRK(S, f, x);
+}
+
+
+/* an instruction with an open B (up to 'top') follows one that sets it */
+static int isopen (const Proto *f, int pc) {
+  Instruction i;
+  if (pc == 0)
+    return 0;
+  i = f->code[pc - 1];
+  switch (GET_OPCODE(i)) {
+    case OP_CALL: case OP_TAILCALL: return GETARG_C(i) == 0;
+    case OP_VARARG: return GETARG_B(i) == 0;
+    default: return 0;
+  }
+}
+
+
+/* 'pc + 1' exists and is an instruction 'op' */
+#define checknext(S,f,pc,op) \
+	checkv(S, (pc) + 1 < (f)->sizecode && \
+	  GET_OPCODE((f)->code[(pc) + 1]) == (op))
+
+
+static void checkcode (LoadState *S, const Proto *f) {
+  int n = f->sizecode;
+  int pc;
+  checkv(S, n > 0 && GET_OPCODE(f->code[n - 1]) == OP_RETURN);
+  checkv(S, f->numparams <= f->maxstacksize);
+  checkv(S, f->sizelineinfo == 0 || f->sizelineinfo == n);
+  for (pc = 0; pc < n; pc++) {
+    Instruction i = f->code[pc];
+    OpCode op = GET_OPCODE(i);
+    int a = GETARG_A(i);
+    int b = GETARG_B(i);
+    int c = GETARG_C(i);
+    checkv(S, op < OP_GETTABUPF);  /* fused opcodes are never dumped */
+    if (testAMode(op))
+      checkreg(S, f, a);
+    switch (getOpMode(op)) {
+      case iABC: {
+        checkarg(S, f, getBMode(op), b);
+        checkarg(S, f, getCMode(op), c);
+        break;
+      }
+      case iABx: {
+        if (getBMode(op) == OpArgK)
+          checkv(S, GETARG_Bx(i) < f->sizek);
+        break;
+      }
+      case iAsBx: {
+        int dest = pc + 1 + GETARG_sBx(i);
+        checkv(S, 0 <= dest && dest < n &&
+                  GET_OPCODE(f->code[dest]) != OP_EXTRAARG);
+        break;
+      }
+      case iAx: {
+        checkv(S, 0);  /* only as part of the previous instruction */
+        break;
+      }
+    }
+    if (testTMode(op))
+      checknext(S, f, pc, OP_JMP);
+    switch (op) {  /* what the modes do not tell */
+      case OP_LOADKX: {
+        checknext(S, f, pc, OP_EXTRAARG);
+        checkv(S, GETARG_Ax(f->code[++pc]) < f->sizek);
+        break;
+      }
+      case OP_LOADBOOL: {
+        checkv(S, c == 0 || pc + 2 < n);
+        break;
+      }
+      case OP_LOADNIL: checkreg(S, f, a + b); break;
+      case OP_GETUPVAL: case OP_SETUPVAL: case OP_GETTABUP: {
+        checkv(S, b < f->sizeupvalues);
+        break;
+      }
+      case OP_SETTABUP: checkv(S, a < f->sizeupvalues); break;
+      case OP_SETTABLE: case OP_TEST: checkreg(S, f, a); break;
+      case OP_SELF: checkreg(S, f, a + 1); break;
+      case OP_CONCAT: checkv(S, b < c); break;
+      case OP_JMP: checkv(S, a == 0 || a - 1 < f->maxstacksize); break;
+      case OP_CALL: case OP_TAILCALL: {
+        checkv(S, b > 0 ? a + b - 1 < f->maxstacksize : isopen(f, pc));
+        if (op == OP_CALL && c > 1)
+          checkreg(S, f, a + c - 2);
+        break;
+      }
+      case OP_RETURN: {
+        if (b != 1)
+          checkv(S, b > 1 ? a + b - 2 < f->maxstacksize :
+                            a < f->maxstacksize && isopen(f, pc));
+        break;
+      }
+      case OP_FORLOOP: case OP_FORPREP: checkreg(S, f, a + 3); break;
+      case OP_TFORCALL: {
+        checkreg(S, f, a + 2 + c);
+        checknext(S, f, pc, OP_TFORLOOP);
+        break;
+      }
+      case OP_TFORLOOP: checkreg(S, f, a + 1); break;
+      case OP_SETLIST: {
+        checkreg(S, f, a);
+        checkv(S, b > 0 ? a + b < f->maxstacksize : isopen(f, pc));
+        if (c == 0) {
+          checknext(S, f, pc, OP_EXTRAARG);
+          pc++;
+        }
+        break;
+      }
+      case OP_CLOSURE: checkv(S, GETARG_Bx(i) < f->sizep); break;
+      case OP_VARARG: checkv(S, b <= 1 || a + b - 2 < f->maxstacksize); break;
+      default: break;
+    }
+  }
+}
+
+
+/* checks 'f' once it is loaded, with the upvalues of its nested functions */
+static void checkfunction (LoadState *S, const Proto *f) {
+  int i, j;
+  checkcode(S, f);
+  for (i = 0; i < f->sizep; i++) {
+    const Proto *p = f->p[i];
+    for (j = 0; j < p->sizeupvalues; j++) {
+      const Upvaldesc *uv = &p->upvalues[j];
+      checkv(S, uv->instack ? uv->idx < f->maxstacksize
+                            : uv->idx < f->sizeupvalues);
+    }
+  }
+}
+
+/* }====================================================== */
+
+
 static void LoadFunction (LoadState *S, Proto *f, TString *psource) {
   f->source = LoadString(S);
   if (f->source == NULL)  /* no source in dump? */
@@ -217,6 +404,10 @@ static void LoadFunction (LoadState *S, Proto *f, TString *psource) {
   LoadUpvalues(S, f);
   LoadProtos(S, f);
   LoadDebug(S, f);
+  if (S->verify)
+    checkfunction(S, f);
+  luaP_fuse(f, f->sizecode);
+  luaF_initicache(S->L, f);
 }
 
 
@@ -257,9 +448,9 @@ static void checkHeader (LoadState *S) {
 
 
 /*
-** load precompiled chunk
+** load precompiled chunk, checking the bounds of its code if 'verify'
 */
-LClosure *luaU_undump(lua_State *L, ZIO *Z, const char *name) {
+LClosure *luaU_undump(lua_State *L, ZIO *Z, const char *name, int verify) {
   LoadState S;
   LClosure *cl;
   if (*name == '@' || *name == '=')
@@ -270,14 +461,16 @@ LClosure *luaU_undump(lua_State *L, ZIO *Z, const char *name) {
     S.name = name;
   S.L = L;
   S.Z = Z;
+  S.verify = verify;
   checkHeader(&S);
   cl = luaF_newLclosure(L, LoadByte(&S));
   setclLvalue(L, L->top, cl);
   luaD_inctop(L);
   cl->p = luaF_newproto(L);
   LoadFunction(&S, cl->p, NULL);
+  if (verify && cl->nupvalues != cl->p->sizeupvalues)
+    error(&S, "bad code in");
   lua_assert(cl->nupvalues == cl->p->sizeupvalues);
-  luai_verifycode(L, buff, cl->p);
   return cl;
 }
 
@@ -65,13 +65,36 @@ static const char *utf8_decode (const char *o, int *val) {
 }
 
 
+/* a word with the high bit of each of its bytes set */
+#define HIGHBITS	((~(size_t)0 / 0xFF) * 0x80)
+
+
+/*
+** Number of ASCII bytes at the start of the 'len' bytes at 's', which
+** are tested a word at a time, so that only the spans with other bytes
+** go through 'utf8_decode'
+*/
+static size_t asciispan (const char *s, size_t len) {
+  size_t i = 0;
+  for (; len - i >= sizeof(size_t); i += sizeof(size_t)) {
+    size_t w;
+    memcpy(&w, s + i, sizeof(w));  /* (may be unaligned) */
+    if (w & HIGHBITS)
+      break;
+  }
+  while (i < len && (unsigned char)s[i] < 0x80)
+    i++;
+  return i;
+}
+
+
 /*
 ** utf8len(s [, i [, j]]) --> number of characters that start in the
 ** range [i,j], or nil + current position if 's' is not well formed in
 ** that interval
 */
 static int utflen (lua_State *L) {
-  int n = 0;
+  lua_Integer n = 0;
   size_t len;
   const char *s = luaL_checklstring(L, 1, &len);
   lua_Integer posi = u_posrelat(luaL_optinteger(L, 2, 1), len);
@@ -81,7 +104,13 @@ static int utflen (lua_State *L) {
   luaL_argcheck(L, --posj < (lua_Integer)len, 3,
                    "final position out of string");
   while (posi <= posj) {
-    const char *s1 = utf8_decode(s + posi, NULL);
+    const char *s1;
+    size_t a = asciispan(s + posi, (size_t)(posj - posi) + 1);
+    n += a;
+    posi += a;
+    if (posi > posj)  /* only ASCII up to the end? */
+      break;
+    s1 = utf8_decode(s + posi, NULL);
     if (s1 == NULL) {  /* conversion error? */
       lua_pushnil(L);  /* return nil ... */
       lua_pushinteger(L, posi + 1);  /* ... and current position */
@@ -117,6 +146,11 @@ static int codepoint (lua_State *L) {
   se = s + pose;
   for (s += posi - 1; s < se;) {
     int code;
+    if ((unsigned char)*s < 0x80) {  /* ASCII? (no need to decode) */
+      lua_pushinteger(L, (unsigned char)*s++);
+      n++;
+      continue;
+    }
     s = utf8_decode(s, &code);
     if (s == NULL)
       return luaL_error(L, "invalid UTF-8 code");
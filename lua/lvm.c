@@ -37,6 +37,18 @@
 #define MAXTAGLOOP	2000
 
 
+/* exponent of the power of 2 'p' (for OP_IDIVP2) */
+#if defined(__GNUC__)
+#define pow2exp(p)	__builtin_ctzll(p)
+#else
+static int pow2exp (lua_Unsigned p) {
+  int n = 0;
+  while (p > 1) { p >>= 1; n++; }
+  return n;
+}
+#endif
+
+
 
 #ifndef _KERNEL
 /*
@@ -95,10 +107,10 @@ int luaV_tonumber_ (const TValue *obj, lua_Number *n) {
 ** mode == 1: takes the floor of the number
 ** mode == 2: takes the ceil of the number
 */
+#ifndef _KERNEL
 int luaV_tointeger (const TValue *obj, lua_Integer *p, int mode) {
   TValue v;
  again:
-#ifndef _KERNEL
   if (ttisfloat(obj)) {
     lua_Number n = fltvalue(obj);
     lua_Number f = l_floor(n);
@@ -110,10 +122,6 @@ int luaV_tointeger (const TValue *obj, lua_Integer *p, int mode) {
     return lua_numbertointeger(f, p);
   }
   else if (ttisinteger(obj)) {
-#else /* _KERNEL */
-  if (ttisinteger(obj)) {
-    UNUSED(mode);
-#endif /* _KERNEL */
     *p = ivalue(obj);
     return 1;
   }
@@ -124,6 +132,26 @@ int luaV_tointeger (const TValue *obj, lua_Integer *p, int mode) {
   }
   return 0;  /* conversion failed */
 }
+#else /* _KERNEL */
+/*
+** numbers are always integers and 'luaO_str2num' can only produce
+** integers, so there is no rounding mode and no second pass
+*/
+int luaV_tointeger (const TValue *obj, lua_Integer *p, int mode) {
+  TValue v;
+  UNUSED(mode);
+  if (ttisinteger(obj)) {
+    *p = ivalue(obj);
+    return 1;
+  }
+  else if (cvt2num(obj) &&
+            luaO_str2num(svalue(obj), &v) == vslen(obj) + 1) {
+    *p = ivalue(&v);
+    return 1;
+  }
+  return 0;  /* conversion failed */
+}
+#endif /* _KERNEL */
 
 
 #ifndef _KERNEL
@@ -483,52 +511,75 @@ int luaV_equalobj (lua_State *L, const TValue *t1, const TValue *t2) {
 #define tostring(L,o)  \
 	(ttisstring(o) || (cvt2str(o) && (luaO_tostring(L, o), 1)))
 
+/*
+** same, but integers are left as they are, to be written straight into
+** the result ('copy2buff') instead of converted into a string of their own
+*/
+#define tostringorint(L,o)  \
+	(ttisstring(o) || \
+	 (cvt2str(o) && (ttisinteger(o) || (luaO_tostring(L, o), 1))))
+
 #define isemptystr(o)	(ttisshrstring(o) && tsvalue(o)->shrlen == 0)
 
-/* copy strings in stack from top - n up to top - 1 to buffer */
+/* length of an operand left by 'tostringorint' */
+#define concatlen(o)	(ttisstring(o) ? vslen(o) : \
+			 cast(size_t, luaO_intlen(ivalue(o))))
+
+/*
+** copy operands in stack from top - n up to top - 1 to buffer, which
+** has room for one char more than their length (for the '\0' that
+** 'luaO_int2str' writes after an integer)
+*/
 static void copy2buff (StkId top, int n, char *buff) {
   size_t tl = 0;  /* size already copied */
   do {
-    size_t l = vslen(top - n);  /* length of string being copied */
-    memcpy(buff + tl, svalue(top - n), l * sizeof(char));
-    tl += l;
+    if (ttisstring(top - n)) {
+      size_t l = vslen(top - n);  /* length of string being copied */
+      memcpy(buff + tl, svalue(top - n), l * sizeof(char));
+      tl += l;
+    }
+    else
+      tl += luaO_int2str(buff + tl, ivalue(top - n));
   } while (--n > 0);
 }
 
 
 /*
 ** Main operation for concatenation: concat 'total' values in the stack,
-** from 'L->top - total' up to 'L->top - 1'.
+** from 'L->top - total' up to 'L->top - 1'. Runs of strings and numbers
+** are measured first (integers by their number of digits) and written
+** into the result in a single pass.
 */
 void luaV_concat (lua_State *L, int total) {
   lua_assert(total >= 2);
   do {
     StkId top = L->top;
     int n = 2;  /* number of elements handled in this pass (at least 2) */
-    if (!(ttisstring(top-2) || cvt2str(top-2)) || !tostring(L, top-1))
+    if (!(ttisstring(top-2) || cvt2str(top-2)) || !tostringorint(L, top-1))
       luaT_trybinTM(L, top-2, top-1, top-2, TM_CONCAT);
     else if (isemptystr(top - 1))  /* second operand is empty? */
       cast_void(tostring(L, top - 2));  /* result is first operand */
     else if (isemptystr(top - 2)) {  /* first operand is an empty string? */
+      cast_void(tostring(L, top - 1));
       setobjs2s(L, top - 2, top - 1);  /* result is second op. */
     }
     else {
-      /* at least two non-empty string values; get as many as possible */
-      size_t tl = vslen(top - 1);
+      /* at least two non-empty operands; get as many as possible */
+      size_t tl = concatlen(top - 1);
       TString *ts;
-      /* collect total length and number of strings */
-      for (n = 1; n < total && tostring(L, top - n - 1); n++) {
-        size_t l = vslen(top - n - 1);
+      /* collect total length and number of operands */
+      for (n = 1; n < total && tostringorint(L, top - n - 1); n++) {
+        size_t l = concatlen(top - n - 1);
         if (l >= (MAX_SIZE/sizeof(char)) - tl)
           luaG_runerror(L, "string length overflow");
         tl += l;
       }
       if (tl <= LUAI_MAXSHORTLEN) {  /* is result a short string? */
-        char buff[LUAI_MAXSHORTLEN];
-        copy2buff(top, n, buff);  /* copy strings to buffer */
+        char buff[LUAI_MAXSHORTLEN + 1];
+        copy2buff(top, n, buff);  /* copy operands to buffer */
         ts = luaS_newlstr(L, buff, tl);
       }
-      else {  /* long string; copy strings directly to final result */
+      else {  /* long string; copy operands directly to final result */
         ts = luaS_createlngstrobj(L, tl);
         copy2buff(top, n, getstr(ts));
       }
@@ -578,6 +629,12 @@ void luaV_objlen (lua_State *L, StkId ra, const TValue *rb) {
 ** 'floor(q) == trunc(q)' when 'q >= 0' or when 'q' is integer,
 ** otherwise 'floor(q) == trunc(q) - 1'.
 */
+#ifdef _KERNEL
+/* 'n' is a positive power of 2 (the kernel lacks fast 64-bit division) */
+#define ispow2(n)	((n) > 0 && ((n) & ((n) - 1)) == 0)
+#endif
+
+
 lua_Integer luaV_div (lua_State *L, lua_Integer m, lua_Integer n) {
   if (l_castS2U(n) + 1u <= 1u) {  /* special cases: -1 or 0 */
     if (n == 0)
@@ -589,7 +646,10 @@ lua_Integer luaV_div (lua_State *L, lua_Integer m, lua_Integer n) {
     lua_Integer q = m / n;  /* perform C division */
     if ((m ^ n) < 0 && m % n != 0)  /* 'm/n' would be negative non-integer? */
 #else
-    lua_Integer q = lunatik_idiv(m, n);  /* perform C division */
+    lua_Integer q;
+    if (ispow2(n))  /* positive power of 2? */
+      return m >> lunatik_ctz(n);  /* arithmetic shift rounds to minus inf */
+    q = lunatik_idiv(m, n);  /* perform C division */
     if ((m ^ n) < 0 && lunatik_imod(m, n) != 0)  /* 'm/n' would be negative non-integer? */
 #endif /* _KERNEL */
       q -= 1;  /* correct result for different rounding */
@@ -613,7 +673,10 @@ lua_Integer luaV_mod (lua_State *L, lua_Integer m, lua_Integer n) {
 #ifndef _KERNEL
     lua_Integer r = m % n;
 #else
-    lua_Integer r = lunatik_imod(m, n);
+    lua_Integer r;
+    if (ispow2(n))  /* positive power of 2? */
+      return m & (n - 1);  /* already rounded to minus inf */
+    r = lunatik_imod(m, n);
 #endif /* _KERNEL */
     if (r != 0 && (m ^ n) < 0)  /* 'm/n' would be non-integer negative? */
       r += n;  /* correct result for different rounding */
@@ -641,23 +704,57 @@ lua_Integer luaV_shiftl (lua_Integer x, lua_Integer y) {
 
 
 /*
-** check whether cached closure in prototype 'p' may be reused, that is,
-** whether there is a cached closure with the same upvalues needed by
-** new closure to be created.
+** Check whether no program can tell values 't1' and 't2' apart. Unlike
+** raw equality, variants must match (1 and 1.0 differ) and zero floats
+** never match (0.0 and -0.0 differ).
+*/
+static int samevalue (const TValue *t1, const TValue *t2) {
+  if (ttype(t1) != ttype(t2))
+    return 0;
+  switch (ttype(t1)) {
+    case LUA_TNIL: return 1;
+    case LUA_TNUMINT: return (ivalue(t1) == ivalue(t2));
+#ifndef _KERNEL
+    case LUA_TNUMFLT:
+      return (fltvalue(t1) != 0 && luai_numeq(fltvalue(t1), fltvalue(t2)));
+#endif /* _KERNEL */
+    case LUA_TBOOLEAN: return bvalue(t1) == bvalue(t2);
+    case LUA_TLIGHTUSERDATA: return pvalue(t1) == pvalue(t2);
+    case LUA_TLCF: return fvalue(t1) == fvalue(t2);
+    case LUA_TLNGSTR: return luaS_eqlngstr(tsvalue(t1), tsvalue(t2));
+    default:
+      lua_assert(iscollectable(t1));
+      return gcvalue(t1) == gcvalue(t2);
+  }
+}
+
+
+/*
+** check whether some cached closure in prototype 'p' may be reused,
+** that is, whether there is a cached closure with the same upvalues
+** needed by new closure to be created. An upvalue whose variable is
+** never assigned after its creation ('ro') only needs to hold the
+** same value: no one can tell the two variables apart.
 */
 static LClosure *getcached (Proto *p, UpVal **encup, StkId base) {
-  LClosure *c = p->cache;
-  if (c != NULL) {  /* is there a cached closure? */
-    int nup = p->sizeupvalues;
-    Upvaldesc *uv = p->upvalues;
+  int nup = p->sizeupvalues;
+  Upvaldesc *uv = p->upvalues;
+  int n;
+  for (n = 0; n < NCLCACHE; n++) {
+    LClosure *c = p->cache[n];
     int i;
+    if (c == NULL)  /* empty entry? */
+      continue;
     for (i = 0; i < nup; i++) {  /* check whether it has right upvalues */
       TValue *v = uv[i].instack ? base + uv[i].idx : encup[uv[i].idx]->v;
-      if (c->upvals[i]->v != v)
-        return NULL;  /* wrong upvalue; cannot reuse closure */
+      TValue *cv = c->upvals[i]->v;
+      if (cv != v && !(uv[i].ro && samevalue(cv, v)))
+        break;  /* wrong upvalue; cannot reuse closure */
     }
+    if (i == nup)
+      return c;  /* all upvalues match */
   }
-  return c;  /* return cached closure (or NULL if no cached closure) */
+  return NULL;  /* no cached closure can be reused */
 }
 
 
@@ -683,8 +780,10 @@ static void pushclosure (lua_State *L, Proto *p, UpVal **encup, StkId base,
     ncl->upvals[i]->refcount++;
     /* new closure is white, so we do not need a barrier here */
   }
-  if (!isblack(p))  /* cache will not break GC invariant? */
-    p->cache = ncl;  /* save it on cache for reuse */
+  if (!isblack(p)) {  /* cache will not break GC invariant? */
+    p->cache[p->cachepos] = ncl;  /* save it on cache for reuse */
+    p->cachepos = (p->cachepos + 1) % NCLCACHE;
+  }
 }
 
 
@@ -709,7 +808,8 @@ void luaV_finishOp (lua_State *L) {
     case OP_MOD:
 #endif /* _KERNEL */
     case OP_UNM: case OP_BNOT: case OP_LEN:
-    case OP_GETTABUP: case OP_GETTABLE: case OP_SELF: {
+    case OP_MODP2: case OP_IDIVP2:
+    case OP_GETTABUP: case OP_GETTABLE: case OP_SELF: case OP_GETTABUPF: {
       setobjs2s(L, base + GETARG_A(inst), --L->top);
       break;
     }
@@ -780,11 +880,23 @@ void luaV_finishOp (lua_State *L) {
 	ISK(GETARG_C(i)) ? k+INDEXK(GETARG_C(i)) : base+GETARG_C(i))
 
 
+/*
+** consume a unit of the instruction budget (see 'lua_setbudget'), at
+** backward jumps and calls to Lua functions; 'luaD_poll' runs every
+** 'POLLMASK' + 1 units (serving requests for hooks) and when it runs out
+*/
+#define POLLMASK	0xff
+
+#define checkbudget(L)  \
+	{ if ((--L->budget & POLLMASK) == 0) Protect(luaD_poll(L)); }
+
+
 /* execute a jump instruction */
 #define dojump(ci,i,e) \
-  { int a = GETARG_A(i); \
+  { int a = GETARG_A(i); int sbx = GETARG_sBx(i); \
     if (a != 0) luaF_close(L, ci->u.l.base + a - 1); \
-    ci->u.l.savedpc += GETARG_sBx(i) + e; }
+    ci->u.l.savedpc += sbx + e; \
+    if (sbx < 0) checkbudget(L); }
 
 /* for test instructions, execute the jump instruction that follows it */
 #define donextjump(ci)	{ i = *ci->u.l.savedpc; dojump(ci, i, 1); }
@@ -801,13 +913,14 @@ void luaV_finishOp (lua_State *L) {
 /* fetch an instruction and prepare its execution */
 #define vmfetch()	{ \
   i = *(ci->u.l.savedpc++); \
-  if (L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT)) \
+  if (L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT | LUAI_MASKCOUNTERS)) \
     Protect(luaG_traceexec(L)); \
   ra = RA(i); /* WARNING: any stack reallocation invalidates 'ra' */ \
   lua_assert(base == ci->u.l.base); \
   lua_assert(base <= L->top && L->top < L->stack + L->stacksize); \
 }
 
+/* 'ljumptab.h' redefines these for the computed-goto dispatch */
 #define vmdispatch(o)	switch(o)
 #define vmcase(l)	case l:
 #define vmbreak		break
@@ -822,6 +935,27 @@ void luaV_finishOp (lua_State *L) {
   else Protect(luaV_finishget(L,t,k,v,slot)); }
 
 
+/*
+** same as 'gettableProtected', but constant short-string keys go
+** through the inline cache of the current instruction (for a table, or
+** for the '__index' table of another value)
+*/
+#define gettablecached(L,t,k,v)  { \
+  if (ISK(GETARG_C(i)) && ttisshrstring(k)) { \
+    const TValue *slot; \
+    unsigned int *ic_ = &cl->p->icache[pcRel(ci->u.l.savedpc, cl->p)]; \
+    if (ttistable(t)) { \
+      Table *h_ = hvalue(t); \
+      if (icachehit(h_, tsvalue(k), *ic_)) slot = gval(gnode(h_, *ic_)); \
+      else slot = luaH_getshortstrcached(h_, tsvalue(k), ic_); \
+      if (!ttisnil(slot)) { setobj2s(L, v, slot); } \
+      else Protect(luaV_finishget(L,t,k,v,slot)); } \
+    else if ((slot = luaT_fastindex(L, t, tsvalue(k), ic_)) != NULL) { \
+      setobj2s(L, v, slot); } \
+    else Protect(luaV_finishget(L,t,k,v,NULL)); } \
+  else gettableProtected(L,t,k,v); }
+
+
 /* same for 'luaV_settable' */
 #define settableProtected(L,t,k,v) { const TValue *slot; \
   if (!luaV_fastset(L,t,k,slot,luaH_get,v)) \
@@ -834,6 +968,9 @@ void luaV_execute (lua_State *L) {
   LClosure *cl;
   TValue *k;
   StkId base;
+#if defined(LUAI_USEJUMPTABLE)
+#include "ljumptab.h"
+#endif
   ci->callstatus |= CIST_FRESH;  /* fresh invocation of 'luaV_execute" */
  newframe:  /* reentry point when frame changes (call/return) */
   lua_assert(ci == L->ci);
@@ -882,13 +1019,13 @@ void luaV_execute (lua_State *L) {
       vmcase(OP_GETTABUP) {
         TValue *upval = cl->upvals[GETARG_B(i)]->v;
         TValue *rc = RKC(i);
-        gettableProtected(L, upval, rc, ra);
+        gettablecached(L, upval, rc, ra);
         vmbreak;
       }
       vmcase(OP_GETTABLE) {
         StkId rb = RB(i);
         TValue *rc = RKC(i);
-        gettableProtected(L, rb, rc, ra);
+        gettablecached(L, rb, rc, ra);
         vmbreak;
       }
       vmcase(OP_SETTABUP) {
@@ -929,6 +1066,11 @@ void luaV_execute (lua_State *L) {
         if (luaV_fastget(L, rb, key, aux, luaH_getstr)) {
           setobj2s(L, ra, aux);
         }
+        else if (!ttistable(rb) && ISK(GETARG_C(i)) && ttisshrstring(rc) &&
+                 (aux = luaT_fastindex(L, rb, key,
+                    &cl->p->icache[pcRel(ci->u.l.savedpc, cl->p)])) != NULL) {
+          setobj2s(L, ra, aux);  /* method from '__index' table */
+        }
         else Protect(luaV_finishget(L, rb, rc, ra, aux));
         vmbreak;
       }
@@ -1101,6 +1243,28 @@ void luaV_execute (lua_State *L) {
         else { Protect(luaT_trybinTM(L, rb, rc, ra, TM_IDIV)); }
         vmbreak;
       }
+      vmcase(OP_MODP2) {  /* RK(C) is a positive power of 2 */
+        TValue *rb = RKB(i);
+        TValue *rc = RKC(i);
+        if (ttisinteger(rb)) {
+          setivalue(ra, intop(&, ivalue(rb), ivalue(rc) - 1));
+        }
+        else { Protect(luaO_arith(L, LUA_OPMOD, rb, rc, ra)); }
+        vmbreak;
+      }
+      vmcase(OP_IDIVP2) {  /* RK(C) is a positive power of 2 */
+        TValue *rb = RKB(i);
+        TValue *rc = RKC(i);
+        if (ttisinteger(rb)) {
+          lua_Integer ib = ivalue(rb);
+          int n = pow2exp(l_castS2U(ivalue(rc)));
+          /* floor division: shift the nonnegative one of 'ib' and '~ib' */
+          setivalue(ra, (ib >= 0) ? l_castU2S(l_castS2U(ib) >> n)
+                                  : ~l_castU2S(l_castS2U(~ib) >> n));
+        }
+        else { Protect(luaO_arith(L, LUA_OPIDIV, rb, rc, ra)); }
+        vmbreak;
+      }
 #ifndef _KERNEL
       vmcase(OP_POW) {
         TValue *rb = RKB(i);
@@ -1173,6 +1337,7 @@ void luaV_execute (lua_State *L) {
         dojump(ci, i, 0);
         vmbreak;
       }
+#ifndef _KERNEL
       vmcase(OP_EQ) {
         TValue *rb = RKB(i);
         TValue *rc = RKC(i);
@@ -1202,6 +1367,50 @@ void luaV_execute (lua_State *L) {
         )
         vmbreak;
       }
+#else /* _KERNEL */
+      vmcase(OP_EQ) {
+        TValue *rb = RKB(i);
+        TValue *rc = RKC(i);
+        int res;
+        if (ttisinteger(rb) && ttisinteger(rc))
+          res = (ivalue(rb) == ivalue(rc));
+        else
+          Protect(res = luaV_equalobj(L, rb, rc));
+        if (res != GETARG_A(i))
+          ci->u.l.savedpc++;
+        else
+          donextjump(ci);
+        vmbreak;
+      }
+      vmcase(OP_LT) {
+        TValue *rb = RKB(i);
+        TValue *rc = RKC(i);
+        int res;
+        if (ttisinteger(rb) && ttisinteger(rc))
+          res = (ivalue(rb) < ivalue(rc));
+        else
+          Protect(res = luaV_lessthan(L, rb, rc));
+        if (res != GETARG_A(i))
+          ci->u.l.savedpc++;
+        else
+          donextjump(ci);
+        vmbreak;
+      }
+      vmcase(OP_LE) {
+        TValue *rb = RKB(i);
+        TValue *rc = RKC(i);
+        int res;
+        if (ttisinteger(rb) && ttisinteger(rc))
+          res = (ivalue(rb) <= ivalue(rc));
+        else
+          Protect(res = luaV_lessequal(L, rb, rc));
+        if (res != GETARG_A(i))
+          ci->u.l.savedpc++;
+        else
+          donextjump(ci);
+        vmbreak;
+      }
+#endif /* _KERNEL */
       vmcase(OP_TEST) {
         if (GETARG_C(i) ? l_isfalse(ra) : !l_isfalse(ra))
             ci->u.l.savedpc++;
@@ -1223,13 +1432,16 @@ void luaV_execute (lua_State *L) {
         int b = GETARG_B(i);
         int nresults = GETARG_C(i) - 1;
         if (b != 0) L->top = ra+b;  /* else previous instruction set top */
-        if (luaD_precall(L, ra, nresults)) {  /* C function? */
+        if (ttislcf(ra) ?  /* light C function? skip the type dispatch */
+              luaD_precallC(L, ra, nresults, fvalue(ra)) :
+              luaD_precall(L, ra, nresults)) {  /* C function? */
           if (nresults >= 0)
             L->top = ci->top;  /* adjust results */
           Protect((void)0);  /* update 'base' */
         }
         else {  /* Lua function */
           ci = L->ci;
+          checkbudget(L);
           goto newframe;  /* restart luaV_execute over new Lua function */
         }
         vmbreak;
@@ -1261,6 +1473,7 @@ void luaV_execute (lua_State *L) {
           oci->callstatus |= CIST_TAIL;  /* function was tail called */
           ci = L->ci = oci;  /* remove new frame */
           lua_assert(L->top == oci->u.l.base + getproto(ofunc)->maxstacksize);
+          checkbudget(L);
           goto newframe;  /* restart luaV_execute over new Lua function */
         }
         vmbreak;
@@ -1268,9 +1481,12 @@ void luaV_execute (lua_State *L) {
       vmcase(OP_RETURN) {
         int b = GETARG_B(i);
         if (cl->p->sizep > 0) luaF_close(L, base);
+        luai_tracereturn(L, cl->p);
         b = luaD_poscall(L, ci, ra, (b != 0 ? b - 1 : cast_int(L->top - ra)));
-        if (ci->callstatus & CIST_FRESH)  /* local 'ci' still from callee */
+        if (ci->callstatus & CIST_FRESH) {  /* local 'ci' still from callee */
+          countbudget(L);
           return;  /* external invocation: return */
+        }
         else {  /* invocation via reentry: continue execution */
           ci = L->ci;
           if (b) L->top = ci->top;
@@ -1290,6 +1506,7 @@ void luaV_execute (lua_State *L) {
             ci->u.l.savedpc += GETARG_sBx(i);  /* jump back */
             chgivalue(ra, idx);  /* update internal index... */
             setivalue(ra + 3, idx);  /* ...and external index */
+            checkbudget(L);
           }
 #ifndef _KERNEL
         }
@@ -1302,6 +1519,7 @@ void luaV_execute (lua_State *L) {
             ci->u.l.savedpc += GETARG_sBx(i);  /* jump back */
             chgfltvalue(ra, idx);  /* update internal index... */
             setfltvalue(ra + 3, idx);  /* ...and external index */
+            checkbudget(L);
           }
         }
 #endif /* _KERNEL */
@@ -1366,6 +1584,7 @@ void luaV_execute (lua_State *L) {
         if (!ttisnil(ra + 1)) {  /* continue loop? */
           setobjs2s(L, ra, ra + 1);  /* save control variable */
            ci->u.l.savedpc += GETARG_sBx(i);  /* jump back */
+          checkbudget(L);
         }
         vmbreak;
       }
@@ -1419,6 +1638,19 @@ void luaV_execute (lua_State *L) {
           setnilvalue(ra + j);
         vmbreak;
       }
+      vmcase(OP_GETTABUPF) {
+        TValue *upval = cl->upvals[GETARG_B(i)]->v;
+        TValue *rc = RKC(i);
+        gettablecached(L, upval, rc, ra);
+        vmfetch();  /* fused OP_GETTABLE */
+        lua_assert(GET_OPCODE(i) == OP_GETTABLE);
+        {
+          StkId rb = RB(i);
+          rc = RKC(i);
+          gettablecached(L, rb, rc, ra);
+        }
+        vmbreak;
+      }
       vmcase(OP_EXTRAARG) {
         lua_assert(0);
         vmbreak;
@@ -57,12 +57,12 @@
 ** return 1 with 'slot' pointing to 't[k]' (final result).  Otherwise,
 ** return 0 (meaning it will have to check metamethod) with 'slot'
 ** pointing to a nil 't[k]' (if 't' is a table) or NULL (otherwise).
-** 'f' is the raw get function to use.
+** 'f' is the raw get function to use, called as 'f(L, table, key)'.
 */
 #define luaV_fastget(L,t,k,slot,f) \
   (!ttistable(t)  \
    ? (slot = NULL, 0)  /* not a table; 'slot' is NULL and result is 0 */  \
-   : (slot = f(hvalue(t), k),  /* else, do raw access */  \
+   : (slot = f(L, hvalue(t), k),  /* else, do raw access */  \
       !ttisnil(slot)))  /* result not nil? */
 
 /*
@@ -84,7 +84,7 @@
 #define luaV_fastset(L,t,k,slot,f,v) \
   (!ttistable(t) \
    ? (slot = NULL, 0) \
-   : (slot = f(hvalue(t), k), \
+   : (slot = f(L, hvalue(t), k), \
      ttisnil(slot) ? 0 \
      : (luaC_barrierback(L, hvalue(t), v), \
         setobj2t(L, cast(TValue *,slot), v), \
@@ -0,0 +1,200 @@
+/*
+* Copyright (c) 2017-2019 CUJO LLC.
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef lunatik_h
+#define lunatik_h
+
+#include <linux/types.h>
+#include <linux/gfp.h>
+#include <linux/list.h>
+#include <linux/u64_stats_sync.h>
+
+#include "lua/lua.h"
+
+/* allocator backends for 'lunatik_newstate' */
+#define LUNATIK_ALLOC_KMALLOC	(0)	/* krealloc, as used by 'luaL_newstate' */
+#define LUNATIK_ALLOC_SLAB	(1 << 0)	/* per-size kmem_cache pools */
+
+/* allocation context; states are atomic (GFP_ATOMIC) by default */
+#define LUNATIK_ALLOC_NOWAIT	(1 << 1)	/* GFP_NOWAIT, spares the reserves */
+#define LUNATIK_ALLOC_SLEEP	(1 << 2)	/* GFP_KERNEL, may use kvmalloc */
+
+/* GC steps run from a work item instead of inline (needs LUNATIK_LOCK) */
+#define LUNATIK_GC_DEFER	(1 << 3)
+
+/* per-CPU state pools; states are reset with 'lua_settop(L, 0)' on return */
+#define LUNATIK_POOL_RESTORE	(1 << 8)	/* also restore the globals */
+#define LUNATIK_POOL_SHARE	(1 << 9)	/* share the code of the chunk */
+#define LUNATIK_POOL_CLONE	(1 << 10)	/* run the chunk only once */
+
+struct lunatik_pool;
+struct lunatik_gc;
+struct dentry;
+
+/*
+** runtime statistics of a state; as the counters of its allocator, they
+** are only written by the state, within 'sync', and are read with
+** 'lunatik_readstats', which does not see torn values on 32-bit
+*/
+struct lunatik_stats {
+	u64 allocated;	/* bytes allocated or grown into */
+	u64 freed;	/* bytes freed or shrunk off */
+	u64 allocfails;	/* failed allocations, including over the limit */
+	u64 gccycles;	/* completed collection cycles */
+	u64 gcns;	/* nanoseconds spent in the collector */
+	u64 budget;	/* units of instruction budget spent */
+	u64 errors;	/* failed protected calls and coroutines */
+	int stackpeak;	/* largest stack of a thread, in slots */
+	struct u64_stats_sync sync;
+};
+
+#define LUNATIK_NAMELEN	32
+
+/*
+** allocator data of states created by 'lunatik_newstate' ('ud'); 'used',
+** 'peak' and 'nallocs' are only written by the allocator and can be read
+** with READ_ONCE from any context
+*/
+struct lunatik_alloc {
+	unsigned int flags;
+	gfp_t gfp;
+	size_t limit;	/* hard quota in bytes (0 means unlimited) */
+	size_t used;	/* bytes currently allocated */
+	size_t peak;	/* high-water mark of 'used' */
+	size_t nallocs;	/* blocks allocated or resized so far */
+	int node;	/* NUMA node of the blocks, or NUMA_NO_NODE */
+	struct lunatik_gc *gc;	/* deferred collector, or NULL */
+	struct lunatik_stats stats;
+	struct list_head states;	/* in the registry of live states */
+	unsigned int id;
+	struct dentry *dir;	/* of a named state in debugfs, or NULL */
+	char name[LUNATIK_NAMELEN];	/* empty if not named */
+};
+
+LUALIB_API lua_State *(lunatik_newstate) (unsigned int flags);
+LUALIB_API lua_State *(lunatik_newstatenode) (unsigned int flags, int node);
+LUALIB_API void (lunatik_close) (lua_State *L);
+LUALIB_API struct lunatik_alloc *(lunatik_getalloc) (lua_State *L);
+LUALIB_API void (lunatik_setlimit) (lua_State *L, size_t limit);
+LUALIB_API int (lunatik_setname) (lua_State *L, const char *name);
+LUALIB_API void (lunatik_readstats) (struct lunatik_alloc *a,
+	struct lunatik_stats *s);
+
+LUALIB_API struct lunatik_pool *(lunatik_newpool) (const char *chunk,
+	size_t len, const char *name, unsigned int nstates, unsigned int flags);
+LUALIB_API void (lunatik_closepool) (struct lunatik_pool *pool);
+LUALIB_API lua_State *(lunatik_getstate) (struct lunatik_pool *pool);
+LUALIB_API void (lunatik_putstate) (struct lunatik_pool *pool, lua_State *L);
+
+/* versioned pools, replaced under RCU (see lunatik_pool.c) */
+struct lunatik_script;
+LUALIB_API struct lunatik_script *(lunatik_newscript) (void);
+LUALIB_API int (lunatik_replace) (struct lunatik_script *script,
+	const char *chunk, size_t len, const char *name, unsigned int nstates,
+	unsigned int flags);
+LUALIB_API void (lunatik_closescript) (struct lunatik_script *script);
+LUALIB_API lua_State *(lunatik_getscript) (struct lunatik_script *script,
+	struct lunatik_pool **pool);
+LUALIB_API void (lunatik_putscript) (struct lunatik_pool *pool,
+	lua_State *L);
+
+LUALIB_API int (lunatik_loadbuffer) (lua_State *L, const char *buf,
+	size_t len, const char *name);
+LUALIB_API void (lunatik_setcachelimit) (size_t limit);
+
+/* byte views over C memory (see lunatik_view.c) */
+#define LUNATIK_VIEW_RDONLY	(1 << 0)	/* no setters */
+
+struct lunatik_view;
+LUALIB_API struct lunatik_view *(lunatik_pushview) (lua_State *L, void *ptr,
+	size_t len, unsigned int flags);
+LUALIB_API void (lunatik_invalidate) (struct lunatik_view *view);
+
+/* hash maps shared by states (see lunatik_shmap.c) */
+#define LUNATIK_SHMAP_RDONLY	(1 << 0)	/* no updates from Lua */
+
+struct lunatik_shmap;
+LUALIB_API struct lunatik_shmap *(lunatik_newshmap) (unsigned int size,
+	unsigned int flags);
+LUALIB_API void (lunatik_closeshmap) (struct lunatik_shmap *map);
+LUALIB_API void (lunatik_pushshmap) (lua_State *L, struct lunatik_shmap *map,
+	unsigned int flags);
+
+/* message channels between states (see lunatik_channel.c) */
+#define LUNATIK_CHANNEL_MPSC	(1 << 16)	/* several producers */
+
+#define LUNATIK_CHANNEL_SEND	(1 << 0)	/* ends, for 'lunatik_pushchannel' */
+#define LUNATIK_CHANNEL_RECV	(1 << 1)
+
+struct lunatik_channel;
+LUALIB_API struct lunatik_channel *(lunatik_newchannel) (unsigned int size,
+	unsigned int flags);
+LUALIB_API void (lunatik_closechannel) (struct lunatik_channel *ch);
+LUALIB_API void (lunatik_pushchannel) (lua_State *L,
+	struct lunatik_channel *ch, unsigned int flags);
+
+struct scatterlist;
+LUALIB_API int (lunatik_loadsg) (lua_State *L, struct scatterlist *sgl,
+	unsigned int nents, const char *name, const char *mode);
+
+/* coroutine executor on a workqueue (see lunatik_exec.c; needs LUNATIK_LOCK) */
+struct lunatik_exec;
+struct lunatik_task;
+struct workqueue_struct;
+typedef void (*lunatik_Done) (lua_State *co, int status, void *ud);
+
+LUALIB_API struct lunatik_exec *(lunatik_newexec) (lua_State *L,
+	struct workqueue_struct *wq, int budget);
+LUALIB_API void (lunatik_closeexec) (struct lunatik_exec *e);
+LUALIB_API int (lunatik_spawn) (struct lunatik_exec *e, int nargs,
+	lunatik_Done done, void *ud);
+LUALIB_API struct lunatik_task *(lunatik_gettask) (lua_State *L);
+LUALIB_API void (lunatik_holdtask) (struct lunatik_task *t);
+LUALIB_API void (lunatik_droptask) (struct lunatik_task *t);
+LUALIB_API int (lunatik_suspend) (lua_State *L, lua_KContext ctx,
+	lua_KFunction k);
+LUALIB_API void (lunatik_wake) (struct lunatik_task *t);
+LUALIB_API int (lunatik_sleep) (lua_State *L);
+
+/* sampling profiler, dumped through debugfs (see lunatik_prof.c) */
+struct lunatik_prof;
+LUALIB_API struct lunatik_prof *(lunatik_newprof) (lua_State *L,
+	unsigned int hz);
+LUALIB_API void (lunatik_closeprof) (struct lunatik_prof *prof);
+
+/* native libraries found by 'require' without a symbol table walk */
+LUALIB_API int (lunatik_registerlib) (const char *name, lua_CFunction open);
+LUALIB_API void (lunatik_unregisterlib) (const char *name);
+
+/* internal; called on module load/unload */
+struct dentry;
+int lunatik_allocinit(void);
+void lunatik_allocexit(void);
+int lunatik_syminit(void);
+void lunatik_symexit(void);
+void lunatik_profinit(struct dentry *dir);
+void lunatik_profexit(void);
+void *lunatik_allocf(void *ud, void *ptr, size_t osize, size_t nsize);
+gfp_t lunatik_gfp(unsigned int flags);
+
+#endif /* lunatik_h */
+
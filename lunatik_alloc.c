@@ -0,0 +1,266 @@
+/*
+* Copyright (c) 2017-2019 CUJO LLC.
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifdef __linux__
+#include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/numa.h>
+
+#include "lunatik.h"
+
+#include "lua/lobject.h"
+#include "lua/lstate.h"
+#include "lua/lfunc.h"
+#include "lua/lstring.h"
+
+/*
+** Slab backend: fixed-size GC objects (tables, upvalues, call infos, small
+** Lua closures and short strings) are served from dedicated kmem_caches;
+** anything else goes through krealloc.  Every block is released with kfree,
+** which SLAB and SLUB resolve to the owning cache, thus a block can migrate
+** between a cache and kmalloc on realloc without being tracked; this also
+** keeps shrinking reallocations from ever failing.  The GFP flags and NUMA
+** node are taken from the state's 'struct lunatik_alloc'.
+*/
+#define LUNATIK_SLABALIGN	(sizeof(void *))
+#define LUNATIK_SLABMAX		(256)
+#define LUNATIK_NSLABS		(LUNATIK_SLABMAX / LUNATIK_SLABALIGN + 1)
+
+#define slabindex(s)	(((s) + LUNATIK_SLABALIGN - 1) / LUNATIK_SLABALIGN)
+#define slabsize(i)	((i) * LUNATIK_SLABALIGN)
+
+static struct kmem_cache *lunatik_slabs[LUNATIK_NSLABS];
+static char lunatik_slabnames[LUNATIK_NSLABS][sizeof("lunatik-256")];
+
+static inline struct kmem_cache *lunatik_slab(size_t size)
+{
+	size_t i = slabindex(size);
+	return i < LUNATIK_NSLABS ? lunatik_slabs[i] : NULL;
+}
+
+static int lunatik_newslab(size_t size)
+{
+	size_t i = slabindex(size);
+	char *name = lunatik_slabnames[i];
+
+	if (i >= LUNATIK_NSLABS || lunatik_slabs[i] != NULL)
+		return 0;
+
+	snprintf(name, sizeof(lunatik_slabnames[i]), "lunatik-%zu",
+		slabsize(i));
+	lunatik_slabs[i] = kmem_cache_create(name, slabsize(i), 0, 0, NULL);
+	return lunatik_slabs[i] == NULL ? -ENOMEM : 0;
+}
+
+static inline void lunatik_free(void *ptr)
+{
+	if (is_vmalloc_addr(ptr))
+		vfree(ptr);
+	else
+		kfree(ptr);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,12,0)
+static void *lunatik_kvrealloc(void *ptr, size_t osize, size_t nsize,
+	gfp_t gfp, int node)
+{
+	void *block = kvmalloc_node(nsize, gfp, node);
+
+	if (block != NULL && ptr != NULL) {
+		memcpy(block, ptr, min(osize, nsize));
+		lunatik_free(ptr);
+	}
+	return block;
+}
+#else
+#define lunatik_kvrealloc(ptr, osize, nsize, gfp, node)	(NULL)
+#endif
+
+/*
+** 'krealloc' has no node variant: blocks of states bound to a node are
+** moved with 'kmalloc_node' when they grow and, as 'krealloc' does, kept
+** when they shrink
+*/
+static void *lunatik_krealloc(struct lunatik_alloc *a, void *ptr,
+	size_t osize, size_t nsize, gfp_t gfp)
+{
+	void *block;
+
+	if (a->node == NUMA_NO_NODE)
+		return krealloc(ptr, nsize, gfp);
+	if (ptr != NULL && nsize <= osize)
+		return ptr;
+	block = kmalloc_node(nsize, gfp, a->node);
+	if (block != NULL && ptr != NULL) {
+		memcpy(block, ptr, osize);
+		kfree(ptr);
+	}
+	return block;
+}
+
+/*
+** Sleepable states fall back to kvmalloc when krealloc cannot find enough
+** contiguous pages, and take blocks larger than a costly page order (such
+** as the stacks of deep scripts) from kvmalloc right away; blocks taken
+** from vmalloc are never shrunk in place, which keeps shrinking from
+** failing.
+*/
+#define LUNATIK_KVMIN	(PAGE_SIZE << PAGE_ALLOC_COSTLY_ORDER)
+
+static void *lunatik_realloc(struct lunatik_alloc *a, void *ptr,
+	size_t osize, size_t nsize)
+{
+	void *block;
+	size_t realosize = ptr != NULL ? osize : 0;
+	bool sleep = a->flags & LUNATIK_ALLOC_SLEEP;
+
+	if (is_vmalloc_addr(ptr))
+		return nsize <= osize ? ptr :
+			lunatik_kvrealloc(ptr, osize, nsize, a->gfp, a->node);
+
+	if (sleep && nsize > LUNATIK_KVMIN) {
+		block = lunatik_kvrealloc(ptr, realosize, nsize, a->gfp,
+			a->node);
+		if (block != NULL)
+			return block;
+	}
+
+	block = lunatik_krealloc(a, ptr, realosize, nsize,
+		sleep ? a->gfp | __GFP_NOWARN : a->gfp);
+	if (block == NULL && sleep)
+		block = lunatik_kvrealloc(ptr, realosize, nsize, a->gfp,
+			a->node);
+	return block;
+}
+
+static void *lunatik_slaballoc(struct lunatik_alloc *a, void *ptr,
+	size_t osize, size_t nsize)
+{
+	struct kmem_cache *slab = lunatik_slab(nsize);
+
+	if (slab != NULL) {
+		if (ptr == NULL)
+			return kmem_cache_alloc_node(slab, a->gfp, a->node);
+		if (slab == lunatik_slab(osize))
+			return ptr;
+	}
+	return lunatik_realloc(a, ptr, osize, nsize);
+}
+
+/* as 'lunatik_statadd' of lunatik_core.c */
+#define lunatik_allocstat(a,f,n)	do { \
+	u64_stats_update_begin(&(a)->stats.sync); \
+	WRITE_ONCE((a)->stats.f, (a)->stats.f + (n)); \
+	u64_stats_update_end(&(a)->stats.sync); \
+} while (0)
+
+/*
+** Usage is charged with the same 'osize'/'nsize' bookkeeping as 'GCdebt';
+** a request that would exceed the quota fails as if memory was exhausted,
+** so 'luaM_realloc_' collects garbage and then raises a memory error.
+*/
+void *lunatik_allocf(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+	struct lunatik_alloc *a = (struct lunatik_alloc *)ud;
+	size_t realosize = ptr != NULL ? osize : 0;
+	size_t used = a->used - realosize;
+	void *block;
+
+	if (nsize == 0) {
+		lunatik_free(ptr);
+		WRITE_ONCE(a->used, used);
+		lunatik_allocstat(a, freed, realosize);
+		return NULL;
+	}
+
+	if (a->limit != 0 && nsize > realosize && used + nsize > a->limit)
+		goto fail;
+
+	block = a->flags & LUNATIK_ALLOC_SLAB ?
+		lunatik_slaballoc(a, ptr, osize, nsize) :
+		lunatik_realloc(a, ptr, osize, nsize);
+	if (block == NULL)
+		goto fail;
+
+	WRITE_ONCE(a->nallocs, a->nallocs + 1);
+	used += nsize;
+	WRITE_ONCE(a->used, used);
+	if (used > a->peak)
+		WRITE_ONCE(a->peak, used);
+	if (nsize > realosize)
+		lunatik_allocstat(a, allocated, nsize - realosize);
+	else
+		lunatik_allocstat(a, freed, realosize - nsize);
+	return block;
+fail:
+	lunatik_allocstat(a, allocfails, 1);
+	return NULL;
+}
+
+gfp_t lunatik_gfp(unsigned int flags)
+{
+	if (flags & LUNATIK_ALLOC_SLEEP)
+		return GFP_KERNEL;
+	return flags & LUNATIK_ALLOC_NOWAIT ? GFP_NOWAIT : GFP_ATOMIC;
+}
+
+int lunatik_allocinit(void)
+{
+#ifndef CONFIG_SLOB /* SLOB's kfree cannot release kmem_cache objects */
+	size_t fixed[] = {sizeof(Table), sizeof(UpVal), sizeof(CallInfo)};
+	size_t i;
+	int ret = 0;
+
+	for (i = 0; i < ARRAY_SIZE(fixed) && ret == 0; i++)
+		ret = lunatik_newslab(fixed[i]);
+
+	for (i = 1; i <= 4 && ret == 0; i++)
+		ret = lunatik_newslab(sizeLclosure(i));
+
+	for (i = 0; i <= LUAI_MAXSHORTLEN && ret == 0; i += LUNATIK_SLABALIGN)
+		ret = lunatik_newslab(sizelstring(i));
+
+	if (ret == 0)
+		ret = lunatik_newslab(sizelstring(LUAI_MAXSHORTLEN));
+
+	if (ret != 0)
+		lunatik_allocexit();
+	return ret;
+#else
+	return 0;
+#endif /* CONFIG_SLOB */
+}
+
+void lunatik_allocexit(void)
+{
+	size_t i;
+
+	for (i = 0; i < LUNATIK_NSLABS; i++) {
+		if (lunatik_slabs[i] != NULL)
+			kmem_cache_destroy(lunatik_slabs[i]);
+		lunatik_slabs[i] = NULL;
+	}
+}
+#endif /* __linux__ */
+
@@ -0,0 +1,220 @@
+/*
+* Copyright (c) 2017-2019 CUJO LLC.
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifdef __linux__
+#include <linux/module.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/sched.h>
+
+#include "lua/lua.h"
+#include "lua/lauxlib.h"
+#include "lua/lualib.h"
+
+#include "lunatik.h"
+
+/*
+** Micro-benchmarks of the VM, the GC and the C API, run in process context
+** on a fresh slab-backed state each.  Reading 'results' under the debugfs
+** directory 'lunatik_bench' runs all of them and reports, per benchmark,
+** the time per operation and the allocator calls of the timed part;
+** 'iterations' sets the number of operations.
+*/
+struct lunatik_bench {
+	const char *name;
+	const char *setup;	/* run before timing, may be NULL */
+	const char *chunk;	/* Lua benchmark, called with the op count */
+	int (*run)(lua_State *L, unsigned int n);	/* or a C one */
+};
+
+static u32 lunatik_bench_iterations = 100000;
+static struct dentry *lunatik_bench_dir;
+
+static int lunatik_bench_pcall(lua_State *L, unsigned int n)
+{
+	unsigned int i;
+
+	if (luaL_loadstring(L, "return ...") != LUA_OK)
+		return lua_error(L);
+	for (i = 0; i < n; i++) {
+		lua_pushvalue(L, -1);
+		lua_pushinteger(L, i);
+		if (lua_pcall(L, 1, 1, 0) != LUA_OK)
+			return lua_error(L);
+		lua_pop(L, 1);
+	}
+	return 0;
+}
+
+static int lunatik_bench_resume(lua_State *L, unsigned int n)
+{
+	lua_State *co = lua_newthread(L);
+	unsigned int i;
+
+	if (luaL_loadstring(co, "while true do coroutine.yield() end") != LUA_OK)
+		return lua_error(L);
+	for (i = 0; i < n; i++) {
+		if (lua_resume(co, L, 0) != LUA_YIELD) {
+			lua_xmove(co, L, 1);
+			return lua_error(L);
+		}
+	}
+	return 0;
+}
+
+static int lunatik_bench_fullgc(lua_State *L, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		lua_gc(L, LUA_GCCOLLECT, 0);
+	return 0;
+}
+
+static int lunatik_bench_stepgc(lua_State *L, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		lua_gc(L, LUA_GCSTEP, 0);
+	return 0;
+}
+
+/* live heap of tables and strings for the collector to traverse */
+#define LUNATIK_BENCH_HEAP \
+	"heap = {} for i = 1, 4096 do heap[i] = {tostring(i), i} end"
+
+static const struct lunatik_bench lunatik_benches[] = {
+	{"opcodes", NULL, "local n = ... local s = 0 for i = 1, n do "
+		"s = s + i % 7 if s > 100 then s = s - 100 end end", NULL},
+	{"tinsert", NULL, "local n = ... local t = {} for i = 1, n do "
+		"t[i] = i end", NULL},
+	{"tlookup", NULL, "local n = ... local t, s = {a = 1, b = 2}, 0 "
+		"for i = 1, n do s = s + t.a + t.b end", NULL},
+	{"intern", NULL, "local n = ... for i = 1, n do "
+		"local s = 'k' .. (i % 1024) end", NULL},
+	{"pcall", NULL, NULL, lunatik_bench_pcall},
+	{"resume", NULL, NULL, lunatik_bench_resume},
+	{"fullgc", LUNATIK_BENCH_HEAP, NULL, lunatik_bench_fullgc},
+	{"stepgc", LUNATIK_BENCH_HEAP, NULL, lunatik_bench_stepgc},
+	{NULL, NULL, NULL, NULL}
+};
+
+static int lunatik_bench_cfunction(lua_State *L)
+{
+	const struct lunatik_bench *b = lua_touserdata(L, 1);
+	unsigned int n = (unsigned int)lua_tointeger(L, 2);
+
+	return b->run(L, n);
+}
+
+static void lunatik_bench_one(struct seq_file *m,
+	const struct lunatik_bench *b, unsigned int n)
+{
+	lua_State *L = lunatik_newstate(LUNATIK_ALLOC_SLAB |
+		LUNATIK_ALLOC_SLEEP);
+	struct lunatik_alloc *a;
+	size_t nallocs;
+	u64 start, ns;
+	int status;
+
+	if (L == NULL) {
+		seq_printf(m, "%-10s not enough memory\n", b->name);
+		return;
+	}
+	luaL_openlibs(L);
+	a = lunatik_getalloc(L);
+
+	if (b->setup != NULL && luaL_dostring(L, b->setup) != LUA_OK)
+		status = LUA_ERRRUN;
+	else if (b->chunk != NULL)
+		status = luaL_loadstring(L, b->chunk);
+	else {
+		lua_pushcfunction(L, lunatik_bench_cfunction);
+		lua_pushlightuserdata(L, (void *)b);
+		status = LUA_OK;
+	}
+	if (status == LUA_OK) {
+		lua_pushinteger(L, n);
+		nallocs = READ_ONCE(a->nallocs);
+		start = ktime_get_ns();
+		status = lua_pcall(L, b->chunk != NULL ? 1 : 2, 0, 0);
+		ns = ktime_get_ns() - start;
+		nallocs = READ_ONCE(a->nallocs) - nallocs;
+	}
+
+	if (status != LUA_OK)
+		seq_printf(m, "%-10s error: %s\n", b->name, lua_tostring(L, -1));
+	else
+		seq_printf(m, "%-10s %10u ops %10llu ns/op %10zu allocs %10zu peak\n",
+			b->name, n, div_u64(ns, n), nallocs, READ_ONCE(a->peak));
+	lunatik_close(L);
+}
+
+static int lunatik_bench_results_show(struct seq_file *m, void *v)
+{
+	unsigned int n = READ_ONCE(lunatik_bench_iterations);
+	const struct lunatik_bench *b;
+
+	if (n == 0)
+		n = 1;
+	for (b = lunatik_benches; b->name != NULL; b++) {
+		lunatik_bench_one(m, b, n);
+		cond_resched();
+	}
+	return 0;
+}
+
+static int lunatik_bench_results_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lunatik_bench_results_show, NULL);
+}
+
+static const struct file_operations lunatik_bench_results_fops = {
+	.owner = THIS_MODULE,
+	.open = lunatik_bench_results_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int __init modinit(void)
+{
+	lunatik_bench_dir = debugfs_create_dir("lunatik_bench", NULL);
+	debugfs_create_u32("iterations", 0600, lunatik_bench_dir,
+		&lunatik_bench_iterations);
+	debugfs_create_file("results", 0400, lunatik_bench_dir, NULL,
+		&lunatik_bench_results_fops);
+	return 0;
+}
+
+static void __exit modexit(void)
+{
+	debugfs_remove_recursive(lunatik_bench_dir);
+}
+
+module_init(modinit);
+module_exit(modexit);
+MODULE_LICENSE("Dual MIT/GPL");
+#endif /* __linux__ */
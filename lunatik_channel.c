@@ -0,0 +1,462 @@
+/*
+* Copyright (c) 2017-2019 CUJO LLC.
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifdef __linux__
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/atomic.h>
+#include <linux/log2.h>
+
+#include "lua/lua.h"
+#include "lua/lauxlib.h"
+
+#include "lunatik.h"
+
+/*
+** Channels: bounded queues of messages between states. A message is a
+** list of nil, boolean, integer or string values, copied into one block
+** by 'send' and pushed again by 'recv'. The queue is a ring of slots with
+** sequence numbers: a slot can be filled when its sequence is the
+** position of the producer and emptied when it is that position plus one,
+** so neither side takes a lock. With LUNATIK_CHANNEL_MPSC, producers
+** claim positions with 'cmpxchg'; otherwise there must be a single
+** producer. There is always a single consumer, which, in a task of an
+** executor, waits for messages without blocking its worker.
+*/
+#define LUNATIK_CHANNEL	"lunatik.channel"
+
+#define LUNATIK_CHANNEL_CLOSED	(1u << 31)
+
+struct lunatik_chslot {
+	unsigned int seq;
+	struct lunatik_chmsg *msg;
+};
+
+struct lunatik_channel {
+	atomic_t refs;	/* the creator's and the userdata's */
+	unsigned int flags;
+	gfp_t gfp;	/* of the messages */
+	unsigned int mask;	/* number of slots minus one */
+	unsigned int head;	/* position of the consumer */
+	unsigned int tail;	/* position of the producers */
+	struct lunatik_task *waiter;	/* consumer waiting (held) */
+	struct lunatik_chslot slots[];
+};
+
+struct lunatik_chmsg {
+	int n;	/* number of values */
+	size_t len;
+	u8 data[];	/* type tag of each value, followed by its contents */
+};
+
+struct lunatik_chud {
+	struct lunatik_channel *ch;
+	unsigned int flags;	/* ends of the channel this userdata can use */
+	struct lunatik_chmsg *msg;	/* received, but not pushed yet */
+	struct lunatik_task *waiter;	/* put in 'ch->waiter' through it */
+};
+
+/*
+** channel methods have the channel metatable as their first upvalue, so
+** checking their arguments is a pointer comparison with its tag
+*/
+#define lunatik_tochud(L, arg)	((struct lunatik_chud *)		\
+	luaL_checkudatatag(L, arg, lua_topointer(L, lua_upvalueindex(1)),\
+		LUNATIK_CHANNEL))
+
+static void lunatik_chput(struct lunatik_channel *ch)
+{
+	unsigned int i;
+
+	if (!atomic_dec_and_test(&ch->refs))
+		return;
+#ifdef LUNATIK_LOCK
+	if (ch->waiter != NULL)	/* never woken */
+		lunatik_droptask(ch->waiter);
+#endif /* LUNATIK_LOCK */
+	for (i = 0; i <= ch->mask; i++)	/* messages not received */
+		kfree(ch->slots[i].msg);
+	kfree(ch);
+}
+
+static bool lunatik_chpush(struct lunatik_channel *ch,
+	struct lunatik_chmsg *msg)
+{
+	struct lunatik_chslot *slot;
+	unsigned int pos = READ_ONCE(ch->tail);
+
+	for (;;) {
+		int diff;
+
+		slot = &ch->slots[pos & ch->mask];
+		diff = (int)(smp_load_acquire(&slot->seq) - pos);
+		if (diff < 0)
+			return false;	/* full */
+		if (diff > 0)	/* another producer took 'pos' */
+			pos = READ_ONCE(ch->tail);
+		else if (!(ch->flags & LUNATIK_CHANNEL_MPSC)) {
+			WRITE_ONCE(ch->tail, pos + 1);
+			break;
+		}
+		else {
+			unsigned int old = cmpxchg(&ch->tail, pos, pos + 1);
+
+			if (old == pos)
+				break;
+			pos = old;
+		}
+	}
+	slot->msg = msg;
+	smp_store_release(&slot->seq, pos + 1);
+	return true;
+}
+
+/* called by the consumer only */
+static struct lunatik_chmsg *lunatik_chpop(struct lunatik_channel *ch)
+{
+	unsigned int pos = ch->head;
+	struct lunatik_chslot *slot = &ch->slots[pos & ch->mask];
+	struct lunatik_chmsg *msg;
+
+	if (smp_load_acquire(&slot->seq) != pos + 1)
+		return NULL;	/* empty */
+	msg = slot->msg;
+	slot->msg = NULL;
+	smp_store_release(&slot->seq, pos + ch->mask + 1);
+	ch->head = pos + 1;
+	return msg;
+}
+
+/* wakes the consumer, dropping the reference taken when it waited */
+static void lunatik_chwake(struct lunatik_channel *ch)
+{
+#ifdef LUNATIK_LOCK
+	struct lunatik_task *t = xchg(&ch->waiter, NULL);
+
+	if (t != NULL)
+		lunatik_wake(t);
+#endif /* LUNATIK_LOCK */
+}
+
+/* size of the encoding of the value at 'idx' */
+static size_t lunatik_chvalsize(lua_State *L, int idx)
+{
+	switch (lua_type(L, idx)) {
+	case LUA_TNIL:
+		return 1;
+	case LUA_TBOOLEAN:
+		return 2;
+	case LUA_TSTRING:
+		return 1 + sizeof(size_t) + lua_rawlen(L, idx);
+	case LUA_TNUMBER:
+		if (lua_isinteger(L, idx))
+			return 1 + sizeof(lua_Integer);
+		break;
+	}
+	return luaL_argerror(L, idx, "nil, boolean, integer or string expected");
+}
+
+static u8 *lunatik_chencode(lua_State *L, int idx, u8 *p)
+{
+	int t = lua_type(L, idx);
+
+	*p++ = (u8)t;
+	switch (t) {
+	case LUA_TBOOLEAN:
+		*p++ = (u8)lua_toboolean(L, idx);
+		break;
+	case LUA_TNUMBER: {
+		lua_Integer i = lua_tointeger(L, idx);
+
+		memcpy(p, &i, sizeof(i));
+		p += sizeof(i);
+		break;
+	}
+	case LUA_TSTRING: {
+		size_t len;
+		const char *s = lua_tolstring(L, idx, &len);
+
+		memcpy(p, &len, sizeof(len));
+		memcpy(p + sizeof(len), s, len);
+		p += sizeof(len) + len;
+		break;
+	}
+	}
+	return p;
+}
+
+static void lunatik_chdecode(lua_State *L, const struct lunatik_chmsg *msg)
+{
+	const u8 *p = msg->data;
+	int i;
+
+	for (i = 0; i < msg->n; i++) {
+		switch (*p++) {
+		case LUA_TNIL:
+			lua_pushnil(L);
+			break;
+		case LUA_TBOOLEAN:
+			lua_pushboolean(L, *p++);
+			break;
+		case LUA_TNUMBER: {
+			lua_Integer v;
+
+			memcpy(&v, p, sizeof(v));
+			lua_pushinteger(L, v);
+			p += sizeof(v);
+			break;
+		}
+		case LUA_TSTRING: {
+			size_t len;
+
+			memcpy(&len, p, sizeof(len));
+			lua_pushlstring(L, (const char *)p + sizeof(len), len);
+			p += sizeof(len) + len;
+			break;
+		}
+		}
+	}
+}
+
+static struct lunatik_chud *lunatik_checkend(lua_State *L,
+	unsigned int end)
+{
+	struct lunatik_chud *ud = lunatik_tochud(L, 1);
+
+	luaL_argcheck(L, ud->flags & end, 1, end == LUNATIK_CHANNEL_SEND ?
+		"not a sending end" : "not a receiving end");
+	return ud;
+}
+
+/* 'ch:send(...)': returns false if the channel is full or closed */
+static int lunatik_channel_send(lua_State *L)
+{
+	struct lunatik_channel *ch =
+		lunatik_checkend(L, LUNATIK_CHANNEL_SEND)->ch;
+	struct lunatik_chmsg *msg;
+	int i, n = lua_gettop(L);
+	size_t len = 0;
+	u8 *p;
+
+	for (i = 2; i <= n; i++)
+		len += lunatik_chvalsize(L, i);
+	if (READ_ONCE(ch->flags) & LUNATIK_CHANNEL_CLOSED) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	if ((msg = kmalloc(sizeof(*msg) + len, ch->gfp)) == NULL)
+		return luaL_error(L, "not enough memory");
+	msg->n = n - 1;
+	msg->len = len;
+	for (i = 2, p = msg->data; i <= n; i++)
+		p = lunatik_chencode(L, i, p);
+	if (!lunatik_chpush(ch, msg)) {
+		kfree(msg);
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	lunatik_chwake(ch);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+** pushes 'true' and the values of the next message, or returns false if
+** there is none; the message is kept by the userdata until pushed
+*/
+static bool lunatik_chrecv(lua_State *L, struct lunatik_chud *ud)
+{
+	if (ud->msg == NULL && (ud->msg = lunatik_chpop(ud->ch)) == NULL)
+		return false;
+	luaL_checkstack(L, ud->msg->n + 1, "too many values to receive");
+	lua_pushboolean(L, 1);
+	lunatik_chdecode(L, ud->msg);
+	return true;
+}
+
+static int lunatik_chresults(struct lunatik_chud *ud)
+{
+	int n = ud->msg->n + 1;
+
+	kfree(ud->msg);
+	ud->msg = NULL;
+	return n;
+}
+
+/* 'ch:tryrecv()': returns true and the values of a message, or false */
+static int lunatik_channel_tryrecv(lua_State *L)
+{
+	struct lunatik_chud *ud = lunatik_checkend(L, LUNATIK_CHANNEL_RECV);
+
+	if (!lunatik_chrecv(L, ud)) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	return lunatik_chresults(ud);
+}
+
+#ifdef LUNATIK_LOCK
+static int lunatik_channel_recv(lua_State *L);
+
+static int lunatik_channel_recvk(lua_State *L, int status, lua_KContext ctx)
+{
+	return lunatik_channel_recv(L);
+}
+
+/*
+** 'ch:recv()': like 'tryrecv', but an empty channel suspends the task
+** calling it until the next message arrives or the channel is closed
+** (which makes it return false)
+*/
+static int lunatik_channel_recv(lua_State *L)
+{
+	struct lunatik_chud *ud = lunatik_checkend(L, LUNATIK_CHANNEL_RECV);
+	struct lunatik_channel *ch = ud->ch;
+	struct lunatik_task *t;
+
+	ud->waiter = NULL;	/* running, so not waiting */
+	for (;;) {
+		if (lunatik_chrecv(L, ud))
+			return lunatik_chresults(ud);
+		if (READ_ONCE(ch->flags) & LUNATIK_CHANNEL_CLOSED) {
+			lua_pushboolean(L, 0);
+			return 1;
+		}
+		if ((t = lunatik_gettask(L)) == NULL)
+			return luaL_error(L, "attempt to wait outside a task");
+		lunatik_holdtask(t);	/* dropped by the wake */
+		ud->waiter = t;
+		smp_store_mb(ch->waiter, t);
+		/* a message (or 'close') that came first will not wake us */
+		if (smp_load_acquire(&ch->slots[ch->head & ch->mask].seq) !=
+		    ch->head + 1 && !(READ_ONCE(ch->flags) &
+		    LUNATIK_CHANNEL_CLOSED))
+			break;
+		if (xchg(&ch->waiter, NULL) == NULL)
+			break;	/* already taken by a waker */
+		lunatik_droptask(t);	/* taken back */
+	}
+	return lunatik_suspend(L, 0, lunatik_channel_recvk);
+}
+#endif /* LUNATIK_LOCK */
+
+static int lunatik_channel_gc(lua_State *L)
+{
+	struct lunatik_chud *ud = lunatik_tochud(L, 1);
+
+	if (ud->ch != NULL) {
+#ifdef LUNATIK_LOCK
+		struct lunatik_task *t;
+
+		/* a task waiting on a collected userdata has ended */
+		if ((t = ud->waiter) != NULL &&
+		    cmpxchg(&ud->ch->waiter, t, NULL) == t)
+			lunatik_droptask(t);
+#endif /* LUNATIK_LOCK */
+		kfree(ud->msg);
+		lunatik_chput(ud->ch);
+		ud->ch = NULL;
+	}
+	return 0;
+}
+
+static const luaL_Reg lunatik_channelmethods[] = {
+	{"send", lunatik_channel_send},
+	{"tryrecv", lunatik_channel_tryrecv},
+#ifdef LUNATIK_LOCK
+	{"recv", lunatik_channel_recv},
+#endif /* LUNATIK_LOCK */
+	{NULL, NULL}
+};
+
+/*
+** creates a channel for 'size' messages (rounded up to a power of 2);
+** 'flags' are LUNATIK_CHANNEL_MPSC and the allocation context of the
+** messages, as in 'lunatik_newstate'
+*/
+struct lunatik_channel *lunatik_newchannel(unsigned int size,
+	unsigned int flags)
+{
+	struct lunatik_channel *ch;
+	unsigned int i, nslots;
+
+	might_sleep();
+	if (size == 0 || size > KMALLOC_MAX_SIZE / sizeof(struct lunatik_chslot))
+		return NULL;
+	nslots = roundup_pow_of_two(size);
+	ch = kmalloc(sizeof(*ch) + nslots * sizeof(struct lunatik_chslot),
+		GFP_KERNEL);
+	if (ch == NULL)
+		return NULL;
+	atomic_set(&ch->refs, 1);
+	ch->flags = flags & LUNATIK_CHANNEL_MPSC;
+	ch->gfp = lunatik_gfp(flags);
+	ch->mask = nslots - 1;
+	ch->head = ch->tail = 0;
+	ch->waiter = NULL;
+	for (i = 0; i < nslots; i++) {
+		ch->slots[i].seq = i;
+		ch->slots[i].msg = NULL;
+	}
+	return ch;
+}
+
+/*
+** closes 'ch' for new messages, waking its consumer, and drops the
+** reference of the creator; states may still hold the channel
+*/
+void lunatik_closechannel(struct lunatik_channel *ch)
+{
+	WRITE_ONCE(ch->flags, ch->flags | LUNATIK_CHANNEL_CLOSED);
+	smp_mb();
+	lunatik_chwake(ch);
+	lunatik_chput(ch);
+}
+
+/*
+** pushes a userdata for 'ch'; 'flags' tell which ends it can use
+** (LUNATIK_CHANNEL_SEND, LUNATIK_CHANNEL_RECV)
+*/
+void lunatik_pushchannel(lua_State *L, struct lunatik_channel *ch,
+	unsigned int flags)
+{
+	struct lunatik_chud *ud;
+
+	ud = (struct lunatik_chud *)lua_newuserdata(L, sizeof(*ud));
+	ud->ch = NULL;
+	ud->msg = NULL;
+	ud->waiter = NULL;
+	if (luaL_newmetatable(L, LUNATIK_CHANNEL)) {
+		luaL_newlibtable(L, lunatik_channelmethods);
+		lua_pushvalue(L, -2);
+		luaL_setfuncs(L, lunatik_channelmethods, 1);
+		lua_setfield(L, -2, "__index");
+		lua_pushvalue(L, -1);
+		lua_pushcclosure(L, lunatik_channel_gc, 1);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+	atomic_inc(&ch->refs);
+	ud->ch = ch;
+	ud->flags = flags & (LUNATIK_CHANNEL_SEND | LUNATIK_CHANNEL_RECV);
+}
+#endif /* __linux__ */
@@ -22,11 +22,35 @@
 */
 #ifdef __linux__
 #include <linux/module.h>
+#include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/atomic.h>
+#include <linux/jhash.h>
+#include <linux/scatterlist.h>
+#include <linux/numa.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
+#include <linux/err.h>
+#include <linux/string.h>
 
 #include "lua/lua.h"
 #include "lua/lauxlib.h"
 #include "lua/lualib.h"
 
+#include "lua/lstate.h"
+
+#include "lunatik.h"
+#include "lunatik_inline.h"
+
+#define CREATE_TRACE_POINTS
+#include "lunatik_trace.h"
+
 EXPORT_SYMBOL(lua_checkstack);
 EXPORT_SYMBOL(lua_xmove);
 EXPORT_SYMBOL(lua_atpanic);
@@ -48,17 +72,31 @@ EXPORT_SYMBOL(lua_rawequal);
 EXPORT_SYMBOL(lua_arith);
 EXPORT_SYMBOL(lua_compare);
 EXPORT_SYMBOL(lua_stringtonumber);
+EXPORT_SYMBOL(lua_integer2buff);
 EXPORT_SYMBOL(lua_tointegerx);
 EXPORT_SYMBOL(lua_toboolean);
 EXPORT_SYMBOL(lua_tolstring);
 EXPORT_SYMBOL(lua_rawlen);
 EXPORT_SYMBOL(lua_tocfunction);
 EXPORT_SYMBOL(lua_touserdata);
+EXPORT_SYMBOL(lua_touserdatatag);
 EXPORT_SYMBOL(lua_tothread);
 EXPORT_SYMBOL(lua_topointer);
 EXPORT_SYMBOL(lua_pushnil);
 EXPORT_SYMBOL(lua_pushinteger);
 EXPORT_SYMBOL(lua_pushlstring);
+EXPORT_SYMBOL(lua_pushexternalstring);
+EXPORT_SYMBOL(lua_pushlongstring);
+EXPORT_SYMBOL(lua_setiarray);
+EXPORT_SYMBOL(lua_getiarray);
+EXPORT_SYMBOL(lua_ref);
+EXPORT_SYMBOL(lua_getref);
+EXPORT_SYMBOL(lua_unref);
+EXPORT_SYMBOL(lua_internkey);
+EXPORT_SYMBOL(lua_getfieldk);
+EXPORT_SYMBOL(lua_setfieldk);
+EXPORT_SYMBOL(lua_setstrcache);
+EXPORT_SYMBOL(lua_strcachestats);
 EXPORT_SYMBOL(lua_pushstring);
 EXPORT_SYMBOL(lua_pushvfstring);
 EXPORT_SYMBOL(lua_pushfstring);
@@ -74,6 +112,9 @@ EXPORT_SYMBOL(lua_rawget);
 EXPORT_SYMBOL(lua_rawgeti);
 EXPORT_SYMBOL(lua_rawgetp);
 EXPORT_SYMBOL(lua_createtable);
+EXPORT_SYMBOL(lua_clonetable);
+EXPORT_SYMBOL(lua_reservetable);
+EXPORT_SYMBOL(lua_cleartable);
 EXPORT_SYMBOL(lua_getmetatable);
 EXPORT_SYMBOL(lua_getuservalue);
 EXPORT_SYMBOL(lua_setglobal);
@@ -87,12 +128,16 @@ EXPORT_SYMBOL(lua_setmetatable);
 EXPORT_SYMBOL(lua_setuservalue);
 EXPORT_SYMBOL(lua_callk);
 EXPORT_SYMBOL(lua_pcallk);
+EXPORT_SYMBOL(lua_pcallbatch);
 EXPORT_SYMBOL(lua_load);
 EXPORT_SYMBOL(lua_dump);
 EXPORT_SYMBOL(lua_status);
 EXPORT_SYMBOL(lua_gc);
+EXPORT_SYMBOL(lua_beginregion);
+EXPORT_SYMBOL(lua_endregion);
 EXPORT_SYMBOL(lua_error);
 EXPORT_SYMBOL(lua_next);
+EXPORT_SYMBOL(lua_nextidx);
 EXPORT_SYMBOL(lua_concat);
 EXPORT_SYMBOL(lua_len);
 EXPORT_SYMBOL(lua_getallocf);
@@ -113,9 +158,11 @@ EXPORT_SYMBOL(lua_getinfo);
 EXPORT_SYMBOL(lua_resume);
 EXPORT_SYMBOL(lua_isyieldable);
 EXPORT_SYMBOL(lua_yieldk);
+EXPORT_SYMBOL(lua_setbudget);
 EXPORT_SYMBOL(lua_newthread);
 EXPORT_SYMBOL(lua_newstate);
 EXPORT_SYMBOL(lua_close);
+EXPORT_SYMBOL(lua_clonestate);
 EXPORT_SYMBOL(luaL_traceback);
 EXPORT_SYMBOL(luaL_argerror);
 EXPORT_SYMBOL(luaL_where);
@@ -124,6 +171,8 @@ EXPORT_SYMBOL(luaL_newmetatable);
 EXPORT_SYMBOL(luaL_setmetatable);
 EXPORT_SYMBOL(luaL_testudata);
 EXPORT_SYMBOL(luaL_checkudata);
+EXPORT_SYMBOL(luaL_udatatag);
+EXPORT_SYMBOL(luaL_checkudatatag);
 EXPORT_SYMBOL(luaL_checkoption);
 EXPORT_SYMBOL(luaL_checkstack);
 EXPORT_SYMBOL(luaL_checktype);
@@ -155,6 +204,7 @@ EXPORT_SYMBOL(luaL_gsub);
 EXPORT_SYMBOL(luaL_newstate);
 EXPORT_SYMBOL(luaL_checkversion_);
 EXPORT_SYMBOL(luaL_openlibs);
+EXPORT_SYMBOL(luaL_openselectedlibs);
 EXPORT_SYMBOL(luaopen_base);
 EXPORT_SYMBOL(luaopen_package);
 EXPORT_SYMBOL(luaopen_coroutine);
@@ -164,14 +214,740 @@ EXPORT_SYMBOL(luaopen_os);
 EXPORT_SYMBOL(luaopen_string);
 EXPORT_SYMBOL(luaopen_table);
 EXPORT_SYMBOL(luaopen_utf8);
+EXPORT_SYMBOL(luaopen_intmap);
+EXPORT_SYMBOL(luaL_newintmap);
+EXPORT_SYMBOL(luaL_intmapget);
+EXPORT_SYMBOL(luaL_intmapset);
+
+EXPORT_SYMBOL(lunatik_newstate);
+EXPORT_SYMBOL(lunatik_newstatenode);
+EXPORT_SYMBOL(lunatik_close);
+EXPORT_SYMBOL(lunatik_getalloc);
+EXPORT_SYMBOL(lunatik_setlimit);
+EXPORT_SYMBOL(lunatik_setname);
+EXPORT_SYMBOL(lunatik_readstats);
+EXPORT_SYMBOL(lunatik_newpool);
+EXPORT_SYMBOL(lunatik_closepool);
+EXPORT_SYMBOL(lunatik_getstate);
+EXPORT_SYMBOL(lunatik_putstate);
+EXPORT_SYMBOL(lunatik_newscript);
+EXPORT_SYMBOL(lunatik_replace);
+EXPORT_SYMBOL(lunatik_closescript);
+EXPORT_SYMBOL(lunatik_getscript);
+EXPORT_SYMBOL(lunatik_putscript);
+EXPORT_SYMBOL(lunatik_loadbuffer);
+EXPORT_SYMBOL(lunatik_setcachelimit);
+EXPORT_SYMBOL(lunatik_loadsg);
+EXPORT_SYMBOL(lunatik_pushview);
+EXPORT_SYMBOL(lunatik_invalidate);
+EXPORT_SYMBOL(lunatik_newshmap);
+EXPORT_SYMBOL(lunatik_closeshmap);
+EXPORT_SYMBOL(lunatik_pushshmap);
+EXPORT_SYMBOL(lunatik_newchannel);
+EXPORT_SYMBOL(lunatik_closechannel);
+EXPORT_SYMBOL(lunatik_pushchannel);
+EXPORT_SYMBOL(lunatik_newprof);
+EXPORT_SYMBOL(lunatik_closeprof);
+EXPORT_SYMBOL(lunatik_layout);
+EXPORT_SYMBOL(lunatik_registerlib);
+EXPORT_SYMBOL(lunatik_unregisterlib);
+#ifdef LUNATIK_LOCK
+EXPORT_SYMBOL(lunatik_newexec);
+EXPORT_SYMBOL(lunatik_closeexec);
+EXPORT_SYMBOL(lunatik_spawn);
+EXPORT_SYMBOL(lunatik_gettask);
+EXPORT_SYMBOL(lunatik_holdtask);
+EXPORT_SYMBOL(lunatik_droptask);
+EXPORT_SYMBOL(lunatik_suspend);
+EXPORT_SYMBOL(lunatik_wake);
+EXPORT_SYMBOL(lunatik_sleep);
+#endif /* LUNATIK_LOCK */
+
+#ifdef LUNATIK_LOCK
+/*
+** Deferred collector: when a GC step is due, the allocating context only
+** queues 'work'; the step runs in process context, under the state lock.
+** Emergency collections, on allocation failures, still run inline.
+*/
+struct lunatik_gc {
+	struct work_struct work;
+	lua_State *L;
+};
+
+static void lunatik_gcwork(struct work_struct *work)
+{
+	struct lunatik_gc *gc = container_of(work, struct lunatik_gc, work);
+
+	lua_gc(gc->L, LUA_GCDEFERSTEP, 0);
+}
+
+/*
+** 'luai_gcdefer'; called with the state locked. States not created by
+** 'lunatik_newstate' (e.g., by 'luaL_newstate') have no work item; their
+** owners must call 'LUA_GCDEFERSTEP' themselves.
+*/
+void lunatik_gcdefer(lua_State *L)
+{
+	struct lunatik_gc *gc;
+
+	if (G(L)->frealloc != lunatik_allocf)
+		return;
+	gc = lunatik_getalloc(L)->gc;
+	if (gc != NULL)
+		schedule_work(&gc->work);
+}
+#endif /* LUNATIK_LOCK */
+
+/*
+** 'luai_budgetyield'; called with the state locked. Only states created
+** with LUNATIK_ALLOC_SLEEP are known to run in process context.
+*/
+void lunatik_budgetyield(lua_State *L)
+{
+	if (G(L)->frealloc == lunatik_allocf &&
+	    (((struct lunatik_alloc *)G(L)->ud)->flags & LUNATIK_ALLOC_SLEEP)) {
+		lua_unlock(L);
+		cond_resched();
+		lua_lock(L);
+	}
+}
+
+/*
+** Registry of live states: every state of 'lunatik_newstate' is listed,
+** with its statistics (see 'struct lunatik_stats'), by 'states' under the
+** debugfs directory 'lunatik'; a state named with 'lunatik_setname' also
+** has '<name>/stats'. The statistics are plain counters, as those of the
+** allocator: a state is used by a single context at a time, which is the
+** only writer, so they are updated without atomics; the u64 counters are
+** written within 'u64_stats_sync', so readers do not see torn values on
+** 32-bit.
+*/
+static DEFINE_SPINLOCK(lunatik_stateslock);
+static LIST_HEAD(lunatik_states);
+static atomic_t lunatik_lastid = ATOMIC_INIT(0);
+static struct dentry *lunatik_dir;
+
+#define lunatik_statadd(s,f,n)	do { \
+	u64_stats_update_begin(&(s)->sync); \
+	WRITE_ONCE((s)->f, (s)->f + (n)); \
+	u64_stats_update_end(&(s)->sync); \
+} while (0)
+
+static inline struct lunatik_stats *lunatik_getstats(lua_State *L)
+{
+	return G(L)->frealloc == lunatik_allocf ?
+		&((struct lunatik_alloc *)G(L)->ud)->stats : NULL;
+}
+
+/* 'luai_statgc', 'luai_statcycle' and friends; called with the state locked */
+void lunatik_statgc(lua_State *L, u64 ns)
+{
+	struct lunatik_stats *s = lunatik_getstats(L);
+
+	if (s != NULL)
+		lunatik_statadd(s, gcns, ns);
+}
+
+void lunatik_statcycle(lua_State *L)
+{
+	struct lunatik_stats *s = lunatik_getstats(L);
+
+	if (s != NULL)
+		lunatik_statadd(s, gccycles, 1);
+}
+
+void lunatik_staterror(lua_State *L)
+{
+	struct lunatik_stats *s = lunatik_getstats(L);
+
+	if (s != NULL)
+		lunatik_statadd(s, errors, 1);
+}
+
+void lunatik_statbudget(lua_State *L, u64 n)
+{
+	struct lunatik_stats *s = lunatik_getstats(L);
+
+	if (s != NULL)
+		lunatik_statadd(s, budget, n);
+}
+
+void lunatik_statstack(lua_State *L, int size)
+{
+	struct lunatik_stats *s = lunatik_getstats(L);
+
+	if (s != NULL && size > s->stackpeak)
+		WRITE_ONCE(s->stackpeak, size);
+}
+
+/* copies the statistics of 'a' from any context (see 'lunatik_statadd') */
+void lunatik_readstats(struct lunatik_alloc *a, struct lunatik_stats *s)
+{
+	struct lunatik_stats *as = &a->stats;
+	unsigned int start;
+
+	do {
+		start = u64_stats_fetch_begin(&as->sync);
+		s->allocated = READ_ONCE(as->allocated);
+		s->freed = READ_ONCE(as->freed);
+		s->allocfails = READ_ONCE(as->allocfails);
+		s->gccycles = READ_ONCE(as->gccycles);
+		s->gcns = READ_ONCE(as->gcns);
+		s->budget = READ_ONCE(as->budget);
+		s->errors = READ_ONCE(as->errors);
+	} while (u64_stats_fetch_retry(&as->sync, start));
+	s->stackpeak = READ_ONCE(as->stackpeak);
+}
+
+static int lunatik_stats_show(struct seq_file *m, void *v)
+{
+	struct lunatik_alloc *a = (struct lunatik_alloc *)m->private;
+	struct lunatik_stats st, *s = &st;
+
+	lunatik_readstats(a, s);
+	seq_printf(m, "used %zu\npeak %zu\nlimit %zu\nnallocs %zu\n",
+		READ_ONCE(a->used), READ_ONCE(a->peak), READ_ONCE(a->limit),
+		READ_ONCE(a->nallocs));
+	seq_printf(m, "allocated %llu\nfreed %llu\nallocfails %llu\n",
+		s->allocated, s->freed, s->allocfails);
+	seq_printf(m, "gccycles %llu\ngcns %llu\nbudget %llu\nerrors %llu\n"
+		"stackpeak %d\n", s->gccycles, s->gcns, s->budget, s->errors,
+		s->stackpeak);
+	return 0;
+}
+
+static int lunatik_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lunatik_stats_show, inode->i_private);
+}
+
+static const struct file_operations lunatik_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = lunatik_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+#ifdef LUNATIK_LOCK
+/* one line per function that has run with 'lua_setcounters' on */
+static void lunatik_counters_print(void *ud, const char *src, int linedefined,
+	size_t calls, const size_t *counts, const int *lineinfo, int n)
+{
+	struct seq_file *m = (struct seq_file *)ud;
+	size_t instructions = 0;
+	int pc;
+
+	for (pc = 0; pc < n; pc++)
+		instructions += counts[pc];
+	seq_printf(m, "%12zu %14zu %s:%d\n", calls, instructions, src,
+		linedefined);
+}
+
+/* walks the objects of the state, with it locked */
+static int lunatik_counters_show(struct seq_file *m, void *v)
+{
+	lua_getcounters((lua_State *)m->private, lunatik_counters_print, m);
+	return 0;
+}
+
+static int lunatik_counters_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lunatik_counters_show, inode->i_private);
+}
+
+static const struct file_operations lunatik_counters_fops = {
+	.owner = THIS_MODULE,
+	.open = lunatik_counters_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int lunatik_memory_show(struct seq_file *m, void *v)
+{
+	static const char *const kinds[LUA_MEMKINDS] = {"table", "string",
+		"longstring", "function", "cfunction", "userdata", "thread",
+		"proto", "other"};
+	lua_MemStats *ms = kmalloc(sizeof(*ms), GFP_KERNEL);
+	int i;
+
+	if (ms == NULL)
+		return -ENOMEM;
+	lua_getmemstats((lua_State *)m->private, ms);
+	seq_printf(m, "%-10s %10s %12s\n", "kind", "count", "bytes");
+	for (i = 0; i < LUA_MEMKINDS; i++)
+		seq_printf(m, "%-10s %10zu %12zu\n", kinds[i], ms->count[i],
+			ms->bytes[i]);
+	seq_printf(m, "\n%-10s %10s\n", "size", "blocks");
+	for (i = 0; i < LUA_MEMCLASSES; i++)
+		if (ms->blocks[i] > 0)
+			seq_printf(m, "<= %-7lu %10zu\n", 1UL << i,
+				ms->blocks[i]);
+	kfree(ms);
+	return 0;
+}
+
+static int lunatik_memory_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lunatik_memory_show, inode->i_private);
+}
+
+static const struct file_operations lunatik_memory_fops = {
+	.owner = THIS_MODULE,
+	.open = lunatik_memory_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+#endif /* LUNATIK_LOCK */
+
+static int lunatik_states_show(struct seq_file *m, void *v)
+{
+	struct lunatik_alloc *a;
+	unsigned long flags;
+
+	seq_printf(m, "%-6s %-16s %12s %12s %10s %10s %14s %10s\n", "id",
+		"name", "used", "peak", "allocfails", "gccycles", "gcns",
+		"errors");
+	spin_lock_irqsave(&lunatik_stateslock, flags);
+	list_for_each_entry(a, &lunatik_states, states) {
+		struct lunatik_stats s;
+
+		lunatik_readstats(a, &s);
+		seq_printf(m, "%-6u %-16s %12zu %12zu %10llu %10llu %14llu "
+			"%10llu\n", a->id, a->name[0] != '\0' ? a->name : "-",
+			READ_ONCE(a->used), READ_ONCE(a->peak), s.allocfails,
+			s.gccycles, s.gcns, s.errors);
+	}
+	spin_unlock_irqrestore(&lunatik_stateslock, flags);
+	return 0;
+}
+
+static int lunatik_states_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lunatik_states_show, NULL);
+}
+
+static const struct file_operations lunatik_states_fops = {
+	.owner = THIS_MODULE,
+	.open = lunatik_states_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void lunatik_register(struct lunatik_alloc *a)
+{
+	unsigned long flags;
+
+	memset(&a->stats, 0, sizeof(a->stats));
+	u64_stats_init(&a->stats.sync);
+	a->id = atomic_inc_return(&lunatik_lastid);
+	a->dir = NULL;
+	a->name[0] = '\0';
+	spin_lock_irqsave(&lunatik_stateslock, flags);
+	list_add_tail(&a->states, &lunatik_states);
+	spin_unlock_irqrestore(&lunatik_stateslock, flags);
+}
+
+static void lunatik_unregister(struct lunatik_alloc *a)
+{
+	unsigned long flags;
+
+	if (a->dir != NULL)
+		debugfs_remove_recursive(a->dir);	/* waits for readers */
+	spin_lock_irqsave(&lunatik_stateslock, flags);
+	list_del(&a->states);
+	spin_unlock_irqrestore(&lunatik_stateslock, flags);
+}
+
+/*
+** names the state 'L' and creates '<name>/stats' for it under the debugfs
+** directory 'lunatik' (and '<name>/counters' and '<name>/memory', which
+** take the state lock);
+** process context only, as then is 'lunatik_close'
+*/
+int lunatik_setname(lua_State *L, const char *name)
+{
+	struct lunatik_alloc *a = lunatik_getalloc(L);
+	struct dentry *dir;
+	size_t len = strlen(name);
+	unsigned long flags;
+
+	might_sleep();
+	if (a->dir != NULL)
+		return -EBUSY;
+	if (len >= LUNATIK_NAMELEN)
+		return -ENAMETOOLONG;
+	dir = debugfs_create_dir(name, lunatik_dir);
+	if (IS_ERR_OR_NULL(dir))
+		return dir == NULL ? -ENOMEM : PTR_ERR(dir);
+	debugfs_create_file("stats", 0400, dir, a, &lunatik_stats_fops);
+#ifdef LUNATIK_LOCK
+	debugfs_create_file("counters", 0400, dir, L, &lunatik_counters_fops);
+	debugfs_create_file("memory", 0400, dir, L, &lunatik_memory_fops);
+#endif /* LUNATIK_LOCK */
+	spin_lock_irqsave(&lunatik_stateslock, flags);
+	memcpy(a->name, name, len + 1);
+	spin_unlock_irqrestore(&lunatik_stateslock, flags);
+	a->dir = dir;
+	return 0;
+}
+
+static int lunatik_panic(lua_State *L)
+{
+	printk(KERN_ERR "PANIC: unprotected error in call to Lua API (%s)\n",
+		lua_tostring(L, -1));
+	return 0;
+}
+
+/*
+** creates a state whose memory comes from NUMA node 'node' (NUMA_NO_NODE
+** for any node, as 'lunatik_newstate'); e.g., 'cpu_to_node(cpu)' for a
+** state that will run on 'cpu'
+*/
+lua_State *lunatik_newstatenode(unsigned int flags, int node)
+{
+	struct lunatik_alloc *a;
+	lua_State *L;
+	gfp_t gfp = lunatik_gfp(flags);
+#ifdef LUNATIK_LOCK
+	struct lunatik_gc *gc = NULL;
+	struct lunatik_lock *lock;
+
+#ifdef LUNATIK_SPINLOCK
+	if (flags & LUNATIK_GC_DEFER)
+		return NULL;	/* the step would run with IRQs off */
+#endif /* LUNATIK_SPINLOCK */
+	if ((lock = kmalloc_node(sizeof(struct lunatik_lock), gfp,
+	    node)) == NULL)
+		return NULL;
+	lunatik_lockinit(lock);
+
+	if (flags & LUNATIK_GC_DEFER) {
+		gc = kmalloc_node(sizeof(struct lunatik_gc), gfp, node);
+		if (gc == NULL)
+			goto err;
+		INIT_WORK(&gc->work, lunatik_gcwork);
+	}
+#else
+	if (flags & LUNATIK_GC_DEFER)
+		return NULL;	/* a deferred step needs the state lock */
+#endif /* LUNATIK_LOCK */
+
+	if ((a = kmalloc_node(sizeof(struct lunatik_alloc), gfp, node)) == NULL)
+		goto err;
+
+	a->flags = flags;
+	a->gfp = gfp;
+	a->limit = 0;
+	a->used = a->peak = 0;
+	a->nallocs = 0;
+	a->node = node;
+	a->gc = NULL;
+	lunatik_register(a);
+	if ((L = lua_newstate(lunatik_allocf, a)) == NULL) {
+		lunatik_unregister(a);
+		kfree(a);
+		goto err;
+	}
+#ifdef LUNATIK_LOCK
+	lunatik_getlock(L) = lock;
+	if (gc != NULL) {
+		gc->L = L;
+		a->gc = gc;
+		lua_gc(L, LUA_GCDEFER, 1);
+	}
+#endif /* LUNATIK_LOCK */
+	lua_atpanic(L, &lunatik_panic);
+	return L;
+err:
+#ifdef LUNATIK_LOCK
+	kfree(gc);
+	kfree(lock);
+#endif /* LUNATIK_LOCK */
+	return NULL;
+}
+
+lua_State *lunatik_newstate(unsigned int flags)
+{
+	return lunatik_newstatenode(flags, NUMA_NO_NODE);
+}
+
+void lunatik_close(lua_State *L)
+{
+	void *ud;
+#ifdef LUNATIK_LOCK
+	struct lunatik_lock *lock = lunatik_getlock(L);
+	struct lunatik_gc *gc = lunatik_getalloc(L)->gc;
+
+	if (gc != NULL) {
+		lua_gc(L, LUA_GCDEFER, 0);	/* no more work is queued */
+		cancel_work_sync(&gc->work);
+	}
+#endif /* LUNATIK_LOCK */
+
+	lua_getallocf(L, &ud);
+	lua_close(L);
+	lunatik_unregister((struct lunatik_alloc *)ud);
+	kfree(ud);
+#ifdef LUNATIK_LOCK
+	kfree(gc);
+	kfree(lock);
+#endif /* LUNATIK_LOCK */
+}
+
+/* does not take the state lock; valid until 'lunatik_close' */
+struct lunatik_alloc *lunatik_getalloc(lua_State *L)
+{
+	return (struct lunatik_alloc *)G(L)->ud;
+}
+
+void lunatik_setlimit(lua_State *L, size_t limit)
+{
+	WRITE_ONCE(lunatik_getalloc(L)->limit, limit);
+}
+
+/* layout seen by the core, to be checked by 'lunatik_checkinline' */
+u64 lunatik_layout(void)
+{
+	return LUNATIK_LAYOUT;
+}
+
+/*
+** Bytecode cache: 'lunatik_loadbuffer' keeps the 'lua_dump' of every
+** source chunk it compiles, keyed by its contents and name, and loads
+** later copies of the same chunk with 'luaU_undump' instead of parsing
+** them again.  Entries are kept in LRU order (most recent first) and the
+** least recently used ones are dropped when the cache grows over
+** 'lunatik_cachelimit' bytes.  Loaders hold a reference to the entry
+** they are reading, so the mutex is not held while undumping.
+*/
+struct lunatik_chunk {
+	struct list_head lru;
+	atomic_t refs;	/* the cache's and the loaders' */
+	u32 hash;
+	size_t len;	/* of the source */
+	size_t namelen;
+	size_t dumplen;
+	char data[];	/* source, name and dump */
+};
+
+#define chunksize(c)	(sizeof(struct lunatik_chunk) + (c)->len + \
+	(c)->namelen + (c)->dumplen)
+#define chunkname(c)	((c)->data + (c)->len)
+#define chunkdump(c)	((c)->data + (c)->len + (c)->namelen)
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,12,0)
+#define lunatik_kvmalloc(size)	kvmalloc((size), GFP_KERNEL)
+#define lunatik_kvfree(p)	kvfree(p)
+#else
+#define lunatik_kvmalloc(size)	vmalloc(size)
+#define lunatik_kvfree(p)	vfree(p)
+#endif
+
+static DEFINE_MUTEX(lunatik_cachelock);
+static LIST_HEAD(lunatik_cache);
+static size_t lunatik_cachesize;
+static size_t lunatik_cachelimit = 1 << 20;
+
+static void lunatik_putchunk(struct lunatik_chunk *c)
+{
+	if (atomic_dec_and_test(&c->refs))
+		lunatik_kvfree(c);
+}
+
+/* called with 'lunatik_cachelock' held */
+static void lunatik_evict(size_t limit)
+{
+	while (lunatik_cachesize > limit) {
+		struct lunatik_chunk *c = list_last_entry(&lunatik_cache,
+			struct lunatik_chunk, lru);
+
+		list_del(&c->lru);
+		lunatik_cachesize -= chunksize(c);
+		lunatik_putchunk(c);
+	}
+}
+
+static struct lunatik_chunk *lunatik_getchunk(const char *buf, size_t len,
+	const char *name, size_t namelen, u32 hash)
+{
+	struct lunatik_chunk *c, *found = NULL;
+
+	mutex_lock(&lunatik_cachelock);
+	list_for_each_entry(c, &lunatik_cache, lru) {
+		if (c->hash == hash && c->len == len && c->namelen == namelen &&
+		    memcmp(c->data, buf, len) == 0 &&
+		    memcmp(chunkname(c), name, namelen) == 0) {
+			list_move(&c->lru, &lunatik_cache);
+			atomic_inc(&c->refs);
+			found = c;
+			break;
+		}
+	}
+	mutex_unlock(&lunatik_cachelock);
+	return found;
+}
+
+struct lunatik_dump {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+static int lunatik_dumpwriter(lua_State *L, const void *p, size_t sz,
+	void *ud)
+{
+	struct lunatik_dump *d = (struct lunatik_dump *)ud;
+
+	if (d->len + sz > d->size) {
+		size_t size = max(d->size * 2, d->len + sz);
+		char *buf = krealloc(d->buf, size, GFP_KERNEL);
+
+		if (buf == NULL)
+			return 1;
+		d->buf = buf;
+		d->size = size;
+	}
+	memcpy(d->buf + d->len, p, sz);
+	d->len += sz;
+	return 0;
+}
+
+/* caches the dump of the function on the top of the stack */
+static void lunatik_putcache(lua_State *L, const char *buf, size_t len,
+	const char *name, size_t namelen, u32 hash)
+{
+	struct lunatik_dump d = {NULL, 0, 0};
+	struct lunatik_chunk *c;
+	size_t limit = READ_ONCE(lunatik_cachelimit);
+
+	if (len + namelen >= limit ||
+	    lua_dump(L, lunatik_dumpwriter, &d, 0) != 0 ||
+	    (c = lunatik_kvmalloc(sizeof(*c) + len + namelen + d.len)) == NULL)
+		goto out;
+
+	atomic_set(&c->refs, 1);
+	c->hash = hash;
+	c->len = len;
+	c->namelen = namelen;
+	c->dumplen = d.len;
+	memcpy(c->data, buf, len);
+	memcpy(chunkname(c), name, namelen);
+	memcpy(chunkdump(c), d.buf, d.len);
+
+	mutex_lock(&lunatik_cachelock);
+	list_add(&c->lru, &lunatik_cache);
+	lunatik_cachesize += chunksize(c);
+	lunatik_evict(limit);
+	mutex_unlock(&lunatik_cachelock);
+out:
+	kfree(d.buf);
+}
+
+/*
+** 'luaL_loadbufferx' with the bytecode cache, for text chunks; it must be
+** called in process context.  Binary chunks are loaded as they are.
+*/
+int lunatik_loadbuffer(lua_State *L, const char *buf, size_t len,
+	const char *name)
+{
+	struct lunatik_chunk *c;
+	size_t namelen = name != NULL ? strlen(name) : 0;
+	u32 hash;
+	int status;
+
+	might_sleep();
+	if (len > 0 && buf[0] == LUA_SIGNATURE[0])	/* binary chunk? */
+		return luaL_loadbufferx(L, buf, len, name, NULL);
+
+	hash = jhash(name, namelen, jhash(buf, len, 0));
+	if ((c = lunatik_getchunk(buf, len, name, namelen, hash)) != NULL) {
+		status = luaL_loadbufferx(L, chunkdump(c), c->dumplen, name,
+			"b");
+		lunatik_putchunk(c);
+		return status;
+	}
+
+	status = luaL_loadbufferx(L, buf, len, name, "t");
+	if (status == LUA_OK)
+		lunatik_putcache(L, buf, len, name, namelen, hash);
+	return status;
+}
+
+/* sets the cache size limit in bytes (0 disables and flushes the cache) */
+void lunatik_setcachelimit(size_t limit)
+{
+	mutex_lock(&lunatik_cachelock);
+	WRITE_ONCE(lunatik_cachelimit, limit);
+	lunatik_evict(limit);
+	mutex_unlock(&lunatik_cachelock);
+}
+
+/*
+** Scatter-gather reader: hands 'lua_load' one mapped page at a time, so
+** chunks scattered over pages (e.g., skb fragments through
+** 'skb_to_sgvec') are loaded without being linearized first.  States
+** that may not sleep map the pages with SG_MITER_ATOMIC.
+*/
+static const char *lunatik_sgreader(lua_State *L, void *ud, size_t *size)
+{
+	struct sg_mapping_iter *miter = (struct sg_mapping_iter *)ud;
+
+	do {
+		if (!sg_miter_next(miter)) {
+			*size = 0;
+			return NULL;
+		}
+	} while (miter->length == 0);	/* a zero size would mean the end */
+
+	*size = miter->length;
+	return miter->addr;
+}
+
+int lunatik_loadsg(lua_State *L, struct scatterlist *sgl, unsigned int nents,
+	const char *name, const char *mode)
+{
+	struct sg_mapping_iter miter;
+	unsigned int flags = SG_MITER_FROM_SG;
+	int status;
+
+	if (!(lunatik_getalloc(L)->flags & LUNATIK_ALLOC_SLEEP))
+		flags |= SG_MITER_ATOMIC;
+
+	sg_miter_start(&miter, sgl, nents, flags);
+	status = lua_load(L, lunatik_sgreader, &miter, name, mode);
+	sg_miter_stop(&miter);
+	return status;
+}
 
 static int __init modinit(void)
 {
-        return 0;
+	int ret = lunatik_allocinit();
+
+	if (ret != 0)
+		return ret;
+	ret = lunatik_syminit();
+	if (ret != 0) {
+		lunatik_allocexit();
+		return ret;
+	}
+	lunatik_dir = debugfs_create_dir("lunatik", NULL);
+	debugfs_create_file("states", 0400, lunatik_dir, NULL,
+		&lunatik_states_fops);
+	lunatik_profinit(lunatik_dir);
+	return 0;
 }
 
 static void __exit modexit(void)
 {
+	debugfs_remove_recursive(lunatik_dir);
+	lunatik_profexit();
+	lunatik_setcachelimit(0);
+	lunatik_symexit();
+	lunatik_allocexit();
 }
 
 module_init(modinit);
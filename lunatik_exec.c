@@ -0,0 +1,334 @@
+/*
+* Copyright (c) 2017-2019 CUJO LLC.
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifdef __linux__
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <linux/wait.h>
+#include <linux/atomic.h>
+
+#include "lua/lua.h"
+#include "lua/lauxlib.h"
+
+#include "lunatik.h"
+
+#ifdef LUNATIK_LOCK
+/*
+** Executor: every task is a thread of the state of the executor, resumed
+** by a work item. A C function that starts an asynchronous operation
+** suspends its task ('lunatik_suspend'), yielding with a continuation;
+** the completion of the operation (a callback, a timer, a wait-queue
+** wake) calls 'lunatik_wake', which queues the work item again, and the
+** task goes on in the continuation. Each suspension takes exactly one
+** wake. A task that yields for any other reason (e.g., its instruction
+** budget is out) is queued again at once, so that tasks share the
+** workqueue.
+**
+** The operation holds a reference to the task ('lunatik_holdtask') from
+** its start to its wake, so that a task that ends before the wake (an
+** error raised after the start, 'lunatik_closeexec') is only marked
+** 'ended', and freed by the wake. 'lunatik_closeexec' waits for those.
+*/
+struct lunatik_exec {
+	lua_State *L;
+	struct workqueue_struct *wq;
+	int budget;
+	spinlock_t lock;	/* protects 'tasks', 'ntasks' and 'ended' */
+	struct list_head tasks;
+	unsigned int ntasks;	/* tasks not freed */
+	wait_queue_head_t idle;	/* for 'ntasks' to be 0 */
+};
+
+struct lunatik_task {
+	struct delayed_work work;
+	struct lunatik_exec *exec;
+	lua_State *co;
+	int ref;	/* of 'co' */
+	int nargs;	/* of the next resume */
+	int suspended;	/* waiting for 'lunatik_wake' */
+	int ended;	/* not to be resumed again */
+	atomic_t refs;	/* the task's own and the operations' */
+	lunatik_Done done;
+	void *ud;
+	struct list_head node;
+};
+
+static void lunatik_puttask(struct lunatik_task *t)
+{
+	struct lunatik_exec *e = t->exec;
+	unsigned long flags;
+
+	if (!atomic_dec_and_test(&t->refs))
+		return;
+	kfree(t);
+	spin_lock_irqsave(&e->lock, flags);
+	if (--e->ntasks == 0)
+		wake_up(&e->idle);
+	spin_unlock_irqrestore(&e->lock, flags);
+}
+
+/* drops 'co' and the reference of 't' to itself */
+static void lunatik_freetask(struct lunatik_task *t)
+{
+	lua_unref(t->co, t->ref);
+	lunatik_puttask(t);
+}
+
+/* ends 't', unless 'lunatik_closeexec' has already taken it */
+static void lunatik_endtask(struct lunatik_task *t)
+{
+	struct lunatik_exec *e = t->exec;
+	unsigned long flags;
+	int mine;
+
+	spin_lock_irqsave(&e->lock, flags);
+	mine = !list_empty(&t->node);
+	list_del_init(&t->node);
+	t->ended = 1;
+	spin_unlock_irqrestore(&e->lock, flags);
+	if (mine) {
+		cancel_delayed_work(&t->work);	/* queued by an early wake */
+		lunatik_freetask(t);
+	}
+}
+
+static void lunatik_taskwork(struct work_struct *work)
+{
+	struct lunatik_task *t = container_of(to_delayed_work(work),
+		struct lunatik_task, work);
+	lua_State *co = t->co;
+	int status;
+
+	t->suspended = 0;
+	status = lua_resume(co, NULL, t->nargs);
+	t->nargs = 0;
+	if (status == LUA_YIELD) {
+		lua_settop(co, 0);	/* nothing is passed back to the task */
+		if (!t->suspended)
+			queue_delayed_work(t->exec->wq, &t->work, 0);
+		return;
+	}
+	if (t->done != NULL)
+		t->done(co, status, t->ud);
+	else if (status != LUA_OK)
+		printk(KERN_WARNING "lunatik: task failed: %s\n",
+			lua_tostring(co, -1));
+	lunatik_endtask(t);
+}
+
+struct lunatik_exec *lunatik_newexec(lua_State *L,
+	struct workqueue_struct *wq, int budget)
+{
+	struct lunatik_exec *e = kmalloc(sizeof(struct lunatik_exec),
+		lunatik_getalloc(L)->gfp);
+
+	if (e == NULL)
+		return NULL;
+	e->L = L;
+	e->wq = wq != NULL ? wq : system_wq;
+	e->budget = budget;
+	spin_lock_init(&e->lock);
+	INIT_LIST_HEAD(&e->tasks);
+	e->ntasks = 0;
+	init_waitqueue_head(&e->idle);
+	return e;
+}
+
+static bool lunatik_execidle(struct lunatik_exec *e)
+{
+	unsigned long flags;
+	bool idle;
+
+	spin_lock_irqsave(&e->lock, flags);
+	idle = e->ntasks == 0;
+	spin_unlock_irqrestore(&e->lock, flags);
+	return idle;
+}
+
+/*
+** the state must outlive the executor; waits for the operations that
+** still hold tasks to wake them
+*/
+void lunatik_closeexec(struct lunatik_exec *e)
+{
+	unsigned long flags;
+
+	for (;;) {
+		struct lunatik_task *t;
+
+		spin_lock_irqsave(&e->lock, flags);
+		if (list_empty(&e->tasks)) {
+			spin_unlock_irqrestore(&e->lock, flags);
+			break;
+		}
+		t = list_first_entry(&e->tasks, struct lunatik_task, node);
+		list_del_init(&t->node);
+		t->ended = 1;
+		spin_unlock_irqrestore(&e->lock, flags);
+		cancel_delayed_work_sync(&t->work);
+		lunatik_freetask(t);
+	}
+	/* bindings that hold the tasks (e.g., channels) may drop them */
+	lua_gc(e->L, LUA_GCCOLLECT, 0);
+	wait_event(e->idle, lunatik_execidle(e));
+	kfree(e);
+}
+
+/* creates the thread of task 1, moving it the function and arguments */
+static int lunatik_spawnaux(lua_State *L)
+{
+	struct lunatik_task *t = (struct lunatik_task *)lua_touserdata(L, 1);
+	int n = lua_gettop(L) - 1;	/* function and arguments */
+	lua_State *co = lua_newthread(L);
+
+	if (!lua_checkstack(co, n))
+		return luaL_error(L, "too many arguments");
+	lua_insert(L, 2);
+	lua_xmove(L, co, n);
+	t->co = co;
+	t->ref = lua_ref(L);
+	lunatik_gettask_(co) = t;
+	if (t->exec->budget > 0)
+		lua_setbudget(co, t->exec->budget, 1);
+	return 0;
+}
+
+/*
+** Pops a function and 'nargs' arguments from the stack of the state of
+** 'e' and runs them as a new task; 'done', if not NULL, is called from
+** the work item when the task returns ('status' is LUA_OK and the results
+** are on the stack of 'co') or fails (the error object is on the stack).
+*/
+int lunatik_spawn(struct lunatik_exec *e, int nargs, lunatik_Done done,
+	void *ud)
+{
+	lua_State *L = e->L;
+	struct lunatik_task *t = kmalloc(sizeof(struct lunatik_task),
+		lunatik_getalloc(L)->gfp);
+	unsigned long flags;
+
+	if (t == NULL) {
+		lua_pop(L, nargs + 1);
+		return -ENOMEM;
+	}
+	t->exec = e;
+	t->nargs = nargs;
+	t->suspended = 0;
+	t->ended = 0;
+	atomic_set(&t->refs, 1);
+	t->done = done;
+	t->ud = ud;
+	INIT_DELAYED_WORK(&t->work, lunatik_taskwork);
+	lua_pushcfunction(L, lunatik_spawnaux);
+	lua_pushlightuserdata(L, t);
+	lua_rotate(L, -(nargs + 3), 2);
+	if (lua_pcall(L, nargs + 2, 0, 0) != LUA_OK) {
+		lua_pop(L, 1);
+		kfree(t);
+		return -ENOMEM;
+	}
+	spin_lock_irqsave(&e->lock, flags);
+	list_add_tail(&t->node, &e->tasks);
+	e->ntasks++;
+	spin_unlock_irqrestore(&e->lock, flags);
+	queue_delayed_work(e->wq, &t->work, 0);
+	return 0;
+}
+
+/* task running in 'L', or NULL if 'L' is not a task or cannot suspend */
+struct lunatik_task *lunatik_gettask(lua_State *L)
+{
+	struct lunatik_task *t = (struct lunatik_task *)lunatik_gettask_(L);
+
+	return t != NULL && lua_isyieldable(L) ? t : NULL;
+}
+
+/*
+** Takes a reference to 't' for an operation that will call
+** 'lunatik_wake(t)' (which drops it); to be taken before the operation
+** can complete, and dropped with 'lunatik_droptask' if it never starts.
+*/
+void lunatik_holdtask(struct lunatik_task *t)
+{
+	atomic_inc(&t->refs);
+}
+
+void lunatik_droptask(struct lunatik_task *t)
+{
+	lunatik_puttask(t);
+}
+
+/*
+** Suspends the task running in 'L' until 'lunatik_wake'; to be used as
+** 'return lunatik_suspend(L, ctx, k);' by a C function, once its task
+** (see 'lunatik_gettask') has started an operation that will wake it.
+*/
+int lunatik_suspend(lua_State *L, lua_KContext ctx, lua_KFunction k)
+{
+	struct lunatik_task *t = lunatik_gettask(L);
+
+	if (t == NULL)
+		return luaL_error(L, "attempt to suspend outside a task");
+	t->suspended = 1;
+	return lua_yieldk(L, 0, ctx, k);
+}
+
+/*
+** resumes a suspended task and drops the reference of the operation;
+** can be called from any context
+*/
+void lunatik_wake(struct lunatik_task *t)
+{
+	struct lunatik_exec *e = t->exec;
+	unsigned long flags;
+
+	spin_lock_irqsave(&e->lock, flags);
+	if (!t->ended)
+		queue_delayed_work(e->wq, &t->work, 0);
+	spin_unlock_irqrestore(&e->lock, flags);
+	lunatik_puttask(t);
+}
+
+static int lunatik_sleepk(lua_State *L, int status, lua_KContext ctx)
+{
+	return 0;
+}
+
+/* 'sleep(ms)': suspends the task running it for 'ms' milliseconds */
+int lunatik_sleep(lua_State *L)
+{
+	lua_Integer ms = luaL_checkinteger(L, 1);
+	struct lunatik_task *t = lunatik_gettask(L);
+
+	luaL_argcheck(L, 0 <= ms && ms <= INT_MAX, 1, "out of range");
+	if (t == NULL)
+		return luaL_error(L, "attempt to sleep outside a task");
+	queue_delayed_work(t->exec->wq, &t->work,
+		msecs_to_jiffies((unsigned int)ms));
+	return lunatik_suspend(L, 0, lunatik_sleepk);
+}
+#endif /* LUNATIK_LOCK */
+#endif /* __linux__ */
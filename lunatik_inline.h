@@ -0,0 +1,126 @@
+/*
+* Copyright (c) 2017-2019 CUJO LLC.
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef lunatik_inline_h
+#define lunatik_inline_h
+
+#include <linux/types.h>
+#include <linux/stddef.h>
+
+#include "lua/lua.h"
+#include "lua/lauxlib.h"
+
+#include "lua/lobject.h"
+#include "lua/lstate.h"
+
+/*
+** Inline versions of the hottest read-only accessors of the C API, for
+** modules built against the same tree as the core.  They read the stack
+** of 'L' directly, so a module must call 'lunatik_checkinline' (e.g., in
+** its 'luaopen_' function) to reject a core with another layout.  Pseudo
+** indices (registry and upvalues) fall back to the exported functions.
+*/
+#define LUNATIK_LAYOUT	((u64)sizeof(lua_State) << 48 ^		\
+	(u64)sizeof(CallInfo) << 36 ^ (u64)sizeof(UUdata) << 28 ^	\
+	(u64)offsetof(lua_State, top) << 20 ^				\
+	(u64)offsetof(lua_State, ci) << 12 ^				\
+	(u64)offsetof(CallInfo, func) << 6 ^ (u64)sizeof(TValue))
+
+LUALIB_API u64 (lunatik_layout) (void);
+
+static inline void lunatik_checkinline(lua_State *L)
+{
+	luaL_checkversion(L);
+	if (lunatik_layout() != LUNATIK_LAYOUT)
+		luaL_error(L, "lunatik_inline.h does not match the core");
+}
+
+#define lunatik_isstackindex(idx)	((idx) > LUA_REGISTRYINDEX)
+
+/* value at stack index 'idx' (not a pseudo index), or NULL if none */
+static inline const TValue *lunatik_index2addr(lua_State *L, int idx)
+{
+	const TValue *o = (idx > 0) ? L->ci->func + idx : L->top + idx;
+
+	return (o < L->top) ? o : NULL;
+}
+
+static inline int lunatik_gettop(lua_State *L)
+{
+	return (int)(L->top - (L->ci->func + 1));
+}
+
+static inline int lunatik_type(lua_State *L, int idx)
+{
+	const TValue *o;
+
+	if (!lunatik_isstackindex(idx))
+		return lua_type(L, idx);
+	o = lunatik_index2addr(L, idx);
+	return (o != NULL) ? ttnov(o) : LUA_TNONE;
+}
+
+static inline lua_Integer lunatik_tointegerx(lua_State *L, int idx,
+	int *isnum)
+{
+	const TValue *o;
+
+	if (!lunatik_isstackindex(idx) ||
+	    (o = lunatik_index2addr(L, idx)) == NULL || !ttisinteger(o))
+		return lua_tointegerx(L, idx, isnum);	/* may convert */
+	if (isnum != NULL)
+		*isnum = 1;
+	return ivalue(o);
+}
+
+#define lunatik_tointeger(L, i)	lunatik_tointegerx(L, (i), NULL)
+
+static inline int lunatik_toboolean(lua_State *L, int idx)
+{
+	const TValue *o;
+
+	if (!lunatik_isstackindex(idx))
+		return lua_toboolean(L, idx);
+	o = lunatik_index2addr(L, idx);
+	return (o != NULL) && !l_isfalse(o);
+}
+
+static inline void *lunatik_touserdata(lua_State *L, int idx)
+{
+	const TValue *o;
+
+	if (!lunatik_isstackindex(idx))
+		return lua_touserdata(L, idx);
+	if ((o = lunatik_index2addr(L, idx)) == NULL)
+		return NULL;
+	switch (ttnov(o)) {
+	case LUA_TUSERDATA:
+		return getudatamem(uvalue(o));
+	case LUA_TLIGHTUSERDATA:
+		return pvalue(o);
+	default:
+		return NULL;
+	}
+}
+
+#endif /* lunatik_inline_h */
+
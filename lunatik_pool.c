@@ -0,0 +1,507 @@
+/*
+* Copyright (c) 2017-2019 CUJO LLC.
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifdef __linux__
+#include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/percpu.h>
+#include <linux/topology.h>
+#include <linux/irqflags.h>
+#include <linux/atomic.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+
+#include "lua/lua.h"
+#include "lua/lauxlib.h"
+#include "lua/lualib.h"
+
+#include "lua/lobject.h"
+#include "lua/lstate.h"
+#include "lua/lmem.h"
+
+#include "lunatik.h"
+
+/*
+** Per-CPU pools of warm states: every possible CPU owns 'nstates' states,
+** all loaded with the same chunk and allocated on the NUMA node of the
+** CPU.  'lunatik_getstate' keeps preemption disabled until the state is
+** given back, so a state is only ever used on the CPU that owns it; the
+** idle stack is guarded against softirqs and interrupts running on that
+** same CPU.
+*/
+struct lunatik_poolcpu {
+	unsigned int nfree;
+	lua_State **states;	/* the first 'nfree' states are idle */
+};
+
+struct lunatik_pool {
+	unsigned int nstates;
+	unsigned int flags;
+	struct lunatik_poolcpu __percpu *cpus;
+	struct lunatik_shared *shared;	/* with LUNATIK_POOL_SHARE */
+};
+
+/*
+** With LUNATIK_POOL_SHARE, the 'code' and 'lineinfo' arrays of the
+** prototypes of the chunk are copied once into a read-only block, and the
+** prototypes of every state of the pool borrow them instead of keeping
+** their own copies.  Constants, nested prototype lists and debug names
+** stay per state, as strings are interned per state.  Every borrowing
+** prototype and the pool hold a reference to the block; prototypes drop
+** theirs from 'luaF_freeproto' (through 'luai_protounshare').
+*/
+struct lunatik_sharedproto {
+	Instruction *code;
+	int *lineinfo;
+	int sizecode;
+	int sizelineinfo;
+};
+
+struct lunatik_shared {
+	atomic_t refs;
+	unsigned int nprotos;
+	struct lunatik_sharedproto protos[];	/* in depth-first order */
+};
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,12,0)
+#define lunatik_sharedalloc(size)	kvmalloc((size), GFP_KERNEL)
+#define lunatik_sharedfree(s)		kvfree(s)
+#else
+#define lunatik_sharedalloc(size)	vmalloc(size)
+#define lunatik_sharedfree(s)		vfree(s)
+#endif
+
+static unsigned int lunatik_countprotos(const Proto *f, size_t *size)
+{
+	unsigned int n = 1;
+	int i;
+
+	*size += f->sizecode * sizeof(Instruction) +
+		f->sizelineinfo * sizeof(int);
+	for (i = 0; i < f->sizep; i++)
+		n += lunatik_countprotos(f->p[i], size);
+	return n;
+}
+
+static void lunatik_copyprotos(struct lunatik_shared *s, const Proto *f,
+	unsigned int *n, char **data)
+{
+	struct lunatik_sharedproto *sp = &s->protos[(*n)++];
+	int i;
+
+	sp->sizecode = f->sizecode;
+	sp->code = (Instruction *)*data;
+	memcpy(sp->code, f->code, f->sizecode * sizeof(Instruction));
+	*data += f->sizecode * sizeof(Instruction);
+
+	sp->sizelineinfo = f->sizelineinfo;
+	sp->lineinfo = (int *)*data;
+	memcpy(sp->lineinfo, f->lineinfo, f->sizelineinfo * sizeof(int));
+	*data += f->sizelineinfo * sizeof(int);
+
+	for (i = 0; i < f->sizep; i++)
+		lunatik_copyprotos(s, f->p[i], n, data);
+}
+
+static struct lunatik_shared *lunatik_newshared(const Proto *f)
+{
+	struct lunatik_shared *s;
+	size_t size = 0;
+	unsigned int nprotos = lunatik_countprotos(f, &size);
+	size_t header = sizeof(*s) + nprotos * sizeof(s->protos[0]);
+	unsigned int n = 0;
+	char *data;
+
+	if ((s = lunatik_sharedalloc(header + size)) == NULL)
+		return NULL;
+
+	atomic_set(&s->refs, 1);	/* pool's reference */
+	s->nprotos = nprotos;
+	data = (char *)s + header;
+	lunatik_copyprotos(s, f, &n, &data);
+	return s;
+}
+
+/* checks that the prototype tree has exactly the code of the block */
+static bool lunatik_matchprotos(const struct lunatik_shared *s,
+	const Proto *f, unsigned int *n)
+{
+	const struct lunatik_sharedproto *sp;
+	int i;
+
+	if (*n >= s->nprotos)
+		return false;
+
+	sp = &s->protos[(*n)++];
+	if (f->shared != NULL || sp->sizecode != f->sizecode ||
+	    sp->sizelineinfo != f->sizelineinfo ||
+	    memcmp(sp->code, f->code, f->sizecode * sizeof(Instruction)) ||
+	    memcmp(sp->lineinfo, f->lineinfo, f->sizelineinfo * sizeof(int)))
+		return false;
+
+	for (i = 0; i < f->sizep; i++)
+		if (!lunatik_matchprotos(s, f->p[i], n))
+			return false;
+	return true;
+}
+
+static void lunatik_borrowprotos(lua_State *L, struct lunatik_shared *s,
+	Proto *f, unsigned int *n)
+{
+	struct lunatik_sharedproto *sp = &s->protos[(*n)++];
+	int i;
+
+	luaM_freearray(L, f->code, f->sizecode);
+	luaM_freearray(L, f->lineinfo, f->sizelineinfo);
+	f->code = sp->code;
+	f->lineinfo = sp->lineinfo;
+	f->shared = s;
+	atomic_inc(&s->refs);
+
+	for (i = 0; i < f->sizep; i++)
+		lunatik_borrowprotos(L, s, f->p[i], n);
+}
+
+/* makes the function on the top of the stack use the pool's shared code */
+static void lunatik_shareprotos(lua_State *L, struct lunatik_shared **s)
+{
+	Proto *f = ((const LClosure *)lua_topointer(L, -1))->p;
+	unsigned int n = 0;
+
+	if (*s == NULL && (*s = lunatik_newshared(f)) == NULL)
+		return;	/* no memory; keep the private copies */
+
+	if (lunatik_matchprotos(*s, f, &n) && n == (*s)->nprotos) {
+		n = 0;
+		lunatik_borrowprotos(L, *s, f, &n);
+	}
+}
+
+void lunatik_share(void *shared)
+{
+	atomic_inc(&((struct lunatik_shared *)shared)->refs);
+}
+
+void lunatik_unshare(void *shared)
+{
+	struct lunatik_shared *s = (struct lunatik_shared *)shared;
+
+	if (atomic_dec_and_test(&s->refs))
+		lunatik_sharedfree(s);
+}
+
+static char lunatik_snapshot;	/* registry key for the globals snapshot */
+
+static int lunatik_snapshotglobals(lua_State *L)
+{
+	lua_newtable(L);
+	lua_pushglobaltable(L);
+	lua_pushnil(L);
+	while (lua_next(L, -2)) {
+		lua_pushvalue(L, -2);
+		lua_insert(L, -2);
+		lua_rawset(L, -5);
+	}
+	lua_pop(L, 1);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &lunatik_snapshot);
+	return 0;
+}
+
+/* drops globals created since the snapshot and restores the others */
+static int lunatik_restoreglobals(lua_State *L)
+{
+	lua_settop(L, 0);
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &lunatik_snapshot);
+	lua_pushglobaltable(L);
+	lua_pushnil(L);
+	while (lua_next(L, 2)) {
+		lua_pop(L, 1);
+		lua_pushvalue(L, -1);
+		if (lua_rawget(L, 1) == LUA_TNIL) {
+			lua_pushvalue(L, -2);
+			lua_pushnil(L);
+			lua_rawset(L, 2);
+		}
+		lua_pop(L, 1);
+	}
+	lua_pushnil(L);
+	while (lua_next(L, 1)) {
+		lua_pushvalue(L, -2);
+		lua_insert(L, -2);
+		lua_rawset(L, 2);
+	}
+	return 0;
+}
+
+static lua_State *lunatik_warmstate(struct lunatik_pool *pool,
+	const char *chunk, size_t len, const char *name, int node)
+{
+	unsigned int flags = pool->flags;
+	lua_State *L = lunatik_newstatenode(flags, node);
+
+	if (L == NULL)
+		return NULL;
+
+	luaL_openlibs(L);
+	if (luaL_loadbufferx(L, chunk, len, name, NULL) != LUA_OK)
+		goto err;
+
+	if (flags & LUNATIK_POOL_SHARE)
+		lunatik_shareprotos(L, &pool->shared);
+
+	if (lua_pcall(L, 0, 0, 0) != LUA_OK)
+		goto err;
+
+	if (flags & LUNATIK_POOL_RESTORE) {
+		lua_pushcfunction(L, lunatik_snapshotglobals);
+		if (lua_pcall(L, 0, 0, 0) != LUA_OK)
+			goto err;
+	}
+	return L;
+err:
+	pr_err("lunatik: %s: %s\n", name, lua_tostring(L, -1));
+	lunatik_close(L);
+	return NULL;
+}
+
+/* with LUNATIK_POOL_CLONE, states after the first one are copies of it */
+static lua_State *lunatik_clonestate(lua_State *first, unsigned int flags,
+	const char *name, int node)
+{
+	lua_State *L = lunatik_newstatenode(flags, node);
+
+	if (L == NULL)
+		return NULL;
+
+	if (lua_clonestate(first, L) != LUA_OK) {
+		pr_err("lunatik: %s: %s\n", name, lua_tostring(L, -1));
+		lunatik_close(L);
+		return NULL;
+	}
+	return L;
+}
+
+void lunatik_closepool(struct lunatik_pool *pool)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct lunatik_poolcpu *c = per_cpu_ptr(pool->cpus, cpu);
+		unsigned int i;
+
+		if (c->states == NULL)
+			continue;
+
+		for (i = 0; i < c->nfree; i++)
+			lunatik_close(c->states[i]);
+		kfree(c->states);
+	}
+	free_percpu(pool->cpus);
+	if (pool->shared != NULL)
+		lunatik_unshare(pool->shared);
+	kfree(pool);
+}
+
+struct lunatik_pool *lunatik_newpool(const char *chunk, size_t len,
+	const char *name, unsigned int nstates, unsigned int flags)
+{
+	struct lunatik_pool *pool;
+	lua_State *first = NULL;	/* the state cloned by the others */
+	int cpu;
+
+	might_sleep();
+	/* states of a pool run with preemption off (see 'lunatik_getstate') */
+	if (nstates == 0 || (flags & LUNATIK_ALLOC_SLEEP) ||
+	    (pool = kmalloc(sizeof(*pool), GFP_KERNEL)) == NULL)
+		return NULL;
+
+	pool->nstates = nstates;
+	pool->flags = flags;
+	pool->shared = NULL;
+	if ((pool->cpus = alloc_percpu(struct lunatik_poolcpu)) == NULL) {
+		kfree(pool);
+		return NULL;
+	}
+
+	for_each_possible_cpu(cpu) {
+		struct lunatik_poolcpu *c = per_cpu_ptr(pool->cpus, cpu);
+		int node = cpu_to_node(cpu);
+
+		c->nfree = 0;
+		c->states = kcalloc_node(nstates, sizeof(lua_State *),
+			GFP_KERNEL, node);
+		if (c->states == NULL)
+			goto err;
+
+		while (c->nfree < nstates) {
+			lua_State *L;
+
+			if (first != NULL && (flags & LUNATIK_POOL_CLONE))
+				L = lunatik_clonestate(first, flags, name,
+					node);
+			else
+				L = first = lunatik_warmstate(pool, chunk, len,
+					name, node);
+			if (L == NULL)
+				goto err;
+			c->states[c->nfree++] = L;
+		}
+	}
+	return pool;
+err:
+	lunatik_closepool(pool);
+	return NULL;
+}
+
+/*
+** returns an idle state of the current CPU, or NULL if all of them are in
+** use; on success, preemption stays disabled until 'lunatik_putstate'
+*/
+lua_State *lunatik_getstate(struct lunatik_pool *pool)
+{
+	struct lunatik_poolcpu *c = get_cpu_ptr(pool->cpus);
+	lua_State *L = NULL;
+	unsigned long irqflags;
+
+	local_irq_save(irqflags);
+	if (c->nfree > 0)
+		L = c->states[--c->nfree];
+	local_irq_restore(irqflags);
+
+	if (L == NULL)
+		put_cpu_ptr(pool->cpus);
+	return L;
+}
+
+void lunatik_putstate(struct lunatik_pool *pool, lua_State *L)
+{
+	struct lunatik_poolcpu *c = this_cpu_ptr(pool->cpus);
+	unsigned long irqflags;
+
+	if (pool->flags & LUNATIK_POOL_RESTORE) {
+		lua_pushcfunction(L, lunatik_restoreglobals);
+		lua_pcall(L, 0, 0, 0);
+	}
+	lua_settop(L, 0);
+
+	local_irq_save(irqflags);
+	c->states[c->nfree++] = L;
+	local_irq_restore(irqflags);
+	put_cpu_ptr(pool->cpus);
+}
+
+/*
+** Scripts: versioned handles to a pool, replaced without stopping their
+** users. A new version is loaded and warmed in a new pool, in process
+** context, and published with 'rcu_assign_pointer'; users take a state
+** of the current version inside an RCU read-side section, which lasts
+** until the state is given back, so the pool of the old version is
+** closed once a grace period has elapsed.
+*/
+struct lunatik_script {
+	struct lunatik_pool __rcu *pool;
+	struct mutex lock;	/* serializes replacements */
+	int version;
+};
+
+struct lunatik_script *lunatik_newscript(void)
+{
+	struct lunatik_script *script = kmalloc(sizeof(*script), GFP_KERNEL);
+
+	if (script == NULL)
+		return NULL;
+	RCU_INIT_POINTER(script->pool, NULL);
+	mutex_init(&script->lock);
+	script->version = 0;
+	return script;
+}
+
+/*
+** loads 'chunk' in a new pool (see 'lunatik_newpool') and makes it the
+** current version of 'script'; returns the number of the new version,
+** -EINVAL for LUNATIK_ALLOC_SLEEP or -ENOMEM if the pool could not be
+** created (the old version stays)
+*/
+int lunatik_replace(struct lunatik_script *script, const char *chunk,
+	size_t len, const char *name, unsigned int nstates, unsigned int flags)
+{
+	struct lunatik_pool *pool, *old;
+	int version;
+
+	if (flags & LUNATIK_ALLOC_SLEEP)
+		return -EINVAL;
+	if ((pool = lunatik_newpool(chunk, len, name, nstates, flags)) == NULL)
+		return -ENOMEM;
+
+	mutex_lock(&script->lock);
+	old = rcu_dereference_protected(script->pool,
+		lockdep_is_held(&script->lock));
+	rcu_assign_pointer(script->pool, pool);
+	version = ++script->version;
+	mutex_unlock(&script->lock);
+
+	if (old != NULL) {
+		synchronize_rcu();	/* wait for the users of 'old' */
+		lunatik_closepool(old);
+	}
+	return version;
+}
+
+/* none of the states of 'script' may be in use */
+void lunatik_closescript(struct lunatik_script *script)
+{
+	struct lunatik_pool *pool = rcu_dereference_protected(script->pool, 1);
+
+	if (pool != NULL)
+		lunatik_closepool(pool);
+	kfree(script);
+}
+
+/*
+** returns an idle state of the current version of 'script' and sets
+** '*pool' to its pool, or returns NULL if there is no version yet or all
+** of its states of the current CPU are in use; on success, the RCU
+** read-side section (and disabled preemption) lasts until
+** 'lunatik_putscript'
+*/
+lua_State *lunatik_getscript(struct lunatik_script *script,
+	struct lunatik_pool **pool)
+{
+	lua_State *L = NULL;
+
+	rcu_read_lock();
+	if ((*pool = rcu_dereference(script->pool)) != NULL)
+		L = lunatik_getstate(*pool);
+	if (L == NULL)
+		rcu_read_unlock();
+	return L;
+}
+
+void lunatik_putscript(struct lunatik_pool *pool, lua_State *L)
+{
+	lunatik_putstate(pool, L);
+	rcu_read_unlock();
+}
+#endif /* __linux__ */
+
@@ -0,0 +1,311 @@
+/*
+* Copyright (c) 2017-2019 CUJO LLC.
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifdef __linux__
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/percpu.h>
+#include <linux/topology.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "lua/lua.h"
+#include "lua/lauxlib.h"
+
+#include "lua/lstate.h"
+
+#include "lunatik.h"
+
+/*
+** Sampling profiler: a per-state hrtimer fires 'hz' times a second and
+** only sets 'hookreq' of the state; the timer touches no thread, which
+** may be running on another CPU or be gone. The thread running in the
+** state serves the request within 256 backward jumps or calls by setting
+** on itself a count hook of one instruction ('lunatik_profreq'). The
+** hook, run at the next instruction, removes itself and appends the
+** stack of the thread, as a line of folded frames ("main;f;g 1", root
+** first), to the text buffer of the current CPU. Reading 'profile' in
+** the debugfs directory 'lunatik' prints the buffers, ready for
+** flamegraph.pl; writing to it empties them. Samples are dropped (and
+** counted in 'profile_dropped') while a buffer is full, and are not
+** taken while the thread has a hook of its own. Time spent in C
+** functions is charged to the Lua code that runs after them.
+*/
+#define LUNATIK_PROFBUF		(64 * 1024)	/* bytes of folded lines per CPU */
+#define LUNATIK_PROFLINE	256	/* longest line */
+#define LUNATIK_PROFDEPTH	32	/* innermost frames kept */
+#define LUNATIK_PROFMAXHZ	10000
+
+struct lunatik_profbuf {
+	spinlock_t lock;
+	size_t len;
+	unsigned long dropped;
+	char data[LUNATIK_PROFBUF];
+};
+
+struct lunatik_prof {
+	struct hrtimer timer;
+	ktime_t period;
+	lua_State *L;
+};
+
+static DEFINE_PER_CPU(struct lunatik_profbuf *, lunatik_profbuf);
+static DEFINE_MUTEX(lunatik_proflock);	/* serializes buffer allocation */
+static bool lunatik_profready;
+
+/* appends the frame of 'ar' to 'line'; ';' would split the frame */
+static size_t lunatik_profframe(char *line, size_t len, lua_Debug *ar)
+{
+	size_t start = len;
+
+	if (*ar->what == 'C')
+		len += scnprintf(line + len, LUNATIK_PROFLINE - len, "%s",
+			ar->name != NULL ? ar->name : "[C]");
+	else if (*ar->what == 'm')
+		len += scnprintf(line + len, LUNATIK_PROFLINE - len, "%s",
+			ar->short_src);
+	else
+		len += scnprintf(line + len, LUNATIK_PROFLINE - len, "%s@%s:%d",
+			ar->name != NULL ? ar->name : "?", ar->short_src,
+			ar->linedefined);
+	for (; start < len; start++)
+		if (line[start] == ';')
+			line[start] = ',';
+	return len;
+}
+
+static void lunatik_profhook(lua_State *L, lua_Debug *ar)
+{
+	struct lunatik_profbuf *buf;
+	char line[LUNATIK_PROFLINE];
+	size_t len = 0;
+	unsigned long flags;
+	lua_Debug d;
+	int level, depth = 0;
+
+	lua_sethook(L, NULL, 0, 0);	/* one sample per request */
+	while (depth < LUNATIK_PROFDEPTH && lua_getstack(L, depth, &d))
+		depth++;
+	if (depth == LUNATIK_PROFDEPTH && lua_getstack(L, depth, &d))
+		len = scnprintf(line, sizeof(line), "...;");
+	for (level = depth - 1; level >= 0; level--) {
+		lua_getstack(L, level, &d);
+		lua_getinfo(L, "Sn", &d);
+		len = lunatik_profframe(line, len, &d);
+		if (level > 0)
+			len += scnprintf(line + len, sizeof(line) - len, ";");
+	}
+
+	buf = raw_cpu_read(lunatik_profbuf);	/* any CPU would do */
+	spin_lock_irqsave(&buf->lock, flags);
+	if (buf->len + len + 3 <= LUNATIK_PROFBUF) {
+		memcpy(buf->data + buf->len, line, len);
+		memcpy(buf->data + buf->len + len, " 1\n", 3);
+		buf->len += len + 3;
+	}
+	else
+		buf->dropped++;
+	spin_unlock_irqrestore(&buf->lock, flags);
+}
+
+/* 'luai_hookreq': called by the thread running in the state */
+void lunatik_profreq(lua_State *L)
+{
+	if (lua_gethook(L) == NULL)
+		lua_sethook(L, lunatik_profhook, LUA_MASKCOUNT, 1);
+}
+
+static enum hrtimer_restart lunatik_proftimer(struct hrtimer *timer)
+{
+	struct lunatik_prof *prof = container_of(timer, struct lunatik_prof,
+		timer);
+
+	WRITE_ONCE(G(prof->L)->hookreq, 1);
+	hrtimer_forward_now(timer, prof->period);
+	return HRTIMER_RESTART;
+}
+
+static int lunatik_profalloc(void)
+{
+	int cpu, ret = 0;
+
+	mutex_lock(&lunatik_proflock);
+	if (lunatik_profready)
+		goto out;
+	for_each_possible_cpu(cpu) {
+		struct lunatik_profbuf *buf = per_cpu(lunatik_profbuf, cpu);
+
+		if (buf == NULL) {
+			buf = vmalloc_node(sizeof(*buf), cpu_to_node(cpu));
+			if (buf == NULL) {
+				ret = -ENOMEM;
+				goto out;
+			}
+			spin_lock_init(&buf->lock);
+			buf->len = 0;
+			buf->dropped = 0;
+			per_cpu(lunatik_profbuf, cpu) = buf;
+		}
+	}
+	smp_store_release(&lunatik_profready, true);
+out:
+	mutex_unlock(&lunatik_proflock);
+	return ret;
+}
+
+/*
+** starts sampling the state 'L' 'hz' times a second, until
+** 'lunatik_closeprof' (to be called before 'lunatik_close'); process
+** context only
+*/
+struct lunatik_prof *lunatik_newprof(lua_State *L, unsigned int hz)
+{
+	struct lunatik_prof *prof;
+
+	might_sleep();
+	if (hz == 0 || hz > LUNATIK_PROFMAXHZ || lunatik_profalloc() != 0)
+		return NULL;
+	if ((prof = kmalloc(sizeof(*prof), GFP_KERNEL)) == NULL)
+		return NULL;
+	prof->L = L;
+	prof->period = ns_to_ktime(NSEC_PER_SEC / hz);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,13,0)
+	hrtimer_setup(&prof->timer, lunatik_proftimer, CLOCK_MONOTONIC,
+		HRTIMER_MODE_REL);
+#else
+	hrtimer_init(&prof->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	prof->timer.function = lunatik_proftimer;
+#endif
+	hrtimer_start(&prof->timer, prof->period, HRTIMER_MODE_REL);
+	return prof;
+}
+
+/* a sample already requested may still be taken, into the buffers */
+void lunatik_closeprof(struct lunatik_prof *prof)
+{
+	hrtimer_cancel(&prof->timer);
+	kfree(prof);
+}
+
+static int lunatik_profile_show(struct seq_file *m, void *v)
+{
+	int cpu;
+
+	if (!smp_load_acquire(&lunatik_profready))
+		return 0;
+	for_each_possible_cpu(cpu) {
+		struct lunatik_profbuf *buf = per_cpu(lunatik_profbuf, cpu);
+		unsigned long flags;
+
+		spin_lock_irqsave(&buf->lock, flags);
+		seq_write(m, buf->data, buf->len);
+		spin_unlock_irqrestore(&buf->lock, flags);
+	}
+	return 0;
+}
+
+static int lunatik_profile_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lunatik_profile_show, NULL);
+}
+
+static ssize_t lunatik_profile_write(struct file *file,
+	const char __user *ubuf, size_t count, loff_t *ppos)
+{
+	int cpu;
+
+	if (smp_load_acquire(&lunatik_profready)) {
+		for_each_possible_cpu(cpu) {
+			struct lunatik_profbuf *buf = per_cpu(lunatik_profbuf,
+				cpu);
+			unsigned long flags;
+
+			spin_lock_irqsave(&buf->lock, flags);
+			buf->len = 0;
+			buf->dropped = 0;
+			spin_unlock_irqrestore(&buf->lock, flags);
+		}
+	}
+	return count;
+}
+
+static const struct file_operations lunatik_profile_fops = {
+	.owner = THIS_MODULE,
+	.open = lunatik_profile_open,
+	.read = seq_read,
+	.write = lunatik_profile_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int lunatik_profile_dropped_show(struct seq_file *m, void *v)
+{
+	unsigned long dropped = 0;
+	int cpu;
+
+	if (smp_load_acquire(&lunatik_profready))
+		for_each_possible_cpu(cpu)
+			dropped += READ_ONCE(per_cpu(lunatik_profbuf,
+				cpu)->dropped);
+	seq_printf(m, "%lu\n", dropped);
+	return 0;
+}
+
+static int lunatik_profile_dropped_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lunatik_profile_dropped_show, NULL);
+}
+
+static const struct file_operations lunatik_profile_dropped_fops = {
+	.owner = THIS_MODULE,
+	.open = lunatik_profile_dropped_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+void lunatik_profinit(struct dentry *dir)
+{
+	debugfs_create_file("profile", 0600, dir, NULL, &lunatik_profile_fops);
+	debugfs_create_file("profile_dropped", 0400, dir, NULL,
+		&lunatik_profile_dropped_fops);
+}
+
+/* called after the debugfs files are removed */
+void lunatik_profexit(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		vfree(per_cpu(lunatik_profbuf, cpu));
+		per_cpu(lunatik_profbuf, cpu) = NULL;
+	}
+	lunatik_profready = false;
+}
+#endif /* __linux__ */
@@ -0,0 +1,366 @@
+/*
+* Copyright (c) 2017-2019 CUJO LLC.
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifdef __linux__
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/rculist.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/log2.h>
+
+#include "lua/lua.h"
+#include "lua/lauxlib.h"
+
+#include "lua/llimits.h"
+
+#include "lunatik.h"
+
+/*
+** Shared maps: hash tables kept by the kernel, outside any state, from
+** integer or string keys to booleans, integers or strings, stored as
+** plain bytes. Any number of states can hold a map, as a userdata; lookups
+** run under 'rcu_read_lock' and take no lock, while updates, serialized by
+** the spinlock of the map, replace whole entries and free the old ones
+** after a grace period. So an entry never changes once it is visible.
+*/
+#define LUNATIK_SHMAP	"lunatik.shmap"
+
+struct lunatik_shentry {
+	struct hlist_node node;
+	struct rcu_head rcu;
+	u32 hash;
+	u8 ktype;	/* LUA_TNUMBER (an integer) or LUA_TSTRING */
+	u8 vtype;	/* LUA_TBOOLEAN, LUA_TNUMBER or LUA_TSTRING */
+	lua_Integer ki, vi;	/* integer key, boolean or integer value */
+	size_t klen, vlen;	/* of string keys and values */
+	char data[];	/* string key and string value, '\0' terminated */
+};
+
+#define shentrykey(e)	((e)->data)
+#define shentryvalue(e)	((e)->data + (e)->klen + 1)
+
+struct lunatik_shmap {
+	atomic_t refs;	/* the creator's and the userdata's */
+	spinlock_t lock;	/* serializes updates */
+	unsigned int count;
+	unsigned int mask;	/* number of buckets minus one */
+	u32 seed;
+	gfp_t gfp;	/* of the entries */
+	struct hlist_head buckets[];
+};
+
+struct lunatik_shkey {
+	int type;
+	lua_Integer i;
+	const char *s;
+	size_t len;
+	u32 hash;
+};
+
+struct lunatik_shmapud {
+	struct lunatik_shmap *map;
+	unsigned int flags;
+};
+
+/*
+** map methods have the map metatable as their first upvalue, so
+** checking their arguments is a pointer comparison with its tag
+*/
+#define lunatik_toshmap(L, arg)	((struct lunatik_shmapud *)		\
+	luaL_checkudatatag(L, arg, lua_topointer(L, lua_upvalueindex(1)),\
+		LUNATIK_SHMAP))
+
+static void lunatik_shmapget(struct lunatik_shmap *map)
+{
+	atomic_inc(&map->refs);
+}
+
+static void lunatik_shmapput(struct lunatik_shmap *map)
+{
+	unsigned int i;
+
+	if (!atomic_dec_and_test(&map->refs))
+		return;
+	for (i = 0; i <= map->mask; i++) {
+		struct lunatik_shentry *e;
+		struct hlist_node *next;
+
+		hlist_for_each_entry_safe(e, next, &map->buckets[i], node)
+			kfree(e);
+	}
+	kfree(map);
+}
+
+static void lunatik_checkshkey(lua_State *L, struct lunatik_shmap *map,
+	int arg, struct lunatik_shkey *k)
+{
+	k->type = lua_type(L, arg);
+	if (k->type == LUA_TSTRING) {
+		k->s = lua_tolstring(L, arg, &k->len);
+		k->hash = jhash(k->s, k->len, map->seed);
+	}
+	else {
+		int isnum;
+
+		k->i = lua_tointegerx(L, arg, &isnum);
+		luaL_argcheck(L, isnum && k->type == LUA_TNUMBER, arg,
+			"integer or string expected");
+		k->hash = jhash(&k->i, sizeof(k->i), map->seed);
+	}
+}
+
+/* called under 'rcu_read_lock' or the lock of the map */
+static struct lunatik_shentry *lunatik_shfind(struct lunatik_shmap *map,
+	const struct lunatik_shkey *k)
+{
+	struct lunatik_shentry *e;
+
+	hlist_for_each_entry_rcu(e, &map->buckets[k->hash & map->mask], node) {
+		if (e->hash != k->hash || e->ktype != k->type)
+			continue;
+		if (k->type == LUA_TSTRING ? e->klen == k->len &&
+		    memcmp(shentrykey(e), k->s, k->len) == 0 : e->ki == k->i)
+			return e;
+	}
+	return NULL;
+}
+
+/*
+** Values are copied to the stack after 'rcu_read_unlock', as pushing may
+** raise an error; a long string is pushed (with 'lua_pushlongstring')
+** before copying it, and the entry is looked up again, until its length
+** matches the one of the string.
+*/
+static int lunatik_shmap_index(lua_State *L)
+{
+	struct lunatik_shmap *map = lunatik_toshmap(L, 1)->map;
+	struct lunatik_shkey k;
+	char buf[LUAI_MAXSHORTLEN];
+	char *s = NULL;	/* long string on the top of the stack */
+	size_t len = 0;
+
+	lunatik_checkshkey(L, map, 2, &k);
+	for (;;) {
+		struct lunatik_shentry *e;
+		lua_Integer v;
+
+		rcu_read_lock();
+		if ((e = lunatik_shfind(map, &k)) == NULL) {
+			rcu_read_unlock();
+			lua_pushnil(L);
+			return 1;
+		}
+		v = e->vi;
+		switch (e->vtype) {
+		case LUA_TBOOLEAN:
+			rcu_read_unlock();
+			lua_pushboolean(L, (int)v);
+			return 1;
+		case LUA_TNUMBER:
+			rcu_read_unlock();
+			lua_pushinteger(L, v);
+			return 1;
+		}
+		if (e->vlen <= LUAI_MAXSHORTLEN) {
+			len = e->vlen;
+			memcpy(buf, shentryvalue(e), len);
+			rcu_read_unlock();
+			lua_pushlstring(L, buf, len);
+			return 1;
+		}
+		if (s != NULL && e->vlen == len) {
+			memcpy(s, shentryvalue(e), len);
+			rcu_read_unlock();
+			return 1;
+		}
+		len = e->vlen;
+		rcu_read_unlock();
+		if (s != NULL)
+			lua_pop(L, 1);
+		s = lua_pushlongstring(L, len);
+	}
+}
+
+static struct lunatik_shentry *lunatik_newshentry(lua_State *L,
+	struct lunatik_shmap *map, const struct lunatik_shkey *k, int arg)
+{
+	struct lunatik_shentry *e;
+	const char *v = NULL;
+	size_t vlen = 0;
+	lua_Integer vi = 0;
+	int vtype = lua_type(L, arg);
+	size_t klen = k->type == LUA_TSTRING ? k->len : 0;
+
+	switch (vtype) {
+	case LUA_TBOOLEAN:
+		vi = lua_toboolean(L, arg);
+		break;
+	case LUA_TSTRING:
+		v = lua_tolstring(L, arg, &vlen);
+		break;
+	default: {
+		int isnum;
+
+		vi = lua_tointegerx(L, arg, &isnum);
+		luaL_argcheck(L, isnum && vtype == LUA_TNUMBER, arg,
+			"boolean, integer or string expected");
+	}
+	}
+	if (klen + vlen > SIZE_MAX - sizeof(*e) - 2 ||
+	    (e = kmalloc(sizeof(*e) + klen + vlen + 2, map->gfp)) == NULL)
+		luaL_error(L, "not enough memory");
+
+	e->hash = k->hash;
+	e->ktype = (u8)k->type;
+	e->vtype = (u8)vtype;
+	e->ki = k->i;
+	e->vi = vi;
+	e->klen = klen;
+	e->vlen = vlen;
+	if (klen > 0)
+		memcpy(shentrykey(e), k->s, klen);
+	shentrykey(e)[klen] = '\0';
+	if (vlen > 0)
+		memcpy(shentryvalue(e), v, vlen);
+	shentryvalue(e)[vlen] = '\0';
+	return e;
+}
+
+/* 'map[k] = v': replaces (or, if 'v' is nil, removes) the entry of 'k' */
+static int lunatik_shmap_newindex(lua_State *L)
+{
+	struct lunatik_shmapud *ud = lunatik_toshmap(L, 1);
+	struct lunatik_shmap *map = ud->map;
+	struct lunatik_shentry *e = NULL, *old;
+	struct lunatik_shkey k;
+	unsigned long flags;
+
+	luaL_argcheck(L, !(ud->flags & LUNATIK_SHMAP_RDONLY), 1,
+		"read-only map");
+	lunatik_checkshkey(L, map, 2, &k);
+	if (!lua_isnil(L, 3))
+		e = lunatik_newshentry(L, map, &k, 3);
+
+	spin_lock_irqsave(&map->lock, flags);
+	old = lunatik_shfind(map, &k);
+	if (old != NULL && e != NULL)
+		hlist_replace_rcu(&old->node, &e->node);
+	else if (old != NULL) {
+		hlist_del_rcu(&old->node);
+		map->count--;
+	}
+	else if (e != NULL) {
+		hlist_add_head_rcu(&e->node, &map->buckets[k.hash & map->mask]);
+		map->count++;
+	}
+	spin_unlock_irqrestore(&map->lock, flags);
+
+	if (old != NULL)
+		kfree_rcu(old, rcu);
+	return 0;
+}
+
+static int lunatik_shmap_len(lua_State *L)
+{
+	struct lunatik_shmap *map = lunatik_toshmap(L, 1)->map;
+
+	lua_pushinteger(L, READ_ONCE(map->count));
+	return 1;
+}
+
+static int lunatik_shmap_gc(lua_State *L)
+{
+	struct lunatik_shmapud *ud = lunatik_toshmap(L, 1);
+
+	if (ud->map != NULL) {
+		lunatik_shmapput(ud->map);
+		ud->map = NULL;
+	}
+	return 0;
+}
+
+static const luaL_Reg lunatik_shmapmeta[] = {
+	{"__index", lunatik_shmap_index},
+	{"__newindex", lunatik_shmap_newindex},
+	{"__len", lunatik_shmap_len},
+	{"__gc", lunatik_shmap_gc},
+	{NULL, NULL}
+};
+
+/*
+** creates a map for about 'size' entries (the number of buckets is fixed);
+** 'flags' give the allocation context of the entries, as in
+** 'lunatik_newstate'
+*/
+struct lunatik_shmap *lunatik_newshmap(unsigned int size, unsigned int flags)
+{
+	struct lunatik_shmap *map;
+	unsigned int i, nbuckets;
+
+	might_sleep();
+	if (size > KMALLOC_MAX_SIZE / sizeof(struct hlist_head))
+		return NULL;
+	nbuckets = size > 1 ? roundup_pow_of_two(size) : 1;
+	if (nbuckets > KMALLOC_MAX_SIZE / sizeof(struct hlist_head))
+		return NULL;
+	map = kmalloc(sizeof(*map) + nbuckets * sizeof(struct hlist_head),
+		GFP_KERNEL);
+	if (map == NULL)
+		return NULL;
+	atomic_set(&map->refs, 1);
+	spin_lock_init(&map->lock);
+	map->count = 0;
+	map->mask = nbuckets - 1;
+	get_random_bytes(&map->seed, sizeof(map->seed));
+	map->gfp = lunatik_gfp(flags);
+	for (i = 0; i < nbuckets; i++)
+		INIT_HLIST_HEAD(&map->buckets[i]);
+	return map;
+}
+
+/* drops the reference of the creator; states may still hold the map */
+void lunatik_closeshmap(struct lunatik_shmap *map)
+{
+	lunatik_shmapput(map);
+}
+
+/* pushes a userdata for 'map'; with LUNATIK_SHMAP_RDONLY, it cannot update */
+void lunatik_pushshmap(lua_State *L, struct lunatik_shmap *map,
+	unsigned int flags)
+{
+	struct lunatik_shmapud *ud;
+
+	ud = (struct lunatik_shmapud *)lua_newuserdata(L, sizeof(*ud));
+	ud->map = NULL;
+	if (luaL_newmetatable(L, LUNATIK_SHMAP)) {
+		lua_pushvalue(L, -1);
+		luaL_setfuncs(L, lunatik_shmapmeta, 1);
+	}
+	lua_setmetatable(L, -2);
+	lunatik_shmapget(map);
+	ud->map = map;
+	ud->flags = flags & LUNATIK_SHMAP_RDONLY;
+}
+#endif /* __linux__ */
@@ -0,0 +1,280 @@
+/*
+* Copyright (c) 2017-2019 CUJO LLC.
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifdef __linux__
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/kallsyms.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/spinlock.h>
+#include <linux/rculist.h>
+#include <linux/jhash.h>
+
+#include "lua/lua.h"
+#include "lua/lauxlib.h"
+
+#include "lunatik.h"
+
+/*
+** Symbol cache of 'package.loadlib' and 'require' ('luai_lookupsym'):
+** kernel symbols found by 'kallsyms_lookup_name', a walk of the whole
+** symbol table, are kept by name in a hash table shared by all states,
+** along with the 'luaopen_*' functions published by modules with
+** 'lunatik_registerlib'. Lookups run under 'rcu_read_lock' and take no
+** lock; insertions and removals are serialized by a spinlock. Entries
+** within a module are removed when it goes away, through a module
+** notifier, so the cache never returns the address of unloaded code.
+*/
+#define LUNATIK_SYMBUCKETS	64
+
+#define LUNATIK_POF	"luaopen_"	/* as 'LUA_POF' of loadlib.c */
+
+struct lunatik_sym {
+	struct hlist_node node;
+	struct rcu_head rcu;
+	u32 hash;
+	bool registered;	/* by 'lunatik_registerlib', else cached */
+	void *addr;
+	char name[];
+};
+
+/*
+** bounds of the core kernel text, found by name when the cache is set up
+** ('core_kernel_text' is not exported to modules)
+*/
+static unsigned long lunatik_stext, lunatik_etext;
+
+#define lunatik_coretext(a)	((a) >= lunatik_stext && (a) < lunatik_etext)
+
+static DEFINE_SPINLOCK(lunatik_symlock);
+static struct hlist_head lunatik_syms[LUNATIK_SYMBUCKETS];
+
+#define lunatik_symbucket(h)	(&lunatik_syms[(h) & (LUNATIK_SYMBUCKETS - 1)])
+
+/* called under 'rcu_read_lock' or 'lunatik_symlock' */
+static struct lunatik_sym *lunatik_symfind(const char *name, u32 hash)
+{
+	struct lunatik_sym *s;
+
+	hlist_for_each_entry_rcu(s, lunatik_symbucket(hash), node) {
+		if (s->hash == hash && strcmp(s->name, name) == 0)
+			return s;
+	}
+	return NULL;
+}
+
+static struct lunatik_sym *lunatik_newsym(const char *prefix,
+	const char *name, void *addr, bool registered, gfp_t gfp)
+{
+	size_t plen = strlen(prefix), len = strlen(name);
+	struct lunatik_sym *s = kmalloc(sizeof(*s) + plen + len + 1, gfp);
+
+	if (s == NULL)
+		return NULL;
+	memcpy(s->name, prefix, plen);
+	memcpy(s->name + plen, name, len + 1);
+	s->hash = jhash(s->name, plen + len, 0);
+	s->registered = registered;
+	s->addr = addr;
+	return s;
+}
+
+/* code of a module that is not (or no longer) live is not cached */
+static bool lunatik_symlive(void *addr)
+{
+	struct module *mod;
+
+	preempt_disable();
+	mod = __module_address((unsigned long)addr);
+	preempt_enable();
+	return mod == NULL || mod->state == MODULE_STATE_LIVE;
+}
+
+/*
+** holds the module with the code at 'addr' (if any), to be put by
+** 'symbol_put_addr'; fails if that module is going away (or gone)
+*/
+static bool lunatik_symget(void *addr)
+{
+	struct module *mod;
+	bool ok;
+
+	if (lunatik_coretext((unsigned long)addr))
+		return true;
+	preempt_disable();
+	mod = __module_text_address((unsigned long)addr);
+	ok = mod != NULL && try_module_get(mod);
+	preempt_enable();
+	return ok;
+}
+
+/*
+** 'luai_lookupsym'; returns the address of the symbol 'name' with its
+** module held, or NULL. A hit is held within the RCU section that found
+** it, so its module cannot finish unloading in between. A miss is looked
+** up in the symbol table and cached when it is found (if there is memory
+** to), so that only the first lookup of a symbol walks the table.
+*/
+void *lunatik_lookupsym(const char *name)
+{
+	struct lunatik_sym *s;
+	unsigned long flags;
+	void *addr = NULL;
+	bool found;
+
+	rcu_read_lock();
+	s = lunatik_symfind(name, jhash(name, strlen(name), 0));
+	found = s != NULL;
+	if (found && lunatik_symget(s->addr))
+		addr = s->addr;
+	rcu_read_unlock();
+	if (found)
+		return addr;
+
+	addr = (void *)kallsyms_lookup_name(name);
+	if (addr == NULL || !lunatik_symget(addr))
+		return NULL;
+	s = lunatik_newsym("", name, addr, false, GFP_ATOMIC);
+	if (s == NULL)
+		return addr;
+	spin_lock_irqsave(&lunatik_symlock, flags);
+	/* checked under the lock, which the notifier takes after 'GOING' */
+	if (lunatik_symfind(name, s->hash) == NULL && lunatik_symlive(addr)) {
+		hlist_add_head_rcu(&s->node, lunatik_symbucket(s->hash));
+		s = NULL;
+	}
+	spin_unlock_irqrestore(&lunatik_symlock, flags);
+	kfree(s);
+	return addr;
+}
+
+/*
+** Publishes 'open' as the loader of module 'name' (found by 'require' as
+** 'luaopen_<name>'), without a symbol table walk; it replaces a symbol
+** of the same name that was cached. Returns -EEXIST if 'name' is already
+** registered.
+*/
+int lunatik_registerlib(const char *name, lua_CFunction open)
+{
+	struct lunatik_sym *s, *old;
+	unsigned long flags;
+	int ret = 0;
+
+	s = lunatik_newsym(LUNATIK_POF, name, (void *)open, true, GFP_KERNEL);
+	if (s == NULL)
+		return -ENOMEM;
+	spin_lock_irqsave(&lunatik_symlock, flags);
+	old = lunatik_symfind(s->name, s->hash);
+	if (old != NULL && old->registered)
+		ret = -EEXIST;
+	else if (old != NULL)
+		hlist_replace_rcu(&old->node, &s->node);
+	else
+		hlist_add_head_rcu(&s->node, lunatik_symbucket(s->hash));
+	spin_unlock_irqrestore(&lunatik_symlock, flags);
+
+	if (ret != 0)
+		kfree(s);
+	else if (old != NULL)
+		kfree_rcu(old, rcu);
+	return ret;
+}
+
+/* withdraws the loader registered for 'name', if any */
+void lunatik_unregisterlib(const char *name)
+{
+	struct lunatik_sym *s;
+	unsigned long flags;
+	char *sym = kasprintf(GFP_KERNEL, LUNATIK_POF "%s", name);
+
+	if (sym == NULL)
+		return;
+	spin_lock_irqsave(&lunatik_symlock, flags);
+	s = lunatik_symfind(sym, jhash(sym, strlen(sym), 0));
+	if (s != NULL && s->registered)
+		hlist_del_rcu(&s->node);
+	else
+		s = NULL;
+	spin_unlock_irqrestore(&lunatik_symlock, flags);
+
+	if (s != NULL)
+		kfree_rcu(s, rcu);
+	kfree(sym);
+}
+
+/* drops the entries within a module that is going away */
+static int lunatik_symnotify(struct notifier_block *nb, unsigned long action,
+	void *data)
+{
+	struct module *mod = (struct module *)data;
+	struct lunatik_sym *s;
+	struct hlist_node *next;
+	unsigned long flags;
+	int i;
+
+	if (action != MODULE_STATE_GOING)
+		return NOTIFY_DONE;
+	spin_lock_irqsave(&lunatik_symlock, flags);
+	for (i = 0; i < LUNATIK_SYMBUCKETS; i++) {
+		hlist_for_each_entry_safe(s, next, &lunatik_syms[i], node) {
+			if (within_module((unsigned long)s->addr, mod)) {
+				hlist_del_rcu(&s->node);
+				kfree_rcu(s, rcu);
+			}
+		}
+	}
+	spin_unlock_irqrestore(&lunatik_symlock, flags);
+	return NOTIFY_OK;
+}
+
+static struct notifier_block lunatik_symnb = {
+	.notifier_call = lunatik_symnotify,
+};
+
+int lunatik_syminit(void)
+{
+	int i;
+
+	for (i = 0; i < LUNATIK_SYMBUCKETS; i++)
+		INIT_HLIST_HEAD(&lunatik_syms[i]);
+	/* if not found, no address is taken as core text */
+	lunatik_stext = kallsyms_lookup_name("_stext");
+	lunatik_etext = kallsyms_lookup_name("_etext");
+	return register_module_notifier(&lunatik_symnb);
+}
+
+/* called when no state is left, so there are no readers */
+void lunatik_symexit(void)
+{
+	struct lunatik_sym *s;
+	struct hlist_node *next;
+	int i;
+
+	unregister_module_notifier(&lunatik_symnb);
+	for (i = 0; i < LUNATIK_SYMBUCKETS; i++) {
+		hlist_for_each_entry_safe(s, next, &lunatik_syms[i], node)
+			kfree(s);
+		INIT_HLIST_HEAD(&lunatik_syms[i]);
+	}
+}
+#endif /* __linux__ */
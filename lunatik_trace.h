@@ -0,0 +1,150 @@
+/*
+* Copyright (c) 2017-2019 CUJO LLC.
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lunatik
+
+#if !defined(lunatik_trace_h) || defined(TRACE_HEADER_MULTI_READ)
+#define lunatik_trace_h
+
+#include <linux/version.h>
+#include <linux/tracepoint.h>
+
+/*
+** Tracepoints of the Lua core, called through the 'luai_trace' macros
+** (see llimits.h and luaconf.h); a disabled tracepoint costs a static key
+** branch, and its arguments are only evaluated when it is enabled.
+*/
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,10,0)
+#define lunatik_assignstr(dst, src)	__assign_str(dst)
+#else
+#define lunatik_assignstr(dst, src)	__assign_str(dst, src)
+#endif
+
+#define lunatik_gcstates	\
+	{0, "propagate"}, {1, "atomic"}, {2, "swpallgc"}, {3, "swpfinobj"}, \
+	{4, "swptobefnz"}, {5, "swpend"}, {6, "callfin"}, {7, "pause"}
+
+DECLARE_EVENT_CLASS(lunatik_function,
+	TP_PROTO(const void *L, const char *source, int line),
+	TP_ARGS(L, source, line),
+	TP_STRUCT__entry(
+		__field(const void *, L)
+		__string(source, source)
+		__field(int, line)
+	),
+	TP_fast_assign(
+		__entry->L = L;
+		lunatik_assignstr(source, source);
+		__entry->line = line;
+	),
+	TP_printk("L=%p %s:%d", __entry->L, __get_str(source), __entry->line)
+);
+
+/* a Lua function was called; 'line' is where it is defined */
+DEFINE_EVENT(lunatik_function, lunatik_call,
+	TP_PROTO(const void *L, const char *source, int line),
+	TP_ARGS(L, source, line)
+);
+
+DEFINE_EVENT(lunatik_function, lunatik_return,
+	TP_PROTO(const void *L, const char *source, int line),
+	TP_ARGS(L, source, line)
+);
+
+/* the collector went from state 'from' to 'to', doing 'work' in 'from' */
+TRACE_EVENT(lunatik_gcstate,
+	TP_PROTO(const void *L, int from, int to, size_t work),
+	TP_ARGS(L, from, to, work),
+	TP_STRUCT__entry(
+		__field(const void *, L)
+		__field(int, from)
+		__field(int, to)
+		__field(size_t, work)
+	),
+	TP_fast_assign(
+		__entry->L = L;
+		__entry->from = from;
+		__entry->to = to;
+		__entry->work = work;
+	),
+	TP_printk("L=%p %s -> %s work=%zu", __entry->L,
+		__print_symbolic(__entry->from, lunatik_gcstates),
+		__print_symbolic(__entry->to, lunatik_gcstates), __entry->work)
+);
+
+DECLARE_EVENT_CLASS(lunatik_resize,
+	TP_PROTO(const void *L, int osize, int nsize),
+	TP_ARGS(L, osize, nsize),
+	TP_STRUCT__entry(
+		__field(const void *, L)
+		__field(int, osize)
+		__field(int, nsize)
+	),
+	TP_fast_assign(
+		__entry->L = L;
+		__entry->osize = osize;
+		__entry->nsize = nsize;
+	),
+	TP_printk("L=%p %d -> %d", __entry->L, __entry->osize, __entry->nsize)
+);
+
+/* the stack of a thread was resized to 'nsize' slots */
+DEFINE_EVENT(lunatik_resize, lunatik_stack,
+	TP_PROTO(const void *L, int osize, int nsize),
+	TP_ARGS(L, osize, nsize)
+);
+
+/* the string table was resized to 'nsize' buckets */
+DEFINE_EVENT(lunatik_resize, lunatik_strtab,
+	TP_PROTO(const void *L, int osize, int nsize),
+	TP_ARGS(L, osize, nsize)
+);
+
+/* a block was allocated, resized or freed ('nsize' is 0) */
+TRACE_EVENT(lunatik_realloc,
+	TP_PROTO(const void *L, const void *block, const void *nblock,
+		size_t osize, size_t nsize),
+	TP_ARGS(L, block, nblock, osize, nsize),
+	TP_STRUCT__entry(
+		__field(const void *, L)
+		__field(const void *, block)
+		__field(const void *, nblock)
+		__field(size_t, osize)
+		__field(size_t, nsize)
+	),
+	TP_fast_assign(
+		__entry->L = L;
+		__entry->block = block;
+		__entry->nblock = nblock;
+		__entry->osize = osize;
+		__entry->nsize = nsize;
+	),
+	TP_printk("L=%p %p(%zu) -> %p(%zu)", __entry->L, __entry->block,
+		__entry->osize, __entry->nblock, __entry->nsize)
+);
+#endif /* lunatik_trace_h */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE lunatik_trace
+#include <trace/define_trace.h>
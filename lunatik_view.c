@@ -0,0 +1,272 @@
+/*
+* Copyright (c) 2017-2019 CUJO LLC.
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifdef __linux__
+#include <linux/version.h>
+#include <linux/types.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,12,0)
+#include <linux/unaligned.h>
+#else
+#include <asm/unaligned.h>
+#endif
+
+#include "lua/lua.h"
+#include "lua/lauxlib.h"
+
+#include "lunatik.h"
+
+/*
+** Byte views: userdata over a (pointer, length) region owned by C code,
+** read and written through bounds-checked accessors with 0-based byte
+** offsets.  Slices share the region of the view they were taken from
+** (and keep it alive through their user value), so invalidating the
+** original view, once the buffer is released, invalidates all of them.
+*/
+#define LUNATIK_VIEW	"lunatik.view"
+
+#define LUNATIK_VIEW_VALID	(1u << 31)
+
+struct lunatik_view {
+	u8 *ptr;
+	size_t len;
+	struct lunatik_view *root;	/* view owning the region */
+	unsigned int flags;	/* only meaningful in the root */
+};
+
+/*
+** view methods have the view metatable as their first upvalue, so
+** checking their arguments is a pointer comparison with its tag
+*/
+#define lunatik_toview(L, arg)	luaL_checkudatatag(L, arg, \
+	lua_topointer(L, lua_upvalueindex(1)), LUNATIK_VIEW)
+
+static struct lunatik_view *lunatik_checkview(lua_State *L, int arg)
+{
+	struct lunatik_view *v = lunatik_toview(L, arg);
+
+	luaL_argcheck(L, v->root->flags & LUNATIK_VIEW_VALID, arg,
+		"invalidated view");
+	return v;
+}
+
+/* returns the address of 'n' bytes at the offset given by argument 2 */
+static u8 *lunatik_viewptr(lua_State *L, struct lunatik_view *v, size_t n)
+{
+	lua_Integer off = luaL_checkinteger(L, 2);
+
+	luaL_argcheck(L, off >= 0 && (size_t)off <= v->len &&
+		n <= v->len - (size_t)off, 2, "out of bounds");
+	return v->ptr + off;
+}
+
+static u8 *lunatik_viewwptr(lua_State *L, struct lunatik_view *v, size_t n)
+{
+	luaL_argcheck(L, !(v->root->flags & LUNATIK_VIEW_RDONLY), 1,
+		"read-only view");
+	return lunatik_viewptr(L, v, n);
+}
+
+#define lunatik_get_u8(p)	(*(p))
+#define lunatik_put_u8(x, p)	(*(p) = (x))
+
+#define LUNATIK_VIEWACCESSORS(T, name)					\
+static int lunatik_view_##name(lua_State *L)				\
+{									\
+	struct lunatik_view *v = lunatik_checkview(L, 1);		\
+	u8 *p = lunatik_viewptr(L, v, sizeof(T));			\
+	lua_pushinteger(L, (lua_Integer)lunatik_get_##name(p));	\
+	return 1;							\
+}									\
+static int lunatik_view_set##name(lua_State *L)			\
+{									\
+	struct lunatik_view *v = lunatik_checkview(L, 1);		\
+	u8 *p = lunatik_viewwptr(L, v, sizeof(T));			\
+	lunatik_put_##name((T)luaL_checkinteger(L, 3), p);		\
+	return 0;							\
+}
+
+#define lunatik_get_u16be(p)	get_unaligned_be16(p)
+#define lunatik_get_u16le(p)	get_unaligned_le16(p)
+#define lunatik_get_u32be(p)	get_unaligned_be32(p)
+#define lunatik_get_u32le(p)	get_unaligned_le32(p)
+#define lunatik_get_u64be(p)	get_unaligned_be64(p)
+#define lunatik_get_u64le(p)	get_unaligned_le64(p)
+#define lunatik_put_u16be(x, p)	put_unaligned_be16(x, p)
+#define lunatik_put_u16le(x, p)	put_unaligned_le16(x, p)
+#define lunatik_put_u32be(x, p)	put_unaligned_be32(x, p)
+#define lunatik_put_u32le(x, p)	put_unaligned_le32(x, p)
+#define lunatik_put_u64be(x, p)	put_unaligned_be64(x, p)
+#define lunatik_put_u64le(x, p)	put_unaligned_le64(x, p)
+
+LUNATIK_VIEWACCESSORS(u8, u8)
+LUNATIK_VIEWACCESSORS(u16, u16be)
+LUNATIK_VIEWACCESSORS(u16, u16le)
+LUNATIK_VIEWACCESSORS(u32, u32be)
+LUNATIK_VIEWACCESSORS(u32, u32le)
+#ifndef LUA_32BITS	/* 64-bit fields do not fit in 32-bit integers */
+LUNATIK_VIEWACCESSORS(u64, u64be)
+LUNATIK_VIEWACCESSORS(u64, u64le)
+#endif
+
+static struct lunatik_view *lunatik_newview(lua_State *L, u8 *ptr,
+	size_t len, struct lunatik_view *root)
+{
+	struct lunatik_view *v = lua_newuserdata(L, sizeof(*v));
+
+	v->ptr = ptr;
+	v->len = len;
+	v->root = root != NULL ? root : v;
+	v->flags = 0;
+	luaL_setmetatable(L, LUNATIK_VIEW);
+	return v;
+}
+
+/* view:slice(offset [, length]) */
+static int lunatik_view_slice(lua_State *L)
+{
+	struct lunatik_view *v = lunatik_checkview(L, 1);
+	lua_Integer off = luaL_checkinteger(L, 2);
+	lua_Integer len;
+
+	luaL_argcheck(L, off >= 0 && (size_t)off <= v->len, 2,
+		"out of bounds");
+	len = luaL_optinteger(L, 3, v->len - off);
+	luaL_argcheck(L, len >= 0 && (size_t)len <= v->len - off, 3,
+		"out of bounds");
+
+	lunatik_newview(L, v->ptr + off, len, v->root);
+	lua_getuservalue(L, 1);	/* root of 'v', or nil if 'v' is the root */
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_pushvalue(L, 1);
+	}
+	lua_setuservalue(L, -2);	/* keep the root alive */
+	return 1;
+}
+
+/* view:string([offset [, length]]) copies bytes into a string */
+static int lunatik_view_string(lua_State *L)
+{
+	struct lunatik_view *v = lunatik_checkview(L, 1);
+	lua_Integer off = luaL_optinteger(L, 2, 0);
+	lua_Integer len;
+
+	luaL_argcheck(L, off >= 0 && (size_t)off <= v->len, 2,
+		"out of bounds");
+	len = luaL_optinteger(L, 3, v->len - off);
+	luaL_argcheck(L, len >= 0 && (size_t)len <= v->len - off, 3,
+		"out of bounds");
+	lua_pushlstring(L, (const char *)v->ptr + off, len);
+	return 1;
+}
+
+static int lunatik_view_valid(lua_State *L)
+{
+	struct lunatik_view *v = lunatik_toview(L, 1);
+
+	lua_pushboolean(L, v->root->flags & LUNATIK_VIEW_VALID);
+	return 1;
+}
+
+static int lunatik_view_len(lua_State *L)
+{
+	struct lunatik_view *v = lunatik_checkview(L, 1);
+
+	lua_pushinteger(L, v->len);
+	return 1;
+}
+
+/*
+** a copy made by 'lua_clonestate' does not know when the region is
+** released (only the original view is invalidated), so it is invalid
+*/
+static int lunatik_view_clone(lua_State *L)
+{
+	struct lunatik_view *v = lunatik_toview(L, 1);
+
+	if (lua_getuservalue(L, 1) == LUA_TNIL)	/* a root? */
+		v->root = v;
+	else
+		v->root = lua_touserdata(L, -1);
+	v->root->flags &= ~LUNATIK_VIEW_VALID;
+	return 0;
+}
+
+static const luaL_Reg lunatik_viewmethods[] = {
+	{"u8", lunatik_view_u8},
+	{"u16be", lunatik_view_u16be},
+	{"u16le", lunatik_view_u16le},
+	{"u32be", lunatik_view_u32be},
+	{"u32le", lunatik_view_u32le},
+#ifndef LUA_32BITS
+	{"u64be", lunatik_view_u64be},
+	{"u64le", lunatik_view_u64le},
+#endif
+	{"setu8", lunatik_view_setu8},
+	{"setu16be", lunatik_view_setu16be},
+	{"setu16le", lunatik_view_setu16le},
+	{"setu32be", lunatik_view_setu32be},
+	{"setu32le", lunatik_view_setu32le},
+#ifndef LUA_32BITS
+	{"setu64be", lunatik_view_setu64be},
+	{"setu64le", lunatik_view_setu64le},
+#endif
+	{"slice", lunatik_view_slice},
+	{"string", lunatik_view_string},
+	{"valid", lunatik_view_valid},
+	{NULL, NULL}
+};
+
+/*
+** pushes a new view over 'len' bytes at 'ptr'; the view must be
+** invalidated with 'lunatik_invalidate' before the region is released
+*/
+struct lunatik_view *lunatik_pushview(lua_State *L, void *ptr, size_t len,
+	unsigned int flags)
+{
+	struct lunatik_view *v;
+
+	if (luaL_newmetatable(L, LUNATIK_VIEW)) {
+		luaL_newlibtable(L, lunatik_viewmethods);
+		lua_pushvalue(L, -2);
+		luaL_setfuncs(L, lunatik_viewmethods, 1);
+		lua_setfield(L, -2, "__index");
+		lua_pushvalue(L, -1);
+		lua_pushcclosure(L, lunatik_view_len, 1);
+		lua_setfield(L, -2, "__len");
+		lua_pushvalue(L, -1);
+		lua_pushcclosure(L, lunatik_view_clone, 1);
+		lua_setfield(L, -2, "__clone");
+	}
+	lua_pop(L, 1);
+
+	v = lunatik_newview(L, (u8 *)ptr, len, NULL);
+	v->flags = (flags & LUNATIK_VIEW_RDONLY) | LUNATIK_VIEW_VALID;
+	return v;
+}
+
+/* invalidates 'view' and all of its slices; 'view' must still be alive */
+void lunatik_invalidate(struct lunatik_view *view)
+{
+	view->root->flags &= ~LUNATIK_VIEW_VALID;
+}
+#endif /* __linux__ */